@@ -718,8 +718,6 @@ static int __add_keyed_refs(struct btrfs_fs_info *fs_info,
  * refs) for the given bytenr to the refs list, merges duplicates and resolves
  * indirect refs to their parent bytenr.
  * When roots are found, they're added to the roots list
- *
- * FIXME some caching might speed things up
  */
 static int find_parent_nodes(struct btrfs_trans_handle *trans,
 			     struct btrfs_fs_info *fs_info, u64 bytenr,
@@ -901,6 +899,237 @@ static int btrfs_find_all_leafs(struct btrfs_trans_handle *trans,
 	return 0;
 }
 
+/*
+ * Cache of the roots referencing a tree block.  Extents in snapshotted trees
+ * share most of their ancestors, with the cache each of them is resolved
+ * once.  It's not updated when trees are modified, so it's only used while
+ * no transaction is running and dropped on commit.  Entries are additionally
+ * tagged with the generation they were resolved in.
+ */
+#define BACKREF_CACHE_MAX_ENTRIES	65536
+
+struct backref_cache_entry {
+	struct cache_extent cache;
+	struct list_head lru;
+	u64 generation;
+	struct ulist *roots;
+};
+
+struct btrfs_backref_cache {
+	struct cache_tree tree;
+	struct list_head lru;
+	unsigned long nr_entries;
+};
+
+static struct btrfs_backref_cache *
+backref_cache_get(struct btrfs_trans_handle *trans,
+		  struct btrfs_fs_info *fs_info)
+{
+	struct btrfs_backref_cache *cache = fs_info->backref_cache;
+
+	if (trans || fs_info->running_transaction)
+		return NULL;
+	if (cache)
+		return cache;
+
+	cache = malloc(sizeof(*cache));
+	if (!cache)
+		return NULL;
+	cache_tree_init(&cache->tree);
+	INIT_LIST_HEAD(&cache->lru);
+	cache->nr_entries = 0;
+	fs_info->backref_cache = cache;
+	return cache;
+}
+
+static void backref_cache_drop(struct btrfs_backref_cache *cache,
+			       struct backref_cache_entry *entry)
+{
+	remove_cache_extent(&cache->tree, &entry->cache);
+	list_del(&entry->lru);
+	ulist_free(entry->roots);
+	free(entry);
+	cache->nr_entries--;
+}
+
+static struct ulist *backref_cache_lookup(struct btrfs_fs_info *fs_info,
+					  struct btrfs_backref_cache *cache,
+					  u64 bytenr)
+{
+	struct cache_extent *ce;
+	struct backref_cache_entry *entry;
+
+	ce = lookup_cache_extent(&cache->tree, bytenr, 1);
+	if (!ce)
+		return NULL;
+	entry = container_of(ce, struct backref_cache_entry, cache);
+	if (entry->generation != fs_info->generation) {
+		backref_cache_drop(cache, entry);
+		return NULL;
+	}
+	list_move_tail(&entry->lru, &cache->lru);
+	return entry->roots;
+}
+
+/* the cache takes over @roots, also if the insert fails */
+static int backref_cache_insert(struct btrfs_fs_info *fs_info,
+				struct btrfs_backref_cache *cache,
+				u64 bytenr, struct ulist *roots)
+{
+	struct backref_cache_entry *entry;
+	int ret;
+
+	entry = malloc(sizeof(*entry));
+	if (!entry) {
+		ulist_free(roots);
+		return -ENOMEM;
+	}
+	entry->cache.start = bytenr;
+	entry->cache.size = 1;
+	entry->generation = fs_info->generation;
+	entry->roots = roots;
+	ret = insert_cache_extent(&cache->tree, &entry->cache);
+	if (ret) {
+		ulist_free(roots);
+		free(entry);
+		return ret;
+	}
+	list_add_tail(&entry->lru, &cache->lru);
+	cache->nr_entries++;
+
+	if (cache->nr_entries > BACKREF_CACHE_MAX_ENTRIES)
+		backref_cache_drop(cache, list_first_entry(&cache->lru,
+				   struct backref_cache_entry, lru));
+	return 0;
+}
+
+void btrfs_backref_cache_free(struct btrfs_fs_info *fs_info)
+{
+	struct btrfs_backref_cache *cache = fs_info->backref_cache;
+
+	if (!cache)
+		return;
+	while (!list_empty(&cache->lru))
+		backref_cache_drop(cache, list_first_entry(&cache->lru,
+				   struct backref_cache_entry, lru));
+	free(cache);
+	fs_info->backref_cache = NULL;
+}
+
+static int ulist_merge(struct ulist *dst, struct ulist *src)
+{
+	struct ulist_node *node;
+	struct ulist_iterator uiter;
+	int ret;
+
+	ULIST_ITER_INIT(&uiter);
+	while ((node = ulist_next(src, &uiter))) {
+		ret = ulist_add(dst, node->val, node->aux, GFP_NOFS);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Resolve the roots of a tree block as the union of the roots of its
+ * parents, memoized in the backref cache.  The returned ulist belongs to the
+ * cache.  Returns -ELOOP if the parents go deeper than any valid tree, the
+ * caller falls back to the uncached walk which copes with loops.
+ */
+static int tree_block_roots(struct btrfs_fs_info *fs_info,
+			    struct btrfs_backref_cache *cache, u64 bytenr,
+			    u64 time_seq, int depth, struct ulist **roots_ret)
+{
+	struct ulist *parents;
+	struct ulist *roots;
+	struct ulist *sub;
+	struct ulist_node *node;
+	struct ulist_iterator uiter;
+	int ret;
+
+	roots = backref_cache_lookup(fs_info, cache, bytenr);
+	if (roots) {
+		*roots_ret = roots;
+		return 0;
+	}
+	if (depth > BTRFS_MAX_LEVEL)
+		return -ELOOP;
+
+	parents = ulist_alloc(GFP_NOFS);
+	roots = ulist_alloc(GFP_NOFS);
+	if (!parents || !roots) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = find_parent_nodes(NULL, fs_info, bytenr, time_seq, parents,
+				roots, NULL);
+	if (ret < 0 && ret != -ENOENT)
+		goto out;
+
+	ULIST_ITER_INIT(&uiter);
+	while ((node = ulist_next(parents, &uiter))) {
+		ret = tree_block_roots(fs_info, cache, node->val, time_seq,
+				       depth + 1, &sub);
+		if (ret < 0)
+			goto out;
+		ret = ulist_merge(roots, sub);
+		if (ret < 0)
+			goto out;
+	}
+
+	ret = backref_cache_insert(fs_info, cache, bytenr, roots);
+	roots = NULL;
+	if (ret < 0)
+		goto out;
+	*roots_ret = backref_cache_lookup(fs_info, cache, bytenr);
+out:
+	ulist_free(parents);
+	ulist_free(roots);
+	return ret;
+}
+
+/*
+ * Find the direct parents of the extent, and take the roots of each of them
+ * from the backref cache.
+ */
+static int find_all_roots_cached(struct btrfs_fs_info *fs_info,
+				 struct btrfs_backref_cache *cache,
+				 u64 bytenr, u64 time_seq,
+				 struct ulist *roots)
+{
+	struct ulist *parents;
+	struct ulist *sub;
+	struct ulist_node *node;
+	struct ulist_iterator uiter;
+	int ret;
+
+	parents = ulist_alloc(GFP_NOFS);
+	if (!parents)
+		return -ENOMEM;
+
+	ret = find_parent_nodes(NULL, fs_info, bytenr, time_seq, parents,
+				roots, NULL);
+	if (ret < 0 && ret != -ENOENT)
+		goto out;
+
+	ret = 0;
+	ULIST_ITER_INIT(&uiter);
+	while ((node = ulist_next(parents, &uiter))) {
+		ret = tree_block_roots(fs_info, cache, node->val, time_seq, 1,
+				       &sub);
+		if (ret < 0)
+			break;
+		ret = ulist_merge(roots, sub);
+		if (ret < 0)
+			break;
+	}
+out:
+	ulist_free(parents);
+	return ret;
+}
+
 /*
  * walk all backrefs for a given extent to find all roots that reference this
  * extent. Walking a backref means finding all extents that reference this
@@ -918,6 +1147,7 @@ static int __btrfs_find_all_roots(struct btrfs_trans_handle *trans,
 				  struct btrfs_fs_info *fs_info, u64 bytenr,
 				  u64 time_seq, struct ulist **roots)
 {
+	struct btrfs_backref_cache *cache;
 	struct ulist *tmp;
 	struct ulist_node *node = NULL;
 	struct ulist_iterator uiter;
@@ -932,6 +1162,18 @@ static int __btrfs_find_all_roots(struct btrfs_trans_handle *trans,
 		return -ENOMEM;
 	}
 
+	cache = backref_cache_get(trans, fs_info);
+	if (cache) {
+		ret = find_all_roots_cached(fs_info, cache, bytenr, time_seq,
+					    *roots);
+		if (ret == 0) {
+			ulist_free(tmp);
+			return 0;
+		}
+		/* start over without the cache */
+		ulist_reinit(*roots);
+	}
+
 	ULIST_ITER_INIT(&uiter);
 	while (1) {
 		ret = find_parent_nodes(trans, fs_info, bytenr,
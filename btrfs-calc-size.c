@@ -36,11 +36,39 @@
 
 static int verbose = 0;
 static int no_pretty = 0;
+/* only look at metadata changed since this generation */
+static u64 min_gen = 0;
 
-struct seek {
-	u64 distance;
-	u64 count;
-	struct rb_node n;
+/*
+ * Seek distances are collected in power of two buckets so the memory used
+ * does not depend on the size of the tree, bucket n counts distances in
+ * [2^n, 2^(n+1)).
+ */
+#define SEEK_BUCKETS	64
+
+struct seek_stats {
+	u64 total_seeks;
+	u64 forward_seeks;
+	u64 backward_seeks;
+	u64 total_seek_len;
+	u64 max_seek_len;
+	u64 histogram[SEEK_BUCKETS];
+};
+
+/* Seeks as seen by a device, in the order the blocks are visited */
+struct dev_stats {
+	u64 devid;
+	u64 next_physical;
+	u64 total_blocks;
+	struct seek_stats seeks;
+};
+
+struct level_stats {
+	u64 blocks;
+	/* blocks that have been read, leaves are read only for inline data */
+	u64 read_blocks;
+	u64 items;
+	u64 used_bytes;
 };
 
 struct root_stats {
@@ -48,49 +76,87 @@ struct root_stats {
 	u64 total_leaves;
 	u64 total_bytes;
 	u64 total_inline;
-	u64 total_seeks;
-	u64 forward_seeks;
-	u64 backward_seeks;
-	u64 total_seek_len;
-	u64 max_seek_len;
+	struct seek_stats seeks;
 	u64 total_clusters;
 	u64 total_cluster_size;
 	u64 min_cluster_size;
 	u64 max_cluster_size;
 	u64 lowest_bytenr;
 	u64 highest_bytenr;
-	struct rb_root seek_root;
+	struct level_stats levels[BTRFS_MAX_LEVEL];
+	struct dev_stats *devs;
+	int nr_devs;
 	int total_levels;
+	/* readahead window kept ahead of the walk */
+	struct btrfs_prefetch prefetch;
 };
 
-static int add_seek(struct rb_root *root, u64 dist)
+static void add_seek(struct seek_stats *seeks, u64 from, u64 to)
 {
-	struct rb_node **p = &root->rb_node;
-	struct rb_node *parent = NULL;
-	struct seek *seek = NULL;
-
-	while (*p) {
-		parent = *p;
-		seek = rb_entry(parent, struct seek, n);
-
-		if (dist < seek->distance) {
-			p = &(*p)->rb_left;
-		} else if (dist > seek->distance) {
-			p = &(*p)->rb_right;
-		} else {
-			seek->count++;
-			return 0;
+	u64 dist = from < to ? to - from : from - to;
+	int bucket = 0;
+
+	seeks->total_seeks++;
+	seeks->total_seek_len += dist;
+	if (seeks->max_seek_len < dist)
+		seeks->max_seek_len = dist;
+	if (from < to)
+		seeks->forward_seeks++;
+	else
+		seeks->backward_seeks++;
+	while (bucket < SEEK_BUCKETS - 1 && (dist >> (bucket + 1)))
+		bucket++;
+	seeks->histogram[bucket]++;
+}
+
+static void account_block(struct btrfs_root *root, struct root_stats *stat,
+			  struct extent_buffer *b)
+{
+	struct level_stats *ls = &stat->levels[btrfs_header_level(b)];
+	u32 nr = btrfs_header_nritems(b);
+
+	ls->blocks++;
+	ls->read_blocks++;
+	ls->items += nr;
+	if (btrfs_header_level(b))
+		ls->used_bytes += nr * sizeof(struct btrfs_key_ptr);
+	else
+		ls->used_bytes += BTRFS_LEAF_DATA_SIZE(root) -
+				  btrfs_leaf_free_space(root, b);
+}
+
+/*
+ * Record where the block lives on the device it would be read from, a
+ * seek is counted when it does not follow the previous block read from
+ * the same device.
+ */
+static void account_physical(struct btrfs_root *root, struct root_stats *stat,
+			     u64 bytenr, u32 size)
+{
+	struct btrfs_multi_bio *multi = NULL;
+	struct dev_stats *ds = NULL;
+	u64 length = size;
+	u64 physical;
+	int i;
+
+	if (btrfs_map_block(&root->fs_info->mapping_tree, READ, bytenr,
+			    &length, &multi, 0, NULL))
+		return;
+	for (i = 0; i < stat->nr_devs; i++) {
+		if (stat->devs[i].devid == multi->stripes[0].dev->devid) {
+			ds = &stat->devs[i];
+			break;
 		}
 	}
+	physical = multi->stripes[0].physical;
+	kfree(multi);
+	if (!ds)
+		return;
 
-	seek = malloc(sizeof(struct seek));
-	if (!seek)
-		return -ENOMEM;
-	seek->distance = dist;
-	seek->count = 1;
-	rb_link_node(&seek->n, parent, p);
-	rb_insert_color(&seek->n, root);
-	return 0;
+	if (ds->total_blocks && ds->next_physical != physical)
+		add_seek(&ds->seeks, ds->next_physical, physical);
+	ds->total_blocks++;
+	ds->next_physical = physical + size;
 }
 
 static int walk_leaf(struct btrfs_root *root, struct btrfs_path *path,
@@ -107,6 +173,8 @@ static int walk_leaf(struct btrfs_root *root, struct btrfs_path *path,
 	if (!find_inline)
 		return 0;
 
+	account_block(root, stat, b);
+
 	for (i = 0; i < btrfs_header_nritems(b); i++) {
 		btrfs_item_key_to_cpu(b, &found_key, i);
 		if (found_key.type != BTRFS_EXTENT_DATA_KEY)
@@ -122,24 +190,21 @@ static int walk_leaf(struct btrfs_root *root, struct btrfs_path *path,
 	return 0;
 }
 
-static u64 calc_distance(u64 block1, u64 block2)
-{
-	if (block1 < block2)
-		return block2 - block1;
-	return block1 - block2;
-}
-
 static int walk_nodes(struct btrfs_root *root, struct btrfs_path *path,
 		      struct root_stats *stat, int level, int find_inline)
 {
 	struct extent_buffer *b = path->nodes[level];
+	struct btrfs_key key;
 	u64 last_block;
 	u64 cluster_size = root->leafsize;
+	u32 size = btrfs_level_size(root, level - 1);
+	int read_children = (level - 1) > 0 || find_inline;
 	int i;
 	int ret = 0;
 
 	stat->total_bytes += root->nodesize;
 	stat->total_nodes++;
+	account_block(root, stat, b);
 
 	last_block = btrfs_header_bytenr(b);
 	for (i = 0; i < btrfs_header_nritems(b); i++) {
@@ -147,9 +212,11 @@ static int walk_nodes(struct btrfs_root *root, struct btrfs_path *path,
 		u64 cur_blocknr = btrfs_node_blockptr(b, i);
 
 		path->slots[level] = i;
-		if ((level - 1) > 0 || find_inline) {
-			tmp = read_tree_block(root, cur_blocknr,
-					      btrfs_level_size(root, level - 1),
+		account_physical(root, stat, cur_blocknr, size);
+		if (read_children) {
+			btrfs_node_key_to_cpu(b, &key, i);
+			btrfs_prefetch_update(&stat->prefetch, &key);
+			tmp = read_tree_block(root, cur_blocknr, size,
 					      btrfs_node_ptr_generation(b, i));
 			if (!extent_buffer_uptodate(tmp)) {
 				fprintf(stderr, "Failed to read blocknr %Lu\n",
@@ -157,6 +224,9 @@ static int walk_nodes(struct btrfs_root *root, struct btrfs_path *path,
 				continue;
 			}
 			path->nodes[level - 1] = tmp;
+		} else {
+			/* leaves are not read, count what the node tells us */
+			stat->levels[0].blocks++;
 		}
 		if (level - 1)
 			ret = walk_nodes(root, path, stat, level - 1,
@@ -164,23 +234,8 @@ static int walk_nodes(struct btrfs_root *root, struct btrfs_path *path,
 		else
 			ret = walk_leaf(root, path, stat, find_inline);
 		if (last_block + root->leafsize != cur_blocknr) {
-			u64 distance = calc_distance(last_block +
-						     root->leafsize,
-						     cur_blocknr);
-			stat->total_seeks++;
-			stat->total_seek_len += distance;
-			if (stat->max_seek_len < distance)
-				stat->max_seek_len = distance;
-			if (add_seek(&stat->seek_root, distance)) {
-				fprintf(stderr, "Error adding new seek\n");
-				ret = -ENOMEM;
-				break;
-			}
-
-			if (last_block < cur_blocknr)
-				stat->forward_seeks++;
-			else
-				stat->backward_seeks++;
+			add_seek(&stat->seeks, last_block + root->leafsize,
+				 cur_blocknr);
 			if (cluster_size != root->leafsize) {
 				stat->total_cluster_size += cluster_size;
 				stat->total_clusters++;
@@ -208,84 +263,124 @@ static int walk_nodes(struct btrfs_root *root, struct btrfs_path *path,
 	return ret;
 }
 
-static void print_seek_histogram(struct root_stats *stat)
+static void print_ticks(u64 count, u64 tick_interval)
 {
-	struct rb_node *n = rb_first(&stat->seek_root);
-	struct seek *seek;
-	u64 tick_interval;
-	u64 group_start = 0;
-	u64 group_count = 0;
-	u64 group_end = 0;
+	u64 ticks = count / tick_interval;
 	u64 i;
-	u64 max_seek = stat->max_seek_len;
+
+	if (!ticks) {
+		printf("|\n");
+		return;
+	}
+	for (i = 0; i < ticks; i++)
+		printf("#");
+	printf("\n");
+}
+
+static void print_seek_histogram(const char *prefix, struct seek_stats *seeks)
+{
+	u64 tick_interval;
+	u64 max_seek = seeks->max_seek_len;
+	u64 start;
+	u64 end;
 	int digits = 1;
+	int i;
 
-	if (stat->total_seeks < 20)
+	if (seeks->total_seeks < 20)
 		return;
 
 	while ((max_seek /= 10))
 		digits++;
 
 	/* Make a tick count as 5% of the total seeks */
-	tick_interval = stat->total_seeks / 20;
-	printf("\tSeek histogram\n");
-	for (; n; n = rb_next(n)) {
-		u64 ticks, gticks = 0;
-
-		seek = rb_entry(n, struct seek, n);
-		ticks = seek->count / tick_interval;
-		if (group_count)
-			gticks = group_count / tick_interval;
-
-		if (ticks <= 2 && gticks <= 2) {
-			if (group_count == 0)
-				group_start = seek->distance;
-			group_end = seek->distance;
-			group_count += seek->count;
+	tick_interval = seeks->total_seeks / 20;
+	printf("%sSeek histogram\n", prefix);
+	for (i = 0; i < SEEK_BUCKETS; i++) {
+		if (!seeks->histogram[i])
 			continue;
-		}
+		start = i ? 1ULL << i : 0;
+		end = (i == SEEK_BUCKETS - 1) ? (u64)-1 : (2ULL << i) - 1;
+		end = min(end, seeks->max_seek_len);
+		printf("%s\t%*llu - %*llu: %*llu ", prefix, digits, start,
+		       digits, end, digits, seeks->histogram[i]);
+		print_ticks(seeks->histogram[i], tick_interval);
+	}
+}
 
-		if (group_count) {
-
-			gticks = group_count / tick_interval;
-			printf("\t\t%*Lu - %*Lu: %*Lu ", digits, group_start,
-			       digits, group_end, digits, group_count);
-			if (gticks) {
-				for (i = 0; i < gticks; i++)
-					printf("#");
-				printf("\n");
-			} else {
-				printf("|\n");
-			}
-			group_count = 0;
-		}
+static void print_seeks(const char *prefix, struct seek_stats *seeks)
+{
+	u64 avg = seeks->total_seeks ?
+		  seeks->total_seek_len / seeks->total_seeks : 0;
+
+	printf("%sTotal seeks: %llu\n", prefix, seeks->total_seeks);
+	printf("%s\tForward seeks: %llu\n", prefix, seeks->forward_seeks);
+	printf("%s\tBackward seeks: %llu\n", prefix, seeks->backward_seeks);
+	if (no_pretty)
+		printf("%s\tAvg seek len: %llu\n", prefix, avg);
+	else
+		printf("%s\tAvg seek len: %s\n", prefix, pretty_size(avg));
+	print_seek_histogram(prefix, seeks);
+}
 
-		if (ticks <= 2)
-			continue;
+static void print_level_stats(struct btrfs_root *root, struct root_stats *stat,
+			      int level)
+{
+	struct level_stats *ls;
+	u64 capacity;
+	int i;
 
-		printf("\t\t%*Lu - %*Lu: %*Lu ", digits, seek->distance,
-		       digits, seek->distance, digits, seek->count);
-		for (i = 0; i < ticks; i++)
-			printf("#");
-		printf("\n");
-	}
-	if (group_count) {
-		u64 gticks;
-
-		gticks = group_count / tick_interval;
-		printf("\t\t%*Lu - %*Lu: %*Lu ", digits, group_start,
-		       digits, group_end, digits, group_count);
-		if (gticks) {
-			for (i = 0; i < gticks; i++)
-				printf("#");
+	printf("\tLevel statistics\n");
+	for (i = level; i >= 0; i--) {
+		ls = &stat->levels[i];
+		if (!ls->blocks)
+			continue;
+		if (i)
+			capacity = BTRFS_NODEPTRS_PER_BLOCK(root) *
+				   sizeof(struct btrfs_key_ptr);
+		else
+			capacity = BTRFS_LEAF_DATA_SIZE(root);
+		printf("\t\tLevel %d: %llu blocks", i, ls->blocks);
+		if (!ls->read_blocks) {
 			printf("\n");
-		} else {
-			printf("|\n");
+			continue;
 		}
-		group_count = 0;
+		printf(", avg items %llu, fill %llu%%\n",
+		       ls->items / ls->read_blocks,
+		       ls->used_bytes * 100 / (capacity * ls->read_blocks));
+	}
+}
+
+static void print_dev_stats(struct root_stats *stat)
+{
+	int i;
+
+	for (i = 0; i < stat->nr_devs; i++) {
+		struct dev_stats *ds = &stat->devs[i];
+
+		if (!ds->total_blocks)
+			continue;
+		printf("\tDevice %llu: %llu blocks\n", ds->devid,
+		       ds->total_blocks);
+		print_seeks("\t\t", &ds->seeks);
 	}
 }
 
+static int init_dev_stats(struct btrfs_fs_info *fs_info,
+			  struct root_stats *stat)
+{
+	struct btrfs_device *device;
+	int nr = 0;
+
+	list_for_each_entry(device, &fs_info->fs_devices->devices, dev_list)
+		nr++;
+	stat->devs = calloc(nr, sizeof(struct dev_stats));
+	if (!stat->devs)
+		return -ENOMEM;
+	list_for_each_entry(device, &fs_info->fs_devices->devices, dev_list)
+		stat->devs[stat->nr_devs++].devid = device->devid;
+	return 0;
+}
+
 static void timeval_subtract(struct timeval *result,struct timeval *x,
 			     struct timeval *y)
 {
@@ -305,12 +400,63 @@ static void timeval_subtract(struct timeval *result,struct timeval *x,
 	result->tv_usec = x->tv_usec - y->tv_usec;
 }
 
+/*
+ * Count the leaves and items changed since min_gen, the walk skips the
+ * unchanged subtrees.
+ */
+static int calc_root_changes(struct btrfs_root *root)
+{
+	struct btrfs_tree_iter iter;
+	struct btrfs_key key = { 0 };
+	u64 last_leaf = 0;
+	u64 leaves = 0;
+	u64 items = 0;
+	u64 skipped = 0;
+	int level;
+	int ret;
+
+	btrfs_tree_iter_init(&iter, root, &key, min_gen);
+	while ((ret = btrfs_tree_iter_next(&iter, &key)) == 0) {
+		if (btrfs_header_bytenr(iter.path.nodes[0]) != last_leaf) {
+			last_leaf = btrfs_header_bytenr(iter.path.nodes[0]);
+			leaves++;
+		}
+		items++;
+	}
+	btrfs_tree_iter_release(&iter);
+	if (ret < 0) {
+		fprintf(stderr, "Error walking tree: %d\n", ret);
+		return ret;
+	}
+
+	for (level = 0; level < BTRFS_MAX_LEVEL; level++)
+		skipped += iter.pruned[level];
+	printf("\tChanged since generation %llu: %llu leaves, %llu items\n",
+	       (unsigned long long)min_gen, (unsigned long long)leaves,
+	       (unsigned long long)items);
+	if (no_pretty)
+		printf("\tSkipped blocks: %llu, %llu\n",
+		       (unsigned long long)skipped,
+		       (unsigned long long)iter.pruned_bytes);
+	else
+		printf("\tSkipped blocks: %llu, %s\n",
+		       (unsigned long long)skipped,
+		       pretty_size(iter.pruned_bytes));
+	for (level = BTRFS_MAX_LEVEL - 1; level >= 0; level--) {
+		if (!iter.visited[level] && !iter.pruned[level])
+			continue;
+		printf("\t\tLevel %d: %llu read, %llu skipped\n", level,
+		       (unsigned long long)iter.visited[level],
+		       (unsigned long long)iter.pruned[level]);
+	}
+	return 0;
+}
+
 static int calc_root_size(struct btrfs_root *tree_root, struct btrfs_key *key,
 			  int find_inline)
 {
 	struct btrfs_root *root;
 	struct btrfs_path *path;
-	struct rb_node *n;
 	struct timeval start, end, diff = {0};
 	struct root_stats stat;
 	int level;
@@ -322,6 +468,8 @@ static int calc_root_size(struct btrfs_root *tree_root, struct btrfs_key *key,
 		fprintf(stderr, "Failed to read root %Lu\n", key->objectid);
 		return 1;
 	}
+	if (min_gen)
+		return calc_root_changes(root);
 
 	path = btrfs_alloc_path();
 	if (!path) {
@@ -330,17 +478,29 @@ static int calc_root_size(struct btrfs_root *tree_root, struct btrfs_key *key,
 	}
 
 	memset(&stat, 0, sizeof(stat));
+	btrfs_prefetch_init(&stat.prefetch, root, root->node);
+	/* leaves are only read when looking for inline extents */
+	if (!find_inline)
+		stat.prefetch.level = 1;
 	level = btrfs_header_level(root->node);
 	stat.lowest_bytenr = btrfs_header_bytenr(root->node);
 	stat.highest_bytenr = stat.lowest_bytenr;
 	stat.min_cluster_size = (u64)-1;
 	stat.max_cluster_size = root->leafsize;
+	ret = init_dev_stats(tree_root->fs_info, &stat);
+	if (ret) {
+		fprintf(stderr, "Could not allocate device stats\n");
+		goto out;
+	}
+	account_physical(root, &stat, stat.lowest_bytenr, root->nodesize);
 	path->nodes[level] = root->node;
 	if (gettimeofday(&start, NULL)) {
 		fprintf(stderr, "Error getting time: %d\n", errno);
 		goto out;
 	}
 	if (!level) {
+		if (!find_inline)
+			account_block(root, &stat, root->node);
 		ret = walk_leaf(root, path, &stat, find_inline);
 		if (ret)
 			goto out;
@@ -364,12 +524,7 @@ out_print:
 	if (no_pretty || size_fail) {
 		printf("\tTotal size: %Lu\n", stat.total_bytes);
 		printf("\t\tInline data: %Lu\n", stat.total_inline);
-		printf("\tTotal seeks: %Lu\n", stat.total_seeks);
-		printf("\t\tForward seeks: %Lu\n", stat.forward_seeks);
-		printf("\t\tBackward seeks: %Lu\n", stat.backward_seeks);
-		printf("\t\tAvg seek len: %llu\n", stat.total_seeks ?
-			stat.total_seek_len / stat.total_seeks : 0);
-		print_seek_histogram(&stat);
+		print_seeks("\t", &stat.seeks);
 		printf("\tTotal clusters: %Lu\n", stat.total_clusters);
 		printf("\t\tAvg cluster size: %Lu\n", stat.total_cluster_size /
 		       stat.total_clusters);
@@ -383,13 +538,7 @@ out_print:
 	} else {
 		printf("\tTotal size: %s\n", pretty_size(stat.total_bytes));
 		printf("\t\tInline data: %s\n", pretty_size(stat.total_inline));
-		printf("\tTotal seeks: %Lu\n", stat.total_seeks);
-		printf("\t\tForward seeks: %Lu\n", stat.forward_seeks);
-		printf("\t\tBackward seeks: %Lu\n", stat.backward_seeks);
-		printf("\t\tAvg seek len: %s\n", stat.total_seeks ?
-			pretty_size(stat.total_seek_len / stat.total_seeks) :
-			pretty_size(0));
-		print_seek_histogram(&stat);
+		print_seeks("\t", &stat.seeks);
 		printf("\tTotal clusters: %Lu\n", stat.total_clusters);
 		printf("\t\tAvg cluster size: %s\n",
 				pretty_size((stat.total_cluster_size /
@@ -405,12 +554,11 @@ out_print:
 		       (int)diff.tv_usec);
 		printf("\tLevels: %d\n", level + 1);
 	}
+	print_level_stats(root, &stat, level);
+	print_dev_stats(&stat);
 out:
-	while ((n = rb_first(&stat.seek_root)) != NULL) {
-		struct seek *seek = rb_entry(n, struct seek, n);
-		rb_erase(n, &stat.seek_root);
-		free(seek);
-	}
+	btrfs_prefetch_release(&stat.prefetch);
+	free(stat.devs);
 
 	/*
 	 * We only use path to save node data in iterating,
@@ -425,7 +573,7 @@ out:
 
 static void usage(void)
 {
-	fprintf(stderr, "Usage: calc-size [-v] [-b] <device>\n");
+	fprintf(stderr, "Usage: calc-size [-v] [-b] [-g <generation>] <device>\n");
 }
 
 int main(int argc, char **argv)
@@ -435,7 +583,7 @@ int main(int argc, char **argv)
 	int opt;
 	int ret = 0;
 
-	while ((opt = getopt(argc, argv, "vb")) != -1) {
+	while ((opt = getopt(argc, argv, "vbg:")) != -1) {
 		switch (opt) {
 			case 'v':
 				verbose++;
@@ -443,6 +591,9 @@ int main(int argc, char **argv)
 			case 'b':
 				no_pretty = 1;
 				break;
+			case 'g':
+				min_gen = arg_strtou64(optarg);
+				break;
 			default:
 				usage();
 				exit(1);
@@ -43,6 +43,7 @@
 
 #define INO_OFFSET (BTRFS_FIRST_FREE_OBJECTID - EXT2_ROOT_INO)
 #define CONV_IMAGE_SUBVOL_OBJECTID BTRFS_FIRST_FREE_OBJECTID
+#define CSUM_READ_SIZE		(4 * 1024 * 1024)
 
 struct task_ctx {
 	uint32_t max_copy_inodes;
@@ -303,8 +304,8 @@ static int cache_free_extents(struct btrfs_root *root,
 		if (convert_test_block(cctx, block))
 			continue;
 		bytenr = block * blocksize;
-		ret = set_extent_dirty(&root->fs_info->free_space_cache,
-				       bytenr, bytenr + blocksize - 1, 0);
+		ret = btrfs_mark_free_space(root->fs_info, bytenr,
+					    bytenr + blocksize - 1);
 		BUG_ON(ret);
 	}
 
@@ -313,12 +314,11 @@ static int cache_free_extents(struct btrfs_root *root,
 		bytenr &= ~((u64)BTRFS_STRIPE_LEN - 1);
 		if (bytenr >= blocksize * cctx->block_count)
 			break;
-		clear_extent_dirty(&root->fs_info->free_space_cache, bytenr,
-				   bytenr + BTRFS_STRIPE_LEN - 1, 0);
+		btrfs_clear_free_space(root->fs_info, bytenr,
+				       bytenr + BTRFS_STRIPE_LEN - 1);
 	}
 
-	clear_extent_dirty(&root->fs_info->free_space_cache,
-			   0, BTRFS_SUPER_INFO_OFFSET - 1, 0);
+	btrfs_clear_free_space(root->fs_info, 0, BTRFS_SUPER_INFO_OFFSET - 1);
 
 	return 0;
 }
@@ -372,8 +372,8 @@ static int custom_alloc_extent(struct btrfs_root *root, u64 num_bytes,
 				continue;
 			}
 		}
-		clear_extent_dirty(&root->fs_info->free_space_cache,
-				   start, start + num_bytes - 1, 0);
+		btrfs_clear_free_space(root->fs_info, start,
+				       start + num_bytes - 1);
 
 		ins->objectid = start;
 		ins->offset = num_bytes;
@@ -551,28 +551,45 @@ fail:
 	return ret;
 }
 
+/*
+ * Checksum a data extent. The extent is read in large sequential runs and
+ * the checksums of each run are inserted by a single csum tree search
+ * instead of doing a read and a search for every sector.
+ */
 static int csum_disk_extent(struct btrfs_trans_handle *trans,
 			    struct btrfs_root *root,
 			    u64 disk_bytenr, u64 num_bytes)
 {
-	u32 blocksize = root->sectorsize;
+	struct btrfs_root *csum_root = root->fs_info->csum_root;
 	u64 offset;
+	u64 len;
 	char *buffer;
 	int ret = 0;
 
-	buffer = malloc(blocksize);
+	buffer = malloc(CSUM_READ_SIZE);
 	if (!buffer)
 		return -ENOMEM;
-	for (offset = 0; offset < num_bytes; offset += blocksize) {
-		ret = read_disk_extent(root, disk_bytenr + offset,
-					blocksize, buffer);
+	for (offset = 0; offset < num_bytes; offset += len) {
+		len = min_t(u64, num_bytes - offset, CSUM_READ_SIZE);
+		ret = read_disk_extent(root, disk_bytenr + offset, len,
+				       buffer);
 		if (ret)
 			break;
-		ret = btrfs_csum_file_block(trans,
-					    root->fs_info->csum_root,
-					    disk_bytenr + num_bytes,
-					    disk_bytenr + offset,
-					    buffer, blocksize);
+		ret = btrfs_csum_file_range(trans, csum_root, NULL,
+					    disk_bytenr + offset, buffer, len);
+		/*
+		 * The image file references blocks that may have been
+		 * checksummed already, replace their csums like
+		 * btrfs_csum_file_block() used to.
+		 */
+		if (ret == -EEXIST) {
+			ret = btrfs_del_csums(trans, csum_root,
+					      disk_bytenr + offset, len);
+			if (!ret)
+				ret = btrfs_csum_file_range(trans, csum_root,
+						NULL, disk_bytenr + offset,
+						buffer, len);
+		}
 		if (ret)
 			break;
 	}
@@ -3072,6 +3089,8 @@ int main(int argc, char *argv[])
 	char fslabel[BTRFS_LABEL_SIZE];
 	u64 features = BTRFS_MKFS_DEFAULT_FEATURES;
 
+	crc32c_optimization_init();
+
 	while(1) {
 		enum { GETOPT_VAL_NO_PROGRESS = 256 };
 		static const struct option long_options[] = {
@@ -1061,9 +1061,15 @@ static int is_tree_block(struct btrfs_root *extent_root,
 }
 #endif
 
+/*
+ * @pf, if set, is the readahead window of the tree @eb belongs to.  The
+ * trees found through root items get a window of their own.
+ */
 static int copy_tree_blocks(struct btrfs_root *root, struct extent_buffer *eb,
-			    struct metadump_struct *metadump, int root_tree)
+			    struct metadump_struct *metadump, int root_tree,
+			    struct btrfs_prefetch *pf)
 {
+	struct btrfs_prefetch sub;
 	struct extent_buffer *tmp;
 	struct btrfs_root_item *ri;
 	struct btrfs_key key;
@@ -1097,18 +1103,25 @@ static int copy_tree_blocks(struct btrfs_root *root, struct extent_buffer *eb,
 					"Error reading log root block\n");
 				return -EIO;
 			}
-			ret = copy_tree_blocks(root, tmp, metadump, 0);
+			btrfs_prefetch_init(&sub, root, tmp);
+			ret = copy_tree_blocks(root, tmp, metadump, 0, &sub);
+			btrfs_prefetch_release(&sub);
 			free_extent_buffer(tmp);
 			if (ret)
 				return ret;
 		} else {
+			if (pf) {
+				btrfs_node_key_to_cpu(eb, &key, i);
+				btrfs_prefetch_update(pf, &key);
+			}
 			bytenr = btrfs_node_blockptr(eb, i);
 			tmp = read_tree_block(root, bytenr, root->leafsize, 0);
 			if (!extent_buffer_uptodate(tmp)) {
 				fprintf(stderr, "Error reading log block\n");
 				return -EIO;
 			}
-			ret = copy_tree_blocks(root, tmp, metadump, root_tree);
+			ret = copy_tree_blocks(root, tmp, metadump, root_tree,
+					       pf);
 			free_extent_buffer(tmp);
 			if (ret)
 				return ret;
@@ -1134,7 +1147,7 @@ static int copy_log_trees(struct btrfs_root *root,
 	}
 
 	return copy_tree_blocks(root, root->fs_info->log_root_tree->node,
-				metadump, 1);
+				metadump, 1, NULL);
 }
 
 static int copy_space_cache(struct btrfs_root *root,
@@ -1208,6 +1221,7 @@ static int copy_from_extent_tree(struct metadump_struct *metadump,
 				 struct btrfs_path *path)
 {
 	struct btrfs_root *extent_root;
+	struct btrfs_prefetch prefetch;
 	struct extent_buffer *leaf;
 	struct btrfs_extent_item *ei;
 	struct btrfs_key key;
@@ -1221,9 +1235,14 @@ static int copy_from_extent_tree(struct metadump_struct *metadump,
 	key.type = BTRFS_EXTENT_ITEM_KEY;
 	key.offset = 0;
 
+	btrfs_prefetch_init(&prefetch, extent_root, extent_root->node);
+	prefetch.min_key = key;
+	btrfs_prefetch_update(&prefetch, &key);
+
 	ret = btrfs_search_slot(NULL, extent_root, &key, path, 0, 0);
 	if (ret < 0) {
 		fprintf(stderr, "Error searching extent root %d\n", ret);
+		btrfs_prefetch_release(&prefetch);
 		return ret;
 	}
 	ret = 0;
@@ -1232,6 +1251,12 @@ static int copy_from_extent_tree(struct metadump_struct *metadump,
 
 	while (1) {
 		if (path->slots[0] >= btrfs_header_nritems(leaf)) {
+			/* the window moves on as each leaf is finished */
+			if (btrfs_header_nritems(leaf)) {
+				btrfs_item_key_to_cpu(leaf, &key,
+					btrfs_header_nritems(leaf) - 1);
+				btrfs_prefetch_update(&prefetch, &key);
+			}
 			ret = btrfs_next_leaf(extent_root, path);
 			if (ret < 0) {
 				fprintf(stderr, "Error going to next leaf %d"
@@ -1301,6 +1326,7 @@ static int copy_from_extent_tree(struct metadump_struct *metadump,
 		bytenr += num_bytes;
 	}
 
+	btrfs_prefetch_release(&prefetch);
 	btrfs_release_path(path);
 
 	return ret;
@@ -1348,14 +1374,14 @@ static int create_metadump(const char *input, FILE *out, int num_threads,
 
 	if (walk_trees) {
 		ret = copy_tree_blocks(root, root->fs_info->chunk_root->node,
-				       &metadump, 1);
+				       &metadump, 1, NULL);
 		if (ret) {
 			err = ret;
 			goto out;
 		}
 
 		ret = copy_tree_blocks(root, root->fs_info->tree_root->node,
-				       &metadump, 1);
+				       &metadump, 1, NULL);
 		if (ret) {
 			err = ret;
 			goto out;
@@ -37,6 +37,14 @@
  * */
 static FILE *info_file;
 
+/* batch mode: print mappings as JSON lines, tagged with the requested address */
+static int batch_mode;
+static u64 batch_logical;
+
+/* the last extent found, consecutive lookups tend to hit it again */
+static u64 cached_extent_start;
+static u64 cached_extent_len;
+
 static int map_one_extent(struct btrfs_fs_info *fs_info,
 			  u64 *logical_ret, u64 *len_ret, int search_foward)
 {
@@ -49,6 +57,16 @@ static int map_one_extent(struct btrfs_fs_info *fs_info,
 	BUG_ON(!logical_ret);
 	logical = *logical_ret;
 
+	if (cached_extent_len &&
+	    ((!search_foward && logical >= cached_extent_start &&
+	      logical < cached_extent_start + cached_extent_len) ||
+	     (search_foward && logical == cached_extent_start))) {
+		*logical_ret = cached_extent_start;
+		if (len_ret)
+			*len_ret = cached_extent_len;
+		return 0;
+	}
+
 	path = btrfs_alloc_path();
 	if (!path)
 		return -ENOMEM;
@@ -91,6 +109,8 @@ out:
 		*logical_ret = logical;
 		if (len_ret)
 			*len_ret = len;
+		cached_extent_start = logical;
+		cached_extent_len = len;
 	}
 	return ret;
 }
@@ -112,6 +132,14 @@ static int __print_mapping_info(struct btrfs_fs_info *fs_info, u64 logical,
 				logical + cur_offset, &cur_len,
 				&multi, mirror_num, NULL);
 		if (ret) {
+			if (batch_mode) {
+				fprintf(info_file,
+		"{\"request\":%llu,\"logical\":%llu,\"mirror\":%d,\"error\":",
+					batch_logical, logical, mirror_num);
+				print_json_string(info_file, strerror(-ret));
+				fprintf(info_file, "}\n");
+				return ret;
+			}
 			fprintf(info_file,
 				"Error: fails to map mirror%d logical %llu: %s\n",
 				mirror_num, logical, strerror(-ret));
@@ -119,6 +147,18 @@ static int __print_mapping_info(struct btrfs_fs_info *fs_info, u64 logical,
 		}
 		for (i = 0; i < multi->num_stripes; i++) {
 			device = multi->stripes[i].dev;
+			if (batch_mode) {
+				fprintf(info_file,
+	"{\"request\":%llu,\"logical\":%llu,\"length\":%llu,\"mirror\":%d,"
+	"\"devid\":%llu,\"physical\":%llu,\"device\":",
+					batch_logical, logical + cur_offset,
+					min(cur_len, len - cur_offset),
+					mirror_num, device->devid,
+					multi->stripes[i].physical);
+				print_json_string(info_file, device->name);
+				fprintf(info_file, "}\n");
+				continue;
+			}
 			fprintf(info_file,
 				"mirror %d logical %Lu physical %Lu device %s\n",
 				mirror_num, logical + cur_offset,
@@ -190,6 +230,138 @@ static int write_extent_content(struct btrfs_fs_info *fs_info, int out_fd,
 	return ret;
 }
 
+/*
+ * Map all extents in [logical, logical + bytes) and print where their
+ * copies are, optionally write the data of the given copy to out_fd.
+ *
+ * Return 0 if something was mapped, >0 if there's no extent in the range
+ * and <0 for errors.
+ */
+static int map_logical_range(struct btrfs_fs_info *fs_info, u64 logical,
+			     u64 bytes, int out_fd, u64 copy, int write_data)
+{
+	u64 cur_logical = logical;
+	u64 cur_len = bytes;
+	int found = 0;
+	int ret;
+
+	/* First find the nearest extent */
+	ret = map_one_extent(fs_info, &cur_logical, &cur_len, 0);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to find extent at [%llu,%llu): %s\n",
+			cur_logical, cur_logical + cur_len, strerror(-ret));
+		return ret;
+	}
+	/*
+	 * Normally, search backward should be OK, but for special case like
+	 * given logical is quite small where no extents are before it,
+	 * we need to search forward.
+	 */
+	if (ret > 0) {
+		ret = map_one_extent(fs_info, &cur_logical, &cur_len, 1);
+		if (ret < 0) {
+			fprintf(stderr,
+				"Failed to find extent at [%llu,%llu): %s\n",
+				cur_logical, cur_logical + cur_len,
+				strerror(-ret));
+			return ret;
+		}
+		if (ret > 0) {
+			if (!batch_mode)
+				fprintf(stderr,
+					"Failed to find any extent at [%llu,%llu)\n",
+					cur_logical, cur_logical + cur_len);
+			return ret;
+		}
+	}
+
+	while (cur_logical + cur_len >= logical && cur_logical < logical +
+	       bytes) {
+		u64 real_logical;
+		u64 real_len;
+
+		ret = map_one_extent(fs_info, &cur_logical, &cur_len, 1);
+		if (ret < 0)
+			return ret;
+		if (ret > 0)
+			break;
+		real_logical = max(logical, cur_logical);
+		real_len = min(logical + bytes, cur_logical + cur_len) -
+			   real_logical;
+		/* the nearest extent may end before the range */
+		if (cur_logical + cur_len <= logical) {
+			cur_logical += cur_len;
+			continue;
+		}
+		found = 1;
+
+		ret = print_mapping_info(fs_info, real_logical, real_len);
+		if (ret < 0)
+			return ret;
+		if (write_data && out_fd != -1) {
+			ret = write_extent_content(fs_info, out_fd,
+					real_logical, real_len, copy);
+			if (ret < 0)
+				return ret;
+		}
+
+		cur_logical += cur_len;
+	}
+
+	if (!found) {
+		if (!batch_mode)
+			fprintf(stderr, "No extent found at range [%llu,%llu)\n",
+				logical, logical + bytes);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Read "logical [bytes]" lines from stdin and print the mapping of each as
+ * JSON lines, the filesystem is opened only once for all of them.
+ */
+static int map_batch(struct btrfs_fs_info *fs_info, u64 default_bytes)
+{
+	char *line = NULL;
+	size_t alloc = 0;
+	ssize_t len;
+	u64 vals[2];
+	u64 logical;
+	u64 bytes;
+	int nr;
+	int ret;
+	int err = 0;
+
+	while ((len = getline(&line, &alloc, stdin)) != -1) {
+		if (len && line[len - 1] == '\n')
+			line[len - 1] = 0;
+		if (line[0] == 0 || line[0] == '#')
+			continue;
+		nr = parse_u64_line(line, vals, 2);
+		if (nr <= 0) {
+			fprintf(info_file, "{\"error\":\"invalid input\",\"input\":");
+			print_json_string(info_file, line);
+			fprintf(info_file, "}\n");
+			err = 1;
+			continue;
+		}
+		logical = vals[0];
+		bytes = nr > 1 && vals[1] ? vals[1] : default_bytes;
+
+		batch_logical = logical;
+		ret = map_logical_range(fs_info, logical, bytes, -1, 0, 0);
+		if (ret > 0)
+			fprintf(info_file,
+		"{\"request\":%llu,\"error\":\"no extent found\"}\n",
+				logical);
+		if (ret)
+			err = 1;
+	}
+	free(line);
+	return err;
+}
+
 static void print_usage(void) __attribute__((noreturn));
 static void print_usage(void)
 {
@@ -198,6 +370,8 @@ static void print_usage(void)
 	fprintf(stderr, "\t-c Copy of the extent to read (usually 1 or 2)\n");
 	fprintf(stderr, "\t-o Output file to hold the extent\n");
 	fprintf(stderr, "\t-b Number of bytes to read\n");
+	fprintf(stderr, "\t--stdin Read \"logical [bytes]\" lines from stdin and print\n");
+	fprintf(stderr, "\t        the mappings as JSON lines\n");
 	exit(1);
 }
 
@@ -210,20 +384,19 @@ int main(int argc, char **argv)
 	u64 copy = 0;
 	u64 logical = 0;
 	u64 bytes = 0;
-	u64 cur_logical = 0;
-	u64 cur_len = 0;
 	int out_fd = -1;
-	int found = 0;
 	int ret = 0;
 
 	while(1) {
 		int c;
+		enum { GETOPT_VAL_STDIN = 257 };
 		static const struct option long_options[] = {
 			/* { "byte-count", 1, NULL, 'b' }, */
 			{ "logical", required_argument, NULL, 'l' },
 			{ "copy", required_argument, NULL, 'c' },
 			{ "output", required_argument, NULL, 'o' },
 			{ "bytes", required_argument, NULL, 'b' },
+			{ "stdin", no_argument, NULL, GETOPT_VAL_STDIN },
 			{ NULL, 0, NULL, 0}
 		};
 
@@ -243,6 +416,9 @@ int main(int argc, char **argv)
 			case 'o':
 				output_file = strdup(optarg);
 				break;
+			case GETOPT_VAL_STDIN:
+				batch_mode = 1;
+				break;
 			default:
 				print_usage();
 		}
@@ -250,8 +426,12 @@ int main(int argc, char **argv)
 	set_argv0(argv);
 	if (check_argc_min(argc - optind, 1))
 		print_usage();
-	if (logical == 0)
+	if (logical == 0 && !batch_mode)
 		print_usage();
+	if (batch_mode && (logical || output_file)) {
+		fprintf(stderr, "--stdin can't be used with -l or -o\n");
+		exit(1);
+	}
 
 	dev = argv[optind];
 
@@ -286,70 +466,14 @@ int main(int argc, char **argv)
 
 	if (bytes == 0)
 		bytes = root->nodesize;
-	cur_logical = logical;
-	cur_len = bytes;
 
-	/* First find the nearest extent */
-	ret = map_one_extent(root->fs_info, &cur_logical, &cur_len, 0);
-	if (ret < 0) {
-		fprintf(stderr, "Failed to find extent at [%llu,%llu): %s\n",
-			cur_logical, cur_logical + cur_len, strerror(-ret));
+	if (batch_mode) {
+		ret = map_batch(root->fs_info, bytes);
 		goto out_close_fd;
 	}
-	/*
-	 * Normally, search backward should be OK, but for special case like
-	 * given logical is quite small where no extents are before it,
-	 * we need to search forward.
-	 */
-	if (ret > 0) {
-		ret = map_one_extent(root->fs_info, &cur_logical, &cur_len, 1);
-		if (ret < 0) {
-			fprintf(stderr,
-				"Failed to find extent at [%llu,%llu): %s\n",
-				cur_logical, cur_logical + cur_len,
-				strerror(-ret));
-			goto out_close_fd;
-		}
-		if (ret > 0) {
-			fprintf(stderr,
-				"Failed to find any extent at [%llu,%llu)\n",
-				cur_logical, cur_logical + cur_len);
-			goto out_close_fd;
-		}
-	}
-
-	while (cur_logical + cur_len >= logical && cur_logical < logical +
-	       bytes) {
-		u64 real_logical;
-		u64 real_len;
-
-		found = 1;
-		ret = map_one_extent(root->fs_info, &cur_logical, &cur_len, 1);
-		if (ret < 0)
-			goto out_close_fd;
-		if (ret > 0)
-			break;
-		real_logical = max(logical, cur_logical);
-		real_len = min(logical + bytes, cur_logical + cur_len) -
-			   real_logical;
 
-		ret = print_mapping_info(root->fs_info, real_logical, real_len);
-		if (ret < 0)
-			goto out_close_fd;
-		if (output_file && out_fd != -1) {
-			ret = write_extent_content(root->fs_info, out_fd,
-					real_logical, real_len, copy);
-			if (ret < 0)
-				goto out_close_fd;
-		}
-
-		cur_logical += cur_len;
-	}
-
-	if (!found) {
-		fprintf(stderr, "No extent found at range [%llu,%llu)\n",
-			logical, logical + bytes);
-	}
+	ret = map_logical_range(root->fs_info, logical, bytes, out_fd, copy,
+				output_file != NULL);
 out_close_fd:
 	if (output_file && out_fd != 1)
 		close(out_fd);
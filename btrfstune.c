@@ -25,6 +25,7 @@
 #include <dirent.h>
 #include <uuid/uuid.h>
 #include <getopt.h>
+#include <pthread.h>
 
 #include "kerncompat.h"
 #include "ctree.h"
@@ -32,6 +33,12 @@
 #include "transaction.h"
 #include "utils.h"
 #include "volumes.h"
+#include "crc32c.h"
+
+/* tree blocks collected before they are rewritten by the worker threads */
+#define UUID_BATCH_BLOCKS	32768
+/* blocks taken by a worker at once, keeps each worker's I/O sequential */
+#define UUID_WORKER_CHUNK	64
 
 static char *device;
 static int force = 0;
@@ -115,16 +122,305 @@ static int change_header_uuid(struct btrfs_root *root, struct extent_buffer *eb)
 	return ret;
 }
 
+static int change_tree_block_uuid(struct btrfs_root *root, u64 bytenr)
+{
+	struct extent_buffer *eb;
+	int ret;
+
+	eb = read_tree_block(root, bytenr, root->nodesize, 0);
+	if (IS_ERR(eb)) {
+		fprintf(stderr, "Failed to read tree block: %llu\n", bytenr);
+		return PTR_ERR(eb);
+	}
+	ret = change_header_uuid(root, eb);
+	free_extent_buffer(eb);
+	if (ret < 0)
+		fprintf(stderr, "Failed to change uuid of tree block: %llu\n",
+			bytenr);
+	return ret;
+}
+
+struct uuid_block {
+	u64 bytenr;
+	struct btrfs_multi_bio *multi;
+};
+
+struct uuid_rewrite_ctx {
+	struct btrfs_fs_info *fs_info;
+	struct uuid_block *blocks;
+	int nr;
+	int next;
+	int err;
+	pthread_mutex_t mutex;
+};
+
+static int cmp_uuid_block(const void *a, const void *b)
+{
+	const struct btrfs_bio_stripe *s1 = &((struct uuid_block *)a)->multi->stripes[0];
+	const struct btrfs_bio_stripe *s2 = &((struct uuid_block *)b)->multi->stripes[0];
+
+	if (s1->dev->devid != s2->dev->devid)
+		return s1->dev->devid < s2->dev->devid ? -1 : 1;
+	if (s1->physical != s2->physical)
+		return s1->physical < s2->physical ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Read one tree block from the first good copy, patch fsid and chunk tree
+ * uuid in the header, recalculate the checksum and write it to all copies.
+ * This works on raw buffers so it can run outside of the extent buffer
+ * cache, which is not thread safe.
+ */
+static int rewrite_block_uuid(struct btrfs_fs_info *fs_info,
+			      struct uuid_block *ub, char *buf)
+{
+	struct btrfs_multi_bio *multi = ub->multi;
+	struct btrfs_header *header = (struct btrfs_header *)buf;
+	u32 nodesize = fs_info->tree_root->nodesize;
+	u16 csum_size = btrfs_super_csum_size(fs_info->super_copy);
+	char result[BTRFS_CSUM_SIZE];
+	u32 crc;
+	int good = 0;
+	int ret;
+	int i;
+
+	for (i = 0; i < multi->num_stripes; i++) {
+		struct btrfs_device *dev = multi->stripes[i].dev;
+
+		/* missing device */
+		if (dev->fd < 0)
+			continue;
+		ret = pread64(dev->fd, buf, nodesize,
+			      multi->stripes[i].physical);
+		if (ret != nodesize)
+			continue;
+		if (le64_to_cpu(header->bytenr) != ub->bytenr)
+			continue;
+		crc = crc32c(~(u32)0, (u8 *)buf + BTRFS_CSUM_SIZE,
+			     nodesize - BTRFS_CSUM_SIZE);
+		btrfs_csum_final(crc, result);
+		if (!memcmp(result, buf, csum_size)) {
+			good = 1;
+			break;
+		}
+	}
+	if (!good) {
+		fprintf(stderr, "Failed to read tree block: %llu\n",
+			ub->bytenr);
+		return -EIO;
+	}
+
+	/* already done by an interrupted run */
+	if (!memcmp(header->fsid, fs_info->new_fsid, BTRFS_FSID_SIZE) &&
+	    !memcmp(header->chunk_tree_uuid, fs_info->new_chunk_tree_uuid,
+		    BTRFS_UUID_SIZE))
+		return 0;
+
+	memcpy(header->fsid, fs_info->new_fsid, BTRFS_FSID_SIZE);
+	memcpy(header->chunk_tree_uuid, fs_info->new_chunk_tree_uuid,
+	       BTRFS_UUID_SIZE);
+	crc = crc32c(~(u32)0, (u8 *)buf + BTRFS_CSUM_SIZE,
+		     nodesize - BTRFS_CSUM_SIZE);
+	btrfs_csum_final(crc, buf);
+
+	for (i = 0; i < multi->num_stripes; i++) {
+		struct btrfs_device *dev = multi->stripes[i].dev;
+
+		if (dev->fd < 0)
+			continue;
+		ret = pwrite64(dev->fd, buf, nodesize,
+			       multi->stripes[i].physical);
+		if (ret != nodesize) {
+			fprintf(stderr,
+				"Failed to change uuid of tree block: %llu\n",
+				ub->bytenr);
+			return -EIO;
+		}
+	}
+	return 0;
+}
+
+static void *uuid_rewrite_worker(void *data)
+{
+	struct uuid_rewrite_ctx *ctx = data;
+	char *buf;
+	int start;
+	int end;
+	int ret = 0;
+
+	buf = malloc(ctx->fs_info->tree_root->nodesize);
+	if (!buf) {
+		pthread_mutex_lock(&ctx->mutex);
+		ctx->err = -ENOMEM;
+		pthread_mutex_unlock(&ctx->mutex);
+		return NULL;
+	}
+
+	while (!ret) {
+		pthread_mutex_lock(&ctx->mutex);
+		if (ctx->err || ctx->next >= ctx->nr) {
+			pthread_mutex_unlock(&ctx->mutex);
+			break;
+		}
+		start = ctx->next;
+		end = min(ctx->nr, start + UUID_WORKER_CHUNK);
+		ctx->next = end;
+		pthread_mutex_unlock(&ctx->mutex);
+
+		for (; start < end; start++) {
+			ret = rewrite_block_uuid(ctx->fs_info,
+						 &ctx->blocks[start], buf);
+			if (ret) {
+				pthread_mutex_lock(&ctx->mutex);
+				ctx->err = ret;
+				pthread_mutex_unlock(&ctx->mutex);
+				break;
+			}
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Rewrite a batch of tree blocks that are not in the extent buffer cache,
+ * sorted by device and physical offset and spread over worker threads.
+ */
+static int flush_uuid_blocks(struct btrfs_fs_info *fs_info,
+			     struct uuid_block *blocks, int nr)
+{
+	struct btrfs_root *root = fs_info->extent_root;
+	struct uuid_rewrite_ctx ctx;
+	struct extent_buffer *eb;
+	pthread_t *threads;
+	long num_threads;
+	int nr_queued = 0;
+	int ret = 0;
+	int i;
+
+	/*
+	 * Blocks cached after they were queued must be changed through the
+	 * cache, otherwise a later write of the cached copy would undo it.
+	 */
+	for (i = 0; i < nr; i++) {
+		eb = btrfs_find_tree_block(root, blocks[i].bytenr,
+					   root->nodesize);
+		if (!eb) {
+			blocks[nr_queued++] = blocks[i];
+			continue;
+		}
+		free_extent_buffer(eb);
+		kfree(blocks[i].multi);
+		if (!ret)
+			ret = change_tree_block_uuid(root, blocks[i].bytenr);
+	}
+	if (ret)
+		goto out;
+
+	qsort(blocks, nr_queued, sizeof(*blocks), cmp_uuid_block);
+
+	num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_threads <= 0)
+		num_threads = 1;
+	num_threads = min_t(long, num_threads, nr_queued);
+
+	ctx.fs_info = fs_info;
+	ctx.blocks = blocks;
+	ctx.nr = nr_queued;
+	ctx.next = 0;
+	ctx.err = 0;
+	pthread_mutex_init(&ctx.mutex, NULL);
+
+	threads = calloc(num_threads, sizeof(pthread_t));
+	if (!threads) {
+		ret = -ENOMEM;
+		goto out_mutex;
+	}
+	for (i = 0; i < num_threads; i++) {
+		ret = pthread_create(&threads[i], NULL, uuid_rewrite_worker,
+				     &ctx);
+		if (ret) {
+			ret = -ret;
+			pthread_mutex_lock(&ctx.mutex);
+			ctx.err = ret;
+			pthread_mutex_unlock(&ctx.mutex);
+			break;
+		}
+	}
+	num_threads = i;
+	/* with no worker running, rewrite everything from this thread */
+	if (!num_threads && !ret)
+		uuid_rewrite_worker(&ctx);
+	for (i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+	if (!ret)
+		ret = ctx.err;
+	free(threads);
+out_mutex:
+	pthread_mutex_destroy(&ctx.mutex);
+out:
+	for (i = 0; i < nr_queued; i++)
+		kfree(blocks[i].multi);
+	return ret;
+}
+
+/*
+ * Queue a tree block for the parallel rewrite. Cached blocks and blocks
+ * that can't be written with a plain copy per stripe (RAID56, crossing a
+ * stripe boundary) are changed right away through the extent buffer cache.
+ */
+static int queue_uuid_block(struct btrfs_fs_info *fs_info, u64 bytenr,
+			    struct uuid_block *blocks, int *nr)
+{
+	struct btrfs_root *root = fs_info->extent_root;
+	struct btrfs_multi_bio *multi = NULL;
+	struct extent_buffer *eb;
+	u64 *raid_map = NULL;
+	u64 length = root->nodesize;
+	int ret;
+
+	eb = btrfs_find_tree_block(root, bytenr, root->nodesize);
+	if (eb) {
+		free_extent_buffer(eb);
+		return change_tree_block_uuid(root, bytenr);
+	}
+
+	ret = btrfs_map_block(&fs_info->mapping_tree, WRITE, bytenr, &length,
+			      &multi, 0, &raid_map);
+	if (ret || raid_map || length < root->nodesize) {
+		kfree(raid_map);
+		kfree(multi);
+		return change_tree_block_uuid(root, bytenr);
+	}
+
+	blocks[*nr].bytenr = bytenr;
+	blocks[*nr].multi = multi;
+	(*nr)++;
+	if (*nr < UUID_BATCH_BLOCKS)
+		return 0;
+	ret = flush_uuid_blocks(fs_info, blocks, *nr);
+	*nr = 0;
+	return ret;
+}
+
 static int change_extents_uuid(struct btrfs_fs_info *fs_info)
 {
 	struct btrfs_root *root = fs_info->extent_root;
 	struct btrfs_path *path;
 	struct btrfs_key key = {0, 0, 0};
+	struct uuid_block *blocks;
+	int nr = 0;
 	int ret = 0;
 
 	path = btrfs_alloc_path();
 	if (!path)
 		return -ENOMEM;
+	blocks = calloc(UUID_BATCH_BLOCKS, sizeof(*blocks));
+	if (!blocks) {
+		btrfs_free_path(path);
+		return -ENOMEM;
+	}
 
 	/*
 	 * Here we don't use transaction as it will takes a lot of reserve
@@ -136,7 +432,6 @@ static int change_extents_uuid(struct btrfs_fs_info *fs_info)
 
 	while (1) {
 		struct btrfs_extent_item *ei;
-		struct extent_buffer *eb;
 		u64 flags;
 		u64 bytenr;
 
@@ -151,20 +446,9 @@ static int change_extents_uuid(struct btrfs_fs_info *fs_info)
 			goto next;
 
 		bytenr = key.objectid;
-		eb = read_tree_block(root, bytenr, root->nodesize, 0);
-		if (IS_ERR(eb)) {
-			fprintf(stderr, "Failed to read tree block: %llu\n",
-				bytenr);
-			ret = PTR_ERR(eb);
-			goto out;
-		}
-		ret = change_header_uuid(root, eb);
-		free_extent_buffer(eb);
-		if (ret < 0) {
-			fprintf(stderr, "Failed to change uuid of tree block: %llu\n",
-				bytenr);
+		ret = queue_uuid_block(fs_info, bytenr, blocks, &nr);
+		if (ret < 0)
 			goto out;
-		}
 next:
 		ret = btrfs_next_item(root, path);
 		if (ret < 0)
@@ -177,6 +461,12 @@ next:
 
 out:
 	btrfs_free_path(path);
+	if (!ret)
+		ret = flush_uuid_blocks(fs_info, blocks, nr);
+	else
+		while (nr > 0)
+			kfree(blocks[--nr].multi);
+	free(blocks);
 	return ret;
 }
 
@@ -29,6 +29,7 @@
 
 #include "commands.h"
 #include "utils.h"
+#include "telemetry.h"
 
 static const char * const balance_cmd_group_usage[] = {
 	"btrfs balance <command> [options] <path>",
@@ -470,6 +471,57 @@ out:
 	return ret;
 }
 
+struct balance_telemetry {
+	int fd;
+	struct btrfs_ioctl_balance_args *args;
+	u64 last_completed;
+	double t_start;
+};
+
+static void telemetry_balance_args(struct telemetry *tm,
+				   struct btrfs_ioctl_balance_args *args,
+				   u64 last_completed, double elapsed)
+{
+	const char *state = "paused";
+
+	if (args->state & BTRFS_BALANCE_STATE_CANCEL_REQ)
+		state = "cancel requested";
+	else if (args->state & BTRFS_BALANCE_STATE_PAUSE_REQ)
+		state = "pause requested";
+	else if (args->state & BTRFS_BALANCE_STATE_RUNNING)
+		state = "running";
+	telemetry_str(tm, "state", state);
+	telemetry_u64(tm, "chunks_expected", args->stat.expected);
+	telemetry_u64(tm, "chunks_considered", args->stat.considered);
+	telemetry_u64(tm, "chunks_completed", args->stat.completed);
+	telemetry_rate(tm, args->stat.completed, last_completed,
+		       args->stat.expected, elapsed);
+}
+
+static void balance_telemetry_sample(struct telemetry *tm, const char *event)
+{
+	struct balance_telemetry *bt = tm->data;
+	struct btrfs_ioctl_balance_args progress;
+	struct btrfs_ioctl_balance_args *args = &progress;
+	double now = telemetry_now();
+
+	memset(&progress, 0, sizeof(progress));
+	if (!strcmp(event, "finished")) {
+		/* the balance ioctl returned the final numbers */
+		args = bt->args;
+	} else if (ioctl(bt->fd, BTRFS_IOC_BALANCE_PROGRESS, &progress) < 0) {
+		/* not started yet or already finished */
+		return;
+	}
+
+	telemetry_begin(tm, "balance", event);
+	telemetry_u64(tm, "elapsed", now - bt->t_start);
+	telemetry_balance_args(tm, args, bt->last_completed,
+			       now - tm->last_time);
+	telemetry_end(tm);
+	bt->last_completed = args->stat.completed;
+}
+
 static const char * const cmd_balance_start_usage[] = {
 	"btrfs balance start [options] <path>",
 	"Balance chunks across the devices",
@@ -484,6 +536,7 @@ static const char * const cmd_balance_start_usage[] = {
 	"-s[filters]    act on system chunks (only under -f)",
 	"-v             be verbose",
 	"-f             force reducing of metadata integrity",
+	TELEMETRY_USAGE,
 	NULL
 };
 
@@ -496,8 +549,13 @@ static int cmd_balance_start(int argc, char **argv)
 	int verbose = 0;
 	int nofilters = 1;
 	int i;
+	int ret;
+	struct telemetry tm;
+	struct balance_telemetry bt;
+	DIR *dirstream = NULL;
 
 	memset(&args, 0, sizeof(args));
+	telemetry_init(&tm);
 
 	optind = 1;
 	while (1) {
@@ -507,6 +565,7 @@ static int cmd_balance_start(int argc, char **argv)
 			{ "system", optional_argument, NULL, 's' },
 			{ "force", no_argument, NULL, 'f' },
 			{ "verbose", no_argument, NULL, 'v' },
+			TELEMETRY_LONG_OPTIONS,
 			{ NULL, 0, NULL, 0 }
 		};
 
@@ -514,6 +573,12 @@ static int cmd_balance_start(int argc, char **argv)
 		if (opt < 0)
 			break;
 
+		ret = telemetry_parse_opt(&tm, opt, optarg);
+		if (ret < 0)
+			return 1;
+		if (ret)
+			continue;
+
 		switch (opt) {
 		case 'd':
 			nofilters = 0;
@@ -595,7 +660,25 @@ static int cmd_balance_start(int argc, char **argv)
 	if (verbose)
 		dump_ioctl_balance_args(&args);
 
-	return do_balance(argv[optind], &args, nofilters);
+	if (!telemetry_enabled(&tm))
+		return do_balance(argv[optind], &args, nofilters);
+
+	/* the progress is polled on a separate descriptor */
+	memset(&bt, 0, sizeof(bt));
+	bt.fd = btrfs_open_dir(argv[optind], &dirstream, 1);
+	if (bt.fd < 0) {
+		telemetry_close(&tm);
+		return 1;
+	}
+	bt.args = &args;
+	bt.t_start = telemetry_now();
+	if (telemetry_start(&tm, balance_telemetry_sample, &bt))
+		warning("cannot start telemetry");
+	ret = do_balance(argv[optind], &args, nofilters);
+	telemetry_stop(&tm, "finished");
+	telemetry_close(&tm);
+	close_file_or_dir(bt.fd, dirstream);
+	return ret;
 }
 
 static const char * const cmd_balance_pause_usage[] = {
@@ -747,6 +830,7 @@ static const char * const cmd_balance_status_usage[] = {
 	"Show status of running or paused balance",
 	"",
 	"-v     be verbose",
+	"--telemetry <fd>|<file>  write the status as a JSON line to <fd> or <file>",
 	NULL
 };
 
@@ -765,12 +849,16 @@ static int cmd_balance_status(int argc, char **argv)
 	int verbose = 0;
 	int ret;
 	int e;
+	struct telemetry tm;
 
+	telemetry_init(&tm);
 	optind = 1;
 	while (1) {
 		int opt;
 		static const struct option longopts[] = {
 			{ "verbose", no_argument, NULL, 'v' },
+			{ "telemetry", required_argument, NULL,
+				GETOPT_VAL_TELEMETRY },
 			{ NULL, 0, NULL, 0 }
 		};
 
@@ -778,6 +866,12 @@ static int cmd_balance_status(int argc, char **argv)
 		if (opt < 0)
 			break;
 
+		ret = telemetry_parse_opt(&tm, opt, optarg);
+		if (ret < 0)
+			return 2;
+		if (ret)
+			continue;
+
 		switch (opt) {
 		case 'v':
 			verbose = 1;
@@ -793,13 +887,27 @@ static int cmd_balance_status(int argc, char **argv)
 	path = argv[optind];
 
 	fd = btrfs_open_dir(path, &dirstream, 1);
-	if (fd < 0)
+	if (fd < 0) {
+		telemetry_close(&tm);
 		return 2;
+	}
 
 	ret = ioctl(fd, BTRFS_IOC_BALANCE_PROGRESS, &args);
 	e = errno;
 	close_file_or_dir(fd, dirstream);
 
+	if (telemetry_enabled(&tm)) {
+		telemetry_begin(&tm, "balance", "status");
+		if (ret < 0 && e == ENOTCONN)
+			telemetry_str(&tm, "state", "none");
+		else if (ret < 0)
+			telemetry_str(&tm, "error", strerror(e));
+		else
+			telemetry_balance_args(&tm, &args, 0, 0);
+		telemetry_end(&tm);
+		telemetry_close(&tm);
+	}
+
 	if (ret < 0) {
 		if (e == ENOTCONN) {
 			printf("No balance found on '%s'\n", path);
@@ -833,6 +941,613 @@ static int cmd_balance_status(int argc, char **argv)
 	return 1;
 }
 
+/*
+ * Balance planner: reads the chunks and device items from the chunk tree and
+ * the usage of each block group, estimates what relocating each block group
+ * would gain and prints the balance commands relocating the best ones.
+ */
+struct plan_device {
+	u64 devid;
+	u64 total_bytes;
+	u64 bytes_used;
+};
+
+struct plan_bg {
+	u64 start;
+	u64 length;
+	u64 used;
+	u64 flags;
+	/* bytes allocated on the devices for this block group */
+	u64 dev_bytes;
+	double score;
+	int selected;
+};
+
+struct balance_plan {
+	struct plan_device *devs;
+	int nr_devs;
+	struct plan_bg *bgs;
+	int nr_bgs;
+	int alloc_bgs;
+	/* raw allocation of each block group, per device, in bgs order */
+	u64 *stripe_devids;
+	int *stripe_start;
+	int nr_stripes;
+	int alloc_stripes;
+};
+
+static struct plan_device *plan_find_device(struct balance_plan *plan,
+					    u64 devid)
+{
+	int i;
+
+	for (i = 0; i < plan->nr_devs; i++)
+		if (plan->devs[i].devid == devid)
+			return &plan->devs[i];
+	return NULL;
+}
+
+static u64 plan_dev_extent_size(u64 flags, u64 length, int num_stripes,
+				int sub_stripes)
+{
+	if (flags & BTRFS_BLOCK_GROUP_RAID0)
+		return length / num_stripes;
+	if (flags & BTRFS_BLOCK_GROUP_RAID10)
+		return length * sub_stripes / num_stripes;
+	if (flags & BTRFS_BLOCK_GROUP_RAID5)
+		return length / (num_stripes - 1);
+	if (flags & BTRFS_BLOCK_GROUP_RAID6)
+		return length / (num_stripes - 2);
+	return length;
+}
+
+static int plan_add_chunk(struct balance_plan *plan, u64 start,
+			  struct btrfs_chunk *chunk)
+{
+	struct plan_bg *bg;
+	int num_stripes = btrfs_stack_chunk_num_stripes(chunk);
+	int sub_stripes = btrfs_stack_chunk_sub_stripes(chunk);
+	u64 stripe_size;
+	int i;
+
+	if (plan->nr_bgs == plan->alloc_bgs) {
+		int alloc = max(plan->alloc_bgs * 2, 64);
+
+		bg = realloc(plan->bgs, alloc * sizeof(*bg));
+		if (!bg)
+			return -ENOMEM;
+		plan->bgs = bg;
+		plan->stripe_start = realloc(plan->stripe_start,
+					     alloc * sizeof(int));
+		if (!plan->stripe_start)
+			return -ENOMEM;
+		plan->alloc_bgs = alloc;
+	}
+	if (plan->nr_stripes + num_stripes > plan->alloc_stripes) {
+		int alloc = max(plan->alloc_stripes * 2,
+				plan->nr_stripes + num_stripes);
+		u64 *devids;
+
+		devids = realloc(plan->stripe_devids, alloc * sizeof(u64));
+		if (!devids)
+			return -ENOMEM;
+		plan->stripe_devids = devids;
+		plan->alloc_stripes = alloc;
+	}
+
+	bg = &plan->bgs[plan->nr_bgs];
+	memset(bg, 0, sizeof(*bg));
+	bg->start = start;
+	bg->length = btrfs_stack_chunk_length(chunk);
+	bg->flags = btrfs_stack_chunk_type(chunk);
+	stripe_size = plan_dev_extent_size(bg->flags, bg->length, num_stripes,
+					   sub_stripes);
+	bg->dev_bytes = stripe_size * num_stripes;
+
+	plan->stripe_start[plan->nr_bgs] = plan->nr_stripes;
+	for (i = 0; i < num_stripes; i++)
+		plan->stripe_devids[plan->nr_stripes++] =
+			btrfs_stack_stripe_devid(btrfs_stripe_nr(chunk, i));
+	plan->nr_bgs++;
+	return 0;
+}
+
+static int plan_add_device(struct balance_plan *plan, struct btrfs_dev_item *di)
+{
+	struct plan_device *dev;
+
+	dev = realloc(plan->devs, (plan->nr_devs + 1) * sizeof(*dev));
+	if (!dev)
+		return -ENOMEM;
+	plan->devs = dev;
+	dev = &plan->devs[plan->nr_devs++];
+	dev->devid = btrfs_stack_device_id(di);
+	dev->total_bytes = btrfs_stack_device_total_bytes(di);
+	dev->bytes_used = btrfs_stack_device_bytes_used(di);
+	return 0;
+}
+
+/*
+ * The device items and chunk items are next to each other in the chunk tree
+ * and are read in one sequence of searches.
+ */
+static int plan_load_chunk_tree(int fd, struct balance_plan *plan)
+{
+	struct btrfs_ioctl_search_args args;
+	struct btrfs_ioctl_search_key *sk = &args.key;
+	struct btrfs_ioctl_search_header sh;
+	unsigned long off;
+	int ret;
+	int i;
+
+	memset(&args, 0, sizeof(args));
+	sk->tree_id = BTRFS_CHUNK_TREE_OBJECTID;
+	sk->min_objectid = BTRFS_DEV_ITEMS_OBJECTID;
+	sk->max_objectid = BTRFS_FIRST_CHUNK_TREE_OBJECTID;
+	sk->min_type = BTRFS_DEV_ITEM_KEY;
+	sk->max_type = BTRFS_CHUNK_ITEM_KEY;
+	sk->max_offset = (u64)-1;
+	sk->max_transid = (u64)-1;
+
+	while (1) {
+		sk->nr_items = 4096;
+		ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args);
+		if (ret < 0)
+			return -errno;
+		if (sk->nr_items == 0)
+			break;
+
+		off = 0;
+		for (i = 0; i < sk->nr_items; i++) {
+			memcpy(&sh, args.buf + off, sizeof(sh));
+			off += sizeof(sh);
+			if (sh.type == BTRFS_DEV_ITEM_KEY)
+				ret = plan_add_device(plan,
+					(struct btrfs_dev_item *)(args.buf + off));
+			else if (sh.type == BTRFS_CHUNK_ITEM_KEY)
+				ret = plan_add_chunk(plan, sh.offset,
+					(struct btrfs_chunk *)(args.buf + off));
+			if (ret < 0)
+				return ret;
+			off += sh.len;
+			sk->min_objectid = sh.objectid;
+			sk->min_type = sh.type;
+			sk->min_offset = sh.offset;
+		}
+		if (sk->min_offset < (u64)-1) {
+			sk->min_offset++;
+		} else if (sk->min_type < (u8)-1) {
+			sk->min_type++;
+			sk->min_offset = 0;
+		} else {
+			break;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Look up the used bytes of each block group in the extent tree, with one
+ * exact-key search per chunk.  The block group items are interleaved with
+ * all extent items, a ranged walk would copy most of the extent tree.
+ */
+static int plan_load_block_groups(int fd, struct balance_plan *plan)
+{
+	struct btrfs_ioctl_search_args args;
+	struct btrfs_ioctl_search_key *sk = &args.key;
+	struct btrfs_ioctl_search_header sh;
+	struct btrfs_block_group_item *bgi;
+	int ret;
+	int i;
+
+	for (i = 0; i < plan->nr_bgs; i++) {
+		struct plan_bg *bg = &plan->bgs[i];
+
+		memset(&args, 0, sizeof(args));
+		sk->tree_id = BTRFS_EXTENT_TREE_OBJECTID;
+		sk->min_objectid = bg->start;
+		sk->max_objectid = bg->start;
+		sk->min_type = BTRFS_BLOCK_GROUP_ITEM_KEY;
+		sk->max_type = BTRFS_BLOCK_GROUP_ITEM_KEY;
+		sk->min_offset = bg->length;
+		sk->max_offset = bg->length;
+		sk->max_transid = (u64)-1;
+		sk->nr_items = 1;
+
+		ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args);
+		if (ret < 0)
+			return -errno;
+		if (sk->nr_items == 0) {
+			error("block group %llu not found",
+				(unsigned long long)bg->start);
+			return -ENOENT;
+		}
+		memcpy(&sh, args.buf, sizeof(sh));
+		bgi = (struct btrfs_block_group_item *)(args.buf + sizeof(sh));
+		bg->used = btrfs_block_group_used(bgi);
+	}
+	return 0;
+}
+
+/*
+ * Unallocated space gained per byte moved, weighted up for block groups on
+ * devices that are fuller than the average, so that relocating them evens
+ * out the allocation.
+ */
+static void plan_score(struct balance_plan *plan)
+{
+	double avg_full = 0.0;
+	u64 total = 0;
+	u64 used = 0;
+	int i;
+	int j;
+
+	for (i = 0; i < plan->nr_devs; i++) {
+		total += plan->devs[i].total_bytes;
+		used += plan->devs[i].bytes_used;
+	}
+	if (total)
+		avg_full = (double)used / total;
+
+	for (i = 0; i < plan->nr_bgs; i++) {
+		struct plan_bg *bg = &plan->bgs[i];
+		int first = plan->stripe_start[i];
+		int last = i + 1 < plan->nr_bgs ? plan->stripe_start[i + 1] :
+			plan->nr_stripes;
+		double skew = 0.0;
+		u64 moved = max(bg->used, 4096ULL);
+
+		for (j = first; j < last; j++) {
+			struct plan_device *dev;
+			double full;
+
+			dev = plan_find_device(plan, plan->stripe_devids[j]);
+			if (!dev || !dev->total_bytes)
+				continue;
+			full = (double)dev->bytes_used / dev->total_bytes;
+			if (full > avg_full)
+				skew += full - avg_full;
+		}
+		if (last > first)
+			skew /= last - first;
+		bg->score = (double)(bg->length - bg->used) / moved *
+			(1.0 + skew);
+	}
+}
+
+static int cmp_plan_bg_score(const void *a, const void *b)
+{
+	const struct plan_bg *ba = *(const struct plan_bg **)a;
+	const struct plan_bg *bb = *(const struct plan_bg **)b;
+
+	if (ba->score > bb->score)
+		return -1;
+	if (ba->score < bb->score)
+		return 1;
+	return ba->start < bb->start ? -1 : ba->start > bb->start;
+}
+
+/*
+ * Pick the best block groups of each type and profile for as long as the
+ * data they hold fits into the free space of the block groups that stay, so
+ * the relocation does not need new chunks. Returns bytes moved.
+ */
+static u64 plan_select(struct balance_plan *plan, u64 target, u64 max_move,
+		       u64 max_usage, u64 *reclaimed)
+{
+	struct plan_class {
+		u64 flags;
+		/* free space in the block groups that stay */
+		u64 free;
+		/* data of the selected block groups */
+		u64 demand;
+	} *classes;
+	struct plan_bg **sorted;
+	int nr_classes = 0;
+	u64 moved = 0;
+	int i;
+	int j;
+
+	*reclaimed = 0;
+	if (plan->nr_bgs <= 0)
+		return 0;
+	sorted = malloc(plan->nr_bgs * sizeof(*sorted));
+	classes = calloc(plan->nr_bgs, sizeof(*classes));
+	if (!sorted || !classes)
+		goto out;
+	for (i = 0; i < plan->nr_bgs; i++) {
+		struct plan_bg *bg = &plan->bgs[i];
+
+		sorted[i] = bg;
+		for (j = 0; j < nr_classes; j++)
+			if (classes[j].flags == bg->flags)
+				break;
+		if (j == nr_classes)
+			classes[nr_classes++].flags = bg->flags;
+		classes[j].free += bg->length - bg->used;
+	}
+	qsort(sorted, plan->nr_bgs, sizeof(*sorted), cmp_plan_bg_score);
+
+	for (i = 0; i < plan->nr_bgs; i++) {
+		struct plan_bg *bg = sorted[i];
+		struct plan_class *class;
+
+		if (target && *reclaimed >= target)
+			break;
+		if (bg->flags & BTRFS_BLOCK_GROUP_SYSTEM)
+			continue;
+		if (bg->used * 100 > bg->length * max_usage)
+			continue;
+		if (max_move && moved + bg->used > max_move)
+			continue;
+
+		for (j = 0; j < nr_classes; j++)
+			if (classes[j].flags == bg->flags)
+				break;
+		class = &classes[j];
+		if (class->demand + bg->used >
+		    class->free - (bg->length - bg->used))
+			continue;
+
+		class->free -= bg->length - bg->used;
+		class->demand += bg->used;
+		bg->selected = 1;
+		moved += bg->used;
+		*reclaimed += bg->dev_bytes;
+	}
+out:
+	free(classes);
+	free(sorted);
+	return moved;
+}
+
+static int cmp_plan_bg_start(const void *a, const void *b)
+{
+	const struct plan_bg *ba = a;
+	const struct plan_bg *bb = b;
+
+	return ba->start < bb->start ? -1 : ba->start > bb->start;
+}
+
+static void plan_fill_args(struct btrfs_balance_args *bargs, u64 vstart,
+			   u64 vend, u64 count)
+{
+	bargs->flags |= BTRFS_BALANCE_ARGS_VRANGE | BTRFS_BALANCE_ARGS_LIMIT;
+	bargs->vstart = vstart;
+	bargs->vend = vend;
+	bargs->limit = count;
+}
+
+/*
+ * Relocate runs of selected block groups that are not interrupted by a block
+ * group of the same type that stays, one balance per run.
+ */
+static int plan_run_steps(struct balance_plan *plan, const char *path,
+			  int execute, int pause)
+{
+	struct btrfs_ioctl_balance_args args;
+	int step = 0;
+	int ret;
+	int i;
+	int j;
+
+	qsort(plan->bgs, plan->nr_bgs, sizeof(*plan->bgs), cmp_plan_bg_start);
+	for (i = 0; i < plan->nr_bgs; i++) {
+		struct plan_bg *first = &plan->bgs[i];
+		struct plan_bg *last = first;
+		u64 count = 1;
+		u64 moved = first->used;
+		u64 vend;
+
+		if (!first->selected || first->selected == 2)
+			continue;
+		first->selected = 2;
+		for (j = i + 1; j < plan->nr_bgs; j++) {
+			struct plan_bg *bg = &plan->bgs[j];
+
+			/*
+			 * The vrange filter of the step matches every block
+			 * group of the filtered types inside it, so the run
+			 * ends at any of them that was not selected, including
+			 * other profiles
+			 */
+			if (!(bg->flags & first->flags &
+			      (BTRFS_BLOCK_GROUP_DATA |
+			       BTRFS_BLOCK_GROUP_METADATA)))
+				continue;
+			if (bg->flags != first->flags || !bg->selected)
+				break;
+			bg->selected = 2;
+			last = bg;
+			count++;
+			moved += bg->used;
+		}
+		vend = last->start + last->length;
+
+		memset(&args, 0, sizeof(args));
+		if (first->flags & BTRFS_BLOCK_GROUP_DATA) {
+			args.flags |= BTRFS_BALANCE_DATA;
+			plan_fill_args(&args.data, first->start, vend, count);
+		}
+		if (first->flags & BTRFS_BLOCK_GROUP_METADATA) {
+			args.flags |= BTRFS_BALANCE_METADATA;
+			plan_fill_args(&args.meta, first->start, vend, count);
+		}
+
+		step++;
+		printf("# step %d: %s/%s, %llu block groups, move %s\n", step,
+			btrfs_group_type_str(first->flags),
+			btrfs_group_profile_str(first->flags),
+			(unsigned long long)count, pretty_size(moved));
+		printf("btrfs balance start");
+		if (args.flags & BTRFS_BALANCE_DATA)
+			printf(" -dvrange=%llu..%llu,limit=%llu",
+				(unsigned long long)first->start,
+				(unsigned long long)vend,
+				(unsigned long long)count);
+		if (args.flags & BTRFS_BALANCE_METADATA)
+			printf(" -mvrange=%llu..%llu,limit=%llu",
+				(unsigned long long)first->start,
+				(unsigned long long)vend,
+				(unsigned long long)count);
+		printf(" %s\n", path);
+		fflush(stdout);
+
+		if (!execute)
+			continue;
+		if (step > 1 && pause)
+			sleep(pause);
+		ret = do_balance(path, &args, 0);
+		if (ret)
+			return ret;
+		if (args.state & (BTRFS_BALANCE_STATE_PAUSE_REQ |
+				  BTRFS_BALANCE_STATE_CANCEL_REQ))
+			return 1;
+	}
+	if (!step)
+		printf("# nothing to do\n");
+	return 0;
+}
+
+static const char * const cmd_balance_plan_usage[] = {
+	"btrfs balance plan [options] <path>",
+	"Find the block groups worth relocating and print the balance commands",
+	"Block groups are ranked by the unallocated space reclaimed per byte",
+	"moved, preferring those on fuller devices. Block groups are selected",
+	"as long as their data fits into the free space of the remaining block",
+	"groups of the same type and profile.",
+	"",
+	"--target <size>     stop after reclaiming <size> of unallocated space",
+	"--max-move <size>   move at most <size> of data",
+	"--max-usage <pct>   only consider block groups used up to <pct> percent",
+	"                    (default: 90)",
+	"--execute           run the balance commands",
+	"--pause <seconds>   with --execute, wait between the balance commands",
+	"-v                  print all block groups with their score",
+	NULL
+};
+
+static int cmd_balance_plan(int argc, char **argv)
+{
+	struct balance_plan plan;
+	DIR *dirstream = NULL;
+	u64 target = 0;
+	u64 max_move = 0;
+	u64 max_usage = 90;
+	u64 moved;
+	u64 reclaimed;
+	int execute = 0;
+	int pause = 0;
+	int verbose = 0;
+	int fd;
+	int ret;
+	int i;
+
+	optind = 1;
+	while (1) {
+		enum { GETOPT_VAL_TARGET = 257, GETOPT_VAL_MAX_MOVE,
+			GETOPT_VAL_MAX_USAGE, GETOPT_VAL_EXECUTE,
+			GETOPT_VAL_PAUSE };
+		static const struct option longopts[] = {
+			{ "target", required_argument, NULL, GETOPT_VAL_TARGET },
+			{ "max-move", required_argument, NULL,
+				GETOPT_VAL_MAX_MOVE },
+			{ "max-usage", required_argument, NULL,
+				GETOPT_VAL_MAX_USAGE },
+			{ "execute", no_argument, NULL, GETOPT_VAL_EXECUTE },
+			{ "pause", required_argument, NULL, GETOPT_VAL_PAUSE },
+			{ "verbose", no_argument, NULL, 'v' },
+			{ NULL, 0, NULL, 0 }
+		};
+		int opt = getopt_long(argc, argv, "v", longopts, NULL);
+
+		if (opt < 0)
+			break;
+
+		switch (opt) {
+		case GETOPT_VAL_TARGET:
+			target = parse_size(optarg);
+			break;
+		case GETOPT_VAL_MAX_MOVE:
+			max_move = parse_size(optarg);
+			break;
+		case GETOPT_VAL_MAX_USAGE:
+			max_usage = arg_strtou64(optarg);
+			if (max_usage > 100) {
+				error("invalid usage percentage: %s", optarg);
+				return 1;
+			}
+			break;
+		case GETOPT_VAL_EXECUTE:
+			execute = 1;
+			break;
+		case GETOPT_VAL_PAUSE:
+			pause = arg_strtou64(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(cmd_balance_plan_usage);
+		}
+	}
+
+	if (check_argc_exact(argc - optind, 1))
+		usage(cmd_balance_plan_usage);
+
+	fd = btrfs_open_dir(argv[optind], &dirstream, 1);
+	if (fd < 0)
+		return 1;
+
+	memset(&plan, 0, sizeof(plan));
+	ret = plan_load_chunk_tree(fd, &plan);
+	if (!ret)
+		ret = plan_load_block_groups(fd, &plan);
+	close_file_or_dir(fd, dirstream);
+	if (ret < 0) {
+		error("cannot read block groups: %s", strerror(-ret));
+		ret = 1;
+		goto out;
+	}
+
+	plan_score(&plan);
+	moved = plan_select(&plan, target, max_move, max_usage, &reclaimed);
+
+	for (i = 0; i < plan.nr_devs; i++) {
+		struct plan_device *dev = &plan.devs[i];
+
+		printf("# devid %llu: size %s, allocated %s (%.1f%%)\n",
+			(unsigned long long)dev->devid,
+			pretty_size(dev->total_bytes),
+			pretty_size(dev->bytes_used),
+			dev->total_bytes ?
+			100.0 * dev->bytes_used / dev->total_bytes : 0.0);
+	}
+	if (verbose) {
+		for (i = 0; i < plan.nr_bgs; i++) {
+			struct plan_bg *bg = &plan.bgs[i];
+
+			printf(
+	"# block group %llu %s/%s: length %s, used %s, score %.2f%s\n",
+				(unsigned long long)bg->start,
+				btrfs_group_type_str(bg->flags),
+				btrfs_group_profile_str(bg->flags),
+				pretty_size(bg->length), pretty_size(bg->used),
+				bg->score, bg->selected ? ", selected" : "");
+		}
+	}
+	printf("# block groups: %d, estimated data to move: %s, unallocated space reclaimed: %s\n",
+		plan.nr_bgs, pretty_size(moved), pretty_size(reclaimed));
+
+	ret = plan_run_steps(&plan, argv[optind], execute, pause);
+out:
+	free(plan.devs);
+	free(plan.bgs);
+	free(plan.stripe_devids);
+	free(plan.stripe_start);
+	return ret;
+}
+
 static const char balance_cmd_group_info[] =
 "balance data accross devices, or change block groups using filters";
 
@@ -843,6 +1558,7 @@ const struct cmd_group balance_cmd_group = {
 		{ "cancel", cmd_balance_cancel, cmd_balance_cancel_usage, NULL, 0 },
 		{ "resume", cmd_balance_resume, cmd_balance_resume_usage, NULL, 0 },
 		{ "status", cmd_balance_status, cmd_balance_status_usage, NULL, 0 },
+		{ "plan", cmd_balance_plan, cmd_balance_plan_usage, NULL, 0 },
 		NULL_CMD_STRUCT
 	}
 };
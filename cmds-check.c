@@ -509,6 +509,7 @@ struct walk_control {
 	struct shared_node *nodes[BTRFS_MAX_LEVEL];
 	int active_node;
 	int root_level;
+	struct btrfs_prefetch *prefetch;
 };
 
 struct bad_item {
@@ -1514,71 +1515,15 @@ static int process_inode_extref(struct extent_buffer *eb,
 static int count_csum_range(struct btrfs_root *root, u64 start,
 			    u64 len, u64 *found)
 {
-	struct btrfs_key key;
-	struct btrfs_path path;
-	struct extent_buffer *leaf;
+	u64 nr = (len + root->sectorsize - 1) / root->sectorsize;
 	int ret;
-	size_t size;
-	*found = 0;
-	u64 csum_end;
-	u16 csum_size = btrfs_super_csum_size(root->fs_info->super_copy);
-
-	btrfs_init_path(&path);
-
-	key.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
-	key.offset = start;
-	key.type = BTRFS_EXTENT_CSUM_KEY;
-
-	ret = btrfs_search_slot(NULL, root->fs_info->csum_root,
-				&key, &path, 0, 0);
-	if (ret < 0)
-		goto out;
-	if (ret > 0 && path.slots[0] > 0) {
-		leaf = path.nodes[0];
-		btrfs_item_key_to_cpu(leaf, &key, path.slots[0] - 1);
-		if (key.objectid == BTRFS_EXTENT_CSUM_OBJECTID &&
-		    key.type == BTRFS_EXTENT_CSUM_KEY)
-			path.slots[0]--;
-	}
-
-	while (len > 0) {
-		leaf = path.nodes[0];
-		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
-			ret = btrfs_next_leaf(root->fs_info->csum_root, &path);
-			if (ret > 0)
-				break;
-			else if (ret < 0)
-				goto out;
-			leaf = path.nodes[0];
-		}
-
-		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
-		if (key.objectid != BTRFS_EXTENT_CSUM_OBJECTID ||
-		    key.type != BTRFS_EXTENT_CSUM_KEY)
-			break;
-
-		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
-		if (key.offset >= start + len)
-			break;
-
-		if (key.offset > start)
-			start = key.offset;
 
-		size = btrfs_item_size_nr(leaf, path.slots[0]);
-		csum_end = key.offset + (size / csum_size) * root->sectorsize;
-		if (csum_end > start) {
-			size = min(csum_end - start, len);
-			len -= size;
-			start += size;
-			*found += size;
-		}
-
-		path.slots[0]++;
-	}
-out:
-	btrfs_release_path(&path);
+	*found = 0;
+	ret = btrfs_lookup_csums_range(root->fs_info->csum_root, start, nr,
+				       NULL, NULL);
 	if (ret < 0)
 		return ret;
+	*found = min_t(u64, (u64)ret * root->sectorsize, len);
 	return 0;
 }
 
@@ -1875,6 +1820,13 @@ static int walk_down_tree(struct btrfs_root *root, struct btrfs_path *path,
 			}
 		}
 
+		if (wc->prefetch) {
+			struct btrfs_key node_key;
+
+			btrfs_node_key_to_cpu(cur, &node_key,
+					      path->slots[*level]);
+			btrfs_prefetch_update(wc->prefetch, &node_key);
+		}
 		next = btrfs_find_tree_block(root, bytenr, blocksize);
 		if (!next || !btrfs_buffer_uptodate(next, ptr_gen)) {
 			free_extent_buffer(next);
@@ -2108,6 +2060,7 @@ static int add_missing_dir_index(struct btrfs_root *root,
 	write_extent_buffer(leaf, backref->name, name_ptr, backref->namelen);
 	btrfs_mark_buffer_dirty(leaf);
 	btrfs_free_path(path);
+	btrfs_dir_cache_drop(root, backref->dir);
 	btrfs_commit_transaction(trans, root);
 
 	backref->found_dir_index = 1;
@@ -2163,9 +2116,10 @@ static int delete_dir_index(struct btrfs_root *root,
 		return ret;
 	}
 
-	if (!di)
+	if (!di) {
 		ret = btrfs_del_item(trans, root, path);
-	else
+		btrfs_dir_cache_drop(root, backref->dir);
+	} else
 		ret = btrfs_delete_one_dir_name(trans, root, path, di);
 	BUG_ON(ret);
 	btrfs_free_path(path);
@@ -3471,6 +3425,7 @@ static int check_fs_root(struct btrfs_root *root,
 	int wret;
 	int level;
 	struct btrfs_path path;
+	struct btrfs_prefetch prefetch;
 	struct shared_node root_node;
 	struct root_record *rec;
 	struct btrfs_root_item *root_item = &root->root_item;
@@ -3526,6 +3481,8 @@ static int check_fs_root(struct btrfs_root *root,
 	if (status != BTRFS_TREE_BLOCK_CLEAN)
 		return -EIO;
 
+	btrfs_prefetch_init(&prefetch, root, root->node);
+	wc->prefetch = &prefetch;
 	if (btrfs_root_refs(root_item) > 0 ||
 	    btrfs_disk_key_objectid(&root_item->drop_progress) == 0) {
 		path.nodes[level] = root->node;
@@ -3562,6 +3519,8 @@ static int check_fs_root(struct btrfs_root *root,
 	}
 skip_walking:
 	btrfs_release_path(&path);
+	wc->prefetch = NULL;
+	btrfs_prefetch_release(&prefetch);
 
 	if (!cache_tree_empty(&corrupt_blocks)) {
 		struct cache_extent *cache;
@@ -7541,8 +7500,7 @@ static void reset_cached_block_groups(struct btrfs_fs_info *fs_info)
 					    &start, &end, EXTENT_DIRTY);
 		if (ret)
 			break;
-		clear_extent_dirty(&fs_info->free_space_cache, start, end,
-				   GFP_NOFS);
+		btrfs_clear_free_space(fs_info, start, end);
 	}
 
 	start = 0;
@@ -8564,9 +8522,8 @@ static int reset_block_groups(struct btrfs_fs_info *fs_info)
 				      btrfs_chunk_type(leaf, chunk),
 				      key.objectid, key.offset,
 				      btrfs_chunk_length(leaf, chunk));
-		set_extent_dirty(&fs_info->free_space_cache, key.offset,
-				 key.offset + btrfs_chunk_length(leaf, chunk),
-				 GFP_NOFS);
+		btrfs_mark_free_space(fs_info, key.offset,
+				key.offset + btrfs_chunk_length(leaf, chunk));
 		path->slots[0]++;
 	}
 	start = 0;
@@ -8852,6 +8809,7 @@ static int delete_bad_item(struct btrfs_root *root, struct bad_item *bad)
 		goto out;
 	}
 	ret = btrfs_del_item(trans, root, path);
+	btrfs_dir_cache_drop(root, bad->key.objectid);
 out:
 	btrfs_commit_transaction(trans, root);
 	btrfs_free_path(path);
@@ -8874,31 +8832,42 @@ static int zero_log_tree(struct btrfs_root *root)
 	return ret;
 }
 
+/* data is read and checksummed in runs of this size, @buf must hold one */
+#define CSUM_FILL_SIZE		(1024 * 1024)
+
 static int populate_csum(struct btrfs_trans_handle *trans,
-			 struct btrfs_root *csum_root, char *buf, u64 start,
+			 struct btrfs_root *csum_root,
+			 struct btrfs_bulk_insert *bulk, char *buf, u64 start,
 			 u64 len)
 {
 	u64 offset = 0;
-	u64 sectorsize;
+	u64 run;
+	u64 filled;
+	u64 read_len;
 	int ret = 0;
 
 	while (offset < len) {
-		sectorsize = csum_root->sectorsize;
-		ret = read_extent_data(csum_root, buf, start + offset,
-				       &sectorsize, 0);
-		if (ret)
-			break;
-		ret = btrfs_csum_file_block(trans, csum_root, start + len,
-					    start + offset, buf, sectorsize);
+		run = min_t(u64, len - offset, CSUM_FILL_SIZE);
+		for (filled = 0; filled < run; filled += read_len) {
+			read_len = run - filled;
+			ret = read_extent_data(csum_root, buf + filled,
+					       start + offset + filled,
+					       &read_len, 0);
+			if (ret)
+				return ret;
+		}
+		ret = btrfs_csum_file_range(trans, csum_root, bulk,
+					    start + offset, buf, run);
 		if (ret)
 			break;
-		offset += sectorsize;
+		offset += run;
 	}
 	return ret;
 }
 
 static int fill_csum_tree_from_one_fs_root(struct btrfs_trans_handle *trans,
 				      struct btrfs_root *csum_root,
+				      struct btrfs_bulk_insert *bulk,
 				      struct btrfs_root *cur_root)
 {
 	struct btrfs_path *path;
@@ -8914,7 +8883,7 @@ static int fill_csum_tree_from_one_fs_root(struct btrfs_trans_handle *trans,
 	path = btrfs_alloc_path();
 	if (!path)
 		return -ENOMEM;
-	buf = malloc(cur_root->fs_info->csum_root->sectorsize);
+	buf = malloc(CSUM_FILL_SIZE);
 	if (!buf) {
 		ret = -ENOMEM;
 		goto out;
@@ -8941,7 +8910,7 @@ static int fill_csum_tree_from_one_fs_root(struct btrfs_trans_handle *trans,
 		start = btrfs_file_extent_disk_bytenr(node, fi);
 		len = btrfs_file_extent_disk_num_bytes(node, fi);
 
-		ret = populate_csum(trans, csum_root, buf, start, len);
+		ret = populate_csum(trans, csum_root, bulk, buf, start, len);
 		if (ret == -EEXIST)
 			ret = 0;
 		if (ret < 0)
@@ -8967,7 +8936,8 @@ out:
 }
 
 static int fill_csum_tree_from_fs(struct btrfs_trans_handle *trans,
-				  struct btrfs_root *csum_root)
+				  struct btrfs_root *csum_root,
+				  struct btrfs_bulk_insert *bulk)
 {
 	struct btrfs_fs_info *fs_info = csum_root->fs_info;
 	struct btrfs_path *path;
@@ -9012,7 +8982,7 @@ static int fill_csum_tree_from_fs(struct btrfs_trans_handle *trans,
 				key.objectid);
 			goto out;
 		}
-		ret = fill_csum_tree_from_one_fs_root(trans, csum_root,
+		ret = fill_csum_tree_from_one_fs_root(trans, csum_root, bulk,
 				cur_root);
 		if (ret < 0)
 			goto out;
@@ -9032,7 +9002,8 @@ out:
 }
 
 static int fill_csum_tree_from_extent(struct btrfs_trans_handle *trans,
-				      struct btrfs_root *csum_root)
+				      struct btrfs_root *csum_root,
+				      struct btrfs_bulk_insert *bulk)
 {
 	struct btrfs_root *extent_root = csum_root->fs_info->extent_root;
 	struct btrfs_path *path;
@@ -9056,7 +9027,7 @@ static int fill_csum_tree_from_extent(struct btrfs_trans_handle *trans,
 		return ret;
 	}
 
-	buf = malloc(csum_root->sectorsize);
+	buf = malloc(CSUM_FILL_SIZE);
 	if (!buf) {
 		btrfs_free_path(path);
 		return -ENOMEM;
@@ -9088,8 +9059,10 @@ static int fill_csum_tree_from_extent(struct btrfs_trans_handle *trans,
 			continue;
 		}
 
-		ret = populate_csum(trans, csum_root, buf, key.objectid,
+		ret = populate_csum(trans, csum_root, bulk, buf, key.objectid,
 				    key.offset);
+		if (ret == -EEXIST)
+			ret = 0;
 		if (ret)
 			break;
 		path->slots[0]++;
@@ -9106,15 +9079,24 @@ static int fill_csum_tree_from_extent(struct btrfs_trans_handle *trans,
  * Extent tree init will wipe out all the extent info, so in that case, we
  * can't depend on extent tree, but use fs tree.  If search_fs_tree is set, we
  * will use fs/subvol trees to init the csum tree.
+ *
+ * Data extents are mostly found in ascending order, so the checksums are
+ * appended to the new tree through a bulk insertion.
  */
 static int fill_csum_tree(struct btrfs_trans_handle *trans,
 			  struct btrfs_root *csum_root,
 			  int search_fs_tree)
 {
+	struct btrfs_bulk_insert bulk;
+	int ret;
+
+	btrfs_bulk_insert_init(&bulk, trans, csum_root, 0);
 	if (search_fs_tree)
-		return fill_csum_tree_from_fs(trans, csum_root);
+		ret = fill_csum_tree_from_fs(trans, csum_root, &bulk);
 	else
-		return fill_csum_tree_from_extent(trans, csum_root);
+		ret = fill_csum_tree_from_extent(trans, csum_root, &bulk);
+	btrfs_bulk_insert_release(&bulk);
+	return ret;
 }
 
 struct root_item_info {
@@ -9631,6 +9613,15 @@ int cmd_check(int argc, char **argv)
 
 	global_info = info;
 	root = info->fs_root;
+	/* the extent tree is what we fix, don't allocate from stale caches */
+	if (repair)
+		info->no_free_space_load = 1;
+	/* lost+found and link repair look up names in large directories */
+	if (repair) {
+		ret = btrfs_dir_cache_enable(info);
+		if (ret)
+			goto close_out;
+	}
 
 	/*
 	 * repair mode will force us to commit transaction which
@@ -9842,6 +9833,8 @@ out:
 	printf("file data blocks allocated: %llu\n referenced %llu\n",
 		(unsigned long long)data_bytes_allocated,
 		(unsigned long long)data_bytes_referenced);
+	if (repair)
+		btrfs_print_alloc_stats(info);
 
 	free_root_recs_tree(&root_cache);
 close_out:
@@ -32,11 +32,100 @@
 
 #include "version.h"
 
+/* Buffer for TREE_SEARCH_V2 on the chunk tree, ~40k single stripe chunks */
+#define CHUNK_SEARCH_BUF_SIZE	(4 * 1024 * 1024)
+
+/*
+ * The chunk_info array being built with an open addressing hash on
+ * (type, devid, num_stripes), the slots hold the array index + 1
+ */
+struct chunk_info_table {
+	struct chunk_info *info;
+	int count;
+	int alloc;
+	int *slots;
+	int nr_slots;
+	/* devids of the device items found along the chunks */
+	u64 *devids;
+	int nr_devids;
+	int alloc_devids;
+};
+
+static unsigned int chunk_info_hash(u64 type, u64 devid, u64 num_stripes)
+{
+	u64 hash = type * 0x9e3779b97f4a7c15ULL;
+
+	hash ^= devid + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+	hash ^= num_stripes + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+	return (unsigned int)(hash ^ (hash >> 32));
+}
+
+static int chunk_info_table_grow(struct chunk_info_table *table)
+{
+	int nr_slots = max(table->nr_slots * 2, 64);
+	int *slots;
+	int i;
+
+	slots = calloc(nr_slots, sizeof(*slots));
+	if (!slots)
+		return -ENOMEM;
+	for (i = 0; i < table->count; i++) {
+		struct chunk_info *p = &table->info[i];
+		unsigned int h = chunk_info_hash(p->type, p->devid,
+						 p->num_stripes);
+
+		while (slots[h & (nr_slots - 1)])
+			h++;
+		slots[h & (nr_slots - 1)] = i + 1;
+	}
+	free(table->slots);
+	table->slots = slots;
+	table->nr_slots = nr_slots;
+	return 0;
+}
+
+static struct chunk_info *chunk_info_table_get(struct chunk_info_table *table,
+					       u64 type, u64 devid,
+					       u64 num_stripes)
+{
+	struct chunk_info *p;
+	unsigned int h;
+
+	if (table->count * 2 >= table->nr_slots &&
+	    chunk_info_table_grow(table))
+		return NULL;
+
+	h = chunk_info_hash(type, devid, num_stripes);
+	while (table->slots[h & (table->nr_slots - 1)]) {
+		p = &table->info[table->slots[h & (table->nr_slots - 1)] - 1];
+		if (p->type == type && p->devid == devid &&
+		    p->num_stripes == num_stripes)
+			return p;
+		h++;
+	}
+
+	if (table->count == table->alloc) {
+		int alloc = max(table->alloc * 2, 32);
+
+		p = realloc(table->info, alloc * sizeof(*p));
+		if (!p)
+			return NULL;
+		table->info = p;
+		table->alloc = alloc;
+	}
+	p = &table->info[table->count++];
+	table->slots[h & (table->nr_slots - 1)] = table->count;
+	p->devid = devid;
+	p->type = type;
+	p->size = 0;
+	p->num_stripes = num_stripes;
+	return p;
+}
+
 /*
  * Add the chunk info to the chunk_info list
  */
-static int add_info_to_list(struct chunk_info **info_ptr,
-			int *info_count,
+static int add_info_to_list(struct chunk_info_table *table,
 			struct btrfs_chunk *chunk)
 {
 
@@ -46,40 +135,17 @@ static int add_info_to_list(struct chunk_info **info_ptr,
 	int j;
 
 	for (j = 0 ; j < num_stripes ; j++) {
-		int i;
-		struct chunk_info *p = NULL;
+		struct chunk_info *p;
 		struct btrfs_stripe *stripe;
 		u64    devid;
 
 		stripe = btrfs_stripe_nr(chunk, j);
 		devid = btrfs_stack_stripe_devid(stripe);
 
-		for (i = 0 ; i < *info_count ; i++)
-			if ((*info_ptr)[i].type == type &&
-			    (*info_ptr)[i].devid == devid &&
-			    (*info_ptr)[i].num_stripes == num_stripes ) {
-				p = (*info_ptr) + i;
-				break;
-			}
-
+		p = chunk_info_table_get(table, type, devid, num_stripes);
 		if (!p) {
-			int tmp = sizeof(struct btrfs_chunk) * (*info_count + 1);
-			struct chunk_info *res = realloc(*info_ptr, tmp);
-
-			if (!res) {
-				free(*info_ptr);
-				error("not enough memory");
-				return -ENOMEM;
-			}
-
-			*info_ptr = res;
-			p = res + *info_count;
-			(*info_count)++;
-
-			p->devid = devid;
-			p->type = type;
-			p->size = 0;
-			p->num_stripes = num_stripes;
+			error("not enough memory");
+			return -ENOMEM;
 		}
 
 		p->size += size;
@@ -90,6 +156,24 @@ static int add_info_to_list(struct chunk_info **info_ptr,
 
 }
 
+static int add_devid_to_list(struct chunk_info_table *table, u64 devid)
+{
+	if (table->nr_devids == table->alloc_devids) {
+		int alloc = max(table->alloc_devids * 2, 16);
+		u64 *tmp;
+
+		tmp = realloc(table->devids, alloc * sizeof(*tmp));
+		if (!tmp) {
+			error("not enough memory");
+			return -ENOMEM;
+		}
+		table->devids = tmp;
+		table->alloc_devids = alloc;
+	}
+	table->devids[table->nr_devids++] = devid;
+	return 0;
+}
+
 /*
  *  Helper to sort the chunk type
  */
@@ -126,44 +210,77 @@ static int cmp_chunk_info(const void *a, const void *b)
 		((struct chunk_info *)b)->type);
 }
 
-static int load_chunk_info(int fd, struct chunk_info **info_ptr, int *info_count)
+/*
+ * Read the device items and chunk items, which are next to each other in the
+ * chunk tree, with large TREE_SEARCH_V2 batches. Old kernels get the v1
+ * ioctl. The devids are returned for load_device_info.
+ */
+static int load_chunk_info(int fd, struct chunk_info **info_ptr, int *info_count,
+			   u64 **devids, int *nr_devids)
 {
 	int ret;
+	struct btrfs_ioctl_search_args_v2 *args2;
 	struct btrfs_ioctl_search_args args;
-	struct btrfs_ioctl_search_key *sk = &args.key;
-	struct btrfs_ioctl_search_header *sh;
+	struct btrfs_ioctl_search_key *sk;
+	struct btrfs_ioctl_search_header sh;
+	struct chunk_info_table table;
 	unsigned long off = 0;
+	u64 buf_size;
+	char *buf;
+	int use_v1 = 0;
 	int i, e;
 
-	memset(&args, 0, sizeof(args));
+	memset(&table, 0, sizeof(table));
+	args2 = malloc(sizeof(*args2) + CHUNK_SEARCH_BUF_SIZE);
+	if (!args2) {
+		error("not enough memory");
+		return 1;
+	}
+	sk = &args2->key;
+	memset(sk, 0, sizeof(*sk));
 
-	/*
-	 * there may be more than one ROOT_ITEM key if there are
-	 * snapshots pending deletion, we have to loop through
-	 * them.
-	 */
 	sk->tree_id = BTRFS_CHUNK_TREE_OBJECTID;
 
-	sk->min_objectid = 0;
-	sk->max_objectid = (u64)-1;
-	sk->max_type = 0;
-	sk->min_type = (u8)-1;
+	sk->min_objectid = BTRFS_DEV_ITEMS_OBJECTID;
+	sk->max_objectid = BTRFS_FIRST_CHUNK_TREE_OBJECTID;
+	sk->min_type = BTRFS_DEV_ITEM_KEY;
+	sk->max_type = BTRFS_CHUNK_ITEM_KEY;
 	sk->min_offset = 0;
 	sk->max_offset = (u64)-1;
 	sk->min_transid = 0;
 	sk->max_transid = (u64)-1;
-	sk->nr_items = 4096;
 
 	while (1) {
-		ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args);
-		e = errno;
-		if (e == EPERM)
-			return -e;
+		if (!use_v1) {
+			sk->nr_items = (u32)-1;
+			args2->buf_size = CHUNK_SEARCH_BUF_SIZE;
+			ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH_V2, args2);
+			e = errno;
+			if (ret < 0 && (e == ENOTTY || e == EOPNOTSUPP)) {
+				use_v1 = 1;
+				continue;
+			}
+			buf = (char *)args2->buf;
+			buf_size = CHUNK_SEARCH_BUF_SIZE;
+		} else {
+			sk->nr_items = 4096;
+			memcpy(&args.key, sk, sizeof(*sk));
+			ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args);
+			e = errno;
+			memcpy(sk, &args.key, sizeof(*sk));
+			buf = args.buf;
+			buf_size = sizeof(args.buf);
+		}
+		if (ret < 0 && e == EPERM) {
+			ret = -e;
+			goto out;
+		}
 
 		if (ret < 0) {
 			error("cannot look up chunk tree info: %s",
 				strerror(e));
-			return 1;
+			ret = 1;
+			goto out;
 		}
 		/* the ioctl returns the number of item it found in nr_items */
 
@@ -172,44 +289,63 @@ static int load_chunk_info(int fd, struct chunk_info **info_ptr, int *info_count
 
 		off = 0;
 		for (i = 0; i < sk->nr_items; i++) {
-			struct btrfs_chunk *item;
-			sh = (struct btrfs_ioctl_search_header *)(args.buf +
-								  off);
-
-			off += sizeof(*sh);
-			item = (struct btrfs_chunk *)(args.buf + off);
-
-			ret = add_info_to_list(info_ptr, info_count, item);
+			memcpy(&sh, buf + off, sizeof(sh));
+			off += sizeof(sh);
+
+			ret = 0;
+			if (sh.type == BTRFS_CHUNK_ITEM_KEY)
+				ret = add_info_to_list(&table,
+					(struct btrfs_chunk *)(buf + off));
+			else if (sh.type == BTRFS_DEV_ITEM_KEY)
+				ret = add_devid_to_list(&table, sh.offset);
 			if (ret) {
-				*info_ptr = NULL;
-				return 1;
+				ret = 1;
+				goto out;
 			}
 
-			off += sh->len;
-
-			sk->min_objectid = sh->objectid;
-			sk->min_type = sh->type;
-			sk->min_offset = sh->offset+1;
+			off += sh.len;
 
+			sk->min_objectid = sh.objectid;
+			sk->min_type = sh.type;
+			sk->min_offset = sh.offset;
 		}
-		if (!sk->min_offset)	/* overflow */
-			sk->min_type++;
-		else
-			continue;
 
-		if (!sk->min_type)
+		/*
+		 * The search stops early only if the next item does not fit,
+		 * enough room left means there are no more items
+		 */
+		if (buf_size - off >= sizeof(sh) + BTRFS_MAX_METADATA_BLOCKSIZE)
+			break;
+		if (sk->min_offset < (u64)-1) {
+			sk->min_offset++;
+		} else if (sk->min_type < BTRFS_CHUNK_ITEM_KEY) {
+			sk->min_type++;
+			sk->min_offset = 0;
+		} else if (sk->min_objectid < BTRFS_FIRST_CHUNK_TREE_OBJECTID) {
 			sk->min_objectid++;
-		 else
-			continue;
-
-		if (!sk->min_objectid)
+			sk->min_type = BTRFS_DEV_ITEM_KEY;
+			sk->min_offset = 0;
+		} else {
 			break;
+		}
 	}
 
-	qsort(*info_ptr, *info_count, sizeof(struct chunk_info),
+	qsort(table.info, table.count, sizeof(struct chunk_info),
 		cmp_chunk_info);
 
-	return 0;
+	*info_ptr = table.info;
+	*info_count = table.count;
+	*devids = table.devids;
+	*nr_devids = table.nr_devids;
+	table.info = NULL;
+	table.devids = NULL;
+	ret = 0;
+out:
+	free(table.info);
+	free(table.slots);
+	free(table.devids);
+	free(args2);
+	return ret;
 }
 
 /*
@@ -506,15 +642,18 @@ static int cmp_device_info(const void *a, const void *b)
 }
 
 /*
- *  This function loads the device_info structure and put them in an array
+ *  This function loads the device_info structure and put them in an array.
+ *  With the devids from the chunk tree only the existing devices are
+ *  queried, otherwise all ids up to max_id are tried.
  */
 static int load_device_info(int fd, struct device_info **device_info_ptr,
-			   int *device_info_count)
+			   int *device_info_count, u64 *devids, int nr_devids)
 {
 	int ret, i, ndevs;
 	struct btrfs_ioctl_fs_info_args fi_args;
 	struct btrfs_ioctl_dev_info_args dev_info;
 	struct device_info *info;
+	u64 nr_ids;
 
 	*device_info_count = 0;
 	*device_info_ptr = NULL;
@@ -534,18 +673,26 @@ static int load_device_info(int fd, struct device_info **device_info_ptr,
 		return 1;
 	}
 
-	for (i = 0, ndevs = 0 ; i <= fi_args.max_id ; i++) {
-		BUG_ON(ndevs >= fi_args.num_devices);
+	/*
+	 * A running device replace target has devid 0 and no dev item in the
+	 * chunk tree, probe it in addition to the known devids
+	 */
+	nr_ids = devids ? nr_devids + 1 : fi_args.max_id + 1;
+	for (i = 0, ndevs = 0 ; i < nr_ids ; i++) {
+		u64 devid = (devids && i) ? devids[i - 1] : i;
+
 		memset(&dev_info, 0, sizeof(dev_info));
-		ret = get_device_info(fd, i, &dev_info);
+		ret = get_device_info(fd, devid, &dev_info);
 
 		if (ret == -ENODEV)
 			continue;
 		if (ret) {
-			error("cannot get info about device devid=%d", i);
+			error("cannot get info about device devid=%llu",
+				(unsigned long long)devid);
 			free(info);
 			return ret;
 		}
+		BUG_ON(ndevs >= fi_args.num_devices);
 
 		info[ndevs].devid = dev_info.devid;
 		if (!dev_info.path[0]) {
@@ -572,9 +719,11 @@ static int load_device_info(int fd, struct device_info **device_info_ptr,
 int load_chunk_and_device_info(int fd, struct chunk_info **chunkinfo,
 		int *chunkcount, struct device_info **devinfo, int *devcount)
 {
+	u64 *devids = NULL;
+	int nr_devids = 0;
 	int ret;
 
-	ret = load_chunk_info(fd, chunkinfo, chunkcount);
+	ret = load_chunk_info(fd, chunkinfo, chunkcount, &devids, &nr_devids);
 	if (ret == -EPERM) {
 		warning(
 "cannot read detailed chunk info, RAID5/6 numbers will be incorrect, run as root");
@@ -582,7 +731,8 @@ int load_chunk_and_device_info(int fd, struct chunk_info **chunkinfo,
 		return ret;
 	}
 
-	ret = load_device_info(fd, devinfo, devcount);
+	ret = load_device_info(fd, devinfo, devcount, devids, nr_devids);
+	free(devids);
 	if (ret == -EPERM) {
 		warning(
 		"cannot get filesystem info from ioctl(FS_INFO), run as root");
@@ -27,6 +27,8 @@
 #include <mntent.h>
 #include <linux/limits.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "kerncompat.h"
 #include "ctree.h"
@@ -52,19 +54,29 @@ struct seen_fsid {
 
 static struct seen_fsid *seen_fsid_hash[SEEN_FSID_HASH_SIZE] = {NULL,};
 
+static int seen_fsid_slot(u8 *fsid)
+{
+	u32 hash = 0;
+	int i;
+
+	for (i = 0; i < BTRFS_FSID_SIZE; i++)
+		hash = hash * 31 + fsid[i];
+	return hash % SEEN_FSID_HASH_SIZE;
+}
+
 static int is_seen_fsid(u8 *fsid)
 {
-	u8 hash = fsid[0];
-	int slot = hash % SEEN_FSID_HASH_SIZE;
-	struct seen_fsid *seen = seen_fsid_hash[slot];
+	struct seen_fsid *seen = seen_fsid_hash[seen_fsid_slot(fsid)];
 
-	return seen ? 1 : 0;
+	for (; seen; seen = seen->next)
+		if (memcmp(seen->fsid, fsid, BTRFS_FSID_SIZE) == 0)
+			return 1;
+	return 0;
 }
 
 static int add_seen_fsid(u8 *fsid)
 {
-	u8 hash = fsid[0];
-	int slot = hash % SEEN_FSID_HASH_SIZE;
+	int slot = seen_fsid_slot(fsid);
 	struct seen_fsid *seen = seen_fsid_hash[slot];
 	struct seen_fsid *alloc;
 
@@ -760,6 +772,8 @@ static const char * const cmd_filesystem_show_usage[] = {
 	"Show the structure of a filesystem",
 	"-d|--all-devices   show only disks under /dev containing btrfs filesystem",
 	"-m|--mounted       show only mounted btrfs",
+	"--scan-cache       skip devices found without btrfs by the last scan",
+	"                   if udev saw no change of them",
 	HELPINFO_UNITS_LONG,
 	"If no argument is given, structure of all present filesystems is shown.",
 	NULL
@@ -785,9 +799,12 @@ static int cmd_filesystem_show(int argc, char **argv)
 
 	while (1) {
 		int c;
+		enum { GETOPT_VAL_SCAN_CACHE = 257 };
 		static const struct option long_options[] = {
 			{ "all-devices", no_argument, NULL, 'd'},
 			{ "mounted", no_argument, NULL, 'm'},
+			{ "scan-cache", no_argument, NULL,
+				GETOPT_VAL_SCAN_CACHE },
 			{ NULL, 0, NULL, 0 }
 		};
 
@@ -801,6 +818,9 @@ static int cmd_filesystem_show(int argc, char **argv)
 		case 'm':
 			where = BTRFS_SCAN_MOUNTED;
 			break;
+		case GETOPT_VAL_SCAN_CACHE:
+			btrfs_scan_enable_cache();
+			break;
 		default:
 			usage(cmd_filesystem_show_usage);
 		}
@@ -962,6 +982,13 @@ static const char * const cmd_filesystem_defrag_usage[] = {
 	"-s start       defragment only from byte onward",
 	"-l len         defragment only up to len bytes",
 	"-t size        target extent size hint",
+	"",
+	"With -r, files are defragmented most fragmented first and files that",
+	"would not benefit are skipped:",
+	"--min-extents N   skip files with less than N fragments (default: 2)",
+	"--jobs N          number of files to defragment in parallel (default: 1)",
+	"--max-rate RATE   limit defragmentation to RATE bytes per second",
+	"--progress        print progress and estimated time to stderr",
 	NULL
 };
 
@@ -982,38 +1009,452 @@ static int defrag_global_fancy_ioctl;
 static struct btrfs_ioctl_defrag_range_args defrag_global_range;
 static int defrag_global_verbose;
 static int defrag_global_errors;
-static int defrag_callback(const char *fpath, const struct stat *sb,
-		int typeflag, struct FTW *ftwbuf)
+
+/*
+ * Recursive defragmentation collects the files found by nftw() in batches,
+ * measures the fragmentation of each file from its EXTENT_DATA items, drops
+ * files that would not benefit and defragments the rest, most fragmented
+ * first, on a pool of worker threads.
+ */
+#define DEFRAG_BATCH_FILES	65536
+#define DEFRAG_TARGET_DEFAULT	(256 * 1024)
+
+struct defrag_file {
+	char *path;
+	u64 ino;
+	u64 size;
+	/* number of physically discontiguous pieces in the range */
+	u64 fragments;
+	/* fragments smaller than the target extent size and their bytes */
+	u64 small;
+	u64 small_bytes;
+	/* index in the order of discovery, keeps sorting stable */
+	u64 nr;
+	int skip;
+};
+
+struct defrag_pool {
+	pthread_mutex_t lock;
+	struct defrag_file *files;
+	u64 nr_files;
+	u64 alloc_files;
+	u64 next;
+
+	int jobs;
+	int measure;
+	int progress;
+	u64 min_fragments;
+	u64 target;
+	/* bytes per second, 0 is unlimited */
+	u64 max_rate;
+	int aborted;
+
+	/* totals over all batches */
+	u64 found;
+	u64 skipped;
+	u64 done;
+	u64 queued_bytes;
+	u64 done_bytes;
+	struct timespec start;
+	struct timespec last_progress;
+};
+
+static struct defrag_pool defrag_pool;
+
+static double defrag_elapsed(struct timespec *from)
 {
-	int ret = 0;
-	int e = 0;
-	int fd = 0;
+	struct timespec now;
 
-	if ((typeflag == FTW_F) && S_ISREG(sb->st_mode)) {
-		if (defrag_global_verbose)
-			printf("%s\n", fpath);
-		fd = open(fpath, O_RDWR);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - from->tv_sec) +
+		(now.tv_nsec - from->tv_nsec) / 1000000000.0;
+}
+
+/* Caller holds pool->lock */
+static void defrag_print_progress(struct defrag_pool *pool, int force)
+{
+	double elapsed;
+	double rate;
+	u64 eta = 0;
+
+	if (!pool->progress)
+		return;
+	if (!force && defrag_elapsed(&pool->last_progress) < 1.0)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &pool->last_progress);
+
+	elapsed = defrag_elapsed(&pool->start);
+	rate = elapsed > 0 ? pool->done_bytes / elapsed : 0;
+	if (rate > 0 && pool->queued_bytes > pool->done_bytes)
+		eta = (pool->queued_bytes - pool->done_bytes) / rate;
+	fprintf(stderr,
+	"\rfiles %llu, skipped %llu, defragmented %llu, %s of %s, %s/s, ETA %llu:%02llu:%02llu ",
+		(unsigned long long)pool->found,
+		(unsigned long long)pool->skipped,
+		(unsigned long long)pool->done,
+		pretty_size(pool->done_bytes),
+		pretty_size(pool->queued_bytes),
+		pretty_size((u64)rate),
+		(unsigned long long)eta / 3600,
+		(unsigned long long)(eta / 60) % 60,
+		(unsigned long long)eta % 60);
+	if (force)
+		fprintf(stderr, "\n");
+}
+
+/*
+ * Count the fragments of the file in the defrag range. File extents that
+ * continue on disk where the previous one ended are one fragment. Compressed
+ * extents are capped at 128KiB by design and are not counted as small.
+ *
+ * Returns 0 on success, -errno if the tree search is not possible.
+ */
+static int defrag_measure_file(int fd, struct defrag_file *file, u64 target)
+{
+	struct btrfs_ioctl_search_args args;
+	struct btrfs_ioctl_search_key *sk = &args.key;
+	struct btrfs_ioctl_search_header sh;
+	struct btrfs_file_extent_item *fi;
+	u64 range_start = defrag_global_range.start;
+	u64 range_end;
+	u64 frag_bytes = 0;
+	u64 last_end = 0;
+	int frag_compressed = 0;
+	unsigned long off;
+	int ret;
+	int i;
+
+	if (defrag_global_range.len == (u64)-1)
+		range_end = (u64)-1;
+	else
+		range_end = range_start + defrag_global_range.len;
+
+	file->fragments = 0;
+	file->small = 0;
+	file->small_bytes = 0;
+
+	memset(&args, 0, sizeof(args));
+	sk->tree_id = 0;
+	sk->min_objectid = file->ino;
+	sk->max_objectid = file->ino;
+	sk->min_type = BTRFS_EXTENT_DATA_KEY;
+	sk->max_type = BTRFS_EXTENT_DATA_KEY;
+	sk->max_offset = (u64)-1;
+	sk->max_transid = (u64)-1;
+
+	while (1) {
+		sk->nr_items = 4096;
+		ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args);
+		if (ret < 0)
+			return -errno;
+		if (sk->nr_items == 0)
+			break;
+
+		off = 0;
+		for (i = 0; i < sk->nr_items; i++) {
+			u64 bytenr;
+			u64 len;
+			u8 type;
+
+			memcpy(&sh, args.buf + off, sizeof(sh));
+			off += sizeof(sh);
+			fi = (struct btrfs_file_extent_item *)(args.buf + off);
+			off += sh.len;
+			sk->min_offset = sh.offset;
+
+			if (sh.type != BTRFS_EXTENT_DATA_KEY)
+				continue;
+			type = btrfs_stack_file_extent_type(fi);
+			if (type == BTRFS_FILE_EXTENT_INLINE)
+				continue;
+			bytenr = btrfs_stack_file_extent_disk_bytenr(fi);
+			len = btrfs_stack_file_extent_num_bytes(fi);
+			if (bytenr == 0)
+				continue;
+			if (sh.offset >= range_end ||
+			    sh.offset + len <= range_start)
+				continue;
+
+			bytenr += btrfs_stack_file_extent_offset(fi);
+			if (file->fragments && bytenr == last_end &&
+			    !btrfs_stack_file_extent_compression(fi)) {
+				frag_bytes += len;
+				last_end += len;
+				continue;
+			}
+			if (file->fragments && !frag_compressed &&
+			    frag_bytes < target) {
+				file->small++;
+				file->small_bytes += frag_bytes;
+			}
+			file->fragments++;
+			frag_bytes = len;
+			last_end = bytenr + len;
+			frag_compressed = !!btrfs_stack_file_extent_compression(fi);
+		}
+		if (sk->min_offset == (u64)-1)
+			break;
+		sk->min_offset++;
+	}
+	if (file->fragments && !frag_compressed && frag_bytes < target) {
+		file->small++;
+		file->small_bytes += frag_bytes;
+	}
+	return 0;
+}
+
+static void *defrag_measure_worker(void *data)
+{
+	struct defrag_pool *pool = data;
+	struct defrag_file *file;
+	int ret;
+	int fd;
+
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->next >= pool->nr_files || !pool->measure) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		file = &pool->files[pool->next++];
+		pthread_mutex_unlock(&pool->lock);
+
+		fd = open(file->path, O_RDONLY | O_NOATIME);
+		if (fd < 0)
+			fd = open(file->path, O_RDONLY);
+		/* leave the error reporting to the defrag itself */
 		if (fd < 0)
-			goto error;
-		ret = do_defrag(fd, defrag_global_fancy_ioctl, &defrag_global_range);
-		e = errno;
+			continue;
+		ret = defrag_measure_file(fd, file, pool->target);
 		close(fd);
+		if (ret < 0) {
+			pthread_mutex_lock(&pool->lock);
+			if (pool->measure) {
+				warning(
+		"cannot measure fragmentation, defragmenting all files: %s",
+					strerror(-ret));
+				pool->measure = 0;
+			}
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		/* nothing to gain from a single or already large fragments */
+		if (file->fragments < pool->min_fragments || file->small == 0 ||
+		    file->fragments < 2)
+			file->skip = 1;
+	}
+	return NULL;
+}
+
+/* Bytes expected to be rewritten */
+static u64 defrag_file_bytes(struct defrag_pool *pool, struct defrag_file *file)
+{
+	u64 bytes;
+
+	if (pool->measure)
+		return file->small_bytes;
+	if (file->size <= defrag_global_range.start)
+		return 0;
+	bytes = file->size - defrag_global_range.start;
+	return min(bytes, defrag_global_range.len);
+}
+
+static void *defrag_worker(void *data)
+{
+	struct defrag_pool *pool = data;
+	struct defrag_file *file;
+	double ahead;
+	u64 bytes;
+	int ret;
+	int e = 0;
+	int fd;
+
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->next < pool->nr_files &&
+		       pool->files[pool->next].skip)
+			pool->next++;
+		if (pool->next >= pool->nr_files || pool->aborted) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		file = &pool->files[pool->next++];
+		pthread_mutex_unlock(&pool->lock);
+
+		if (defrag_global_verbose)
+			printf("%s\n", file->path);
+		fd = open(file->path, O_RDWR);
+		if (fd < 0) {
+			ret = -1;
+			e = errno;
+		} else {
+			ret = do_defrag(fd, defrag_global_fancy_ioctl,
+					&defrag_global_range);
+			e = errno;
+			close(fd);
+		}
+		bytes = defrag_file_bytes(pool, file);
+
+		pthread_mutex_lock(&pool->lock);
 		if (ret && e == ENOTTY && defrag_global_fancy_ioctl) {
-			error("defrag range ioctl not "
-				"supported in this kernel, please try "
-				"without any options.");
+			if (!pool->aborted)
+				error("defrag range ioctl not "
+					"supported in this kernel, please try "
+					"without any options.");
+			pool->aborted = 1;
+			defrag_global_errors++;
+		} else if (ret) {
+			error("defrag failed on %s: %s", file->path,
+					strerror(e));
 			defrag_global_errors++;
-			return ENOTTY;
 		}
-		if (ret)
-			goto error;
+		pool->done++;
+		pool->done_bytes += bytes;
+		defrag_print_progress(pool, 0);
+		ahead = 0;
+		if (pool->max_rate)
+			ahead = (double)pool->done_bytes / pool->max_rate -
+				defrag_elapsed(&pool->start);
+		pthread_mutex_unlock(&pool->lock);
+
+		/* stay within the I/O budget */
+		if (ahead > 0)
+			usleep(ahead * 1000000);
 	}
-	return 0;
+	return NULL;
+}
 
-error:
-	error("defrag failed on %s: %s", fpath, strerror(e));
-	defrag_global_errors++;
-	return 0;
+static int cmp_defrag_file(const void *a, const void *b)
+{
+	const struct defrag_file *fa = a;
+	const struct defrag_file *fb = b;
+
+	if (fa->small > fb->small)
+		return -1;
+	if (fa->small < fb->small)
+		return 1;
+	if (fa->nr < fb->nr)
+		return -1;
+	return fa->nr > fb->nr;
+}
+
+static void defrag_run_workers(struct defrag_pool *pool,
+		void *(*fn)(void *))
+{
+	pthread_t *threads;
+	int started = 0;
+	int i;
+
+	pool->next = 0;
+	threads = calloc(pool->jobs, sizeof(pthread_t));
+	if (threads) {
+		for (i = 0; i < pool->jobs; i++) {
+			if (pthread_create(&threads[i], NULL, fn, pool))
+				break;
+			started++;
+		}
+	}
+	/* the calling thread does the work if no thread could be started */
+	if (!started)
+		fn(pool);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
+static void defrag_flush_batch(struct defrag_pool *pool)
+{
+	u64 i;
+
+	if (!pool->nr_files)
+		return;
+
+	if (pool->measure)
+		defrag_run_workers(pool, defrag_measure_worker);
+	if (pool->measure) {
+		qsort(pool->files, pool->nr_files, sizeof(*pool->files),
+		      cmp_defrag_file);
+	} else {
+		/* measuring failed midway, keep the order of discovery */
+		for (i = 0; i < pool->nr_files; i++)
+			pool->files[i].skip = 0;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	for (i = 0; i < pool->nr_files; i++) {
+		if (pool->files[i].skip)
+			pool->skipped++;
+		else
+			pool->queued_bytes += defrag_file_bytes(pool,
+							&pool->files[i]);
+	}
+	defrag_print_progress(pool, 0);
+	pthread_mutex_unlock(&pool->lock);
+
+	defrag_run_workers(pool, defrag_worker);
+
+	for (i = 0; i < pool->nr_files; i++)
+		free(pool->files[i].path);
+	pool->nr_files = 0;
+}
+
+static int defrag_callback(const char *fpath, const struct stat *sb,
+		int typeflag, struct FTW *ftwbuf)
+{
+	struct defrag_pool *pool = &defrag_pool;
+	struct defrag_file *file;
+
+	if (pool->aborted)
+		return ENOTTY;
+	if (typeflag != FTW_F || !S_ISREG(sb->st_mode))
+		return 0;
+
+	if (pool->nr_files == pool->alloc_files) {
+		u64 alloc = max(pool->alloc_files * 2, 1024ULL);
+
+		alloc = min(alloc, (u64)DEFRAG_BATCH_FILES);
+		file = realloc(pool->files, alloc * sizeof(*file));
+		if (!file) {
+			error("not enough memory");
+			defrag_global_errors++;
+			return ENOMEM;
+		}
+		pool->files = file;
+		pool->alloc_files = alloc;
+	}
+
+	file = &pool->files[pool->nr_files];
+	memset(file, 0, sizeof(*file));
+	file->path = strdup(fpath);
+	if (!file->path) {
+		error("not enough memory");
+		defrag_global_errors++;
+		return ENOMEM;
+	}
+	file->ino = sb->st_ino;
+	file->size = sb->st_size;
+	file->nr = pool->found++;
+	pool->nr_files++;
+
+	if (pool->nr_files == DEFRAG_BATCH_FILES)
+		defrag_flush_batch(pool);
+	return pool->aborted ? ENOTTY : 0;
+}
+
+/*
+ * Returns 0 on success, ENOTTY if the kernel does not support the range
+ * ioctl and the whole command should stop. Other errors are counted in
+ * defrag_global_errors.
+ */
+static int defrag_recursive(const char *path)
+{
+	struct defrag_pool *pool = &defrag_pool;
+	int ret;
+
+	ret = nftw(path, defrag_callback, 10, FTW_MOUNT | FTW_PHYS);
+	if (ret != ENOTTY && ret != ENOMEM)
+		defrag_flush_batch(pool);
+	return pool->aborted ? ENOTTY : 0;
 }
 
 static int cmd_filesystem_defrag(int argc, char **argv)
@@ -1029,14 +1470,30 @@ static int cmd_filesystem_defrag(int argc, char **argv)
 	int e = 0;
 	int compress_type = BTRFS_COMPRESS_NONE;
 	DIR *dirstream;
+	struct defrag_pool *pool = &defrag_pool;
 
 	defrag_global_errors = 0;
 	defrag_global_verbose = 0;
 	defrag_global_errors = 0;
 	defrag_global_fancy_ioctl = 0;
+	memset(pool, 0, sizeof(*pool));
+	pool->jobs = 1;
+	pool->min_fragments = 2;
 	optind = 1;
 	while(1) {
-		int c = getopt(argc, argv, "vrc::fs:l:t:");
+		enum { GETOPT_VAL_MIN_EXTENTS = 257, GETOPT_VAL_JOBS,
+			GETOPT_VAL_MAX_RATE, GETOPT_VAL_PROGRESS };
+		static const struct option long_options[] = {
+			{ "min-extents", required_argument, NULL,
+				GETOPT_VAL_MIN_EXTENTS },
+			{ "jobs", required_argument, NULL, GETOPT_VAL_JOBS },
+			{ "max-rate", required_argument, NULL,
+				GETOPT_VAL_MAX_RATE },
+			{ "progress", no_argument, NULL, GETOPT_VAL_PROGRESS },
+			{ NULL, 0, NULL, 0 }
+		};
+		int c = getopt_long(argc, argv, "vrc::fs:l:t:", long_options,
+				NULL);
 		if (c < 0)
 			break;
 
@@ -1075,6 +1532,25 @@ static int cmd_filesystem_defrag(int argc, char **argv)
 		case 'r':
 			recursive = 1;
 			break;
+		case GETOPT_VAL_MIN_EXTENTS:
+			pool->min_fragments = arg_strtou64(optarg);
+			break;
+		case GETOPT_VAL_JOBS: {
+			u64 tmp = arg_strtou64(optarg);
+
+			if (tmp < 1 || tmp > 256) {
+				error("number of jobs must be 1 to 256");
+				return 1;
+			}
+			pool->jobs = tmp;
+			break;
+		}
+		case GETOPT_VAL_MAX_RATE:
+			pool->max_rate = parse_size(optarg);
+			break;
+		case GETOPT_VAL_PROGRESS:
+			pool->progress = 1;
+			break;
 		default:
 			usage(cmd_filesystem_defrag_usage);
 		}
@@ -1083,6 +1559,15 @@ static int cmd_filesystem_defrag(int argc, char **argv)
 	if (check_argc_min(argc - optind, 1))
 		usage(cmd_filesystem_defrag_usage);
 
+	/*
+	 * Recompression rewrites every extent, the fragmentation does not
+	 * matter then.
+	 */
+	pool->measure = !compress_type;
+	pool->target = thresh ? thresh : DEFRAG_TARGET_DEFAULT;
+	pthread_mutex_init(&pool->lock, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &pool->start);
+
 	memset(&defrag_global_range, 0, sizeof(defrag_global_range));
 	defrag_global_range.start = start;
 	defrag_global_range.len = len;
@@ -1122,8 +1607,7 @@ static int cmd_filesystem_defrag(int argc, char **argv)
 		}
 		if (recursive) {
 			if (S_ISDIR(st.st_mode)) {
-				ret = nftw(argv[i], defrag_callback, 10,
-						FTW_MOUNT | FTW_PHYS);
+				ret = defrag_recursive(argv[i]);
 				if (ret == ENOTTY)
 					exit(1);
 				/* errors are handled in the callback */
@@ -1155,6 +1639,10 @@ static int cmd_filesystem_defrag(int argc, char **argv)
 			defrag_global_errors++;
 		}
 	}
+	if (recursive)
+		defrag_print_progress(pool, 1);
+	free(pool->files);
+	pthread_mutex_destroy(&pool->lock);
 	if (defrag_global_errors)
 		fprintf(stderr, "total %d failures\n", defrag_global_errors);
 
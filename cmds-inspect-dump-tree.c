@@ -33,6 +33,8 @@
 #include "utils.h"
 #include "cmds-inspect-dump-tree.h"
 
+#define DUMP_TREE_OUTBUF_SIZE	(1024 * 1024)
+
 static void print_extents(struct btrfs_root *root, struct extent_buffer *eb)
 {
 	int i;
@@ -49,6 +51,9 @@ static void print_extents(struct btrfs_root *root, struct extent_buffer *eb)
 
 	size = btrfs_level_size(root, btrfs_header_level(eb) - 1);
 	nr = btrfs_header_nritems(eb);
+	for (i = 0; i < nr; i++)
+		readahead_tree_block(root, btrfs_node_blockptr(eb, i), size,
+				     btrfs_node_ptr_generation(eb, i));
 	for (i = 0; i < nr; i++) {
 		struct extent_buffer *next = read_tree_block(root,
 					     btrfs_node_blockptr(eb, i),
@@ -106,6 +111,149 @@ static void print_old_roots(struct btrfs_super_block *super)
 	}
 }
 
+/*
+ * Compact machine readable output, one JSON object per line. Each tree
+ * block produces a "node" or "leaf" record followed by one "ptr" or "item"
+ * record per slot. Key types are printed as numbers.
+ */
+static void print_json_block(struct btrfs_root *root, struct extent_buffer *eb,
+			     int follow)
+{
+	struct btrfs_disk_key disk_key;
+	u64 owner = btrfs_header_owner(eb);
+	u32 nr = btrfs_header_nritems(eb);
+	u32 size;
+	int level = btrfs_header_level(eb);
+	int i;
+
+	printf("{\"record\":\"%s\",\"tree\":%llu,\"bytenr\":%llu,"
+	       "\"level\":%d,\"generation\":%llu,\"items\":%u}\n",
+	       level ? "node" : "leaf", (unsigned long long)owner,
+	       (unsigned long long)eb->start, level,
+	       (unsigned long long)btrfs_header_generation(eb), nr);
+
+	for (i = 0; i < nr; i++) {
+		if (level)
+			btrfs_node_key(eb, &disk_key, i);
+		else
+			btrfs_item_key(eb, &disk_key, i);
+		printf("{\"record\":\"%s\",\"tree\":%llu,\"bytenr\":%llu,"
+		       "\"slot\":%d,\"objectid\":%llu,\"type\":%u,"
+		       "\"offset\":%llu,",
+		       level ? "ptr" : "item", (unsigned long long)owner,
+		       (unsigned long long)eb->start, i,
+		       (unsigned long long)btrfs_disk_key_objectid(&disk_key),
+		       btrfs_disk_key_type(&disk_key),
+		       (unsigned long long)btrfs_disk_key_offset(&disk_key));
+		if (level)
+			printf("\"blockptr\":%llu,\"ptr_generation\":%llu}\n",
+			       (unsigned long long)btrfs_node_blockptr(eb, i),
+			       (unsigned long long)btrfs_node_ptr_generation(eb, i));
+		else
+			printf("\"data_offset\":%u,\"size\":%u}\n",
+			       btrfs_item_offset_nr(eb, i),
+			       btrfs_item_size_nr(eb, i));
+	}
+
+	if (!level || !follow)
+		return;
+
+	size = btrfs_level_size(root, level - 1);
+	for (i = 0; i < nr; i++)
+		readahead_tree_block(root, btrfs_node_blockptr(eb, i), size,
+				     btrfs_node_ptr_generation(eb, i));
+	for (i = 0; i < nr; i++) {
+		struct extent_buffer *next = read_tree_block(root,
+					     btrfs_node_blockptr(eb, i),
+					     size,
+					     btrfs_node_ptr_generation(eb, i));
+		if (!extent_buffer_uptodate(next)) {
+			fflush(stdout);
+			error("failed to read %llu in tree %llu",
+				(unsigned long long)btrfs_node_blockptr(eb, i),
+				(unsigned long long)owner);
+			continue;
+		}
+		if (btrfs_header_level(next) != level - 1)
+			BUG();
+		print_json_block(root, next, 1);
+		free_extent_buffer(next);
+	}
+}
+
+/*
+ * Dump the root and chunk tree followed by all trees referenced from the
+ * tree root and the log root tree, limited to tree_id if it's set.
+ */
+static int print_json_trees(struct btrfs_fs_info *info, u64 tree_id)
+{
+	struct btrfs_root *tree_root_scan = info->tree_root;
+	struct btrfs_root_item ri;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	struct extent_buffer *leaf;
+	struct extent_buffer *buf;
+	int ret;
+
+	if ((!tree_id || tree_id == BTRFS_ROOT_TREE_OBJECTID) &&
+	    extent_buffer_uptodate(info->tree_root->node))
+		print_json_block(info->tree_root, info->tree_root->node, 1);
+	if ((!tree_id || tree_id == BTRFS_CHUNK_TREE_OBJECTID) &&
+	    extent_buffer_uptodate(info->chunk_root->node))
+		print_json_block(info->chunk_root, info->chunk_root->node, 1);
+
+	btrfs_init_path(&path);
+again:
+	if (!extent_buffer_uptodate(tree_root_scan->node))
+		goto next_root_tree;
+
+	key.objectid = 0;
+	key.type = BTRFS_ROOT_ITEM_KEY;
+	key.offset = 0;
+	ret = btrfs_search_slot(NULL, tree_root_scan, &key, &path, 0, 0);
+	if (ret < 0)
+		goto out;
+	while (1) {
+		leaf = path.nodes[0];
+		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(tree_root_scan, &path);
+			if (ret < 0)
+				goto out;
+			if (ret > 0)
+				break;
+			leaf = path.nodes[0];
+		}
+		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
+		if (key.type != BTRFS_ROOT_ITEM_KEY ||
+		    (tree_id && key.objectid != tree_id))
+			goto next;
+
+		read_extent_buffer(leaf, &ri,
+				   btrfs_item_ptr_offset(leaf, path.slots[0]),
+				   sizeof(ri));
+		buf = read_tree_block(tree_root_scan, btrfs_root_bytenr(&ri),
+				      btrfs_level_size(tree_root_scan,
+						       btrfs_root_level(&ri)),
+				      0);
+		if (extent_buffer_uptodate(buf))
+			print_json_block(tree_root_scan, buf, 1);
+		free_extent_buffer(buf);
+next:
+		path.slots[0]++;
+	}
+	btrfs_release_path(&path);
+
+next_root_tree:
+	if (tree_root_scan == info->tree_root && info->log_root_tree) {
+		tree_root_scan = info->log_root_tree;
+		goto again;
+	}
+	ret = 0;
+out:
+	btrfs_release_path(&path);
+	return ret;
+}
+
 /*
  * Convert a tree name from various forms to the numerical id if possible
  * Accepted forms:
@@ -187,6 +335,8 @@ const char * const cmd_inspect_dump_tree_usage[] = {
 	"-u|--uuid              print only the uuid tree",
 	"-b|--block <block_num> print info from the specified block only",
 	"-t|--tree <tree_id>    print only tree with the given id (string or number)",
+	"--json                 print one JSON object per tree block and item,",
+	"                       can be combined with --block and --tree only",
 	NULL
 };
 
@@ -208,12 +358,15 @@ int cmd_inspect_dump_tree(int argc, char **argv)
 	int uuid_tree_only = 0;
 	int roots_only = 0;
 	int root_backups = 0;
+	int json = 0;
 	u64 block_only = 0;
 	struct btrfs_root *tree_root_scan;
 	u64 tree_id = 0;
+	char *outbuf = NULL;
 
 	while (1) {
 		int c;
+		enum { GETOPT_VAL_JSON = 257 };
 		static const struct option long_options[] = {
 			{ "extents", no_argument, NULL, 'e'},
 			{ "device", no_argument, NULL, 'd'},
@@ -222,6 +375,7 @@ int cmd_inspect_dump_tree(int argc, char **argv)
 			{ "uuid", no_argument, NULL, 'u'},
 			{ "block", required_argument, NULL, 'b'},
 			{ "tree", required_argument, NULL, 't'},
+			{ "json", no_argument, NULL, GETOPT_VAL_JSON},
 			{ NULL, 0, NULL, 0 }
 		};
 
@@ -268,6 +422,9 @@ int cmd_inspect_dump_tree(int argc, char **argv)
 				exit(1);
 			}
 			break;
+		case GETOPT_VAL_JSON:
+			json = 1;
+			break;
 		default:
 			usage(cmd_inspect_dump_tree_usage);
 		}
@@ -276,13 +433,25 @@ int cmd_inspect_dump_tree(int argc, char **argv)
 	if (check_argc_exact(argc - optind, 1))
 		usage(cmd_inspect_dump_tree_usage);
 
+	if (json && (extent_only || device_only || roots_only ||
+		     uuid_tree_only)) {
+		error("--json can be combined with --block and --tree only");
+		exit(1);
+	}
+
 	ret = check_arg_type(argv[optind]);
 	if (ret != BTRFS_ARG_BLKDEV && ret != BTRFS_ARG_REG) {
 		error("not a block device or regular file: %s", argv[optind]);
 		goto out;
 	}
 
-	printf("%s\n", PACKAGE_STRING);
+	/* the output can be huge, don't let small writes dominate */
+	outbuf = malloc(DUMP_TREE_OUTBUF_SIZE);
+	if (outbuf)
+		setvbuf(stdout, outbuf, _IOFBF, DUMP_TREE_OUTBUF_SIZE);
+
+	if (!json)
+		printf("%s\n", PACKAGE_STRING);
 
 	info = open_ctree_fs_info(argv[optind], 0, 0, 0, OPEN_CTREE_PARTIAL);
 	if (!info) {
@@ -317,11 +486,25 @@ int cmd_inspect_dump_tree(int argc, char **argv)
 				(unsigned long long)block_only);
 			goto close_root;
 		}
-		btrfs_print_tree(root, leaf, 0);
+		if (json)
+			print_json_block(root, leaf, 0);
+		else
+			btrfs_print_tree(root, leaf, 0);
 		free_extent_buffer(leaf);
 		goto close_root;
 	}
 
+	if (json) {
+		ret = print_json_trees(info, tree_id);
+		if (ret < 0) {
+			error("failed to walk the tree roots: %s",
+				strerror(-ret));
+			close_ctree(root);
+			goto out;
+		}
+		goto close_root;
+	}
+
 	if (!(extent_only || uuid_tree_only || tree_id)) {
 		if (roots_only) {
 			printf("root tree: %llu level %d\n",
@@ -548,5 +731,11 @@ no_node:
 close_root:
 	ret = close_ctree(root);
 out:
+	if (outbuf) {
+		fflush(stdout);
+		setvbuf(stdout, NULL, isatty(STDOUT_FILENO) ? _IOLBF : _IOFBF,
+			BUFSIZ);
+		free(outbuf);
+	}
 	return !!ret;
 }
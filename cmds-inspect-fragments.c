@@ -0,0 +1,1041 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include "kerncompat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+
+#include "ctree.h"
+#include "ioctl.h"
+#include "bitops.h"
+#include "utils.h"
+#include "commands.h"
+#include "cmds-inspect-fragments.h"
+
+/*
+ * Fragmentation analysis streams the extent tree with large tree searches.
+ * A block group item sorts after the extent at the block group start and
+ * before the other extents it contains, the gaps between the extents are
+ * the free space.
+ * Nothing is kept per block group after it has been printed, so the memory
+ * use does not depend on the filesystem size.
+ */
+#define FRAG_SEARCH_BUF_SIZE	(16 * 1024 * 1024)
+
+/* Power of two histogram buckets from 4KiB, the last one is open ended */
+#define FRAG_HIST_MIN_SHIFT	12
+#define FRAG_HIST_BUCKETS	20
+
+/* Upper limit of --files, the heap of files is allocated upfront */
+#define FRAG_MAX_TOP_FILES	(1024 * 1024)
+
+/* Compact image, one pixel covers at least a sector */
+#define FRAG_IMAGE_WIDTH	256
+#define FRAG_IMAGE_MAX_CELLS	(FRAG_IMAGE_WIDTH * FRAG_IMAGE_WIDTH)
+
+enum frag_format {
+	FRAG_FORMAT_TEXT,
+	FRAG_FORMAT_CSV,
+	FRAG_FORMAT_JSON,
+};
+
+struct frag_bg {
+	u64 start;
+	u64 len;
+	u64 flags;
+	u64 used;
+	u64 extents;
+	u64 free_extents;
+	u64 free_bytes;
+	u64 largest_free;
+	/* end of the last allocated extent */
+	u64 last_end;
+	u64 free_hist[FRAG_HIST_BUCKETS];
+
+	/* allocated bytes per image cell */
+	u32 *cells;
+	u64 cell_size;
+	u64 nr_cells;
+};
+
+struct frag_file {
+	u64 ino;
+	u64 fragments;
+	u64 extents;
+	u64 bytes;
+	/* physical end of the last fragment */
+	u64 last_end;
+};
+
+struct frag_ctx {
+	int fd;
+	u64 type_flags;
+	enum frag_format format;
+	unsigned unit_mode;
+	const char *image_dir;
+	u32 nodesize;
+	u32 sectorsize;
+
+	struct frag_bg bg;
+	int have_bg;
+	/* end of the block group being skipped */
+	u64 skip_end;
+	/* the extent at the start of the next block group */
+	u64 pending_start;
+	u64 pending_len;
+	int pending_data;
+	int have_pending;
+
+	/* totals over the analyzed block groups */
+	u64 nr_bgs;
+	u64 total_len;
+	u64 total_used;
+	u64 free_extents;
+	u64 free_bytes;
+	u64 largest_free;
+	u64 free_hist[FRAG_HIST_BUCKETS];
+	u64 data_extents;
+	u64 data_bytes;
+	u64 data_hist[FRAG_HIST_BUCKETS];
+	u64 metadata_extents;
+
+	/* per-file analysis, min-heap of the most fragmented files */
+	struct frag_file file;
+	struct frag_file *top;
+	u64 nr_top;
+	u64 max_top;
+	u64 files;
+	u64 file_fragments;
+};
+
+typedef int (*frag_item_fn)(struct frag_ctx *ctx,
+			    struct btrfs_ioctl_search_key *sk,
+			    struct btrfs_ioctl_search_header *sh, void *item);
+
+static int frag_hist_bucket(u64 len)
+{
+	int bucket = 0;
+
+	len >>= FRAG_HIST_MIN_SHIFT;
+	while (len > 1 && bucket < FRAG_HIST_BUCKETS - 1) {
+		len >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+static double frag_free_fragmentation(u64 free_bytes, u64 largest_free)
+{
+	if (!free_bytes)
+		return 0.0;
+	return 1.0 - (double)largest_free / free_bytes;
+}
+
+static int frag_key_after(struct btrfs_ioctl_search_header *sh,
+			  struct btrfs_ioctl_search_key *sk)
+{
+	if (sh->objectid != sk->min_objectid)
+		return sh->objectid > sk->min_objectid;
+	if (sh->type != sk->min_type)
+		return sh->type > sk->min_type;
+	return sh->offset > sk->min_offset;
+}
+
+/*
+ * Call @fn for all items in the range of @key, TREE_SEARCH_V2 with a large
+ * buffer and v1 as fallback. The callback may move the minimum of the
+ * search key forward to skip items: the rest of the buffer is still passed
+ * to it, the next search starts after the later of that key and the last
+ * item.
+ */
+static int frag_search(struct frag_ctx *ctx, struct btrfs_ioctl_search_key *key,
+		       frag_item_fn fn)
+{
+	struct btrfs_ioctl_search_args_v2 *args2;
+	struct btrfs_ioctl_search_args args;
+	struct btrfs_ioctl_search_key *sk;
+	struct btrfs_ioctl_search_header sh;
+	unsigned long off;
+	u64 buf_size;
+	char *buf;
+	int use_v1 = 0;
+	int ret = 0;
+	int e;
+	int i;
+
+	args2 = malloc(sizeof(*args2) + FRAG_SEARCH_BUF_SIZE);
+	if (!args2) {
+		error("not enough memory");
+		return -ENOMEM;
+	}
+	sk = &args2->key;
+	memcpy(sk, key, sizeof(*sk));
+
+	while (1) {
+		if (!use_v1) {
+			sk->nr_items = (u32)-1;
+			args2->buf_size = FRAG_SEARCH_BUF_SIZE;
+			ret = ioctl(ctx->fd, BTRFS_IOC_TREE_SEARCH_V2, args2);
+			e = errno;
+			if (ret < 0 && (e == ENOTTY || e == EOPNOTSUPP)) {
+				use_v1 = 1;
+				continue;
+			}
+			buf = (char *)args2->buf;
+			buf_size = FRAG_SEARCH_BUF_SIZE;
+		} else {
+			sk->nr_items = 4096;
+			memcpy(&args.key, sk, sizeof(*sk));
+			ret = ioctl(ctx->fd, BTRFS_IOC_TREE_SEARCH, &args);
+			e = errno;
+			memcpy(sk, &args.key, sizeof(*sk));
+			buf = args.buf;
+			buf_size = sizeof(args.buf);
+		}
+		if (ret < 0) {
+			error("cannot search tree %llu: %s",
+				(unsigned long long)sk->tree_id, strerror(e));
+			ret = -e;
+			goto out;
+		}
+		if (sk->nr_items == 0)
+			break;
+
+		off = 0;
+		for (i = 0; i < sk->nr_items; i++) {
+			memcpy(&sh, buf + off, sizeof(sh));
+			off += sizeof(sh);
+			ret = fn(ctx, sk, &sh, buf + off);
+			off += sh.len;
+			if (ret < 0)
+				goto out;
+
+			if (frag_key_after(&sh, sk)) {
+				sk->min_objectid = sh.objectid;
+				sk->min_type = sh.type;
+				sk->min_offset = sh.offset;
+			}
+		}
+
+		/* the search stops early only if the next item does not fit */
+		if (buf_size - off >= sizeof(sh) + BTRFS_MAX_METADATA_BLOCKSIZE)
+			break;
+		if (sk->min_offset < (u64)-1) {
+			sk->min_offset++;
+		} else if (sk->min_type < (u8)-1) {
+			sk->min_type++;
+			sk->min_offset = 0;
+		} else if (sk->min_objectid < (u64)-1) {
+			sk->min_objectid++;
+			sk->min_type = 0;
+			sk->min_offset = 0;
+		} else {
+			break;
+		}
+	}
+out:
+	free(args2);
+	return ret;
+}
+
+static void frag_add_free(struct frag_ctx *ctx, u64 len)
+{
+	struct frag_bg *bg = &ctx->bg;
+	int bucket = frag_hist_bucket(len);
+
+	bg->free_extents++;
+	bg->free_bytes += len;
+	bg->free_hist[bucket]++;
+	if (len > bg->largest_free)
+		bg->largest_free = len;
+
+	ctx->free_extents++;
+	ctx->free_bytes += len;
+	ctx->free_hist[bucket]++;
+	if (len > ctx->largest_free)
+		ctx->largest_free = len;
+}
+
+static void frag_mark_cells(struct frag_bg *bg, u64 start, u64 end)
+{
+	u64 cell;
+	u64 cell_end;
+
+	start -= bg->start;
+	end -= bg->start;
+	while (start < end) {
+		cell = start / bg->cell_size;
+		cell_end = min((cell + 1) * bg->cell_size, end);
+		bg->cells[cell] += cell_end - start;
+		start = cell_end;
+	}
+}
+
+static void frag_account_extent(struct frag_ctx *ctx, u64 bytenr, u64 len,
+				int data)
+{
+	struct frag_bg *bg = &ctx->bg;
+	u64 end = min(bytenr + len, bg->start + bg->len);
+
+	if (bytenr > bg->last_end)
+		frag_add_free(ctx, bytenr - bg->last_end);
+	if (end > bg->last_end)
+		bg->last_end = end;
+	if (bg->cells)
+		frag_mark_cells(bg, bytenr, end);
+	bg->extents++;
+
+	if (data) {
+		ctx->data_extents++;
+		ctx->data_bytes += len;
+		ctx->data_hist[frag_hist_bucket(len)]++;
+	} else {
+		ctx->metadata_extents++;
+	}
+}
+
+/*
+ * Render the block group as a binary PGM image, one pixel per cell, black is
+ * allocated and white is free
+ */
+static int frag_write_image(struct frag_ctx *ctx)
+{
+	struct frag_bg *bg = &ctx->bg;
+	char path[PATH_MAX];
+	u64 height = DIV_ROUND_UP(bg->nr_cells, FRAG_IMAGE_WIDTH);
+	unsigned char *row;
+	FILE *out;
+	u64 cell;
+	u64 y;
+	int x;
+	int ret = 0;
+
+	snprintf(path, sizeof(path), "%s/bg-%llu.pgm", ctx->image_dir,
+		 (unsigned long long)bg->start);
+	out = fopen(path, "w");
+	if (!out) {
+		error("cannot create %s: %s", path, strerror(errno));
+		return -errno;
+	}
+	row = malloc(FRAG_IMAGE_WIDTH);
+	if (!row) {
+		error("not enough memory");
+		fclose(out);
+		return -ENOMEM;
+	}
+
+	fprintf(out, "P5\n%d %llu\n255\n", FRAG_IMAGE_WIDTH,
+		(unsigned long long)height);
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < FRAG_IMAGE_WIDTH; x++) {
+			cell = y * FRAG_IMAGE_WIDTH + x;
+			/* the unused tail of the last row is grey */
+			if (cell >= bg->nr_cells)
+				row[x] = 128;
+			else
+				row[x] = 255 - (u64)bg->cells[cell] * 255 /
+					bg->cell_size;
+		}
+		if (fwrite(row, 1, FRAG_IMAGE_WIDTH, out) != FRAG_IMAGE_WIDTH) {
+			error("cannot write %s: %s", path, strerror(errno));
+			ret = -EIO;
+			break;
+		}
+	}
+	free(row);
+	if (fclose(out) && !ret) {
+		error("cannot write %s: %s", path, strerror(errno));
+		ret = -EIO;
+	}
+	return ret;
+}
+
+static void frag_print_hist_json(const char *name, u64 *hist)
+{
+	int i;
+
+	printf(",\"%s\":[", name);
+	for (i = 0; i < FRAG_HIST_BUCKETS; i++)
+		printf("%s%llu", i ? "," : "", (unsigned long long)hist[i]);
+	printf("]");
+}
+
+static void frag_print_hist_text(const char *title, u64 *hist,
+				 unsigned unit_mode)
+{
+	int i;
+
+	printf("%s:\n", title);
+	for (i = 0; i < FRAG_HIST_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		printf("  %s%10s %12llu\n",
+		       i == FRAG_HIST_BUCKETS - 1 ? ">=" : "  ",
+		       pretty_size_mode(1ULL << (FRAG_HIST_MIN_SHIFT + i),
+					unit_mode),
+		       (unsigned long long)hist[i]);
+	}
+}
+
+static void frag_print_bg_head(struct frag_ctx *ctx)
+{
+	int i;
+
+	switch (ctx->format) {
+	case FRAG_FORMAT_TEXT:
+		printf("%-16s %10s %-8s %-7s %6s %9s %9s %10s %6s\n",
+		       "start", "length", "type", "profile", "used",
+		       "extents", "free-ext", "largest", "frag");
+		break;
+	case FRAG_FORMAT_CSV:
+		printf("record,start,length,type,profile,used,extents,"
+		       "free_extents,free_bytes,largest_free,"
+		       "free_fragmentation");
+		for (i = 0; i < FRAG_HIST_BUCKETS; i++)
+			printf(",free_%llu",
+			       1ULL << (FRAG_HIST_MIN_SHIFT + i));
+		printf("\n");
+		break;
+	case FRAG_FORMAT_JSON:
+		break;
+	}
+}
+
+static void frag_print_bg(struct frag_ctx *ctx)
+{
+	struct frag_bg *bg = &ctx->bg;
+	double frag = frag_free_fragmentation(bg->free_bytes,
+					      bg->largest_free);
+	int i;
+
+	switch (ctx->format) {
+	case FRAG_FORMAT_TEXT:
+		printf("%-16llu %10s %-8s %-7s %5.1f%% %9llu %9llu %10s %5.1f%%\n",
+		       (unsigned long long)bg->start,
+		       pretty_size_mode(bg->len, ctx->unit_mode),
+		       btrfs_group_type_str(bg->flags),
+		       btrfs_group_profile_str(bg->flags),
+		       bg->len ? 100.0 * bg->used / bg->len : 0.0,
+		       (unsigned long long)bg->extents,
+		       (unsigned long long)bg->free_extents,
+		       pretty_size_mode(bg->largest_free, ctx->unit_mode),
+		       100.0 * frag);
+		break;
+	case FRAG_FORMAT_CSV:
+		printf("block_group,%llu,%llu,%s,%s,%llu,%llu,%llu,%llu,%llu,"
+		       "%.4f",
+		       (unsigned long long)bg->start,
+		       (unsigned long long)bg->len,
+		       btrfs_group_type_str(bg->flags),
+		       btrfs_group_profile_str(bg->flags),
+		       (unsigned long long)bg->used,
+		       (unsigned long long)bg->extents,
+		       (unsigned long long)bg->free_extents,
+		       (unsigned long long)bg->free_bytes,
+		       (unsigned long long)bg->largest_free, frag);
+		for (i = 0; i < FRAG_HIST_BUCKETS; i++)
+			printf(",%llu", (unsigned long long)bg->free_hist[i]);
+		printf("\n");
+		break;
+	case FRAG_FORMAT_JSON:
+		printf("{\"record\":\"block_group\",\"start\":%llu,"
+		       "\"length\":%llu,\"type\":\"%s\",\"profile\":\"%s\","
+		       "\"used\":%llu,\"extents\":%llu,\"free_extents\":%llu,"
+		       "\"free_bytes\":%llu,\"largest_free\":%llu,"
+		       "\"free_fragmentation\":%.4f",
+		       (unsigned long long)bg->start,
+		       (unsigned long long)bg->len,
+		       btrfs_group_type_str(bg->flags),
+		       btrfs_group_profile_str(bg->flags),
+		       (unsigned long long)bg->used,
+		       (unsigned long long)bg->extents,
+		       (unsigned long long)bg->free_extents,
+		       (unsigned long long)bg->free_bytes,
+		       (unsigned long long)bg->largest_free, frag);
+		frag_print_hist_json("free_histogram", bg->free_hist);
+		printf("}\n");
+		break;
+	}
+}
+
+static int frag_finish_bg(struct frag_ctx *ctx)
+{
+	struct frag_bg *bg = &ctx->bg;
+	int ret = 0;
+
+	if (!ctx->have_bg)
+		return 0;
+
+	if (bg->start + bg->len > bg->last_end)
+		frag_add_free(ctx, bg->start + bg->len - bg->last_end);
+
+	if (ctx->format == FRAG_FORMAT_TEXT && ctx->nr_bgs == 0)
+		frag_print_bg_head(ctx);
+	frag_print_bg(ctx);
+	if (bg->cells)
+		ret = frag_write_image(ctx);
+
+	ctx->nr_bgs++;
+	ctx->total_len += bg->len;
+	ctx->total_used += bg->used;
+	free(bg->cells);
+	bg->cells = NULL;
+	ctx->have_bg = 0;
+	return ret;
+}
+
+static int frag_start_bg(struct frag_ctx *ctx, u64 start, u64 len, u64 flags,
+			 u64 used)
+{
+	struct frag_bg *bg = &ctx->bg;
+
+	memset(bg, 0, sizeof(*bg));
+	bg->start = start;
+	bg->len = len;
+	bg->flags = flags;
+	bg->used = used;
+	bg->last_end = start;
+
+	if (ctx->image_dir) {
+		bg->cell_size = max_t(u64, ctx->sectorsize,
+				DIV_ROUND_UP(len, FRAG_IMAGE_MAX_CELLS));
+		bg->nr_cells = DIV_ROUND_UP(len, bg->cell_size);
+		bg->cells = calloc(bg->nr_cells, sizeof(u32));
+		if (!bg->cells) {
+			error("not enough memory");
+			return -ENOMEM;
+		}
+	}
+	ctx->have_bg = 1;
+	return 0;
+}
+
+static int frag_extent_tree_item(struct frag_ctx *ctx,
+				 struct btrfs_ioctl_search_key *sk,
+				 struct btrfs_ioctl_search_header *sh,
+				 void *item)
+{
+	struct btrfs_block_group_item *bgi;
+	struct btrfs_extent_item *ei;
+	struct frag_bg *bg = &ctx->bg;
+	u64 flags;
+	u64 len;
+	int data = 0;
+	int ret;
+
+	switch (sh->type) {
+	case BTRFS_BLOCK_GROUP_ITEM_KEY:
+		ret = frag_finish_bg(ctx);
+		if (ret < 0)
+			return ret;
+
+		bgi = item;
+		flags = btrfs_block_group_flags(bgi);
+		if (!(flags & ctx->type_flags)) {
+			/*
+			 * Ignore the extents of this block group and search
+			 * on from the key just before the next one.
+			 */
+			ctx->have_pending = 0;
+			ctx->skip_end = sh->objectid + sh->offset;
+			if (frag_key_after(sh, sk)) {
+				sk->min_objectid = ctx->skip_end - 1;
+				sk->min_type = (u8)-1;
+				sk->min_offset = (u64)-1;
+			}
+			return 0;
+		}
+		ret = frag_start_bg(ctx, sh->objectid, sh->offset, flags,
+				    btrfs_block_group_used(bgi));
+		if (ret < 0)
+			return ret;
+		if (ctx->have_pending && ctx->pending_start == sh->objectid)
+			frag_account_extent(ctx, ctx->pending_start,
+					    ctx->pending_len, ctx->pending_data);
+		else if (ctx->have_pending)
+			warning("extent %llu is without block group",
+				(unsigned long long)ctx->pending_start);
+		ctx->have_pending = 0;
+		break;
+	case BTRFS_EXTENT_ITEM_KEY:
+	case BTRFS_METADATA_ITEM_KEY:
+		if (sh->type == BTRFS_EXTENT_ITEM_KEY) {
+			len = sh->offset;
+			ei = item;
+			if (sh->len >= sizeof(*ei))
+				data = !!(btrfs_stack_extent_flags(ei) &
+					  BTRFS_EXTENT_FLAG_DATA);
+		} else {
+			len = ctx->nodesize;
+		}
+		if (sh->objectid < ctx->skip_end)
+			break;
+		if (ctx->have_bg && sh->objectid >= bg->start &&
+		    sh->objectid < bg->start + bg->len) {
+			frag_account_extent(ctx, sh->objectid, len, data);
+			break;
+		}
+		if (ctx->have_pending)
+			warning("extent %llu is without block group",
+				(unsigned long long)ctx->pending_start);
+		ctx->pending_start = sh->objectid;
+		ctx->pending_len = len;
+		ctx->pending_data = data;
+		ctx->have_pending = 1;
+		break;
+	}
+	return 0;
+}
+
+static int frag_analyze_extent_tree(struct frag_ctx *ctx)
+{
+	struct btrfs_ioctl_search_key key;
+	int ret;
+
+	memset(&key, 0, sizeof(key));
+	key.tree_id = BTRFS_EXTENT_TREE_OBJECTID;
+	key.max_objectid = (u64)-1;
+	key.max_type = (u8)-1;
+	key.max_offset = (u64)-1;
+	key.max_transid = (u64)-1;
+
+	ret = frag_search(ctx, &key, frag_extent_tree_item);
+	if (ret < 0)
+		return ret;
+	return frag_finish_bg(ctx);
+}
+
+static void frag_top_sift_down(struct frag_ctx *ctx, u64 i)
+{
+	struct frag_file tmp;
+	u64 child;
+
+	while (1) {
+		child = 2 * i + 1;
+		if (child >= ctx->nr_top)
+			break;
+		if (child + 1 < ctx->nr_top &&
+		    ctx->top[child + 1].fragments < ctx->top[child].fragments)
+			child++;
+		if (ctx->top[i].fragments <= ctx->top[child].fragments)
+			break;
+		tmp = ctx->top[i];
+		ctx->top[i] = ctx->top[child];
+		ctx->top[child] = tmp;
+		i = child;
+	}
+}
+
+static void frag_top_add(struct frag_ctx *ctx, struct frag_file *file)
+{
+	struct frag_file tmp;
+	u64 i;
+
+	if (ctx->nr_top < ctx->max_top) {
+		i = ctx->nr_top++;
+		ctx->top[i] = *file;
+		while (i > 0 && ctx->top[(i - 1) / 2].fragments >
+				ctx->top[i].fragments) {
+			tmp = ctx->top[i];
+			ctx->top[i] = ctx->top[(i - 1) / 2];
+			ctx->top[(i - 1) / 2] = tmp;
+			i = (i - 1) / 2;
+		}
+	} else if (file->fragments > ctx->top[0].fragments) {
+		ctx->top[0] = *file;
+		frag_top_sift_down(ctx, 0);
+	}
+}
+
+static void frag_finish_file(struct frag_ctx *ctx)
+{
+	struct frag_file *file = &ctx->file;
+
+	if (!file->extents)
+		return;
+	ctx->files++;
+	ctx->file_fragments += file->fragments;
+	if (file->fragments > 1)
+		frag_top_add(ctx, file);
+}
+
+/*
+ * File extents that continue on disk where the previous one ended belong to
+ * the same fragment, compressed extents are always a fragment of their own
+ */
+static int frag_fs_tree_item(struct frag_ctx *ctx,
+			     struct btrfs_ioctl_search_key *sk,
+			     struct btrfs_ioctl_search_header *sh, void *item)
+{
+	struct btrfs_file_extent_item *fi = item;
+	struct frag_file *file = &ctx->file;
+	u64 bytenr;
+	u64 len;
+
+	if (sh->objectid != file->ino) {
+		frag_finish_file(ctx);
+		memset(file, 0, sizeof(*file));
+		file->ino = sh->objectid;
+	}
+	if (sh->type != BTRFS_EXTENT_DATA_KEY)
+		return 0;
+	if (btrfs_stack_file_extent_type(fi) == BTRFS_FILE_EXTENT_INLINE)
+		return 0;
+	bytenr = btrfs_stack_file_extent_disk_bytenr(fi);
+	if (bytenr == 0)
+		return 0;
+	len = btrfs_stack_file_extent_num_bytes(fi);
+	bytenr += btrfs_stack_file_extent_offset(fi);
+
+	file->extents++;
+	file->bytes += len;
+	if (file->fragments && bytenr == file->last_end &&
+	    !btrfs_stack_file_extent_compression(fi)) {
+		file->last_end += len;
+		return 0;
+	}
+	file->fragments++;
+	file->last_end = bytenr + len;
+	return 0;
+}
+
+static int frag_cmp_file(const void *a, const void *b)
+{
+	const struct frag_file *fa = a;
+	const struct frag_file *fb = b;
+
+	if (fa->fragments != fb->fragments)
+		return fa->fragments > fb->fragments ? -1 : 1;
+	if (fa->ino != fb->ino)
+		return fa->ino < fb->ino ? -1 : 1;
+	return 0;
+}
+
+static int frag_analyze_files(struct frag_ctx *ctx)
+{
+	struct btrfs_ioctl_search_key key;
+	int ret;
+
+	ctx->top = calloc(ctx->max_top, sizeof(*ctx->top));
+	if (!ctx->top) {
+		error("not enough memory");
+		return -ENOMEM;
+	}
+
+	/* tree_id 0 is the subvolume of the opened path */
+	memset(&key, 0, sizeof(key));
+	key.min_objectid = BTRFS_FIRST_FREE_OBJECTID;
+	key.min_type = BTRFS_EXTENT_DATA_KEY;
+	key.max_objectid = BTRFS_LAST_FREE_OBJECTID;
+	key.max_type = BTRFS_EXTENT_DATA_KEY;
+	key.max_offset = (u64)-1;
+	key.max_transid = (u64)-1;
+
+	memset(&ctx->file, 0, sizeof(ctx->file));
+	ret = frag_search(ctx, &key, frag_fs_tree_item);
+	if (ret < 0)
+		return ret;
+	frag_finish_file(ctx);
+
+	qsort(ctx->top, ctx->nr_top, sizeof(*ctx->top), frag_cmp_file);
+	return 0;
+}
+
+/* First path of the inode relative to the subvolume, empty if unknown */
+static void frag_ino_path(int fd, u64 ino, char *path, size_t size)
+{
+	struct btrfs_ioctl_ino_path_args ipa;
+	struct btrfs_data_container *fspath;
+	char buf[PATH_MAX + sizeof(*fspath)];
+
+	path[0] = 0;
+	fspath = (struct btrfs_data_container *)buf;
+	memset(fspath, 0, sizeof(*fspath));
+	memset(&ipa, 0, sizeof(ipa));
+	ipa.inum = ino;
+	ipa.size = sizeof(buf);
+	ipa.fspath = ptr_to_u64(fspath);
+
+	if (ioctl(fd, BTRFS_IOC_INO_PATHS, &ipa) < 0 || !fspath->elem_cnt)
+		return;
+	__strncpy_null(path, (char *)fspath->val + fspath->val[0], size);
+}
+
+static void frag_print_files(struct frag_ctx *ctx)
+{
+	char path[PATH_MAX];
+	struct frag_file *file;
+	const char *p;
+	u64 i;
+
+	if (ctx->format == FRAG_FORMAT_TEXT) {
+		printf("Files: %llu, %.2f fragments per file\n",
+		       (unsigned long long)ctx->files,
+		       ctx->files ? (double)ctx->file_fragments / ctx->files : 0.0);
+		if (ctx->nr_top)
+			printf("Most fragmented files:\n%12s %10s %10s  %s\n",
+			       "fragments", "extents", "size", "path");
+	} else if (ctx->format == FRAG_FORMAT_CSV) {
+		printf("record,inode,fragments,extents,bytes,path\n");
+	}
+
+	for (i = 0; i < ctx->nr_top; i++) {
+		file = &ctx->top[i];
+		frag_ino_path(ctx->fd, file->ino, path, sizeof(path));
+
+		switch (ctx->format) {
+		case FRAG_FORMAT_TEXT:
+			printf("%12llu %10llu %10s  ",
+			       (unsigned long long)file->fragments,
+			       (unsigned long long)file->extents,
+			       pretty_size_mode(file->bytes, ctx->unit_mode));
+			if (path[0])
+				printf("%s\n", path);
+			else
+				printf("<inode %llu>\n",
+				       (unsigned long long)file->ino);
+			break;
+		case FRAG_FORMAT_CSV:
+			printf("file,%llu,%llu,%llu,%llu,\"",
+			       (unsigned long long)file->ino,
+			       (unsigned long long)file->fragments,
+			       (unsigned long long)file->extents,
+			       (unsigned long long)file->bytes);
+			for (p = path; *p; p++) {
+				if (*p == '"')
+					putchar('"');
+				putchar(*p);
+			}
+			printf("\"\n");
+			break;
+		case FRAG_FORMAT_JSON:
+			printf("{\"record\":\"file\",\"inode\":%llu,"
+			       "\"fragments\":%llu,\"extents\":%llu,"
+			       "\"bytes\":%llu,\"path\":",
+			       (unsigned long long)file->ino,
+			       (unsigned long long)file->fragments,
+			       (unsigned long long)file->extents,
+			       (unsigned long long)file->bytes);
+			if (path[0])
+				print_json_string(stdout, path);
+			else
+				printf("null");
+			printf("}\n");
+			break;
+		}
+	}
+}
+
+static void frag_print_summary(struct frag_ctx *ctx)
+{
+	double frag = frag_free_fragmentation(ctx->free_bytes,
+					      ctx->largest_free);
+
+	switch (ctx->format) {
+	case FRAG_FORMAT_TEXT:
+		printf("\nBlock groups: %llu, size %s, used %s\n",
+		       (unsigned long long)ctx->nr_bgs,
+		       pretty_size_mode(ctx->total_len, ctx->unit_mode),
+		       pretty_size_mode(ctx->total_used, ctx->unit_mode));
+		printf("Free space: %s in %llu extents, largest %s, "
+		       "fragmentation %.1f%%\n",
+		       pretty_size_mode(ctx->free_bytes, ctx->unit_mode),
+		       (unsigned long long)ctx->free_extents,
+		       pretty_size_mode(ctx->largest_free, ctx->unit_mode),
+		       100.0 * frag);
+		printf("Extents: %llu data (%s), %llu metadata\n",
+		       (unsigned long long)ctx->data_extents,
+		       pretty_size_mode(ctx->data_bytes, ctx->unit_mode),
+		       (unsigned long long)ctx->metadata_extents);
+		frag_print_hist_text("Free extent sizes", ctx->free_hist,
+				     ctx->unit_mode);
+		frag_print_hist_text("Data extent sizes", ctx->data_hist,
+				     ctx->unit_mode);
+		break;
+	case FRAG_FORMAT_CSV:
+		break;
+	case FRAG_FORMAT_JSON:
+		printf("{\"record\":\"summary\",\"block_groups\":%llu,"
+		       "\"length\":%llu,\"used\":%llu,\"free_extents\":%llu,"
+		       "\"free_bytes\":%llu,\"largest_free\":%llu,"
+		       "\"free_fragmentation\":%.4f,\"data_extents\":%llu,"
+		       "\"data_bytes\":%llu,\"metadata_extents\":%llu,"
+		       "\"histogram_min\":%llu",
+		       (unsigned long long)ctx->nr_bgs,
+		       (unsigned long long)ctx->total_len,
+		       (unsigned long long)ctx->total_used,
+		       (unsigned long long)ctx->free_extents,
+		       (unsigned long long)ctx->free_bytes,
+		       (unsigned long long)ctx->largest_free, frag,
+		       (unsigned long long)ctx->data_extents,
+		       (unsigned long long)ctx->data_bytes,
+		       (unsigned long long)ctx->metadata_extents,
+		       1ULL << FRAG_HIST_MIN_SHIFT);
+		frag_print_hist_json("free_histogram", ctx->free_hist);
+		frag_print_hist_json("data_extent_histogram", ctx->data_hist);
+		if (ctx->max_top)
+			printf(",\"files\":%llu,\"file_fragments\":%llu",
+			       (unsigned long long)ctx->files,
+			       (unsigned long long)ctx->file_fragments);
+		printf("}\n");
+		break;
+	}
+}
+
+const char * const cmd_inspect_fragments_usage[] = {
+	"btrfs inspect-internal fragments [options] <path>",
+	"Analyze free space and file fragmentation",
+	"Print per block group free space fragmentation, the largest free",
+	"extent and histograms of the free and data extent sizes. The",
+	"histogram buckets are powers of two starting at 4KiB.",
+	"",
+	"-d                 analyze data block groups",
+	"-m                 analyze metadata block groups",
+	"-s                 analyze system block groups",
+	"                   (default: all)",
+	"--files N          print the N most fragmented files of the subvolume",
+	"                   at <path>",
+	"--image DIR        render each block group as a PGM image to DIR",
+	"--format=text|csv|json",
+	"                   output format, csv and json print sizes in bytes,",
+	"                   the first csv column and the json 'record' field",
+	"                   tell block groups and files apart",
+	HELPINFO_UNITS_LONG,
+	NULL
+};
+
+int cmd_inspect_fragments(int argc, char **argv)
+{
+	struct btrfs_ioctl_fs_info_args fi_args;
+	struct frag_ctx ctx;
+	DIR *dirstream = NULL;
+	char *path;
+	int ret;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.unit_mode = get_unit_mode_from_arg(&argc, argv, 0);
+
+	optind = 1;
+	while (1) {
+		int c;
+		enum {
+			GETOPT_VAL_FILES = 257,
+			GETOPT_VAL_IMAGE,
+			GETOPT_VAL_FORMAT,
+		};
+		static const struct option long_options[] = {
+			{ "files", required_argument, NULL, GETOPT_VAL_FILES },
+			{ "image", required_argument, NULL, GETOPT_VAL_IMAGE },
+			{ "format", required_argument, NULL,
+				GETOPT_VAL_FORMAT },
+			{ NULL, 0, NULL, 0 }
+		};
+
+		c = getopt_long(argc, argv, "dms", long_options, NULL);
+		if (c < 0)
+			break;
+		switch (c) {
+		case 'd':
+			ctx.type_flags |= BTRFS_BLOCK_GROUP_DATA;
+			break;
+		case 'm':
+			ctx.type_flags |= BTRFS_BLOCK_GROUP_METADATA;
+			break;
+		case 's':
+			ctx.type_flags |= BTRFS_BLOCK_GROUP_SYSTEM;
+			break;
+		case GETOPT_VAL_FILES:
+			ctx.max_top = arg_strtou64(optarg);
+			if (ctx.max_top > FRAG_MAX_TOP_FILES) {
+				error("--files is limited to %u files",
+					FRAG_MAX_TOP_FILES);
+				return 1;
+			}
+			break;
+		case GETOPT_VAL_IMAGE:
+			ctx.image_dir = optarg;
+			break;
+		case GETOPT_VAL_FORMAT:
+			if (!strcmp(optarg, "text")) {
+				ctx.format = FRAG_FORMAT_TEXT;
+			} else if (!strcmp(optarg, "csv")) {
+				ctx.format = FRAG_FORMAT_CSV;
+			} else if (!strcmp(optarg, "json")) {
+				ctx.format = FRAG_FORMAT_JSON;
+			} else {
+				error("unknown output format: %s", optarg);
+				usage(cmd_inspect_fragments_usage);
+			}
+			break;
+		default:
+			usage(cmd_inspect_fragments_usage);
+		}
+	}
+	if (check_argc_exact(argc - optind, 1))
+		usage(cmd_inspect_fragments_usage);
+
+	if (!ctx.type_flags)
+		ctx.type_flags = BTRFS_BLOCK_GROUP_DATA |
+				 BTRFS_BLOCK_GROUP_METADATA |
+				 BTRFS_BLOCK_GROUP_SYSTEM;
+
+	path = argv[optind];
+	ctx.fd = btrfs_open_dir(path, &dirstream, 1);
+	if (ctx.fd < 0)
+		return 1;
+
+	ret = ioctl(ctx.fd, BTRFS_IOC_FS_INFO, &fi_args);
+	if (ret < 0) {
+		error("cannot get filesystem info: %s", strerror(errno));
+		ret = 1;
+		goto out;
+	}
+	/* older kernels do not fill the sizes */
+	ctx.nodesize = fi_args.nodesize ? fi_args.nodesize :
+		BTRFS_MKFS_DEFAULT_NODE_SIZE;
+	ctx.sectorsize = fi_args.sectorsize ? fi_args.sectorsize : 4096;
+
+	if (ctx.format == FRAG_FORMAT_CSV)
+		frag_print_bg_head(&ctx);
+
+	ret = frag_analyze_extent_tree(&ctx);
+	if (ret < 0) {
+		ret = 1;
+		goto out;
+	}
+	frag_print_summary(&ctx);
+
+	if (ctx.max_top) {
+		ret = frag_analyze_files(&ctx);
+		if (ret < 0) {
+			ret = 1;
+			goto out;
+		}
+		frag_print_files(&ctx);
+	}
+	ret = 0;
+out:
+	free(ctx.bg.cells);
+	free(ctx.top);
+	close_file_or_dir(ctx.fd, dirstream);
+	return ret;
+}
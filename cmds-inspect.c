@@ -31,8 +31,10 @@
 #include "disk-io.h"
 #include "commands.h"
 #include "btrfs-list.h"
+#include "extent-cache.h"
 #include "cmds-inspect-dump-tree.h"
 #include "cmds-inspect-dump-super.h"
+#include "cmds-inspect-fragments.h"
 
 static const char * const inspect_cmd_group_usage[] = {
 	"btrfs inspect-internal <command> <args>",
@@ -124,9 +126,277 @@ static int cmd_inspect_inode_resolve(int argc, char **argv)
 
 }
 
+/*
+ * Subvolume paths and inode paths resolved in batch mode, the inode paths
+ * are dropped once RESOLVE_MAX_CACHED_INODES of them are cached.
+ */
+#define RESOLVE_MAX_CACHED_INODES	(64 * 1024)
+
+struct resolved_root {
+	struct cache_extent cache;
+	char *path;
+};
+
+struct resolved_inode {
+	struct cache_extent cache;
+	int nr_paths;
+	char **paths;
+	int err;
+};
+
+static void free_resolved_root(struct cache_extent *ce)
+{
+	struct resolved_root *rr;
+
+	rr = container_of(ce, struct resolved_root, cache);
+	free(rr->path);
+	free(rr);
+}
+
+static void free_resolved_inode(struct cache_extent *ce)
+{
+	struct resolved_inode *ri;
+	int i;
+
+	ri = container_of(ce, struct resolved_inode, cache);
+	for (i = 0; i < ri->nr_paths; i++)
+		free(ri->paths[i]);
+	free(ri->paths);
+	free(ri);
+}
+
+FREE_EXTENT_CACHE_BASED_TREE(resolved_root, free_resolved_root);
+FREE_EXTENT_CACHE_BASED_TREE(resolved_inode, free_resolved_inode);
+
+/* Full path of the subvolume with the given id, looked up only once */
+static struct resolved_root *resolve_root_path(struct cache_tree *roots,
+					       int fd, const char *mnt,
+					       u64 root)
+{
+	struct resolved_root *rr;
+	struct cache_extent *ce;
+	char *name;
+
+	ce = lookup_cache_extent(roots, root, 1);
+	if (ce)
+		return container_of(ce, struct resolved_root, cache);
+
+	name = btrfs_list_path_for_root(fd, root);
+	if (IS_ERR(name))
+		return ERR_PTR(PTR_ERR(name));
+	rr = calloc(1, sizeof(*rr));
+	if (!rr) {
+		free(name);
+		return ERR_PTR(-ENOMEM);
+	}
+	rr->path = malloc(strlen(mnt) + (name ? strlen(name) : 0) + 2);
+	if (!rr->path) {
+		free(rr);
+		free(name);
+		return ERR_PTR(-ENOMEM);
+	}
+	if (name)
+		sprintf(rr->path, "%s/%s", mnt, name);
+	else
+		strcpy(rr->path, mnt);
+	free(name);
+	rr->cache.start = root;
+	rr->cache.size = 1;
+	insert_cache_extent(roots, &rr->cache);
+	return rr;
+}
+
+/* All paths of an inode in a subvolume, looked up only once */
+static struct resolved_inode *resolve_inode_paths(struct cache_tree *inodes,
+		u64 *nr_inodes, struct cache_tree *roots, int fd,
+		const char *mnt, u64 root, u64 inum,
+		struct btrfs_data_container *fspath, u64 size)
+{
+	struct btrfs_ioctl_ino_path_args ipa;
+	struct resolved_inode *ri;
+	struct resolved_root *rr;
+	struct cache_extent *ce;
+	DIR *dirs = NULL;
+	int path_fd;
+	int ret;
+	int i;
+
+	ce = lookup_cache_extent2(inodes, root, inum, 1);
+	if (ce)
+		return container_of(ce, struct resolved_inode, cache);
+	if (*nr_inodes >= RESOLVE_MAX_CACHED_INODES) {
+		free_resolved_inode_tree(inodes);
+		*nr_inodes = 0;
+	}
+
+	ri = calloc(1, sizeof(*ri));
+	if (!ri)
+		return ERR_PTR(-ENOMEM);
+	ri->cache.objectid = root;
+	ri->cache.start = inum;
+	ri->cache.size = 1;
+
+	rr = resolve_root_path(roots, fd, mnt, root);
+	if (IS_ERR(rr)) {
+		ri->err = PTR_ERR(rr);
+		goto out;
+	}
+	path_fd = open_file_or_dir(rr->path, &dirs);
+	if (path_fd < 0) {
+		ri->err = -errno;
+		goto out;
+	}
+
+	memset(fspath, 0, sizeof(*fspath));
+	ipa.inum = inum;
+	ipa.size = size;
+	ipa.fspath = ptr_to_u64(fspath);
+	ret = ioctl(path_fd, BTRFS_IOC_INO_PATHS, &ipa);
+	if (ret < 0)
+		ri->err = -errno;
+	close_file_or_dir(path_fd, dirs);
+	if (ri->err)
+		goto out;
+
+	ri->paths = calloc(fspath->elem_cnt, sizeof(char *));
+	if (fspath->elem_cnt && !ri->paths) {
+		ri->err = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < fspath->elem_cnt; i++) {
+		char *str = (char *)fspath->val + fspath->val[i];
+
+		ri->paths[i] = malloc(strlen(rr->path) + strlen(str) + 2);
+		if (!ri->paths[i]) {
+			ri->err = -ENOMEM;
+			break;
+		}
+		sprintf(ri->paths[i], "%s/%s", rr->path, str);
+		ri->nr_paths++;
+	}
+out:
+	insert_cache_extent2(inodes, &ri->cache);
+	(*nr_inodes)++;
+	return ri;
+}
+
+static void print_resolve_error(u64 logical, int err)
+{
+	printf("{\"logical\":%llu,\"error\":", (unsigned long long)logical);
+	print_json_string(stdout, strerror(-err));
+	printf("}\n");
+}
+
+/*
+ * Resolve logical addresses read from stdin. The paths of subvolumes and
+ * inodes are cached, so addresses in the same files cost one LOGICAL_INO
+ * ioctl each.
+ */
+static int logical_resolve_batch(int fd, const char *mnt, u64 size,
+				 int getpath)
+{
+	struct btrfs_ioctl_logical_ino_args loi;
+	struct btrfs_data_container *inodes;
+	struct btrfs_data_container *fspath;
+	struct cache_tree roots;
+	struct cache_tree inode_paths;
+	u64 nr_inode_paths = 0;
+	char *line = NULL;
+	size_t alloc = 0;
+	ssize_t len;
+	u64 logical;
+	int err = 0;
+	int ret;
+	int i;
+	int j;
+
+	inodes = malloc(size);
+	fspath = malloc(64 * 1024);
+	if (!inodes || !fspath) {
+		free(inodes);
+		free(fspath);
+		return -ENOMEM;
+	}
+	cache_tree_init(&roots);
+	cache_tree_init(&inode_paths);
+
+	while ((len = getline(&line, &alloc, stdin)) != -1) {
+		if (len && line[len - 1] == '\n')
+			line[len - 1] = 0;
+		if (line[0] == 0 || line[0] == '#')
+			continue;
+		if (parse_u64_line(line, &logical, 1) != 1) {
+			printf("{\"error\":\"invalid input\",\"input\":");
+			print_json_string(stdout, line);
+			printf("}\n");
+			err = 1;
+			continue;
+		}
+
+		memset(inodes, 0, sizeof(*inodes));
+		loi.logical = logical;
+		loi.size = size;
+		loi.inodes = ptr_to_u64(inodes);
+		ret = ioctl(fd, BTRFS_IOC_LOGICAL_INO, &loi);
+		if (ret < 0) {
+			print_resolve_error(logical, -errno);
+			err = 1;
+			continue;
+		}
+
+		/* keep one record per input line at least */
+		if (!inodes->elem_cnt)
+			printf("{\"logical\":%llu,\"inodes\":0}\n", logical);
+
+		for (i = 0; i < inodes->elem_cnt; i += 3) {
+			u64 inum = inodes->val[i];
+			u64 offset = inodes->val[i + 1];
+			u64 root = inodes->val[i + 2];
+			struct resolved_inode *ri;
+
+			if (!getpath) {
+				printf("{\"logical\":%llu,\"inode\":%llu,"
+				       "\"offset\":%llu,\"root\":%llu}\n",
+				       logical, inum, offset, root);
+				continue;
+			}
+			ri = resolve_inode_paths(&inode_paths, &nr_inode_paths,
+						 &roots, fd, mnt, root, inum,
+						 fspath, 64 * 1024);
+			if (IS_ERR(ri) || ri->err) {
+				print_resolve_error(logical, IS_ERR(ri) ?
+						    PTR_ERR(ri) : ri->err);
+				err = 1;
+				continue;
+			}
+			if (!ri->nr_paths)
+				printf("{\"logical\":%llu,\"inode\":%llu,"
+				       "\"offset\":%llu,\"root\":%llu,"
+				       "\"path\":null}\n",
+				       logical, inum, offset, root);
+			for (j = 0; j < ri->nr_paths; j++) {
+				printf("{\"logical\":%llu,\"inode\":%llu,"
+				       "\"offset\":%llu,\"root\":%llu,"
+				       "\"path\":", logical, inum, offset, root);
+				print_json_string(stdout, ri->paths[j]);
+				printf("}\n");
+			}
+		}
+	}
+
+	free(line);
+	free_resolved_inode_tree(&inode_paths);
+	free_resolved_root_tree(&roots);
+	free(inodes);
+	free(fspath);
+	return err;
+}
+
 static const char * const cmd_inspect_logical_resolve_usage[] = {
 	"btrfs inspect-internal logical-resolve [-Pv] [-s bufsize] <logical> <path>",
 	"Get file system paths for the given logical address",
+	"If <logical> is -, addresses are read from stdin, one per line, and",
+	"the results are printed as JSON lines.",
 	"-P          skip the path resolving and print the inodes instead",
 	"-v          verbose mode",
 	"-s bufsize  set inode container's size. This is used to increase inode",
@@ -175,6 +445,18 @@ static int cmd_inspect_logical_resolve(int argc, char **argv)
 		usage(cmd_inspect_logical_resolve_usage);
 
 	size = min(size, (u64)64 * 1024);
+
+	if (!strcmp(argv[optind], "-")) {
+		fd = btrfs_open_dir(argv[optind + 1], &dirstream, 1);
+		if (fd < 0)
+			return 1;
+		ret = logical_resolve_batch(fd, argv[optind + 1], size, getpath);
+		if (ret < 0)
+			error("batch resolve failed: %s", strerror(-ret));
+		close_file_or_dir(fd, dirstream);
+		return !!ret;
+	}
+
 	inodes = malloc(size);
 	if (!inodes)
 		return 1;
@@ -640,6 +922,8 @@ const struct cmd_group inspect_cmd_group = {
 				cmd_inspect_dump_tree_usage, NULL, 0 },
 		{ "dump-super", cmd_inspect_dump_super,
 				cmd_inspect_dump_super_usage, NULL, 0 },
+		{ "fragments", cmd_inspect_fragments,
+				cmd_inspect_fragments_usage, NULL, 0 },
 		NULL_CMD_STRUCT
 	}
 };
@@ -273,7 +273,8 @@ static int cmd_qgroup_destroy(int argc, char **argv)
 
 static const char * const cmd_qgroup_show_usage[] = {
 	"btrfs qgroup show -pcreFf "
-	"[--sort=qgroupid,rfer,excl,max_rfer,max_excl] <path>",
+	"[--sort=qgroupid,rfer,excl,max_rfer,max_excl] "
+	"[--format=table|csv|json] <path>",
 	"Show subvolume quota groups.",
 	"-p             print parent qgroup id",
 	"-c             print child qgroup id",
@@ -288,6 +289,10 @@ static const char * const cmd_qgroup_show_usage[] = {
 	"               list qgroups sorted by specified items",
 	"               you can use '+' or '-' in front of each item.",
 	"               (+:ascending, -:descending, ascending default)",
+	"--format=table|csv|json",
+	"               output format, csv prints the selected columns with",
+	"               sizes in bytes, json prints one object per qgroup",
+	"               with all fields",
 	NULL
 };
 
@@ -312,8 +317,10 @@ static int cmd_qgroup_show(int argc, char **argv)
 	optind = 1;
 	while (1) {
 		int c;
+		enum { GETOPT_VAL_FORMAT = 257 };
 		static const struct option long_options[] = {
 			{"sort", required_argument, NULL, 'S'},
+			{"format", required_argument, NULL, GETOPT_VAL_FORMAT},
 			{ NULL, 0, NULL, 0 }
 		};
 
@@ -349,6 +356,21 @@ static int cmd_qgroup_show(int argc, char **argv)
 			if (ret)
 				usage(cmd_qgroup_show_usage);
 			break;
+		case GETOPT_VAL_FORMAT:
+			if (!strcmp(optarg, "table")) {
+				btrfs_qgroup_setup_format(
+					BTRFS_QGROUP_FORMAT_TABLE);
+			} else if (!strcmp(optarg, "csv")) {
+				btrfs_qgroup_setup_format(
+					BTRFS_QGROUP_FORMAT_CSV);
+			} else if (!strcmp(optarg, "json")) {
+				btrfs_qgroup_setup_format(
+					BTRFS_QGROUP_FORMAT_JSON);
+			} else {
+				error("unknown output format: %s", optarg);
+				usage(cmd_qgroup_show_usage);
+			}
+			break;
 		default:
 			usage(cmd_qgroup_show_usage);
 		}
@@ -37,9 +37,10 @@
 #include "disk-io.h"
 
 #include "commands.h"
+#include "telemetry.h"
 
-
-static int print_replace_status(int fd, const char *path, int once);
+static int print_replace_status(int fd, const char *path, int once,
+				struct telemetry *tm);
 static char *time2string(char *buf, size_t s, __u64 t);
 static char *progress2string(char *buf, size_t s, int progress_1000);
 
@@ -87,6 +88,78 @@ static int dev_replace_handle_sigint(int fd)
 	return sigaction(SIGINT, &sa, NULL);
 }
 
+struct replace_telemetry {
+	int fd;
+	u64 srcdev_size;
+	u64 last_progress;
+	double t_start;
+};
+
+static const char *replace_state2string(u64 state)
+{
+	switch (state) {
+	case BTRFS_IOCTL_DEV_REPLACE_STATE_NEVER_STARTED:
+		return "never started";
+	case BTRFS_IOCTL_DEV_REPLACE_STATE_STARTED:
+		return "running";
+	case BTRFS_IOCTL_DEV_REPLACE_STATE_FINISHED:
+		return "finished";
+	case BTRFS_IOCTL_DEV_REPLACE_STATE_CANCELED:
+		return "canceled";
+	case BTRFS_IOCTL_DEV_REPLACE_STATE_SUSPENDED:
+		return "suspended";
+	default:
+		return "unknown";
+	}
+}
+
+/*
+ * The kernel reports the progress in 1/1000 of the source device, the rate
+ * and ETA are computed from that.
+ */
+static void telemetry_replace_status(struct telemetry *tm,
+		struct btrfs_ioctl_dev_replace_status_params *status,
+		u64 last_progress, double elapsed, u64 srcdev_size)
+{
+	telemetry_str(tm, "state", replace_state2string(status->replace_state));
+	telemetry_u64(tm, "progress_1000", status->progress_1000);
+	if (srcdev_size) {
+		telemetry_u64(tm, "bytes_done",
+			      srcdev_size / 1000 * status->progress_1000);
+		telemetry_u64(tm, "bytes_total", srcdev_size);
+	}
+	telemetry_rate(tm, status->progress_1000, last_progress, 1000, elapsed);
+	telemetry_u64(tm, "write_errors", status->num_write_errors);
+	telemetry_u64(tm, "uncorrectable_read_errors",
+		      status->num_uncorrectable_read_errors);
+	telemetry_u64(tm, "time_started", status->time_started);
+	if (status->time_stopped)
+		telemetry_u64(tm, "time_stopped", status->time_stopped);
+}
+
+static void replace_telemetry_sample(struct telemetry *tm, const char *event)
+{
+	struct replace_telemetry *rt = tm->data;
+	struct btrfs_ioctl_dev_replace_args args = {0};
+	double now = telemetry_now();
+
+	/* the status would still show the previous replace */
+	if (!strcmp(event, "start"))
+		return;
+
+	args.cmd = BTRFS_IOCTL_DEV_REPLACE_CMD_STATUS;
+	args.result = BTRFS_IOCTL_DEV_REPLACE_RESULT_NO_RESULT;
+	if (ioctl(rt->fd, BTRFS_IOC_DEV_REPLACE, &args) < 0)
+		return;
+
+	telemetry_begin(tm, "replace", event);
+	telemetry_u64(tm, "elapsed", now - rt->t_start);
+	telemetry_replace_status(tm, &args.status, rt->last_progress,
+				 now - tm->last_time, rt->srcdev_size);
+	telemetry_end(tm);
+	rt->last_progress = args.status.progress_1000;
+}
+
 static const char *const cmd_replace_start_usage[] = {
 	"btrfs replace start [-Bfr] <srcdev>|<devid> <targetdev> <mount_point>",
 	"Replace device of a btrfs filesystem.",
@@ -110,6 +183,7 @@ static const char *const cmd_replace_start_usage[] = {
 	"       correct checksum. Devices which are currently mounted are",
 	"       never allowed to be used as the <targetdev>",
 	"-B     do not background",
+	TELEMETRY_USAGE,
 	NULL
 };
 
@@ -118,6 +192,7 @@ static int cmd_replace_start(int argc, char **argv)
 	struct btrfs_ioctl_dev_replace_args start_args = {0};
 	struct btrfs_ioctl_dev_replace_args status_args = {0};
 	int ret;
+	int e;
 	int i;
 	int c;
 	int fdmnt = -1;
@@ -132,8 +207,21 @@ static int cmd_replace_start(int argc, char **argv)
 	DIR *dirstream = NULL;
 	u64 srcdev_size;
 	u64 dstdev_size;
+	struct telemetry tm;
+	struct replace_telemetry rt = { 0 };
+	static const struct option long_options[] = {
+		TELEMETRY_LONG_OPTIONS,
+		{ NULL, 0, NULL, 0 }
+	};
 
-	while ((c = getopt(argc, argv, "Brf")) != -1) {
+	telemetry_init(&tm);
+	while ((c = getopt_long(argc, argv, "Brf", long_options,
+				NULL)) != -1) {
+		ret = telemetry_parse_opt(&tm, c, optarg);
+		if (ret < 0)
+			goto leave_with_error;
+		if (ret)
+			continue;
 		switch (c) {
 		case 'B':
 			do_not_background = 1;
@@ -156,6 +244,12 @@ static int cmd_replace_start(int argc, char **argv)
 		 BTRFS_IOCTL_DEV_REPLACE_CONT_READING_FROM_SRCDEV_MODE_ALWAYS;
 	if (check_argc_exact(argc - optind, 3))
 		usage(cmd_replace_start_usage);
+
+	/* nobody reads a descriptor of the caller once we have detached */
+	if (!do_not_background && tm.out_is_fd) {
+		error("--telemetry to a file descriptor requires -B");
+		goto leave_with_error;
+	}
 	path = argv[optind + 2];
 
 	fdmnt = open_path_or_dev_mnt(path, &dirstream, 1);
@@ -272,21 +366,30 @@ static int cmd_replace_start(int argc, char **argv)
 		}
 	}
 
+	rt.fd = fdmnt;
+	rt.srcdev_size = srcdev_size;
+	rt.t_start = telemetry_now();
+	if (telemetry_start(&tm, replace_telemetry_sample, &rt))
+		warning("cannot start telemetry");
+
 	start_args.cmd = BTRFS_IOCTL_DEV_REPLACE_CMD_START;
 	start_args.result = BTRFS_IOCTL_DEV_REPLACE_RESULT_NO_RESULT;
 	ret = ioctl(fdmnt, BTRFS_IOC_DEV_REPLACE, &start_args);
+	e = errno;
+	telemetry_stop(&tm, "finished");
+	telemetry_close(&tm);
 	if (do_not_background) {
 		if (ret < 0) {
 			fprintf(stderr,
 				"ERROR: ioctl(DEV_REPLACE_START) failed on \"%s\": %s",
-				path, strerror(errno));
+				path, strerror(e));
 			if (start_args.result != BTRFS_IOCTL_DEV_REPLACE_RESULT_NO_RESULT)
 				fprintf(stderr, ", %s\n",
 					replace_dev_result2string(start_args.result));
 			else
 				fprintf(stderr, "\n");
 
-			if (errno == EOPNOTSUPP)
+			if (e == EOPNOTSUPP)
 				warning("device replace of RAID5/6 not supported with this kernel");
 
 			goto leave_with_error;
@@ -304,6 +407,8 @@ static int cmd_replace_start(int argc, char **argv)
 	return 0;
 
 leave_with_error:
+	telemetry_stop(&tm, "finished");
+	telemetry_close(&tm);
 	if (dstdev)
 		free(dstdev);
 	if (fdmnt != -1)
@@ -320,6 +425,7 @@ static const char *const cmd_replace_status_usage[] = {
 	"",
 	"-1     print once instead of print continuously until the replace",
 	"       operation finishes (or is canceled)",
+	TELEMETRY_USAGE,
 	NULL
 };
 
@@ -331,8 +437,20 @@ static int cmd_replace_status(int argc, char **argv)
 	int once = 0;
 	int ret;
 	DIR *dirstream = NULL;
+	struct telemetry tm;
+	static const struct option long_options[] = {
+		TELEMETRY_LONG_OPTIONS,
+		{ NULL, 0, NULL, 0 }
+	};
 
-	while ((c = getopt(argc, argv, "1")) != -1) {
+	telemetry_init(&tm);
+	while ((c = getopt_long(argc, argv, "1", long_options,
+				NULL)) != -1) {
+		ret = telemetry_parse_opt(&tm, c, optarg);
+		if (ret < 0)
+			return 1;
+		if (ret)
+			continue;
 		switch (c) {
 		case '1':
 			once = 1;
@@ -348,15 +466,19 @@ static int cmd_replace_status(int argc, char **argv)
 
 	path = argv[optind];
 	fd = btrfs_open_dir(path, &dirstream, 1);
-	if (fd < 0)
+	if (fd < 0) {
+		telemetry_close(&tm);
 		return 1;
+	}
 
-	ret = print_replace_status(fd, path, once);
+	ret = print_replace_status(fd, path, once, &tm);
 	close_file_or_dir(fd, dirstream);
+	telemetry_close(&tm);
 	return !!ret;
 }
 
-static int print_replace_status(int fd, const char *path, int once)
+static int print_replace_status(int fd, const char *path, int once,
+				struct telemetry *tm)
 {
 	struct btrfs_ioctl_dev_replace_args args = {0};
 	struct btrfs_ioctl_dev_replace_status_params *status;
@@ -367,6 +489,8 @@ static int print_replace_status(int fd, const char *path, int once)
 	char string1[80];
 	char string2[80];
 	char string3[80];
+	u64 last_progress = 0;
+	double elapsed;
 
 	for (;;) {
 		args.cmd = BTRFS_IOCTL_DEV_REPLACE_CMD_STATUS;
@@ -392,6 +516,20 @@ static int print_replace_status(int fd, const char *path, int once)
 
 		status = &args.status;
 
+		/* the last status is always written */
+		if (telemetry_due(tm) || (telemetry_enabled(tm) &&
+		    (once || status->replace_state !=
+			     BTRFS_IOCTL_DEV_REPLACE_STATE_STARTED))) {
+			elapsed = 0;
+			if (tm->last_time)
+				elapsed = telemetry_now() - tm->last_time;
+			telemetry_begin(tm, "replace", "status");
+			telemetry_replace_status(tm, status, last_progress,
+						 elapsed, 0);
+			telemetry_end(tm);
+			last_progress = status->progress_1000;
+		}
+
 		skip_stats = 0;
 		num_chars = 0;
 		switch (status->replace_state) {
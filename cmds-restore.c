@@ -931,6 +931,7 @@ static int search_dir(struct btrfs_root *root, struct btrfs_key *key,
 		      const regex_t *mreg)
 {
 	struct btrfs_path *path;
+	struct btrfs_prefetch prefetch;
 	struct extent_buffer *leaf;
 	struct btrfs_dir_item *dir_item;
 	struct btrfs_key found_key, location;
@@ -951,6 +952,13 @@ static int search_dir(struct btrfs_root *root, struct btrfs_key *key,
 	key->offset = 0;
 	key->type = BTRFS_DIR_INDEX_KEY;
 
+	/* keep the leaves holding the rest of the directory hinted */
+	btrfs_prefetch_init(&prefetch, root, root->node);
+	prefetch.min_key = *key;
+	prefetch.max_key = *key;
+	prefetch.max_key.offset = (u64)-1;
+	btrfs_prefetch_update(&prefetch, key);
+
 	ret = btrfs_search_slot(NULL, root, key, path, 0, 0);
 	if (ret < 0) {
 		fprintf(stderr, "Error searching %d\n", ret);
@@ -989,6 +997,11 @@ static int search_dir(struct btrfs_root *root, struct btrfs_key *key,
 		}
 
 		if (path->slots[0] >= btrfs_header_nritems(leaf)) {
+			if (btrfs_header_nritems(leaf)) {
+				btrfs_item_key_to_cpu(leaf, &found_key,
+					btrfs_header_nritems(leaf) - 1);
+				btrfs_prefetch_update(&prefetch, &found_key);
+			}
 			do {
 				ret = next_leaf(root, path);
 				if (ret < 0) {
@@ -1153,6 +1166,7 @@ static int search_dir(struct btrfs_root *root, struct btrfs_key *key,
 			if (ret < 0) {
 				if (ignore_errors)
 					goto next;
+				btrfs_prefetch_release(&prefetch);
 				btrfs_free_path(path);
 				return ret;
 			}
@@ -1186,6 +1200,7 @@ next:
 	if (verbose)
 		printf("Done searching %s\n", in_dir);
 out:
+	btrfs_prefetch_release(&prefetch);
 	btrfs_free_path(path);
 	return ret;
 }
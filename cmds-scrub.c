@@ -23,6 +23,7 @@
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/sysmacros.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/syscall.h>
@@ -44,6 +45,7 @@
 #include "disk-io.h"
 
 #include "commands.h"
+#include "telemetry.h"
 
 static const char * const scrub_cmd_group_usage[] = {
 	"btrfs scrub <command> [options] <path>|<device>",
@@ -52,6 +54,7 @@ static const char * const scrub_cmd_group_usage[] = {
 
 #define SCRUB_DATA_FILE "/var/lib/btrfs/scrub.status"
 #define SCRUB_PROGRESS_SOCKET_PATH "/var/lib/btrfs/scrub.progress"
+#define SCRUB_CHUNK_LOG "/var/lib/btrfs/scrub.chunks"
 #define SCRUB_FILE_VERSION_PREFIX "scrub status"
 #define SCRUB_FILE_VERSION "1"
 
@@ -84,6 +87,12 @@ struct scrub_progress {
 	pthread_mutex_t progress_mutex;
 	int ioprio_class;
 	int ioprio_classdata;
+	/* chunked scrub, progress of the finished ranges */
+	struct scrub_sched *sched;
+	struct btrfs_scrub_progress done;
+	/* number of ranges merged into @done */
+	u64 nr_done;
+	const char *dev_path;
 };
 
 struct scrub_file_record {
@@ -302,12 +311,15 @@ static void free_history(struct scrub_file_record **last_scrubs)
  * progress status before exiting.
  */
 static int cancel_fd = -1;
+static volatile sig_atomic_t scrub_cancel_requested;
 static void scrub_sigint_record_progress(int signal)
 {
 	int ret;
 
+	/* stops the chunked scrub between two ranges */
+	scrub_cancel_requested = 1;
 	ret = ioctl(cancel_fd, BTRFS_IOC_SCRUB_CANCEL, NULL);
-	if (ret < 0)
+	if (ret < 0 && errno != ENOTCONN)
 		perror("Scrub cancel failed");
 }
 
@@ -863,6 +875,370 @@ static void *scrub_one_dev(void *ctx)
 	return NULL;
 }
 
+/*
+ * Chunked scrub: instead of one ioctl over the whole device, each device is
+ * scrubbed in ranges of whole device extents. After each range the
+ * throughput and the average I/O time of the device are measured, the next
+ * range is sized to take about SCRUB_CHUNK_SECONDS, and the number of devices
+ * scrubbed at the same time is lowered when the latency budget is exceeded.
+ * Finished ranges are appended to a log so that resume does not repeat them.
+ */
+#define SCRUB_CHUNK_SECONDS	10
+#define SCRUB_CHUNK_MIN		(64ULL * 1024 * 1024)
+#define SCRUB_CHUNK_MAX		(64ULL * 1024 * 1024 * 1024)
+#define SCRUB_CHUNK_DEFAULT	(1024ULL * 1024 * 1024)
+
+struct scrub_sched {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* devices scrubbing now and how many may */
+	int active;
+	int allowed;
+	int ndev;
+	/* bytes per second and device, 0 for no limit */
+	u64 rate_limit;
+	/* average I/O time budget in milliseconds, 0 for none */
+	u64 latency_ms;
+	u64 chunk_size;
+	int log_fd;
+};
+
+struct scrub_dev_extent {
+	u64 offset;
+	u64 length;
+};
+
+static void scrub_add_progress(struct btrfs_scrub_progress *acc,
+			       const struct btrfs_scrub_progress *p)
+{
+	acc->data_extents_scrubbed += p->data_extents_scrubbed;
+	acc->tree_extents_scrubbed += p->tree_extents_scrubbed;
+	acc->data_bytes_scrubbed += p->data_bytes_scrubbed;
+	acc->tree_bytes_scrubbed += p->tree_bytes_scrubbed;
+	acc->read_errors += p->read_errors;
+	acc->csum_errors += p->csum_errors;
+	acc->verify_errors += p->verify_errors;
+	acc->no_csum += p->no_csum;
+	acc->csum_discards += p->csum_discards;
+	acc->super_errors += p->super_errors;
+	acc->malloc_errors += p->malloc_errors;
+	acc->uncorrectable_errors += p->uncorrectable_errors;
+	acc->corrected_errors += p->corrected_errors;
+	acc->unverified_errors += p->unverified_errors;
+	acc->last_physical = max(acc->last_physical, p->last_physical);
+}
+
+/* Completed I/Os and milliseconds spent on them, from /proc/diskstats */
+static int read_diskstats(dev_t devt, u64 *ios, u64 *ticks)
+{
+	unsigned long long rd, rd_merged, rd_sectors, rd_ticks;
+	unsigned long long wr, wr_merged, wr_sectors, wr_ticks;
+	unsigned int maj, mnr;
+	char line[256];
+	char name[64];
+	FILE *f;
+	int ret = -ENOENT;
+
+	f = fopen("/proc/diskstats", "r");
+	if (!f)
+		return -errno;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%u %u %63s %llu %llu %llu %llu %llu %llu %llu %llu",
+			   &maj, &mnr, name, &rd, &rd_merged, &rd_sectors,
+			   &rd_ticks, &wr, &wr_merged, &wr_sectors,
+			   &wr_ticks) != 11)
+			continue;
+		if (maj != major(devt) || mnr != minor(devt))
+			continue;
+		*ios = rd + wr;
+		*ticks = rd_ticks + wr_ticks;
+		ret = 0;
+		break;
+	}
+	fclose(f);
+	return ret;
+}
+
+static int scrub_load_dev_extents(int fd, u64 devid,
+				  struct scrub_dev_extent **extents, int *nr)
+{
+	struct btrfs_ioctl_search_args args;
+	struct btrfs_ioctl_search_key *sk = &args.key;
+	struct btrfs_ioctl_search_header sh;
+	struct scrub_dev_extent *ext = NULL;
+	int alloc = 0;
+	unsigned long off;
+	int ret;
+	int i;
+
+	*nr = 0;
+	memset(&args, 0, sizeof(args));
+	sk->tree_id = BTRFS_DEV_TREE_OBJECTID;
+	sk->min_objectid = devid;
+	sk->max_objectid = devid;
+	sk->min_type = BTRFS_DEV_EXTENT_KEY;
+	sk->max_type = BTRFS_DEV_EXTENT_KEY;
+	sk->max_offset = (u64)-1;
+	sk->max_transid = (u64)-1;
+
+	while (1) {
+		sk->nr_items = 4096;
+		ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args);
+		if (ret < 0) {
+			ret = -errno;
+			goto fail;
+		}
+		if (sk->nr_items == 0)
+			break;
+		off = 0;
+		for (i = 0; i < sk->nr_items; i++) {
+			struct btrfs_dev_extent *de;
+
+			memcpy(&sh, args.buf + off, sizeof(sh));
+			off += sizeof(sh);
+			de = (struct btrfs_dev_extent *)(args.buf + off);
+			off += sh.len;
+			sk->min_offset = sh.offset;
+			if (sh.type != BTRFS_DEV_EXTENT_KEY)
+				continue;
+			if (*nr == alloc) {
+				struct scrub_dev_extent *tmp;
+
+				alloc = max(alloc * 2, 64);
+				tmp = realloc(ext, alloc * sizeof(*ext));
+				if (!tmp) {
+					ret = -ENOMEM;
+					goto fail;
+				}
+				ext = tmp;
+			}
+			ext[*nr].offset = sh.offset;
+			ext[*nr].length = btrfs_stack_dev_extent_length(de);
+			(*nr)++;
+		}
+		if (sk->min_offset == (u64)-1)
+			break;
+		sk->min_offset++;
+	}
+	*extents = ext;
+	return 0;
+fail:
+	free(ext);
+	*nr = 0;
+	return ret;
+}
+
+static void scrub_sched_get(struct scrub_sched *sched)
+{
+	pthread_mutex_lock(&sched->lock);
+	while (sched->active >= sched->allowed)
+		pthread_cond_wait(&sched->cond, &sched->lock);
+	sched->active++;
+	pthread_mutex_unlock(&sched->lock);
+}
+
+static void scrub_sched_put(struct scrub_sched *sched, int over_budget)
+{
+	pthread_mutex_lock(&sched->lock);
+	sched->active--;
+	if (sched->latency_ms) {
+		if (over_budget)
+			sched->allowed = max(1, sched->allowed / 2);
+		else if (sched->allowed < sched->ndev)
+			sched->allowed++;
+	}
+	pthread_cond_broadcast(&sched->cond);
+	pthread_mutex_unlock(&sched->lock);
+}
+
+/* Sleep in small steps, so that a cancel request is noticed */
+static void scrub_sched_sleep(double seconds)
+{
+	while (seconds > 0 && !scrub_cancel_requested) {
+		double step = min(seconds, 0.1);
+
+		usleep(step * 1000000);
+		seconds -= step;
+	}
+}
+
+static void scrub_log_chunk(struct scrub_sched *sched, u64 devid, u64 start,
+			    u64 end, u64 bytes, double seconds)
+{
+	char buf[128];
+	int len;
+
+	if (sched->log_fd < 0)
+		return;
+	len = snprintf(buf, sizeof(buf), "%llu %llu %llu %llu %llu\n",
+		       (unsigned long long)devid, (unsigned long long)start,
+		       (unsigned long long)end, (unsigned long long)bytes,
+		       (unsigned long long)(seconds * 1000));
+	/* one append per line, the lines of the devices do not mix */
+	if (write(sched->log_fd, buf, len) != len)
+		warning("cannot write scrub chunk log: %s", strerror(errno));
+}
+
+/* Highest end of a finished range of @devid in the chunk log */
+static u64 scrub_log_resume_offset(int fd, u64 devid)
+{
+	unsigned long long dev, start, end, bytes, msecs;
+	u64 offset = 0;
+	char line[128];
+	FILE *f;
+
+	f = fdopen(dup(fd), "r");
+	if (!f)
+		return 0;
+	rewind(f);
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%llu %llu %llu %llu %llu", &dev, &start,
+			   &end, &bytes, &msecs) != 5)
+			continue;
+		if (dev == devid && end > offset)
+			offset = end;
+	}
+	fclose(f);
+	return offset;
+}
+
+static void *scrub_chunked_dev(void *ctx)
+{
+	struct scrub_progress *sp = ctx;
+	struct scrub_sched *sched = sp->sched;
+	struct btrfs_ioctl_scrub_args args;
+	struct scrub_dev_extent *extents = NULL;
+	struct timeval tv;
+	struct stat st;
+	dev_t devt = 0;
+	u64 chunk = sched->chunk_size;
+	u64 pos = sp->scrub_args.start;
+	int nr_extents = 0;
+	int i = 0;
+	int ret;
+
+	sp->stats.canceled = 0;
+	sp->stats.duration = 0;
+	sp->stats.finished = 0;
+	sp->ret = 0;
+
+	ret = syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+		      IOPRIO_PRIO_VALUE(sp->ioprio_class,
+					sp->ioprio_classdata));
+	if (ret)
+		warning("setting ioprio failed: %s (ignored)",
+			strerror(errno));
+
+	if (sp->dev_path && !stat(sp->dev_path, &st) && S_ISBLK(st.st_mode))
+		devt = st.st_rdev;
+
+	ret = scrub_load_dev_extents(sp->fd, sp->scrub_args.devid, &extents,
+				     &nr_extents);
+	if (ret < 0) {
+		sp->ret = -1;
+		sp->ioctl_errno = -ret;
+		goto out;
+	}
+
+	while (!scrub_cancel_requested) {
+		struct timeval t0, t1;
+		u64 ios0 = 0, ticks0 = 0, ios1 = 0, ticks1 = 0;
+		u64 start;
+		u64 end;
+		u64 bytes;
+		double dt;
+		double pause = 0;
+		int over_budget = 0;
+		int have_stats;
+
+		while (i < nr_extents &&
+		       extents[i].offset + extents[i].length <= pos)
+			i++;
+		if (i >= nr_extents)
+			break;
+		/* the kernel scrubs whole device extents in the range */
+		start = extents[i].offset;
+		end = start + extents[i].length;
+		for (i++; i < nr_extents; i++) {
+			if (extents[i].offset + extents[i].length - start >
+			    chunk)
+				break;
+			end = extents[i].offset + extents[i].length;
+		}
+
+		scrub_sched_get(sched);
+		have_stats = devt && !read_diskstats(devt, &ios0, &ticks0);
+		gettimeofday(&t0, NULL);
+
+		memset(&args, 0, sizeof(args));
+		args.devid = sp->scrub_args.devid;
+		args.start = start;
+		args.end = end;
+		args.flags = sp->scrub_args.flags;
+		ret = ioctl(sp->fd, BTRFS_IOC_SCRUB, &args);
+		if (ret < 0)
+			sp->ioctl_errno = errno;
+
+		gettimeofday(&t1, NULL);
+		if (have_stats)
+			have_stats = !read_diskstats(devt, &ios1, &ticks1);
+		dt = (t1.tv_sec - t0.tv_sec) +
+			(t1.tv_usec - t0.tv_usec) / 1000000.0;
+		if (have_stats && sched->latency_ms && ios1 > ios0 &&
+		    (ticks1 - ticks0) > sched->latency_ms * (ios1 - ios0))
+			over_budget = 1;
+		scrub_sched_put(sched, over_budget);
+
+		pthread_mutex_lock(&sp->progress_mutex);
+		scrub_add_progress(&sp->done, &args.progress);
+		sp->nr_done++;
+		pthread_mutex_unlock(&sp->progress_mutex);
+		if (ret < 0) {
+			sp->ret = ret;
+			break;
+		}
+
+		bytes = args.progress.data_bytes_scrubbed +
+			args.progress.tree_bytes_scrubbed;
+		scrub_log_chunk(sched, args.devid, start, end, bytes, dt);
+		pos = end;
+
+		if (over_budget) {
+			/* leave the device to the other users for a while */
+			chunk = max(chunk / 2, SCRUB_CHUNK_MIN);
+			pause = dt;
+		} else if (dt > 0 && bytes) {
+			chunk = bytes / dt * SCRUB_CHUNK_SECONDS;
+			chunk = min(max(chunk, SCRUB_CHUNK_MIN),
+				    SCRUB_CHUNK_MAX);
+		}
+		if (sched->rate_limit && bytes)
+			pause = max(pause, (double)bytes / sched->rate_limit -
+				    dt);
+		scrub_sched_sleep(pause);
+	}
+	if (scrub_cancel_requested && !sp->ret) {
+		sp->ret = -1;
+		sp->ioctl_errno = ECANCELED;
+	}
+
+out:
+	free(extents);
+	gettimeofday(&tv, NULL);
+	ret = pthread_mutex_lock(&sp->progress_mutex);
+	if (ret)
+		return ERR_PTR(-ret);
+	sp->scrub_args.progress = sp->done;
+	sp->stats.duration = tv.tv_sec - sp->stats.t_start;
+	sp->stats.canceled = !!sp->ret;
+	sp->stats.finished = 1;
+	ret = pthread_mutex_unlock(&sp->progress_mutex);
+	if (ret)
+		return ERR_PTR(-ret);
+
+	return NULL;
+}
+
 static void *progress_one_dev(void *ctx)
 {
 	struct scrub_progress *sp = ctx;
@@ -873,6 +1249,53 @@ static void *progress_one_dev(void *ctx)
 	return NULL;
 }
 
+/*
+ * Read the progress of the chunked scrub of @shared into @sp: the ranges
+ * merged into @shared->done, plus the range in flight unless it has ended
+ * and been merged meanwhile.  Between two ranges the progress ioctl fails
+ * with ENOTCONN and only the merged ranges count.  Returns a pthread error.
+ */
+static int scrub_chunked_progress(struct scrub_progress *sp,
+				  struct scrub_progress *shared)
+{
+	u64 nr_done;
+	int finished;
+	int old;
+	int perr;
+	int err;
+
+	perr = pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+	if (perr)
+		return perr;
+	perr = pthread_mutex_lock(&shared->progress_mutex);
+	if (perr)
+		goto out;
+	nr_done = shared->nr_done;
+	perr = pthread_mutex_unlock(&shared->progress_mutex);
+	if (perr)
+		goto out;
+
+	progress_one_dev(sp);
+
+	perr = pthread_mutex_lock(&shared->progress_mutex);
+	if (perr)
+		goto out;
+	finished = shared->stats.finished;
+	if (sp->ret || shared->nr_done != nr_done)
+		sp->scrub_args.progress = shared->done;
+	else
+		scrub_add_progress(&sp->scrub_args.progress, &shared->done);
+	perr = pthread_mutex_unlock(&shared->progress_mutex);
+	if (perr)
+		goto out;
+	/* the scrub thread is done with @shared */
+	if (finished)
+		memcpy(sp, shared, sizeof(*sp));
+out:
+	err = pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &old);
+	return perr ? perr : err;
+}
+
 /* nb: returns a negative errno via ERR_PTR */
 static void *scrub_progress_cycle(void *ctx)
 {
@@ -941,6 +1364,23 @@ static void *scrub_progress_cycle(void *ctx)
 			sp_shared = &spc->shared_progress[i];
 			if (sp->stats.finished)
 				continue;
+			if (sp_shared->sched) {
+				perr = scrub_chunked_progress(sp, sp_shared);
+				if (perr)
+					goto out;
+				if (sp->stats.finished) {
+					memcpy(sp_last, sp, sizeof(*sp));
+					continue;
+				}
+				sp->stats.duration = tv.tv_sec -
+						     sp->stats.t_start;
+				if (sp->ret && sp->ioctl_errno != ENOTCONN &&
+				    sp->ioctl_errno != ENODEV) {
+					ret = -sp->ioctl_errno;
+					goto out;
+				}
+				continue;
+			}
 			progress_one_dev(sp);
 			sp->stats.duration = tv.tv_sec - sp->stats.t_start;
 			if (!sp->ret)
@@ -1017,6 +1457,121 @@ out:
 	return ERR_PTR(ret);
 }
 
+struct scrub_telemetry {
+	int fdmnt;
+	int ndev;
+	struct btrfs_ioctl_dev_info_args *di_args;
+	struct scrub_progress *sp;
+	/* progress of each device at the previous record */
+	struct btrfs_scrub_progress *last;
+	time_t t_start;
+};
+
+static u64 scrub_bytes_done(struct btrfs_scrub_progress *p)
+{
+	return p->data_bytes_scrubbed + p->tree_bytes_scrubbed;
+}
+
+static void telemetry_scrub_dev(struct telemetry *tm, u64 devid,
+				struct btrfs_scrub_progress *p, u64 total,
+				u64 last_done, double elapsed,
+				const char *state)
+{
+	fprintf(tm->out, "{\"devid\":%llu", (unsigned long long)devid);
+	fprintf(tm->out, ",\"state\":\"%s\"", state);
+	telemetry_u64(tm, "bytes_done", scrub_bytes_done(p));
+	telemetry_u64(tm, "bytes_total", total);
+	telemetry_rate(tm, scrub_bytes_done(p), last_done, total, elapsed);
+	telemetry_u64(tm, "last_physical", p->last_physical);
+	telemetry_u64(tm, "read_errors", p->read_errors);
+	telemetry_u64(tm, "csum_errors", p->csum_errors);
+	telemetry_u64(tm, "verify_errors", p->verify_errors);
+	telemetry_u64(tm, "super_errors", p->super_errors);
+	telemetry_u64(tm, "malloc_errors", p->malloc_errors);
+	telemetry_u64(tm, "uncorrectable_errors", p->uncorrectable_errors);
+	telemetry_u64(tm, "corrected_errors", p->corrected_errors);
+	telemetry_u64(tm, "unverified_errors", p->unverified_errors);
+	fputc('}', tm->out);
+}
+
+/*
+ * Query the progress of all devices from the poller thread. The final record
+ * uses the results returned by the scrub ioctls.
+ */
+static void scrub_telemetry_sample(struct telemetry *tm, const char *event)
+{
+	struct scrub_telemetry *st = tm->data;
+	struct btrfs_ioctl_scrub_args args;
+	struct btrfs_scrub_progress *p;
+	double now = telemetry_now();
+	double elapsed = now - tm->last_time;
+	int final = !strcmp(event, "finished");
+	int first = 1;
+	u64 nr_done;
+	u64 done = 0;
+	u64 last_done = 0;
+	u64 total = 0;
+	int i;
+
+	telemetry_begin(tm, "scrub", event);
+	telemetry_u64(tm, "elapsed", (u64)now - st->t_start);
+	fprintf(tm->out, ",\"devices\":[");
+	for (i = 0; i < st->ndev; i++) {
+		struct scrub_progress *sp = &st->sp[i];
+		const char *state = "running";
+
+		if (sp->skip)
+			continue;
+		memset(&args, 0, sizeof(args));
+		args.devid = sp->scrub_args.devid;
+		pthread_mutex_lock(&sp->progress_mutex);
+		nr_done = sp->nr_done;
+		pthread_mutex_unlock(&sp->progress_mutex);
+		if (!final && !ioctl(st->fdmnt, BTRFS_IOC_SCRUB_PROGRESS,
+				     &args)) {
+			pthread_mutex_lock(&sp->progress_mutex);
+			/* a range merged meanwhile is already in @done */
+			if (sp->sched && sp->nr_done != nr_done)
+				args.progress = sp->done;
+			else if (sp->sched)
+				scrub_add_progress(&args.progress, &sp->done);
+			pthread_mutex_unlock(&sp->progress_mutex);
+		} else {
+			/* not running anymore, the result is in sp */
+			pthread_mutex_lock(&sp->progress_mutex);
+			if (sp->stats.finished) {
+				args.progress = sp->scrub_args.progress;
+				state = sp->ret ? "canceled" : "finished";
+			} else if (sp->sched) {
+				/* between two ranges */
+				args.progress = sp->done;
+				state = "waiting";
+			} else {
+				args.progress = st->last[i];
+				state = "stopping";
+			}
+			pthread_mutex_unlock(&sp->progress_mutex);
+		}
+		p = &args.progress;
+		if (!first)
+			fputc(',', tm->out);
+		first = 0;
+		telemetry_scrub_dev(tm, args.devid, p,
+				    st->di_args[i].bytes_used,
+				    scrub_bytes_done(&st->last[i]), elapsed,
+				    state);
+		done += scrub_bytes_done(p);
+		last_done += scrub_bytes_done(&st->last[i]);
+		total += st->di_args[i].bytes_used;
+		st->last[i] = *p;
+	}
+	fputc(']', tm->out);
+	telemetry_u64(tm, "bytes_done", done);
+	telemetry_u64(tm, "bytes_total", total);
+	telemetry_rate(tm, done, last_done, total, elapsed);
+	telemetry_end(tm);
+}
+
 static struct scrub_file_record *last_dev_scrub(
 		struct scrub_file_record *const *const past_scrubs, u64 devid)
 {
@@ -1140,9 +1695,33 @@ static int scrub_start(int argc, char **argv, int resume)
 	DIR *dirstream = NULL;
 	int force = 0;
 	int nothing_to_resume = 0;
+	struct telemetry tm;
+	struct scrub_telemetry st = { 0 };
+	struct scrub_sched sched;
+	int chunked = 0;
+	enum { GETOPT_VAL_LIMIT = 257, GETOPT_VAL_LATENCY,
+		GETOPT_VAL_CHUNK_SIZE };
+	static const struct option long_options[] = {
+		{ "limit", required_argument, NULL, GETOPT_VAL_LIMIT },
+		{ "latency", required_argument, NULL, GETOPT_VAL_LATENCY },
+		{ "chunk-size", required_argument, NULL,
+			GETOPT_VAL_CHUNK_SIZE },
+		TELEMETRY_LONG_OPTIONS,
+		{ NULL, 0, NULL, 0 }
+	};
 
+	telemetry_init(&tm);
+	memset(&sched, 0, sizeof(sched));
+	sched.log_fd = -1;
+	sched.chunk_size = SCRUB_CHUNK_DEFAULT;
 	optind = 1;
-	while ((c = getopt(argc, argv, "BdqrRc:n:f")) != -1) {
+	while ((c = getopt_long(argc, argv, "BdqrRc:n:f", long_options,
+				NULL)) != -1) {
+		ret = telemetry_parse_opt(&tm, c, optarg);
+		if (ret < 0)
+			return 1;
+		if (ret)
+			continue;
 		switch (c) {
 		case 'B':
 			do_background = 0;
@@ -1170,6 +1749,20 @@ static int scrub_start(int argc, char **argv, int resume)
 		case 'f':
 			force = 1;
 			break;
+		case GETOPT_VAL_LIMIT:
+			sched.rate_limit = parse_size(optarg);
+			chunked = 1;
+			break;
+		case GETOPT_VAL_LATENCY:
+			sched.latency_ms = arg_strtou64(optarg);
+			chunked = 1;
+			break;
+		case GETOPT_VAL_CHUNK_SIZE:
+			sched.chunk_size = parse_size(optarg);
+			if (sched.chunk_size < SCRUB_CHUNK_MIN)
+				sched.chunk_size = SCRUB_CHUNK_MIN;
+			chunked = 1;
+			break;
 		case '?':
 		default:
 			usage(resume ? cmd_scrub_resume_usage :
@@ -1260,8 +1853,9 @@ static int scrub_start(int argc, char **argv, int resume)
 	t_devs = malloc(fi_args.num_devices * sizeof(*t_devs));
 	sp = calloc(fi_args.num_devices, sizeof(*sp));
 	spc.progress = calloc(fi_args.num_devices * 2, sizeof(*spc.progress));
+	st.last = calloc(fi_args.num_devices, sizeof(*st.last));
 
-	if (!t_devs || !sp || !spc.progress) {
+	if (!t_devs || !sp || !spc.progress || !st.last) {
 		error_on(!do_quiet, "scrub failed: %s", strerror(errno));
 		err = 1;
 		goto out;
@@ -1403,7 +1997,35 @@ static int scrub_start(int argc, char **argv, int resume)
 
 	scrub_handle_sigint_child(fdmnt);
 
+	if (chunked) {
+		char log_path[PATH_MAX];
+
+		ret = scrub_datafile(SCRUB_CHUNK_LOG, fsid, NULL, log_path,
+				     sizeof(log_path));
+		if (!ret) {
+			sched.log_fd = open(log_path, O_RDWR | O_CREAT |
+					(resume ? O_APPEND : O_TRUNC), 0600);
+			if (sched.log_fd < 0)
+				warning_on(!do_quiet,
+				"cannot open scrub chunk log %s: %s",
+					log_path, strerror(errno));
+		}
+		pthread_mutex_init(&sched.lock, NULL);
+		pthread_cond_init(&sched.cond, NULL);
+		sched.ndev = fi_args.num_devices;
+		sched.allowed = fi_args.num_devices;
+	}
+
 	for (i = 0; i < fi_args.num_devices; ++i) {
+		if (chunked && !sp[i].skip) {
+			sp[i].sched = &sched;
+			sp[i].dev_path = (const char *)di_args[i].path;
+			if (resume && sched.log_fd >= 0)
+				sp[i].scrub_args.start = max(
+					sp[i].scrub_args.start,
+					scrub_log_resume_offset(sched.log_fd,
+							di_args[i].devid));
+		}
 		if (sp[i].skip) {
 			sp[i].scrub_args.progress = sp[i].resumed->p;
 			sp[i].stats = sp[i].resumed->stats;
@@ -1415,7 +2037,8 @@ static int scrub_start(int argc, char **argv, int resume)
 		gettimeofday(&tv, NULL);
 		sp[i].stats.t_start = tv.tv_sec;
 		ret = pthread_create(&t_devs[i], NULL,
-					scrub_one_dev, &sp[i]);
+				chunked ? scrub_chunked_dev : scrub_one_dev,
+				&sp[i]);
 		if (ret) {
 			if (do_print)
 			error("creating scrub_one_dev[%llu] thread failed: %s",
@@ -1425,6 +2048,16 @@ static int scrub_start(int argc, char **argv, int resume)
 		}
 	}
 
+	st.fdmnt = fdmnt;
+	st.ndev = fi_args.num_devices;
+	st.di_args = di_args;
+	st.sp = sp;
+	st.t_start = time(NULL);
+	ret = telemetry_start(&tm, scrub_telemetry_sample, &st);
+	if (ret)
+		warning_on(!do_quiet, "cannot start telemetry: %s",
+			strerror(-ret));
+
 	spc.fdmnt = fdmnt;
 	spc.prg_fd = prg_fd;
 	spc.do_record = do_record;
@@ -1479,6 +2112,7 @@ static int scrub_start(int argc, char **argv, int resume)
 		    || sp[i].scrub_args.progress.unverified_errors > 0)
 			e_correctable++;
 	}
+	telemetry_stop(&tm, "finished");
 
 	if (do_print) {
 		const char *append = "done";
@@ -1530,11 +2164,16 @@ static int scrub_start(int argc, char **argv, int resume)
 	scrub_handle_sigint_child(-1);
 
 out:
+	telemetry_stop(&tm, "finished");
+	telemetry_close(&tm);
+	if (sched.log_fd >= 0)
+		close(sched.log_fd);
 	free_history(past_scrubs);
 	free(di_args);
 	free(t_devs);
 	free(sp);
 	free(spc.progress);
+	free(st.last);
 	if (prg_fd > -1) {
 		close(prg_fd);
 		if (sock_path[0])
@@ -1570,6 +2209,12 @@ static const char * const cmd_scrub_start_usage[] = {
 	"-n     set ioprio classdata (see ionice(1) manpage)",
 	"-f     force starting new scrub even if a scrub is already running",
 	"       this is useful when scrub stats record file is damaged",
+	"--limit <rate>       scrub each device with at most <rate> bytes per second",
+	"--latency <ms>       back off when the average I/O time of a device",
+	"                     exceeds <ms> milliseconds",
+	"--chunk-size <size>  scrub in ranges of about <size>, adapted to the",
+	"                     throughput (default: 1G with --limit or --latency)",
+	TELEMETRY_USAGE,
 	NULL
 };
 
@@ -1635,6 +2280,12 @@ static const char * const cmd_scrub_resume_usage[] = {
 	"-R     raw print mode, print full data instead of summary",
 	"-c     set ioprio class (see ionice(1) manpage)",
 	"-n     set ioprio classdata (see ionice(1) manpage)",
+	"--limit <rate>       scrub each device with at most <rate> bytes per second",
+	"--latency <ms>       back off when the average I/O time of a device",
+	"                     exceeds <ms> milliseconds",
+	"--chunk-size <size>  scrub in ranges of about <size>, adapted to the",
+	"                     throughput (default: 1G with --limit or --latency)",
+	TELEMETRY_USAGE,
 	NULL
 };
 
@@ -1649,9 +2300,57 @@ static const char * const cmd_scrub_status_usage[] = {
 	"",
 	"-d     stats per device",
 	"-R     print raw stats",
+	"--telemetry <fd>|<file>  write the status as a JSON line to <fd> or <file>",
 	NULL
 };
 
+/* One record with the status of the last or running scrub */
+static void scrub_status_telemetry(struct telemetry *tm, int ndev,
+		struct btrfs_ioctl_dev_info_args *di_args,
+		struct scrub_file_record **past_scrubs, int in_progress)
+{
+	struct scrub_file_record *last_scrub;
+	int first = 1;
+	u64 done = 0;
+	u64 total = 0;
+	u64 duration = 0;
+	int i;
+
+	telemetry_begin(tm, "scrub", "status");
+	fprintf(tm->out, ",\"running\":%s", in_progress ? "true" : "false");
+	fprintf(tm->out, ",\"devices\":[");
+	for (i = 0; i < ndev; i++) {
+		const char *state;
+
+		last_scrub = last_dev_scrub(past_scrubs, di_args[i].devid);
+		if (!last_scrub)
+			continue;
+		if (last_scrub->stats.canceled)
+			state = "canceled";
+		else if (last_scrub->stats.finished)
+			state = "finished";
+		else if (in_progress)
+			state = "running";
+		else
+			state = "interrupted";
+		if (!first)
+			fputc(',', tm->out);
+		first = 0;
+		telemetry_scrub_dev(tm, di_args[i].devid, &last_scrub->p,
+				    di_args[i].bytes_used, 0,
+				    last_scrub->stats.duration, state);
+		done += scrub_bytes_done(&last_scrub->p);
+		total += di_args[i].bytes_used;
+		duration = max(duration, last_scrub->stats.duration);
+	}
+	fputc(']', tm->out);
+	telemetry_u64(tm, "elapsed", duration);
+	telemetry_u64(tm, "bytes_done", done);
+	telemetry_u64(tm, "bytes_total", total);
+	telemetry_rate(tm, done, 0, total, duration);
+	telemetry_end(tm);
+}
+
 static int cmd_scrub_status(int argc, char **argv)
 {
 	char *path;
@@ -1674,9 +2373,21 @@ static int cmd_scrub_status(int argc, char **argv)
 	int fdres = -1;
 	int err = 0;
 	DIR *dirstream = NULL;
+	struct telemetry tm;
+	static const struct option long_options[] = {
+		{ "telemetry", required_argument, NULL, GETOPT_VAL_TELEMETRY },
+		{ NULL, 0, NULL, 0 }
+	};
 
+	telemetry_init(&tm);
 	optind = 1;
-	while ((c = getopt(argc, argv, "dR")) != -1) {
+	while ((c = getopt_long(argc, argv, "dR", long_options,
+				NULL)) != -1) {
+		ret = telemetry_parse_opt(&tm, c, optarg);
+		if (ret < 0)
+			return 1;
+		if (ret)
+			continue;
 		switch (c) {
 		case 'd':
 			do_stats_per_dev = 1;
@@ -1745,6 +2456,10 @@ static int cmd_scrub_status(int argc, char **argv)
 	}
 	in_progress = is_scrub_running_in_kernel(fdmnt, di_args, fi_args.num_devices);
 
+	if (telemetry_enabled(&tm))
+		scrub_status_telemetry(&tm, fi_args.num_devices, di_args,
+				       past_scrubs, in_progress);
+
 	printf("scrub status for %s\n", fsid);
 
 	if (do_stats_per_dev) {
@@ -1782,6 +2497,7 @@ out:
 	if (fdres > -1)
 		close(fdres);
 	close_file_or_dir(fdmnt, dirstream);
+	telemetry_close(&tm);
 
 	return !!err;
 }
@@ -18,13 +18,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/ioctl.h>
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/vfs.h>
 #include <libgen.h>
 #include <limits.h>
+#include <ctype.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <uuid/uuid.h>
 #include <linux/magic.h>
 
@@ -36,67 +39,307 @@
 #include "commands.h"
 #include "utils.h"
 #include "btrfs-list.h"
-#include "utils.h"
+#include "telemetry.h"
+
+/*
+ * Size of the TREE_SEARCH_V2 buffer for the scans of the tree of tree roots,
+ * enough for the items of several thousand subvolumes in one call
+ */
+#define SUBVOL_SCAN_BUF_SIZE		(8 * 1024 * 1024)
+
+/* Polling interval grows up to this multiple of the initial interval */
+#define SUBVOL_SYNC_MAX_BACKOFF		16
+
+struct subvol_root {
+	u64 id;
+	u64 bytes;
+};
+
+/*
+ * Root items of the subvolumes and the orphan items in the tree of tree
+ * roots, both sorted by subvolume id as they come from the tree
+ */
+struct subvol_scan {
+	struct btrfs_ioctl_search_args_v2 *args;
+	int use_v1;
+	struct subvol_root *roots;
+	int nr_roots;
+	int alloc_roots;
+	u64 *orphans;
+	int nr_orphans;
+	int alloc_orphans;
+};
+
+static void free_subvol_scan(struct subvol_scan *scan)
+{
+	free(scan->args);
+	free(scan->roots);
+	free(scan->orphans);
+}
+
+static int subvol_scan_item(struct subvol_scan *scan,
+			    struct btrfs_ioctl_search_header *sh, void *item)
+{
+	if (sh->type == BTRFS_ROOT_ITEM_KEY &&
+	    sh->objectid <= BTRFS_LAST_FREE_OBJECTID) {
+		struct btrfs_root_item *ri = item;
+		struct subvol_root *root;
+
+		if (scan->nr_roots == scan->alloc_roots) {
+			int alloc = max(scan->alloc_roots * 2, 256);
+
+			root = realloc(scan->roots, alloc * sizeof(*root));
+			if (!root)
+				return -ENOMEM;
+			scan->roots = root;
+			scan->alloc_roots = alloc;
+		}
+		/* snapshots have several root items, keep the last one */
+		if (scan->nr_roots &&
+		    scan->roots[scan->nr_roots - 1].id == sh->objectid)
+			scan->nr_roots--;
+		root = &scan->roots[scan->nr_roots++];
+		root->id = sh->objectid;
+		root->bytes = btrfs_root_used(ri);
+	} else if (sh->type == BTRFS_ORPHAN_ITEM_KEY &&
+		   sh->objectid == BTRFS_ORPHAN_OBJECTID) {
+		if (scan->nr_orphans == scan->alloc_orphans) {
+			int alloc = max(scan->alloc_orphans * 2, 256);
+			u64 *orphans;
+
+			orphans = realloc(scan->orphans,
+					  alloc * sizeof(*orphans));
+			if (!orphans)
+				return -ENOMEM;
+			scan->orphans = orphans;
+			scan->alloc_orphans = alloc;
+		}
+		scan->orphans[scan->nr_orphans++] = sh->offset;
+	}
+	return 0;
+}
 
-static int is_subvolume_cleaned(int fd, u64 subvolid)
+/*
+ * Read the root items of all subvolumes and the orphan items. Both live in
+ * the tree of tree roots between the first subvolume id and the orphan
+ * objectid, so this is usually a single TREE_SEARCH_V2 call. Old kernels
+ * without it take the v1 ioctl in 4k chunks.
+ */
+static int subvol_scan(int fd, struct subvol_scan *scan)
 {
+	struct btrfs_ioctl_search_args v1;
+	struct btrfs_ioctl_search_key *sk;
+	struct btrfs_ioctl_search_header sh;
+	unsigned long off;
+	char *buf;
+	u64 buf_size;
 	int ret;
-	struct btrfs_ioctl_search_args args;
-	struct btrfs_ioctl_search_key *sk = &args.key;
+	int i;
 
+	if (!scan->args) {
+		scan->args = malloc(sizeof(*scan->args) + SUBVOL_SCAN_BUF_SIZE);
+		if (!scan->args)
+			return -ENOMEM;
+	}
+	scan->nr_roots = 0;
+	scan->nr_orphans = 0;
+
+	sk = &scan->args->key;
+	memset(sk, 0, sizeof(*sk));
 	sk->tree_id = BTRFS_ROOT_TREE_OBJECTID;
-	sk->min_objectid = subvolid;
-	sk->max_objectid = subvolid;
-	sk->min_type = BTRFS_ROOT_ITEM_KEY;
-	sk->max_type = BTRFS_ROOT_ITEM_KEY;
-	sk->min_offset = 0;
+	sk->min_objectid = BTRFS_FIRST_FREE_OBJECTID;
+	sk->max_objectid = BTRFS_ORPHAN_OBJECTID;
+	sk->max_type = (u8)-1;
 	sk->max_offset = (u64)-1;
-	sk->min_transid = 0;
 	sk->max_transid = (u64)-1;
-	sk->nr_items = 1;
 
-	ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args);
-	if (ret < 0)
-		return -errno;
+	while (1) {
+		if (!scan->use_v1) {
+			sk->nr_items = (u32)-1;
+			scan->args->buf_size = SUBVOL_SCAN_BUF_SIZE;
+			ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH_V2, scan->args);
+			if (ret < 0 && (errno == ENOTTY || errno == EOPNOTSUPP)) {
+				scan->use_v1 = 1;
+				continue;
+			}
+			buf = (char *)scan->args->buf;
+			buf_size = SUBVOL_SCAN_BUF_SIZE;
+		} else {
+			sk->nr_items = 4096;
+			memcpy(&v1.key, sk, sizeof(*sk));
+			ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH, &v1);
+			memcpy(sk, &v1.key, sizeof(*sk));
+			buf = v1.buf;
+			buf_size = sizeof(v1.buf);
+		}
+		if (ret < 0)
+			return -errno;
+		if (sk->nr_items == 0)
+			break;
 
-	if (sk->nr_items == 0)
-		return 1;
+		off = 0;
+		for (i = 0; i < sk->nr_items; i++) {
+			memcpy(&sh, buf + off, sizeof(sh));
+			off += sizeof(sh);
+			ret = subvol_scan_item(scan, &sh, buf + off);
+			if (ret)
+				return ret;
+			off += sh.len;
+			sk->min_objectid = sh.objectid;
+			sk->min_type = sh.type;
+			sk->min_offset = sh.offset;
+		}
 
+		/*
+		 * The search stops early only when the next item does not
+		 * fit, so a buffer with room for the largest item means the
+		 * whole range has been read.
+		 */
+		if (buf_size - off >= sizeof(sh) + BTRFS_MAX_METADATA_BLOCKSIZE)
+			break;
+		if (sk->min_offset < (u64)-1) {
+			sk->min_offset++;
+		} else if (sk->min_type < (u8)-1) {
+			sk->min_type++;
+			sk->min_offset = 0;
+		} else if (sk->min_objectid < BTRFS_ORPHAN_OBJECTID) {
+			sk->min_objectid++;
+			sk->min_type = 0;
+			sk->min_offset = 0;
+		} else {
+			break;
+		}
+	}
 	return 0;
 }
 
+static struct subvol_root *subvol_scan_find(struct subvol_scan *scan, u64 id)
+{
+	int lo = 0;
+	int hi = scan->nr_roots;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (scan->roots[mid].id == id)
+			return &scan->roots[mid];
+		if (scan->roots[mid].id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+/*
+ * Wait until the subvolumes in @ids are cleaned, clearing the ids that are
+ * gone. The whole set is checked with one scan per poll and the polling
+ * interval doubles while nothing changes.
+ */
 static int wait_for_subvolume_cleaning(int fd, int count, u64 *ids,
-		int sleep_interval)
+		int sleep_interval, int progress, struct telemetry *tm)
 {
+	struct subvol_scan scan = { 0 };
+	u64 last_bytes = (u64)-1;
+	int interval = sleep_interval;
+	int left = 0;
 	int ret;
 	int i;
 
+	for (i = 0; i < count; i++)
+		if (ids[i])
+			left++;
+
 	while (1) {
-		int clean = 1;
+		int changed = 0;
+		u64 bytes = 0;
 
+		ret = subvol_scan(fd, &scan);
+		if (ret < 0) {
+			error("cannot read status of dead subvolumes: %s",
+				strerror(-ret));
+			goto out;
+		}
 		for (i = 0; i < count; i++) {
+			struct subvol_root *root;
+
 			if (!ids[i])
 				continue;
-			ret = is_subvolume_cleaned(fd, ids[i]);
-			if (ret < 0) {
-				error(
-			    "cannot read status of dead subvolume %llu: %s",
-					(unsigned long long)ids[i], strerror(-ret));
-				return ret;
-			}
-			if (ret) {
-				printf("Subvolume id %llu is gone\n", ids[i]);
-				ids[i] = 0;
-			} else {
-				clean = 0;
+			root = subvol_scan_find(&scan, ids[i]);
+			if (root) {
+				bytes += root->bytes;
+				continue;
 			}
+			printf("Subvolume id %llu is gone\n",
+				(unsigned long long)ids[i]);
+			ids[i] = 0;
+			left--;
+			changed = 1;
 		}
-		if (clean)
+		if (bytes != last_bytes)
+			changed = 1;
+		last_bytes = bytes;
+
+		if (progress)
+			printf("Waiting for %d subvolumes, %s of metadata left\n",
+				left, pretty_size(bytes));
+		if (tm && (telemetry_due(tm) ||
+			   (!left && telemetry_enabled(tm)))) {
+			telemetry_begin(tm, "subvolume-sync",
+					left ? "progress" : "finished");
+			telemetry_u64(tm, "subvolumes_left", left);
+			telemetry_u64(tm, "bytes_left", bytes);
+			telemetry_u64(tm, "interval", interval);
+			telemetry_end(tm);
+		}
+		if (!left)
 			break;
-		sleep(sleep_interval);
+
+		if (changed)
+			interval = sleep_interval;
+		else
+			interval = min(interval * 2,
+				       sleep_interval * SUBVOL_SYNC_MAX_BACKOFF);
+		sleep(interval);
 	}
+	ret = 0;
+out:
+	free_subvol_scan(&scan);
+	return ret;
+}
 
-	return 0;
+/*
+ * Enumerate the deleted subvolumes that are not cleaned yet, ie. the orphan
+ * items with a root item. Return the number of ids stored to @ids.
+ */
+static int enumerate_dead_subvols(int fd, u64 **ids)
+{
+	struct subvol_scan scan = { 0 };
+	int count = 0;
+	int ret;
+	int i;
+
+	*ids = NULL;
+	ret = subvol_scan(fd, &scan);
+	if (ret < 0)
+		goto out;
+	if (!scan.nr_orphans)
+		goto out;
+
+	*ids = malloc(scan.nr_orphans * sizeof(u64));
+	if (!*ids) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < scan.nr_orphans; i++) {
+		/* skip stale orphan items */
+		if (subvol_scan_find(&scan, scan.orphans[i]))
+			(*ids)[count++] = scan.orphans[i];
+	}
+	ret = count;
+out:
+	free_subvol_scan(&scan);
+	return ret;
 }
 
 static const char * const subvolume_cmd_group_usage[] = {
@@ -234,8 +477,563 @@ static int wait_for_commit(int fd)
 	return ioctl(fd, BTRFS_IOC_WAIT_SYNC, NULL);
 }
 
+/*
+ * Batch deletion: the subvolumes are given as paths or ids, on the command
+ * line or on stdin. Ids are resolved from the ROOT_BACKREF items read in one
+ * tree search, every parent directory is opened once and the deletions run
+ * on a few threads. The transaction is committed once at the end.
+ */
+struct subvol_ref {
+	u64 id;
+	u64 parent;
+	u64 dirid;
+	char *name;
+	/* path from the toplevel subvolume, resolved on demand */
+	char *path;
+};
+
+struct subvol_refs {
+	struct subvol_ref *refs;
+	int nr;
+	int alloc;
+};
+
+struct subvol_target {
+	char *dir;
+	char *name;
+	u64 id;
+	int dir_fd;
+	int ret;
+};
+
+struct subvol_delete_batch {
+	pthread_mutex_t lock;
+	struct subvol_target *targets;
+	int nr;
+	int next;
+	int commit;
+};
+
+static int cmp_subvol_ref(const void *a, const void *b)
+{
+	const struct subvol_ref *ra = a;
+	const struct subvol_ref *rb = b;
+
+	return ra->id < rb->id ? -1 : ra->id > rb->id;
+}
+
+static struct subvol_ref *find_subvol_ref(struct subvol_refs *refs, u64 id)
+{
+	struct subvol_ref key = { .id = id };
+
+	return bsearch(&key, refs->refs, refs->nr, sizeof(key),
+		       cmp_subvol_ref);
+}
+
+static int load_subvol_refs(int fd, struct subvol_refs *refs)
+{
+	struct btrfs_ioctl_search_args args;
+	struct btrfs_ioctl_search_key *sk = &args.key;
+	struct btrfs_ioctl_search_header sh;
+	unsigned long off;
+	int ret;
+	int i;
+
+	memset(&args, 0, sizeof(args));
+	sk->tree_id = BTRFS_ROOT_TREE_OBJECTID;
+	sk->min_objectid = BTRFS_FIRST_FREE_OBJECTID;
+	sk->max_objectid = BTRFS_LAST_FREE_OBJECTID;
+	sk->min_type = BTRFS_ROOT_BACKREF_KEY;
+	sk->max_type = BTRFS_ROOT_BACKREF_KEY;
+	sk->max_offset = (u64)-1;
+	sk->max_transid = (u64)-1;
+
+	while (1) {
+		sk->nr_items = 4096;
+		ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args);
+		if (ret < 0)
+			return -errno;
+		if (sk->nr_items == 0)
+			break;
+
+		off = 0;
+		for (i = 0; i < sk->nr_items; i++) {
+			struct btrfs_root_ref *rr;
+			struct subvol_ref *ref;
+			int name_len;
+
+			memcpy(&sh, args.buf + off, sizeof(sh));
+			off += sizeof(sh);
+			rr = (struct btrfs_root_ref *)(args.buf + off);
+			off += sh.len;
+			sk->min_objectid = sh.objectid;
+			sk->min_type = sh.type;
+			sk->min_offset = sh.offset;
+			if (sh.type != BTRFS_ROOT_BACKREF_KEY)
+				continue;
+
+			if (refs->nr == refs->alloc) {
+				int alloc = max(refs->alloc * 2, 64);
+
+				ref = realloc(refs->refs, alloc * sizeof(*ref));
+				if (!ref)
+					return -ENOMEM;
+				refs->refs = ref;
+				refs->alloc = alloc;
+			}
+			ref = &refs->refs[refs->nr];
+			name_len = btrfs_stack_root_ref_name_len(rr);
+			ref->id = sh.objectid;
+			ref->parent = sh.offset;
+			ref->dirid = btrfs_stack_root_ref_dirid(rr);
+			ref->path = NULL;
+			ref->name = strndup((char *)(rr + 1), name_len);
+			if (!ref->name)
+				return -ENOMEM;
+			refs->nr++;
+		}
+		if (sk->min_offset < (u64)-1) {
+			sk->min_offset++;
+		} else if (sk->min_objectid < (u64)-1) {
+			sk->min_objectid++;
+			sk->min_offset = 0;
+			sk->min_type = BTRFS_ROOT_BACKREF_KEY;
+		} else {
+			break;
+		}
+	}
+	qsort(refs->refs, refs->nr, sizeof(*refs->refs), cmp_subvol_ref);
+	return 0;
+}
+
+static void free_subvol_refs(struct subvol_refs *refs)
+{
+	int i;
+
+	for (i = 0; i < refs->nr; i++) {
+		free(refs->refs[i].name);
+		free(refs->refs[i].path);
+	}
+	free(refs->refs);
+}
+
+/*
+ * Path of the directory that contains subvolume @id, relative to the
+ * toplevel subvolume, with a trailing slash unless empty.
+ */
+static int subvol_parent_dir(int fd, struct subvol_refs *refs, u64 id,
+			     char *buf, int size);
+
+/* Path of subvolume @id relative to the toplevel subvolume */
+static const char *subvol_ref_path(int fd, struct subvol_refs *refs, u64 id)
+{
+	struct subvol_ref *ref;
+	char dir[PATH_MAX];
+
+	if (id == BTRFS_FS_TREE_OBJECTID)
+		return "";
+	ref = find_subvol_ref(refs, id);
+	if (!ref)
+		return NULL;
+	if (ref->path)
+		return ref->path;
+	if (subvol_parent_dir(fd, refs, id, dir, sizeof(dir)))
+		return NULL;
+	ref->path = malloc(strlen(dir) + strlen(ref->name) + 1);
+	if (!ref->path)
+		return NULL;
+	sprintf(ref->path, "%s%s", dir, ref->name);
+	return ref->path;
+}
+
+static int subvol_parent_dir(int fd, struct subvol_refs *refs, u64 id,
+			     char *buf, int size)
+{
+	struct btrfs_ioctl_ino_lookup_args args;
+	struct subvol_ref *ref;
+	const char *parent;
+	int ret;
+
+	ref = find_subvol_ref(refs, id);
+	if (!ref)
+		return -ENOENT;
+	parent = subvol_ref_path(fd, refs, ref->parent);
+	if (!parent)
+		return -ENOENT;
+
+	memset(&args, 0, sizeof(args));
+	args.treeid = ref->parent;
+	args.objectid = ref->dirid;
+	ret = ioctl(fd, BTRFS_IOC_INO_LOOKUP, &args);
+	if (ret < 0)
+		return -errno;
+	/* the directory part from the kernel ends with a slash */
+	ret = snprintf(buf, size, "%s%s%s", parent, parent[0] ? "/" : "",
+		       args.name);
+	return ret >= size ? -ENAMETOOLONG : 0;
+}
+
+static void *subvol_delete_worker(void *data)
+{
+	struct subvol_delete_batch *batch = data;
+	struct btrfs_ioctl_vol_args args;
+	struct subvol_target *t;
+
+	while (1) {
+		pthread_mutex_lock(&batch->lock);
+		if (batch->next >= batch->nr) {
+			pthread_mutex_unlock(&batch->lock);
+			break;
+		}
+		t = &batch->targets[batch->next++];
+		pthread_mutex_unlock(&batch->lock);
+
+		if (t->ret || t->dir_fd < 0)
+			continue;
+		memset(&args, 0, sizeof(args));
+		strncpy_null(args.name, t->name);
+		if (ioctl(t->dir_fd, BTRFS_IOC_SNAP_DESTROY, &args) < 0) {
+			t->ret = -errno;
+			error("cannot delete '%s/%s': %s", t->dir, t->name,
+				strerror(errno));
+			continue;
+		}
+		printf("Delete subvolume (%s): '%s/%s'\n",
+			batch->commit ? "commit" : "no-commit",
+			t->dir, t->name);
+		if (batch->commit == 2 && wait_for_commit(t->dir_fd) < 0) {
+			t->ret = -errno;
+			error("unable to wait for commit after '%s/%s': %s",
+				t->dir, t->name, strerror(errno));
+		}
+	}
+	return NULL;
+}
+
+static int cmp_subvol_target_dir(const void *a, const void *b)
+{
+	const struct subvol_target *ta = a;
+	const struct subvol_target *tb = b;
+
+	return strcmp(ta->dir, tb->dir);
+}
+
+/* Fill the parent directory and name of a target given by path */
+static int resolve_target_path(struct subvol_target *t, const char *path,
+			       int need_id)
+{
+	char *cpath;
+	char *tmp;
+	int fd;
+
+	cpath = realpath(path, NULL);
+	if (!cpath)
+		return -errno;
+	tmp = strdup(cpath);
+	t->dir = tmp ? strdup(dirname(tmp)) : NULL;
+	free(tmp);
+	tmp = strdup(cpath);
+	t->name = tmp ? strdup(basename(tmp)) : NULL;
+	free(tmp);
+	if (need_id) {
+		fd = open(cpath, O_RDONLY | O_DIRECTORY);
+		if (fd >= 0) {
+			if (lookup_ino_rootid(fd, &t->id))
+				t->id = 0;
+			close(fd);
+		}
+	}
+	free(cpath);
+	if (!t->dir || !t->name)
+		return -ENOMEM;
+	return 0;
+}
+
+/* Fill the parent directory and name of a target given by subvolume id */
+static int resolve_target_id(int fd, const char *mnt, const char *mnt_path,
+			     struct subvol_refs *refs, struct subvol_target *t)
+{
+	struct subvol_ref *ref;
+	char dir[PATH_MAX];
+	int len = strlen(mnt_path);
+	int ret;
+
+	ref = find_subvol_ref(refs, t->id);
+	if (!ref)
+		return -ENOENT;
+	ret = subvol_parent_dir(fd, refs, t->id, dir, sizeof(dir));
+	if (ret)
+		return ret;
+	/* the subvolume must be reachable from the mounted subvolume */
+	if (len && (strncmp(dir, mnt_path, len) || dir[len] != '/'))
+		return -EXDEV;
+	t->dir = malloc(strlen(mnt) + strlen(dir + len) + 2);
+	t->name = strdup(ref->name);
+	if (!t->dir || !t->name)
+		return -ENOMEM;
+	sprintf(t->dir, "%s/%s", mnt, dir + len + (len ? 1 : 0));
+	/* drop the trailing slash */
+	t->dir[strlen(t->dir) - 1] = 0;
+	return 0;
+}
+
+/*
+ * Batch entries of the form id:<subvolid> name a subvolume by id, anything
+ * else is a path.  Returns 1 and sets @id for an id, 0 for a path or
+ * -EINVAL for a malformed id.
+ */
+static int parse_batch_entry_id(const char *entry, u64 *id)
+{
+	char *end;
+
+	if (strncmp(entry, "id:", 3))
+		return 0;
+	entry += 3;
+	if (!isdigit(entry[0]))
+		return -EINVAL;
+	errno = 0;
+	*id = strtoull(entry, &end, 10);
+	if (errno || *end)
+		return -EINVAL;
+	return 1;
+}
+
+static int get_fd_fsid(int fd, u8 *fsid)
+{
+	struct btrfs_ioctl_fs_info_args args;
+
+	memset(&args, 0, sizeof(args));
+	if (ioctl(fd, BTRFS_IOC_FS_INFO, &args) < 0)
+		return -errno;
+	memcpy(fsid, args.fsid, BTRFS_FSID_SIZE);
+	return 0;
+}
+
+static int add_batch_entry(char ***entries, int *nr, int *alloc,
+			   const char *entry)
+{
+	if (*nr == *alloc) {
+		char **tmp;
+		int n = max(*alloc * 2, 64);
+
+		tmp = realloc(*entries, n * sizeof(char *));
+		if (!tmp)
+			return -ENOMEM;
+		*entries = tmp;
+		*alloc = n;
+	}
+	(*entries)[*nr] = strdup(entry);
+	if (!(*entries)[*nr])
+		return -ENOMEM;
+	(*nr)++;
+	return 0;
+}
+
+static int subvol_delete_batch(const char *mnt, char **argv, int argc,
+			       int use_stdin, int jobs, int commit,
+			       int wait_clean)
+{
+	struct subvol_delete_batch batch;
+	struct subvol_refs refs = { 0 };
+	struct subvol_target *targets = NULL;
+	const char *mnt_path = "";
+	pthread_t *threads = NULL;
+	char **entries = NULL;
+	char line[PATH_MAX];
+	DIR *dirstream = NULL;
+	u8 fsid[BTRFS_FSID_SIZE];
+	u8 dir_fsid[BTRFS_FSID_SIZE];
+	u64 *ids = NULL;
+	u64 mnt_root;
+	int nr_entries = 0;
+	int alloc_entries = 0;
+	int have_ids = 0;
+	int started = 0;
+	int deleted = 0;
+	int nr_ids = 0;
+	int ret = 0;
+	int fd;
+	int i;
+
+	fd = btrfs_open_dir(mnt, &dirstream, 1);
+	if (fd < 0)
+		return 1;
+	ret = get_fd_fsid(fd, fsid);
+	if (ret) {
+		error("cannot get filesystem info of %s: %s", mnt,
+			strerror(-ret));
+		close_file_or_dir(fd, dirstream);
+		return 1;
+	}
+
+	for (i = 0; i < argc; i++)
+		if (add_batch_entry(&entries, &nr_entries, &alloc_entries,
+				    argv[i]))
+			goto oom;
+	while (use_stdin && fgets(line, sizeof(line), stdin)) {
+		line[strcspn(line, "\n")] = 0;
+		if (!line[0])
+			continue;
+		if (add_batch_entry(&entries, &nr_entries, &alloc_entries,
+				    line))
+			goto oom;
+	}
+	if (!nr_entries) {
+		error("no subvolumes to delete");
+		ret = 1;
+		goto out;
+	}
+
+	targets = calloc(nr_entries, sizeof(*targets));
+	if (!targets)
+		goto oom;
+	for (i = 0; i < nr_entries; i++) {
+		targets[i].dir_fd = -1;
+		if (parse_batch_entry_id(entries[i], &targets[i].id))
+			have_ids = 1;
+	}
+
+	if (have_ids) {
+		ret = load_subvol_refs(fd, &refs);
+		if (!ret)
+			ret = lookup_ino_rootid(fd, &mnt_root);
+		if (!ret && mnt_root != BTRFS_FS_TREE_OBJECTID) {
+			mnt_path = subvol_ref_path(fd, &refs, mnt_root);
+			if (!mnt_path)
+				ret = -ENOENT;
+		}
+		if (ret) {
+			error("cannot resolve subvolume ids: %s",
+				strerror(-ret));
+			ret = 1;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < nr_entries; i++) {
+		struct subvol_target *t = &targets[i];
+
+		t->ret = parse_batch_entry_id(entries[i], &t->id);
+		if (t->ret > 0)
+			t->ret = resolve_target_id(fd, mnt, mnt_path, &refs, t);
+		else if (!t->ret)
+			t->ret = resolve_target_path(t, entries[i], wait_clean);
+		if (t->ret) {
+			error("cannot resolve subvolume %s: %s", entries[i],
+				t->ret == -EXDEV ?
+				"not reachable from the mount point" :
+				strerror(-t->ret));
+			ret = 1;
+		}
+		if (!t->dir) {
+			free(t->name);
+			t->name = NULL;
+			t->dir = strdup(entries[i]);
+			if (!t->dir)
+				goto oom;
+		}
+	}
+
+	/* open each parent directory once */
+	qsort(targets, nr_entries, sizeof(*targets), cmp_subvol_target_dir);
+	for (i = 0; i < nr_entries; i++) {
+		struct subvol_target *t = &targets[i];
+
+		if (t->ret)
+			continue;
+		if (i && !targets[i - 1].ret &&
+		    !strcmp(targets[i - 1].dir, t->dir)) {
+			t->dir_fd = targets[i - 1].dir_fd;
+			continue;
+		}
+		t->dir_fd = open(t->dir, O_RDONLY | O_DIRECTORY);
+		if (t->dir_fd < 0) {
+			t->ret = -errno;
+			error("cannot open %s: %s", t->dir, strerror(errno));
+			ret = 1;
+			continue;
+		}
+		/* all targets must be on the filesystem mounted at @mnt */
+		if (get_fd_fsid(t->dir_fd, dir_fsid) ||
+		    memcmp(fsid, dir_fsid, BTRFS_FSID_SIZE)) {
+			error("%s is not on the filesystem mounted at %s",
+				t->dir, mnt);
+			close(t->dir_fd);
+			t->dir_fd = -1;
+			t->ret = -EXDEV;
+			ret = 1;
+		}
+	}
+
+	memset(&batch, 0, sizeof(batch));
+	pthread_mutex_init(&batch.lock, NULL);
+	batch.targets = targets;
+	batch.nr = nr_entries;
+	batch.commit = commit;
+	threads = calloc(jobs, sizeof(*threads));
+	for (i = 0; threads && i < jobs; i++) {
+		if (pthread_create(&threads[i], NULL, subvol_delete_worker,
+				   &batch))
+			break;
+		started++;
+	}
+	if (!started)
+		subvol_delete_worker(&batch);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&batch.lock);
+
+	ids = calloc(nr_entries, sizeof(*ids));
+	for (i = 0; i < nr_entries; i++) {
+		if (targets[i].ret) {
+			ret = 1;
+			continue;
+		}
+		deleted++;
+		if (ids && targets[i].id)
+			ids[nr_ids++] = targets[i].id;
+	}
+	printf("Deleted %d of %d subvolumes\n", deleted, nr_entries);
+
+	if (commit == 1 && deleted) {
+		if (wait_for_commit(fd) < 0) {
+			error("unable to wait for commit: %s",
+				strerror(errno));
+			ret = 1;
+		}
+	}
+	if (wait_clean && nr_ids) {
+		if (wait_for_subvolume_cleaning(fd, nr_ids, ids, 1, 0, NULL))
+			ret = 1;
+	}
+	goto out;
+
+oom:
+	error("not enough memory");
+	ret = 1;
+out:
+	for (i = 0; targets && i < nr_entries; i++) {
+		if (targets[i].dir_fd >= 0 &&
+		    (i + 1 == nr_entries ||
+		     targets[i + 1].dir_fd != targets[i].dir_fd))
+			close(targets[i].dir_fd);
+		free(targets[i].dir);
+		free(targets[i].name);
+	}
+	for (i = 0; i < nr_entries; i++)
+		free(entries[i]);
+	free(entries);
+	free(targets);
+	free(threads);
+	free(ids);
+	free_subvol_refs(&refs);
+	close_file_or_dir(fd, dirstream);
+	return ret;
+}
+
 static const char * const cmd_subvol_delete_usage[] = {
 	"btrfs subvolume delete [options] <subvolume> [<subvolume>...]",
+	"btrfs subvolume delete [options] --batch <mount> [<subvolume>|id:<id>...]",
 	"Delete subvolume(s)",
 	"Delete subvolumes from the filesystem. The corresponding directory",
 	"is removed instantly but the data blocks are removed later.",
@@ -246,6 +1044,15 @@ static const char * const cmd_subvol_delete_usage[] = {
 	"",
 	"-c|--commit-after      wait for transaction commit at the end of the operation",
 	"-C|--commit-each       wait for transaction commit after deleting each subvolume",
+	"",
+	"Batch mode deletes many subvolumes of the filesystem mounted at <mount>,",
+	"given as paths or as id:<subvolid>, in parallel:",
+	"",
+	"--batch                the first argument is the mount point",
+	"--stdin                read more subvolumes from stdin, one per line",
+	"                       (implies --batch)",
+	"--jobs <N>             number of parallel deletions (default: 4)",
+	"--wait                 wait until the deleted subvolumes are cleaned",
 	NULL
 };
 
@@ -262,13 +1069,23 @@ static int cmd_subvol_delete(int argc, char **argv)
 	DIR	*dirstream = NULL;
 	int verbose = 0;
 	int commit_mode = 0;
+	int batch = 0;
+	int use_stdin = 0;
+	int wait_clean = 0;
+	int jobs = 4;
 
 	optind = 1;
 	while (1) {
 		int c;
+		enum { GETOPT_VAL_BATCH = 257, GETOPT_VAL_STDIN,
+			GETOPT_VAL_JOBS, GETOPT_VAL_WAIT };
 		static const struct option long_options[] = {
 			{"commit-after", no_argument, NULL, 'c'},  /* commit mode 1 */
 			{"commit-each", no_argument, NULL, 'C'},  /* commit mode 2 */
+			{"batch", no_argument, NULL, GETOPT_VAL_BATCH},
+			{"stdin", no_argument, NULL, GETOPT_VAL_STDIN},
+			{"jobs", required_argument, NULL, GETOPT_VAL_JOBS},
+			{"wait", no_argument, NULL, GETOPT_VAL_WAIT},
 			{NULL, 0, NULL, 0}
 		};
 
@@ -286,6 +1103,26 @@ static int cmd_subvol_delete(int argc, char **argv)
 		case 'v':
 			verbose++;
 			break;
+		case GETOPT_VAL_BATCH:
+			batch = 1;
+			break;
+		case GETOPT_VAL_STDIN:
+			batch = 1;
+			use_stdin = 1;
+			break;
+		case GETOPT_VAL_JOBS: {
+			u64 tmp = arg_strtou64(optarg);
+
+			if (tmp < 1 || tmp > 256) {
+				error("invalid number of jobs: %s", optarg);
+				return 1;
+			}
+			jobs = tmp;
+			break;
+		}
+		case GETOPT_VAL_WAIT:
+			wait_clean = 1;
+			break;
 		default:
 			usage(cmd_subvol_delete_usage);
 		}
@@ -294,6 +1131,15 @@ static int cmd_subvol_delete(int argc, char **argv)
 	if (check_argc_min(argc - optind, 1))
 		usage(cmd_subvol_delete_usage);
 
+	if (wait_clean && !batch) {
+		error("--wait requires --batch");
+		return 1;
+	}
+	if (batch)
+		return subvol_delete_batch(argv[optind], argv + optind + 1,
+					   argc - optind - 1, use_stdin, jobs,
+					   commit_mode, wait_clean);
+
 	if (verbose > 0) {
 		printf("Transaction commit: %s\n",
 			!commit_mode ? "none (default)" :
@@ -1025,156 +1871,15 @@ static const char * const cmd_subvol_sync_usage[] = {
 	"after deletion.",
 	"If no subvolume id is given, wait until all current deletion requests",
 	"are completed, but do not wait for subvolumes deleted meanwhile.",
-	"The status of subvolume ids is checked periodically.",
+	"The status of subvolume ids is checked periodically, the interval",
+	"doubles while nothing changes, up to 16 times the initial one.",
 	"",
 	"-s <N>       sleep N seconds between checks (default: 1)",
+	"--progress   print the number of subvolumes and metadata bytes left",
+	TELEMETRY_USAGE,
 	NULL
 };
 
-#if 0
-/*
- * If we're looking for any dead subvolume, take a shortcut and look
- * for any ORPHAN_ITEMs in the tree root
- */
-static int fs_has_dead_subvolumes(int fd)
-{
-	int ret;
-	struct btrfs_ioctl_search_args args;
-	struct btrfs_ioctl_search_key *sk = &args.key;
-	struct btrfs_ioctl_search_header sh;
-	u64 min_subvolid = 0;
-
-again:
-	sk->tree_id = BTRFS_ROOT_TREE_OBJECTID;
-	sk->min_objectid = BTRFS_ORPHAN_OBJECTID;
-	sk->max_objectid = BTRFS_ORPHAN_OBJECTID;
-	sk->min_type = BTRFS_ORPHAN_ITEM_KEY;
-	sk->max_type = BTRFS_ORPHAN_ITEM_KEY;
-	sk->min_offset = min_subvolid;
-	sk->max_offset = (u64)-1;
-	sk->min_transid = 0;
-	sk->max_transid = (u64)-1;
-	sk->nr_items = 1;
-
-	ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args);
-	if (ret < 0)
-		return -errno;
-
-	if (!sk->nr_items)
-		return 0;
-
-	memcpy(&sh, args.buf, sizeof(sh));
-	min_subvolid = sh.offset;
-
-	/*
-	 * Verify that the root item is really there and we haven't hit
-	 * a stale orphan
-	 */
-	sk->tree_id = BTRFS_ROOT_TREE_OBJECTID;
-	sk->min_objectid = min_subvolid;
-	sk->max_objectid = min_subvolid;
-	sk->min_type = BTRFS_ROOT_ITEM_KEY;
-	sk->max_type = BTRFS_ROOT_ITEM_KEY;
-	sk->min_offset = 0;
-	sk->max_offset = (u64)-1;
-	sk->min_transid = 0;
-	sk->max_transid = (u64)-1;
-	sk->nr_items = 1;
-
-	ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args);
-	if (ret < 0)
-		return -errno;
-
-	/*
-	 * Stale orphan, try the next one
-	 */
-	if (!sk->nr_items) {
-		min_subvolid++;
-		goto again;
-	}
-
-	return 1;
-}
-#endif
-
-#define SUBVOL_ID_BATCH		1024
-
-/*
- * Enumerate all dead subvolumes that exist in the filesystem.
- * Fill @ids and reallocate to bigger size if needed.
- */
-static int enumerate_dead_subvols(int fd, u64 **ids)
-{
-	int ret;
-	struct btrfs_ioctl_search_args args;
-	struct btrfs_ioctl_search_key *sk = &args.key;
-	int idx = 0;
-	int count = 0;
-
-	memset(&args, 0, sizeof(args));
-
-	sk->tree_id = BTRFS_ROOT_TREE_OBJECTID;
-	sk->min_objectid = BTRFS_ORPHAN_OBJECTID;
-	sk->max_objectid = BTRFS_ORPHAN_OBJECTID;
-	sk->min_type = BTRFS_ORPHAN_ITEM_KEY;
-	sk->max_type = BTRFS_ORPHAN_ITEM_KEY;
-	sk->min_offset = 0;
-	sk->max_offset = (u64)-1;
-	sk->min_transid = 0;
-	sk->max_transid = (u64)-1;
-	sk->nr_items = 4096;
-
-	*ids = NULL;
-	while (1) {
-		struct btrfs_ioctl_search_header *sh;
-		unsigned long off;
-		int i;
-
-		ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args);
-		if (ret < 0)
-			return -errno;
-
-		if (!sk->nr_items)
-			return idx;
-
-		off = 0;
-		for (i = 0; i < sk->nr_items; i++) {
-			sh = (struct btrfs_ioctl_search_header*)(args.buf + off);
-			off += sizeof(*sh);
-
-			if (sh->type == BTRFS_ORPHAN_ITEM_KEY) {
-				if (idx >= count) {
-					u64 *newids;
-
-					count += SUBVOL_ID_BATCH;
-					newids = (u64*)realloc(*ids,
-							count * sizeof(u64));
-					if (!newids)
-						return -ENOMEM;
-					*ids = newids;
-				}
-				(*ids)[idx] = sh->offset;
-				idx++;
-			}
-			off += sh->len;
-
-			sk->min_objectid = sh->objectid;
-			sk->min_type = sh->type;
-			sk->min_offset = sh->offset;
-		}
-		if (sk->min_offset < (u64)-1)
-			sk->min_offset++;
-		else
-			break;
-		if (sk->min_type != BTRFS_ORPHAN_ITEM_KEY)
-			break;
-		if (sk->min_objectid != BTRFS_ORPHAN_OBJECTID)
-			break;
-	}
-
-	return idx;
-}
-
 static int cmd_subvol_sync(int argc, char **argv)
 {
 	int fd = -1;
@@ -1184,24 +1889,43 @@ static int cmd_subvol_sync(int argc, char **argv)
 	u64 *ids = NULL;
 	int id_count;
 	int sleep_interval = 1;
+	int progress = 0;
+	struct telemetry tm;
 
+	telemetry_init(&tm);
 	optind = 1;
 	while (1) {
-		int c = getopt(argc, argv, "s:");
+		int c;
+		enum { GETOPT_VAL_PROGRESS = 257 };
+		static const struct option long_options[] = {
+			{ "progress", no_argument, NULL, GETOPT_VAL_PROGRESS },
+			TELEMETRY_LONG_OPTIONS,
+			{ NULL, 0, NULL, 0 }
+		};
 
+		c = getopt_long(argc, argv, "s:", long_options, NULL);
 		if (c < 0)
 			break;
 
+		ret = telemetry_parse_opt(&tm, c, optarg);
+		if (ret < 0) {
+			ret = 1;
+			goto out;
+		}
+		if (ret)
+			continue;
 		switch (c) {
 		case 's':
-			sleep_interval = atoi(argv[optind]);
+			sleep_interval = atoi(optarg);
 			if (sleep_interval < 1) {
-				error("invalid sleep interval %s",
-					argv[optind]);
+				error("invalid sleep interval %s", optarg);
 				ret = 1;
 				goto out;
 			}
 			break;
+		case GETOPT_VAL_PROGRESS:
+			progress = 1;
+			break;
 		default:
 			usage(cmd_subvol_sync_usage);
 		}
@@ -1260,9 +1984,11 @@ static int cmd_subvol_sync(int argc, char **argv)
 		}
 	}
 
-	ret = wait_for_subvolume_cleaning(fd, id_count, ids, sleep_interval);
+	ret = wait_for_subvolume_cleaning(fd, id_count, ids, sleep_interval,
+					  progress, &tm);
 
 out:
+	telemetry_close(&tm);
 	free(ids);
 	close_file_or_dir(fd, dirstream);
 
@@ -2592,6 +2592,244 @@ int btrfs_insert_item(struct btrfs_trans_handle *trans, struct btrfs_root
 	return ret;
 }
 
+/*
+ * Bulk insertion of items in ascending key order.
+ *
+ * Items sorting after everything in the tree are appended to the rightmost
+ * leaf through a path kept between calls, so there is no search from the
+ * root per item.  Full leaves are not split in half; a new empty block is
+ * started to the right instead, and parents are linked bottom-up the same
+ * way.  Leaves and nodes end up filled to the requested percentage instead
+ * of about half.
+ *
+ * The kept path is revalidated on each call, as the tree may have been
+ * modified in between.  Anything that can't be appended takes the normal
+ * btrfs_insert_empty_item() path.  The extent tree always does, allocating
+ * a new block inserts into it behind our back.
+ */
+void btrfs_bulk_insert_init(struct btrfs_bulk_insert *bulk,
+			    struct btrfs_trans_handle *trans,
+			    struct btrfs_root *root, int fill)
+{
+	if (fill <= 0 || fill > 100)
+		fill = BTRFS_BULK_INSERT_FILL;
+
+	memset(bulk, 0, sizeof(*bulk));
+	bulk->trans = trans;
+	bulk->root = root;
+	bulk->leaf_limit = (u64)BTRFS_LEAF_DATA_SIZE(root) * fill / 100;
+	bulk->node_limit = max_t(u32, 2,
+			(u64)BTRFS_NODEPTRS_PER_BLOCK(root) * fill / 100);
+}
+
+void btrfs_bulk_insert_release(struct btrfs_bulk_insert *bulk)
+{
+	btrfs_release_path(&bulk->path);
+}
+
+/*
+ * The kept path is usable if it still leads from the root node along the
+ * last pointers to the leaf, and all blocks on it were COWed in this
+ * transaction.
+ */
+static int bulk_path_valid(struct btrfs_bulk_insert *bulk)
+{
+	struct btrfs_path *path = &bulk->path;
+	struct extent_buffer *eb;
+	u64 transid = bulk->trans->transid;
+	int level;
+	u32 nritems;
+
+	if (!path->nodes[0] || !bulk->root->node)
+		return 0;
+	level = btrfs_header_level(bulk->root->node);
+	if (path->nodes[level] != bulk->root->node)
+		return 0;
+
+	for (; level > 0; level--) {
+		eb = path->nodes[level];
+		nritems = btrfs_header_nritems(eb);
+		if (!path->nodes[level - 1] || nritems == 0 ||
+		    path->slots[level] != nritems - 1 ||
+		    btrfs_header_generation(eb) != transid ||
+		    btrfs_node_blockptr(eb, nritems - 1) !=
+		    path->nodes[level - 1]->start)
+			return 0;
+	}
+	return btrfs_header_generation(path->nodes[0]) == transid;
+}
+
+/*
+ * Point the kept path at the last item of the tree and copy its key to
+ * @key.  Returns 0 if found, 1 if the tree is empty, < 0 on error.
+ */
+int btrfs_bulk_insert_last_key(struct btrfs_bulk_insert *bulk,
+			       struct btrfs_key *key)
+{
+	struct btrfs_path *path = &bulk->path;
+	struct btrfs_key max_key;
+	u32 nritems;
+	int ret;
+
+	if (!bulk_path_valid(bulk)) {
+		btrfs_release_path(path);
+		max_key.objectid = (u64)-1;
+		max_key.type = (u8)-1;
+		max_key.offset = (u64)-1;
+		ret = btrfs_search_slot(bulk->trans, bulk->root, &max_key,
+					path, 0, 1);
+		if (ret < 0)
+			return ret;
+	}
+
+	nritems = btrfs_header_nritems(path->nodes[0]);
+	if (nritems == 0)
+		return 1;
+	path->slots[0] = nritems - 1;
+	btrfs_item_key_to_cpu(path->nodes[0], key, nritems - 1);
+	return 0;
+}
+
+/*
+ * Start an empty block right of path->nodes[level] with @key as its first
+ * key, making room in the parents first.  The path points to the new block.
+ */
+static int bulk_add_right_block(struct btrfs_bulk_insert *bulk, int level,
+				struct btrfs_disk_key *key)
+{
+	struct btrfs_trans_handle *trans = bulk->trans;
+	struct btrfs_root *root = bulk->root;
+	struct btrfs_path *path = &bulk->path;
+	struct extent_buffer *eb;
+	u32 nritems;
+	int ret;
+
+	if (level + 1 >= BTRFS_MAX_LEVEL)
+		return -EOVERFLOW;
+
+	if (!path->nodes[level + 1]) {
+		ret = insert_new_root(trans, root, path, level + 1);
+		if (ret)
+			return ret;
+	}
+	if (btrfs_header_nritems(path->nodes[level + 1]) >= bulk->node_limit) {
+		ret = bulk_add_right_block(bulk, level + 1, key);
+		if (ret)
+			return ret;
+	}
+
+	eb = btrfs_alloc_free_block(trans, root,
+				    level ? root->nodesize : root->leafsize,
+				    root->root_key.objectid, key, level,
+				    path->nodes[level]->start, 0);
+	if (IS_ERR(eb))
+		return PTR_ERR(eb);
+
+	memset_extent_buffer(eb, 0, 0, sizeof(struct btrfs_header));
+	btrfs_set_header_bytenr(eb, eb->start);
+	btrfs_set_header_generation(eb, trans->transid);
+	btrfs_set_header_backref_rev(eb, BTRFS_MIXED_BACKREF_REV);
+	btrfs_set_header_owner(eb, root->root_key.objectid);
+	btrfs_set_header_level(eb, level);
+	write_extent_buffer(eb, root->fs_info->fsid,
+			    btrfs_header_fsid(), BTRFS_FSID_SIZE);
+	write_extent_buffer(eb, root->fs_info->chunk_tree_uuid,
+			    btrfs_header_chunk_tree_uuid(eb),
+			    BTRFS_UUID_SIZE);
+	btrfs_mark_buffer_dirty(eb);
+
+	nritems = btrfs_header_nritems(path->nodes[level + 1]);
+	ret = insert_ptr(trans, root, path, key, eb->start, nritems,
+			 level + 1);
+	if (ret) {
+		free_extent_buffer(eb);
+		return ret;
+	}
+	path->slots[level + 1] = nritems;
+	free_extent_buffer(path->nodes[level]);
+	path->nodes[level] = eb;
+	path->slots[level] = 0;
+	return 0;
+}
+
+/*
+ * Insert an empty item of @data_size for @key.  On success the path in
+ * @bulk points to the new item.
+ */
+int btrfs_bulk_insert_empty_item(struct btrfs_bulk_insert *bulk,
+				 struct btrfs_key *key, u32 data_size)
+{
+	struct btrfs_root *root = bulk->root;
+	struct btrfs_path *path = &bulk->path;
+	struct extent_buffer *leaf;
+	struct btrfs_item *item;
+	struct btrfs_disk_key disk_key;
+	struct btrfs_key last;
+	u32 need = data_size + sizeof(struct btrfs_item);
+	u32 nritems;
+	u32 used;
+	unsigned int data_end;
+	int ret;
+
+	if (root == root->fs_info->extent_root || !bulk_path_valid(bulk) ||
+	    need > BTRFS_LEAF_DATA_SIZE(root))
+		goto fallback;
+
+	leaf = path->nodes[0];
+	nritems = btrfs_header_nritems(leaf);
+	if (nritems == 0)
+		goto fallback;
+	btrfs_item_key_to_cpu(leaf, &last, nritems - 1);
+	if (btrfs_comp_cpu_keys(key, &last) <= 0)
+		goto fallback;
+
+	btrfs_cpu_key_to_disk(&disk_key, key);
+	used = BTRFS_LEAF_DATA_SIZE(root) - btrfs_leaf_free_space(root, leaf);
+	if (used + need > bulk->leaf_limit) {
+		ret = bulk_add_right_block(bulk, 0, &disk_key);
+		if (ret)
+			return ret;
+		leaf = path->nodes[0];
+		nritems = 0;
+	}
+
+	data_end = leaf_data_end(root, leaf);
+	btrfs_set_item_key(leaf, &disk_key, nritems);
+	item = btrfs_item_nr(nritems);
+	btrfs_set_item_offset(leaf, item, data_end - data_size);
+	btrfs_set_item_size(leaf, item, data_size);
+	btrfs_set_header_nritems(leaf, nritems + 1);
+	btrfs_mark_buffer_dirty(leaf);
+	path->slots[0] = nritems;
+	bulk->appended++;
+	return 0;
+
+fallback:
+	btrfs_release_path(path);
+	ret = btrfs_insert_empty_item(bulk->trans, root, path, key, data_size);
+	if (ret)
+		return ret;
+	bulk->fallbacks++;
+	return 0;
+}
+
+int btrfs_bulk_insert_item(struct btrfs_bulk_insert *bulk,
+			   struct btrfs_key *key, void *data, u32 data_size)
+{
+	struct extent_buffer *leaf;
+	int ret;
+
+	ret = btrfs_bulk_insert_empty_item(bulk, key, data_size);
+	if (ret)
+		return ret;
+	leaf = bulk->path.nodes[0];
+	write_extent_buffer(leaf, data,
+			    btrfs_item_ptr_offset(leaf, bulk->path.slots[0]),
+			    data_size);
+	btrfs_mark_buffer_dirty(leaf);
+	return 0;
+}
+
 /*
  * delete the pointer from a given node.
  *
@@ -2874,6 +3112,182 @@ int btrfs_next_leaf(struct btrfs_root *root, struct btrfs_path *path)
 	return 0;
 }
 
+/*
+ * Iteration over the items of a tree in key order, skipping all subtrees
+ * that were not modified since @min_transid, see btrfs_tree_iter_next().
+ */
+void btrfs_tree_iter_init(struct btrfs_tree_iter *iter,
+			  struct btrfs_root *root, struct btrfs_key *min_key,
+			  u64 min_transid)
+{
+	memset(iter, 0, sizeof(*iter));
+	iter->root = root;
+	iter->key = *min_key;
+	iter->min_transid = min_transid;
+	btrfs_init_path(&iter->path);
+}
+
+void btrfs_tree_iter_release(struct btrfs_tree_iter *iter)
+{
+	btrfs_release_path(&iter->path);
+}
+
+/*
+ * Read ahead the children of the node at @level that are new enough,
+ * starting after @slot.  Each node is read ahead in windows of
+ * BTRFS_TREE_ITER_READA pointers, the next window is started when the
+ * walk gets halfway through the current one.
+ */
+static void tree_iter_reada(struct btrfs_tree_iter *iter, int level, int slot)
+{
+	struct extent_buffer *eb = iter->path.nodes[level];
+	u32 nritems = btrfs_header_nritems(eb);
+	u32 blocksize = btrfs_level_size(iter->root, level - 1);
+	int end;
+	int i;
+
+	if (iter->reada_node[level] != btrfs_header_bytenr(eb)) {
+		iter->reada_node[level] = btrfs_header_bytenr(eb);
+		iter->reada_slot[level] = slot + 1;
+	} else if (slot + BTRFS_TREE_ITER_READA / 2 <
+		   iter->reada_slot[level]) {
+		return;
+	}
+
+	i = max(iter->reada_slot[level], slot + 1);
+	end = min_t(int, nritems, slot + 1 + BTRFS_TREE_ITER_READA);
+	for (; i < end; i++) {
+		if (btrfs_node_ptr_generation(eb, i) < iter->min_transid)
+			continue;
+		readahead_tree_block(iter->root, btrfs_node_blockptr(eb, i),
+				     blocksize,
+				     btrfs_node_ptr_generation(eb, i));
+	}
+	iter->reada_slot[level] = end;
+}
+
+/*
+ * Move the path to the first item at or after @slot of the block at
+ * @level, going up and right past the end of a block and skipping child
+ * pointers older than min_transid.
+ */
+static int tree_iter_walk(struct btrfs_tree_iter *iter, int level, int slot)
+{
+	struct btrfs_path *path = &iter->path;
+	struct extent_buffer *eb;
+	struct extent_buffer *next;
+
+	while (1) {
+		eb = path->nodes[level];
+		if (level) {
+			while (slot < btrfs_header_nritems(eb) &&
+			       btrfs_node_ptr_generation(eb, slot) <
+			       iter->min_transid) {
+				iter->pruned[level - 1]++;
+				iter->pruned_bytes +=
+					btrfs_level_size(iter->root, level - 1);
+				slot++;
+			}
+		}
+		if (slot >= btrfs_header_nritems(eb)) {
+			level++;
+			if (level >= BTRFS_MAX_LEVEL || !path->nodes[level])
+				return 1;
+			slot = path->slots[level] + 1;
+			continue;
+		}
+		path->slots[level] = slot;
+		if (!level)
+			return 0;
+
+		tree_iter_reada(iter, level, slot);
+		next = read_node_slot(iter->root, eb, slot);
+		if (!extent_buffer_uptodate(next)) {
+			free_extent_buffer(next);
+			return -EIO;
+		}
+		iter->visited[level - 1]++;
+		free_extent_buffer(path->nodes[level - 1]);
+		path->nodes[level - 1] = next;
+		level--;
+		slot = 0;
+	}
+}
+
+/*
+ * Descend from the root to the first item at or after iter->key, the
+ * first old pointer on the way is where the walk moves right instead.
+ */
+static int tree_iter_search(struct btrfs_tree_iter *iter)
+{
+	struct btrfs_path *path = &iter->path;
+	struct extent_buffer *eb = iter->root->node;
+	struct extent_buffer *next;
+	int level = btrfs_header_level(eb);
+	int slot;
+	int ret;
+
+	if (btrfs_header_generation(eb) < iter->min_transid) {
+		iter->pruned[level]++;
+		iter->pruned_bytes += eb->len;
+		return 1;
+	}
+	extent_buffer_get(eb);
+	path->nodes[level] = eb;
+	iter->visited[level]++;
+	while (1) {
+		ret = bin_search(eb, &iter->key, level, &slot);
+		if (!level)
+			return tree_iter_walk(iter, 0, slot);
+		if (ret && slot > 0)
+			slot--;
+		if (btrfs_node_ptr_generation(eb, slot) < iter->min_transid)
+			return tree_iter_walk(iter, level, slot);
+
+		path->slots[level] = slot;
+		tree_iter_reada(iter, level, slot);
+		next = read_node_slot(iter->root, eb, slot);
+		if (!extent_buffer_uptodate(next)) {
+			free_extent_buffer(next);
+			return -EIO;
+		}
+		iter->visited[level - 1]++;
+		level--;
+		path->nodes[level] = next;
+		eb = next;
+	}
+}
+
+/*
+ * Return the next item in key order, starting at the min_key given to
+ * btrfs_tree_iter_init().  Only leaves reachable through blocks with a
+ * generation of at least min_transid are visited; all of their items are
+ * returned, whatever was changed in them.
+ *
+ * Returns 0 with @key set and iter->path pointing to the item, 1 when
+ * there are no more items and < 0 on error.
+ */
+int btrfs_tree_iter_next(struct btrfs_tree_iter *iter, struct btrfs_key *key)
+{
+	int ret;
+
+	if (iter->done)
+		return 1;
+	if (!iter->path.nodes[0])
+		ret = tree_iter_search(iter);
+	else
+		ret = tree_iter_walk(iter, 0, iter->path.slots[0] + 1);
+	if (ret) {
+		iter->done = 1;
+		return ret;
+	}
+	btrfs_item_key_to_cpu(iter->path.nodes[0], &iter->key,
+			      iter->path.slots[0]);
+	if (key)
+		*key = iter->key;
+	return 0;
+}
+
 int btrfs_previous_item(struct btrfs_root *root,
 			struct btrfs_path *path, u64 min_objectid,
 			int type)
@@ -38,6 +38,8 @@
 struct btrfs_root;
 struct btrfs_trans_handle;
 struct btrfs_free_space_ctl;
+struct btrfs_backref_cache;
+struct btrfs_dir_cache;
 #define BTRFS_MAGIC 0x4D5F53665248425FULL /* ascii _BHRfS_M, no null */
 
 #define BTRFS_MAX_MIRRORS 3
@@ -560,6 +562,45 @@ struct btrfs_path {
 	unsigned int skip_check_block:1;
 };
 
+/*
+ * state of a sorted bulk insertion, see btrfs_bulk_insert_init()
+ */
+#define BTRFS_BULK_INSERT_FILL	90
+
+struct btrfs_bulk_insert {
+	struct btrfs_trans_handle *trans;
+	struct btrfs_root *root;
+	/* points to the last inserted item in the rightmost leaf */
+	struct btrfs_path path;
+	/* leaf bytes and node pointers used before a new block is started */
+	u32 leaf_limit;
+	u32 node_limit;
+	u64 appended;
+	u64 fallbacks;
+};
+
+/*
+ * state of a tree walk skipping old subtrees, see btrfs_tree_iter_next()
+ */
+#define BTRFS_TREE_ITER_READA	32
+
+struct btrfs_tree_iter {
+	struct btrfs_root *root;
+	struct btrfs_path path;
+	/* the last returned key, or where to start */
+	struct btrfs_key key;
+	u64 min_transid;
+	int done;
+	/* readahead done up to this slot of the node at each level */
+	u64 reada_node[BTRFS_MAX_LEVEL];
+	int reada_slot[BTRFS_MAX_LEVEL];
+	/* blocks read and skipped child pointers, by level of the block */
+	u64 visited[BTRFS_MAX_LEVEL];
+	u64 pruned[BTRFS_MAX_LEVEL];
+	/* size of the skipped blocks, not counting the blocks below them */
+	u64 pruned_bytes;
+};
+
 /*
  * items in the extent btree are used to record the objectid of the
  * owner of the block and the number of references
@@ -945,6 +986,16 @@ struct btrfs_space_info {
 	struct list_head list;
 };
 
+/* A free range of a block group in the allocator index */
+struct btrfs_free_range {
+	struct rb_node offset_node;
+	struct rb_node size_node;
+	u64 offset;
+	u64 bytes;
+	/* largest range in the subtree of offset_node */
+	u64 subtree_max;
+};
+
 struct btrfs_block_group_cache {
 	struct cache_extent cache;
 	struct btrfs_key key;
@@ -956,6 +1007,33 @@ struct btrfs_block_group_cache {
 	u64 flags;
 	int cached;
 	int ro;
+
+	/*
+	 * Free ranges indexed by offset and by size, built from
+	 * fs_info->free_space_cache on first allocation from the group
+	 */
+	struct rb_root free_offset;
+	struct rb_root free_size;
+	u64 free_ranges;
+	int free_indexed;
+};
+
+struct btrfs_alloc_stats {
+	u64 allocs;
+	u64 failed;
+	/* candidates rejected as pinned, excluded or being inserted */
+	u64 retries;
+	/* block groups skipped as their largest free range is too small */
+	u64 skipped_groups;
+	u64 index_builds;
+	/* index found out of sync with the free space cache */
+	u64 index_resyncs;
+	/* where block group free space was populated from */
+	u64 cached_from_tree;
+	u64 cached_from_cache;
+	u64 cached_from_scan;
+	u64 total_ns;
+	u64 max_ns;
 };
 
 struct btrfs_extent_ops {
@@ -1022,6 +1100,11 @@ struct btrfs_fs_info {
 	struct btrfs_fs_devices *fs_devices;
 	struct list_head space_info;
 	int system_allocs;
+	struct btrfs_alloc_stats alloc_stats;
+	/* roots referencing tree blocks, see backref.c */
+	struct btrfs_backref_cache *backref_cache;
+	/* directory index, see dir-item.c, NULL unless enabled */
+	struct btrfs_dir_cache *dir_cache;
 
 	unsigned int readonly:1;
 	unsigned int on_restoring:1;
@@ -1030,6 +1113,8 @@ struct btrfs_fs_info {
 	unsigned int suppress_check_block_errors:1;
 	unsigned int ignore_fsid_mismatch:1;
 	unsigned int ignore_chunk_tree_error:1;
+	/* derive free space from the extent tree only */
+	unsigned int no_free_space_load:1;
 
 	int (*free_extent_hook)(struct btrfs_trans_handle *trans,
 				struct btrfs_root *root,
@@ -1073,6 +1158,8 @@ struct btrfs_root {
 	u32 type;
 	u64 highest_inode;
 	u64 last_inode_alloc;
+	/* next objectid to hand out, 0 until loaded, see inode-map.c */
+	u64 free_objectid;
 
 	/*
 	 * Record orphan data extent ref
@@ -2259,6 +2346,9 @@ int btrfs_reserve_extent(struct btrfs_trans_handle *trans,
 			 struct btrfs_key *ins, int data);
 int btrfs_fix_block_accounting(struct btrfs_trans_handle *trans,
 				 struct btrfs_root *root);
+int btrfs_mark_free_space(struct btrfs_fs_info *info, u64 start, u64 end);
+int btrfs_clear_free_space(struct btrfs_fs_info *info, u64 start, u64 end);
+void btrfs_print_alloc_stats(struct btrfs_fs_info *info);
 void btrfs_pin_extent(struct btrfs_fs_info *fs_info, u64 bytenr, u64 num_bytes);
 void btrfs_unpin_extent(struct btrfs_fs_info *fs_info,
 			u64 bytenr, u64 num_bytes);
@@ -2404,6 +2494,16 @@ static inline int btrfs_del_item(struct btrfs_trans_handle *trans,
 
 int btrfs_insert_item(struct btrfs_trans_handle *trans, struct btrfs_root
 		      *root, struct btrfs_key *key, void *data, u32 data_size);
+void btrfs_bulk_insert_init(struct btrfs_bulk_insert *bulk,
+			    struct btrfs_trans_handle *trans,
+			    struct btrfs_root *root, int fill);
+void btrfs_bulk_insert_release(struct btrfs_bulk_insert *bulk);
+int btrfs_bulk_insert_last_key(struct btrfs_bulk_insert *bulk,
+			       struct btrfs_key *key);
+int btrfs_bulk_insert_empty_item(struct btrfs_bulk_insert *bulk,
+				 struct btrfs_key *key, u32 data_size);
+int btrfs_bulk_insert_item(struct btrfs_bulk_insert *bulk,
+			   struct btrfs_key *key, void *data, u32 data_size);
 int btrfs_insert_empty_items(struct btrfs_trans_handle *trans,
 			     struct btrfs_root *root,
 			     struct btrfs_path *path,
@@ -2419,6 +2519,11 @@ static inline int btrfs_insert_empty_item(struct btrfs_trans_handle *trans,
 }
 
 int btrfs_next_leaf(struct btrfs_root *root, struct btrfs_path *path);
+void btrfs_tree_iter_init(struct btrfs_tree_iter *iter,
+			  struct btrfs_root *root, struct btrfs_key *min_key,
+			  u64 min_transid);
+int btrfs_tree_iter_next(struct btrfs_tree_iter *iter, struct btrfs_key *key);
+void btrfs_tree_iter_release(struct btrfs_tree_iter *iter);
 static inline int btrfs_next_item(struct btrfs_root *root,
 				  struct btrfs_path *p)
 {
@@ -2474,10 +2579,15 @@ int btrfs_insert_xattr_item(struct btrfs_trans_handle *trans,
 			    struct btrfs_root *root, const char *name,
 			    u16 name_len, const void *data, u16 data_len,
 			    u64 dir);
+int btrfs_dir_cache_enable(struct btrfs_fs_info *fs_info);
+void btrfs_dir_cache_free(struct btrfs_fs_info *fs_info);
+void btrfs_dir_cache_drop(struct btrfs_root *root, u64 dir);
+int btrfs_dir_cache_last_index(struct btrfs_root *root, u64 dir, u64 *index);
 /* inode-map.c */
 int btrfs_find_free_objectid(struct btrfs_trans_handle *trans,
 			     struct btrfs_root *fs_root,
 			     u64 dirid, u64 *objectid);
+void btrfs_update_free_objectid(struct btrfs_root *root, u64 objectid);
 
 /* inode-item.c */
 int btrfs_insert_inode_ref(struct btrfs_trans_handle *trans,
@@ -2525,6 +2635,15 @@ int btrfs_insert_inline_extent(struct btrfs_trans_handle *trans,
 int btrfs_csum_file_block(struct btrfs_trans_handle *trans,
 			  struct btrfs_root *root, u64 alloc_end,
 			  u64 bytenr, char *data, size_t len);
+int btrfs_insert_csums(struct btrfs_trans_handle *trans,
+		       struct btrfs_root *root, struct btrfs_bulk_insert *bulk,
+		       u64 bytenr, const char *csums, u64 nr);
+int btrfs_csum_file_range(struct btrfs_trans_handle *trans,
+			  struct btrfs_root *root,
+			  struct btrfs_bulk_insert *bulk, u64 bytenr,
+			  char *data, u64 len);
+int btrfs_lookup_csums_range(struct btrfs_root *root, u64 bytenr, u64 nr,
+			     char *csums, unsigned long *found);
 int btrfs_csum_truncate(struct btrfs_trans_handle *trans,
 			struct btrfs_root *root, struct btrfs_path *path,
 			u64 isize);
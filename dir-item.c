@@ -21,10 +21,424 @@
 #include "disk-io.h"
 #include "hash.h"
 #include "transaction.h"
+#include "extent-cache.h"
 
 static struct btrfs_dir_item *btrfs_match_dir_item_name(struct btrfs_root *root,
 			      struct btrfs_path *path,
 			      const char *name, int name_len);
+static int verify_dir_item(struct btrfs_root *root,
+		    struct extent_buffer *leaf,
+		    struct btrfs_dir_item *dir_item);
+
+/*
+ * Optional in-memory index of directories, enabled by
+ * btrfs_dir_cache_enable().
+ *
+ * The DIR_ITEM and DIR_INDEX items of a directory are read with one scan
+ * of its key range the first time it is looked up, and every name in them
+ * is put in a hash table keyed by the item key, so that lookups of names
+ * or indexes which don't exist are answered without a tree search.  The
+ * DIR_INDEX names are also kept in index order.
+ *
+ * Inserts and deletes done through this file keep the index up to date.
+ * Anything else modifying dir items while the cache is enabled must call
+ * btrfs_dir_cache_drop().
+ */
+#define DIR_CACHE_MAX_ENTRIES	(1 << 22)
+
+struct dir_cache_entry {
+	/* hash chain */
+	struct dir_cache_entry *next;
+	/* DIR_INDEX entries of the directory, by index */
+	struct list_head list;
+	/* key of the item holding the name */
+	u64 offset;
+	u8 key_type;
+	/* the item failed verification, lookups have to search the tree */
+	u8 bad;
+	u16 name_len;
+	char name[];
+};
+
+struct dir_cache_dir {
+	/* objectid is the root, start the directory */
+	struct cache_extent cache;
+	struct dir_cache_entry **table;
+	u32 table_size;
+	u32 nr_entries;
+	struct list_head index_list;
+};
+
+struct btrfs_dir_cache {
+	struct cache_tree dirs;
+	u64 nr_entries;
+};
+
+static inline u32 dir_cache_slot(struct dir_cache_dir *d, u8 key_type,
+				 u64 offset)
+{
+	u64 hash = (offset + key_type) * 0x9E3779B97F4A7C15ULL;
+
+	return (u32)(hash >> 32) & (d->table_size - 1);
+}
+
+static void dir_cache_free_dir(struct dir_cache_dir *d)
+{
+	struct dir_cache_entry *entry;
+	u32 i;
+
+	for (i = 0; i < d->table_size; i++) {
+		while ((entry = d->table[i])) {
+			d->table[i] = entry->next;
+			free(entry);
+		}
+	}
+	free(d->table);
+	free(d);
+}
+
+static void dir_cache_remove_dir(struct btrfs_dir_cache *dc,
+				 struct dir_cache_dir *d)
+{
+	remove_cache_extent(&dc->dirs, &d->cache);
+	dc->nr_entries -= d->nr_entries;
+	dir_cache_free_dir(d);
+}
+
+static void btrfs_dir_cache_free_dirs(struct btrfs_dir_cache *dc)
+{
+	struct cache_extent *ce;
+
+	while ((ce = first_cache_extent(&dc->dirs)))
+		dir_cache_remove_dir(dc, container_of(ce, struct dir_cache_dir,
+						      cache));
+}
+
+static int dir_cache_grow(struct dir_cache_dir *d)
+{
+	struct dir_cache_entry **old = d->table;
+	struct dir_cache_entry *entry;
+	u32 old_size = d->table_size;
+	u32 slot;
+	u32 i;
+
+	d->table = calloc(old_size * 2, sizeof(*d->table));
+	if (!d->table) {
+		d->table = old;
+		return -ENOMEM;
+	}
+	d->table_size = old_size * 2;
+	for (i = 0; i < old_size; i++) {
+		while ((entry = old[i])) {
+			old[i] = entry->next;
+			slot = dir_cache_slot(d, entry->key_type,
+					      entry->offset);
+			entry->next = d->table[slot];
+			d->table[slot] = entry;
+		}
+	}
+	free(old);
+	return 0;
+}
+
+static int dir_cache_add(struct btrfs_dir_cache *dc, struct dir_cache_dir *d,
+			 u8 key_type, u64 offset, const char *name,
+			 u16 name_len, int bad)
+{
+	struct dir_cache_entry *entry;
+	struct dir_cache_entry *cur;
+	u32 slot;
+
+	if (d->nr_entries >= d->table_size && dir_cache_grow(d))
+		return -ENOMEM;
+
+	entry = malloc(sizeof(*entry) + name_len);
+	if (!entry)
+		return -ENOMEM;
+	entry->offset = offset;
+	entry->key_type = key_type;
+	entry->bad = bad;
+	entry->name_len = name_len;
+	memcpy(entry->name, name, name_len);
+
+	slot = dir_cache_slot(d, key_type, offset);
+	entry->next = d->table[slot];
+	d->table[slot] = entry;
+
+	INIT_LIST_HEAD(&entry->list);
+	if (key_type == BTRFS_DIR_INDEX_KEY) {
+		/* new indexes normally go last, look from the tail */
+		list_for_each_entry_reverse(cur, &d->index_list, list) {
+			if (cur->offset <= offset)
+				break;
+		}
+		list_add(&entry->list, &cur->list);
+	}
+	d->nr_entries++;
+	dc->nr_entries++;
+	return 0;
+}
+
+/*
+ * Remove the entry for @name in the item at @key_type/@offset, returns
+ * -ENOENT if there is none.
+ */
+static int dir_cache_del(struct btrfs_dir_cache *dc, struct dir_cache_dir *d,
+			 u8 key_type, u64 offset, const char *name,
+			 u16 name_len)
+{
+	struct dir_cache_entry **p;
+	struct dir_cache_entry *entry;
+
+	p = &d->table[dir_cache_slot(d, key_type, offset)];
+	for (; (entry = *p); p = &entry->next) {
+		if (entry->key_type != key_type || entry->offset != offset ||
+		    entry->bad || entry->name_len != name_len ||
+		    memcmp(entry->name, name, name_len))
+			continue;
+		*p = entry->next;
+		list_del(&entry->list);
+		free(entry);
+		d->nr_entries--;
+		dc->nr_entries--;
+		return 0;
+	}
+	return -ENOENT;
+}
+
+/*
+ * Add the names in the item at path to the cache, an item that
+ * btrfs_match_dir_item_name() would reject gets a bad entry instead.
+ */
+static int dir_cache_add_item(struct btrfs_root *root,
+			      struct btrfs_dir_cache *dc,
+			      struct dir_cache_dir *d, struct btrfs_path *path,
+			      struct btrfs_key *key)
+{
+	struct extent_buffer *leaf = path->nodes[0];
+	struct btrfs_dir_item *di;
+	char name[BTRFS_NAME_LEN];
+	u32 total_len;
+	u32 this_len;
+	u32 cur = 0;
+	u16 name_len;
+	int ret;
+
+	di = btrfs_item_ptr(leaf, path->slots[0], struct btrfs_dir_item);
+	total_len = btrfs_item_size_nr(leaf, path->slots[0]);
+	if (verify_dir_item(root, leaf, di))
+		return dir_cache_add(dc, d, key->type, key->offset, NULL, 0, 1);
+
+	while (cur < total_len) {
+		name_len = btrfs_dir_name_len(leaf, di);
+		this_len = sizeof(*di) + name_len + btrfs_dir_data_len(leaf, di);
+		if (this_len > total_len - cur || name_len > BTRFS_NAME_LEN)
+			return dir_cache_add(dc, d, key->type, key->offset,
+					     NULL, 0, 1);
+		read_extent_buffer(leaf, name, (unsigned long)(di + 1),
+				   name_len);
+		ret = dir_cache_add(dc, d, key->type, key->offset, name,
+				    name_len, 0);
+		if (ret)
+			return ret;
+		cur += this_len;
+		di = (struct btrfs_dir_item *)((char *)di + this_len);
+	}
+	return 0;
+}
+
+static int dir_cache_build(struct btrfs_root *root, struct btrfs_dir_cache *dc,
+			   u64 dir, struct dir_cache_dir **ret_dir)
+{
+	struct dir_cache_dir *d;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	int ret;
+
+	if (dc->nr_entries >= DIR_CACHE_MAX_ENTRIES)
+		btrfs_dir_cache_free_dirs(dc);
+
+	d = calloc(1, sizeof(*d));
+	if (!d)
+		return -ENOMEM;
+	d->table_size = 16;
+	d->table = calloc(d->table_size, sizeof(*d->table));
+	if (!d->table) {
+		free(d);
+		return -ENOMEM;
+	}
+	INIT_LIST_HEAD(&d->index_list);
+	d->cache.objectid = root->objectid;
+	d->cache.start = dir;
+	d->cache.size = 1;
+
+	btrfs_init_path(&path);
+	key.objectid = dir;
+	key.type = BTRFS_DIR_ITEM_KEY;
+	key.offset = 0;
+	ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+	if (ret < 0)
+		goto fail;
+	while (1) {
+		if (path.slots[0] >= btrfs_header_nritems(path.nodes[0])) {
+			ret = btrfs_next_leaf(root, &path);
+			if (ret < 0)
+				goto fail;
+			if (ret > 0)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(path.nodes[0], &key, path.slots[0]);
+		if (key.objectid != dir || key.type > BTRFS_DIR_INDEX_KEY)
+			break;
+		if (key.type == BTRFS_DIR_ITEM_KEY ||
+		    key.type == BTRFS_DIR_INDEX_KEY) {
+			ret = dir_cache_add_item(root, dc, d, &path, &key);
+			if (ret)
+				goto fail;
+		}
+		path.slots[0]++;
+	}
+	btrfs_release_path(&path);
+
+	ret = insert_cache_extent2(&dc->dirs, &d->cache);
+	if (ret)
+		goto fail_free;
+	*ret_dir = d;
+	return 0;
+fail:
+	btrfs_release_path(&path);
+fail_free:
+	dc->nr_entries -= d->nr_entries;
+	dir_cache_free_dir(d);
+	return ret;
+}
+
+/*
+ * Return the cached directory, reading it in first if needed.  NULL means
+ * the cache is disabled or the directory could not be read, the caller
+ * searches the tree then.
+ */
+static struct dir_cache_dir *dir_cache_get(struct btrfs_root *root, u64 dir)
+{
+	struct btrfs_dir_cache *dc = root->fs_info->dir_cache;
+	struct cache_extent *ce;
+	struct dir_cache_dir *d = NULL;
+
+	if (!dc)
+		return NULL;
+	ce = lookup_cache_extent2(&dc->dirs, root->objectid, dir, 1);
+	if (ce)
+		return container_of(ce, struct dir_cache_dir, cache);
+	if (dir_cache_build(root, dc, dir, &d))
+		return NULL;
+	return d;
+}
+
+/* Same as dir_cache_get(), but doesn't read in uncached directories */
+static struct dir_cache_dir *dir_cache_find(struct btrfs_root *root, u64 dir)
+{
+	struct btrfs_dir_cache *dc = root->fs_info->dir_cache;
+	struct cache_extent *ce;
+
+	if (!dc)
+		return NULL;
+	ce = lookup_cache_extent2(&dc->dirs, root->objectid, dir, 1);
+	if (!ce)
+		return NULL;
+	return container_of(ce, struct dir_cache_dir, cache);
+}
+
+/*
+ * Returns 1 if the cache knows the item at @key_type/@offset has no entry
+ * named @name (or no entry at all if @name is NULL), 0 if the tree has to
+ * be searched.
+ */
+static int dir_cache_absent(struct btrfs_root *root, u64 dir, u8 key_type,
+			    u64 offset, const char *name, int name_len)
+{
+	struct dir_cache_dir *d = dir_cache_get(root, dir);
+	struct dir_cache_entry *entry;
+
+	if (!d)
+		return 0;
+	entry = d->table[dir_cache_slot(d, key_type, offset)];
+	for (; entry; entry = entry->next) {
+		if (entry->key_type != key_type || entry->offset != offset)
+			continue;
+		if (!name || entry->bad)
+			return 0;
+		if (entry->name_len == name_len &&
+		    !memcmp(entry->name, name, name_len))
+			return 0;
+	}
+	return 1;
+}
+
+static void dir_cache_insert(struct btrfs_root *root, u64 dir, u8 key_type,
+			     u64 offset, const char *name, int name_len)
+{
+	struct dir_cache_dir *d = dir_cache_find(root, dir);
+
+	if (d && dir_cache_add(root->fs_info->dir_cache, d, key_type, offset,
+			       name, name_len, 0))
+		btrfs_dir_cache_drop(root, dir);
+}
+
+int btrfs_dir_cache_enable(struct btrfs_fs_info *fs_info)
+{
+	struct btrfs_dir_cache *dc;
+
+	if (fs_info->dir_cache)
+		return 0;
+	dc = calloc(1, sizeof(*dc));
+	if (!dc)
+		return -ENOMEM;
+	cache_tree_init(&dc->dirs);
+	fs_info->dir_cache = dc;
+	return 0;
+}
+
+void btrfs_dir_cache_free(struct btrfs_fs_info *fs_info)
+{
+	struct btrfs_dir_cache *dc = fs_info->dir_cache;
+
+	if (!dc)
+		return;
+	btrfs_dir_cache_free_dirs(dc);
+	free(dc);
+	fs_info->dir_cache = NULL;
+}
+
+/*
+ * Forget the cached items of @dir, needed after modifying its dir items
+ * other than through this file.
+ */
+void btrfs_dir_cache_drop(struct btrfs_root *root, u64 dir)
+{
+	struct dir_cache_dir *d = dir_cache_find(root, dir);
+
+	if (d)
+		dir_cache_remove_dir(root->fs_info->dir_cache, d);
+}
+
+/*
+ * Find the highest DIR_INDEX of @dir.  Returns 0 and sets @index if the
+ * cache has the answer, -ENOENT if the directory has no index items and
+ * 1 if the tree has to be searched.
+ */
+int btrfs_dir_cache_last_index(struct btrfs_root *root, u64 dir, u64 *index)
+{
+	struct dir_cache_dir *d = dir_cache_get(root, dir);
+
+	if (!d)
+		return 1;
+	if (list_empty(&d->index_list))
+		return -ENOENT;
+	*index = list_entry(d->index_list.prev, struct dir_cache_entry,
+			    list)->offset;
+	return 0;
+}
 
 static struct btrfs_dir_item *insert_with_overflow(struct btrfs_trans_handle
 						   *trans,
@@ -148,6 +562,8 @@ int btrfs_insert_dir_item(struct btrfs_trans_handle *trans, struct btrfs_root
 
 	write_extent_buffer(leaf, name, name_ptr, name_len);
 	btrfs_mark_buffer_dirty(leaf);
+	dir_cache_insert(root, dir, BTRFS_DIR_ITEM_KEY, key.offset, name,
+			 name_len);
 
 	/* FIXME, use some real flag for selecting the extra index */
 	if (root == root->fs_info->tree_root) {
@@ -173,6 +589,8 @@ int btrfs_insert_dir_item(struct btrfs_trans_handle *trans, struct btrfs_root
 	name_ptr = (unsigned long)(dir_item + 1);
 	write_extent_buffer(leaf, name, name_ptr, name_len);
 	btrfs_mark_buffer_dirty(leaf);
+	dir_cache_insert(root, dir, BTRFS_DIR_INDEX_KEY, index, name,
+			 name_len);
 out:
 	btrfs_free_path(path);
 	if (ret)
@@ -200,6 +618,10 @@ struct btrfs_dir_item *btrfs_lookup_dir_item(struct btrfs_trans_handle *trans,
 
 	key.offset = btrfs_name_hash(name, name_len);
 
+	if (dir_cache_absent(root, dir, BTRFS_DIR_ITEM_KEY, key.offset,
+			     name, name_len))
+		return NULL;
+
 	ret = btrfs_search_slot(trans, root, &key, path, ins_len, cow);
 	if (ret < 0)
 		return ERR_PTR(ret);
@@ -235,6 +657,9 @@ struct btrfs_dir_item *btrfs_lookup_dir_index(struct btrfs_trans_handle *trans,
 	key.type = BTRFS_DIR_INDEX_KEY;
 	key.offset = index;
 
+	if (dir_cache_absent(root, dir, BTRFS_DIR_INDEX_KEY, index, NULL, 0))
+		return ERR_PTR(-ENOENT);
+
 	ret = btrfs_search_slot(trans, root, &key, path, ins_len, cow);
 	if (ret < 0)
 		return ERR_PTR(ret);
@@ -255,11 +680,28 @@ int btrfs_delete_one_dir_name(struct btrfs_trans_handle *trans,
 {
 
 	struct extent_buffer *leaf;
+	struct dir_cache_dir *d;
+	struct btrfs_key key;
+	char name[BTRFS_NAME_LEN];
+	u16 name_len;
 	u32 sub_item_len;
 	u32 item_len;
 	int ret = 0;
 
 	leaf = path->nodes[0];
+	btrfs_item_key_to_cpu(leaf, &key, path->slots[0]);
+	name_len = btrfs_dir_name_len(leaf, di);
+	d = NULL;
+	if (key.type == BTRFS_DIR_ITEM_KEY || key.type == BTRFS_DIR_INDEX_KEY)
+		d = dir_cache_find(root, key.objectid);
+	if (d && name_len > BTRFS_NAME_LEN) {
+		btrfs_dir_cache_drop(root, key.objectid);
+		d = NULL;
+	}
+	if (d)
+		read_extent_buffer(leaf, name, (unsigned long)(di + 1),
+				   name_len);
+
 	sub_item_len = sizeof(*di) + btrfs_dir_name_len(leaf, di) +
 		btrfs_dir_data_len(leaf, di);
 	item_len = btrfs_item_size_nr(leaf, path->slots[0]);
@@ -274,6 +716,9 @@ int btrfs_delete_one_dir_name(struct btrfs_trans_handle *trans,
 			item_len - (ptr + sub_item_len - start));
 		btrfs_truncate_item(trans, root, path, item_len - sub_item_len, 1);
 	}
+	if (d && (ret || dir_cache_del(root->fs_info->dir_cache, d, key.type,
+				       key.offset, name, name_len)))
+		btrfs_dir_cache_drop(root, key.objectid);
 	return ret;
 }
 
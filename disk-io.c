@@ -33,6 +33,7 @@
 #include "utils.h"
 #include "print-tree.h"
 #include "rbtree-utils.h"
+#include "backref.h"
 
 /* specified errno for check_tree_block */
 #define BTRFS_BAD_BYTENR		(-1)
@@ -210,6 +211,281 @@ void readahead_tree_block(struct btrfs_root *root, u64 bytenr, u32 blocksize,
 	kfree(multi);
 }
 
+#define PREFETCH_WINDOW		256
+#define PREFETCH_BATCH		128
+/* nodes of the parent level hinted past the one being filled from */
+#define PREFETCH_NODES_AHEAD	4
+
+struct prefetch_block {
+	u64 bytenr;
+	u64 devid;
+	u64 physical;
+	int fd;
+};
+
+void btrfs_prefetch_init(struct btrfs_prefetch *pf, struct btrfs_root *root,
+			 struct extent_buffer *node)
+{
+	memset(pf, 0, sizeof(*pf));
+	pf->root = root;
+	pf->node = node;
+	extent_buffer_get(node);
+	pf->max_key.objectid = (u64)-1;
+	pf->max_key.type = (u8)-1;
+	pf->max_key.offset = (u64)-1;
+	pf->window = PREFETCH_WINDOW;
+	pf->flags = BTRFS_PREFETCH_PHYSICAL;
+}
+
+void btrfs_prefetch_release(struct btrfs_prefetch *pf)
+{
+	int i;
+
+	for (i = 0; i < BTRFS_MAX_LEVEL; i++) {
+		free(pf->scratch[i]);
+		pf->scratch[i] = NULL;
+	}
+	free(pf->queue);
+	pf->queue = NULL;
+	pf->nr = 0;
+	free_extent_buffer(pf->node);
+	pf->node = NULL;
+}
+
+static int prefetch_cmp_physical(const void *a, const void *b)
+{
+	const struct prefetch_block *ba = a;
+	const struct prefetch_block *bb = b;
+
+	if (ba->devid != bb->devid)
+		return ba->devid < bb->devid ? -1 : 1;
+	if (ba->physical != bb->physical)
+		return ba->physical < bb->physical ? -1 : 1;
+	return 0;
+}
+
+static void prefetch_map(struct btrfs_fs_info *fs_info,
+			 struct prefetch_block *blk)
+{
+	struct btrfs_multi_bio *multi = NULL;
+	struct btrfs_device *device;
+	u64 length;
+
+	blk->fd = -1;
+	blk->devid = (u64)-1;
+	blk->physical = blk->bytenr;
+	if (btrfs_map_block(&fs_info->mapping_tree, READ, blk->bytenr,
+			    &length, &multi, 0, NULL))
+		return;
+	device = multi->stripes[0].dev;
+	if (device->fd > 0) {
+		blk->fd = device->fd;
+		blk->devid = device->devid;
+		blk->physical = multi->stripes[0].physical;
+	}
+	kfree(multi);
+}
+
+/* Last slot of @node whose key is not after @key, or 0 */
+static int prefetch_find_slot(struct extent_buffer *node,
+			      struct btrfs_key *key)
+{
+	struct btrfs_key cur;
+	int low = 0;
+	int high = btrfs_header_nritems(node);
+	int mid;
+
+	while (low < high) {
+		mid = (low + high) / 2;
+		btrfs_node_key_to_cpu(node, &cur, mid);
+		if (btrfs_comp_cpu_keys(&cur, key) <= 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low ? low - 1 : 0;
+}
+
+/*
+ * Read the child at @slot of @parent into the scratch buffer of @level,
+ * bypassing the extent buffer cache so that a bad block is left to the
+ * consumer to report.  Returns NULL if it can't be read or does not look
+ * like the expected node.
+ */
+static struct extent_buffer *prefetch_read_node(struct btrfs_prefetch *pf,
+		struct extent_buffer *parent, int slot, int level)
+{
+	struct btrfs_root *root = pf->root;
+	struct extent_buffer *eb = pf->scratch[level];
+	struct prefetch_block blk;
+	u32 nodesize = root->nodesize;
+
+	if (!eb) {
+		eb = calloc(1, sizeof(*eb) + nodesize);
+		if (!eb)
+			return NULL;
+		eb->len = nodesize;
+		eb->refs = 1;
+		eb->fd = -1;
+		pf->scratch[level] = eb;
+	}
+
+	blk.bytenr = btrfs_node_blockptr(parent, slot);
+	prefetch_map(root->fs_info, &blk);
+	if (blk.fd < 0 ||
+	    pread64(blk.fd, eb->data, nodesize, blk.physical) != nodesize)
+		return NULL;
+	eb->start = blk.bytenr;
+
+	if (btrfs_header_bytenr(eb) != blk.bytenr ||
+	    btrfs_header_generation(eb) !=
+			btrfs_node_ptr_generation(parent, slot) ||
+	    btrfs_header_level(eb) != level ||
+	    btrfs_header_nritems(eb) > BTRFS_NODEPTRS_PER_BLOCK(root))
+		return NULL;
+	return eb;
+}
+
+/*
+ * Hint the blocks of @pf->level from @pf->next_key on, up to the end of
+ * the node holding their pointers or until the window is full, plus the
+ * next few nodes at the level of that node.  Returns the number of blocks
+ * added to the window.
+ */
+static int prefetch_fill(struct btrfs_prefetch *pf)
+{
+	struct prefetch_block blks[PREFETCH_BATCH + PREFETCH_NODES_AHEAD];
+	struct extent_buffer *nodes[BTRFS_MAX_LEVEL];
+	int slots[BTRFS_MAX_LEVEL];
+	struct btrfs_key key;
+	int parent = pf->level + 1;
+	int top = btrfs_header_level(pf->node);
+	int level;
+	int added = 0;
+	int nr = 0;
+	int slot;
+	u32 nritems;
+	int i;
+
+	if (top < parent || top >= BTRFS_MAX_LEVEL) {
+		pf->done = 1;
+		return 0;
+	}
+
+	nodes[top] = pf->node;
+	for (level = top; ; level--) {
+		slots[level] = prefetch_find_slot(nodes[level], &pf->next_key);
+		if (level == parent)
+			break;
+		nodes[level - 1] = prefetch_read_node(pf, nodes[level],
+						      slots[level], level - 1);
+		if (!nodes[level - 1]) {
+			pf->done = 1;
+			return 0;
+		}
+	}
+
+	nritems = btrfs_header_nritems(nodes[parent]);
+	for (slot = slots[parent]; slot < nritems; slot++) {
+		btrfs_node_key_to_cpu(nodes[parent], &key, slot);
+		if (btrfs_comp_cpu_keys(&key, &pf->max_key) > 0) {
+			pf->done = 1;
+			break;
+		}
+		if (pf->nr == pf->window || nr == PREFETCH_BATCH)
+			break;
+		blks[nr++].bytenr = btrfs_node_blockptr(nodes[parent], slot);
+		pf->queue[(pf->head + pf->nr) % pf->window] = key;
+		pf->nr++;
+	}
+	added = nr;
+
+	if (!pf->done && slot < nritems) {
+		pf->next_key = key;
+	} else if (!pf->done) {
+		/* continue with the first key of the next node at @parent */
+		for (level = parent + 1; level <= top; level++) {
+			if (slots[level] + 1 <
+			    btrfs_header_nritems(nodes[level])) {
+				btrfs_node_key_to_cpu(nodes[level],
+						      &pf->next_key,
+						      slots[level] + 1);
+				break;
+			}
+		}
+		if (level > top)
+			pf->done = 1;
+	}
+
+	if (parent < top) {
+		nritems = btrfs_header_nritems(nodes[parent + 1]);
+		for (i = 1; i <= PREFETCH_NODES_AHEAD &&
+			    slots[parent + 1] + i < nritems; i++)
+			blks[nr++].bytenr = btrfs_node_blockptr(
+					nodes[parent + 1],
+					slots[parent + 1] + i);
+	}
+
+	for (i = 0; i < nr; i++)
+		prefetch_map(pf->root->fs_info, &blks[i]);
+	if (pf->flags & BTRFS_PREFETCH_PHYSICAL)
+		qsort(blks, nr, sizeof(*blks), prefetch_cmp_physical);
+	for (i = 0; i < nr; i++) {
+		if (blks[i].fd < 0)
+			continue;
+		readahead(blks[i].fd, blks[i].physical, pf->root->nodesize);
+		pf->blocks_hinted++;
+	}
+	pf->batches++;
+	return added;
+}
+
+/*
+ * Move the window of @pf to the walk position @key, see struct
+ * btrfs_prefetch.  The blocks at or before @key are dropped from the
+ * window and it is refilled once it is down to half its size.  Going back
+ * before the window restarts it from @key.
+ */
+void btrfs_prefetch_update(struct btrfs_prefetch *pf, struct btrfs_key *key)
+{
+	struct btrfs_key *next;
+
+	if (!pf->queue) {
+		if (!pf->window)
+			return;
+		pf->queue = malloc(pf->window * sizeof(*pf->queue));
+		if (!pf->queue)
+			return;
+		pf->next_key = pf->min_key;
+	}
+
+	while (pf->nr > 1) {
+		next = &pf->queue[(pf->head + 1) % pf->window];
+		if (btrfs_comp_cpu_keys(next, key) > 0)
+			break;
+		pf->head = (pf->head + 1) % pf->window;
+		pf->nr--;
+	}
+	if (pf->nr == 1 && !pf->done &&
+	    btrfs_comp_cpu_keys(&pf->next_key, key) <= 0)
+		pf->nr = 0;
+
+	if (pf->nr && btrfs_comp_cpu_keys(key, &pf->queue[pf->head]) < 0) {
+		pf->nr = 0;
+		pf->done = 0;
+		pf->next_key = *key;
+	} else if (!pf->nr && !pf->done &&
+		   btrfs_comp_cpu_keys(&pf->next_key, key) < 0) {
+		pf->next_key = *key;
+	}
+	if (btrfs_comp_cpu_keys(&pf->next_key, &pf->min_key) < 0)
+		pf->next_key = pf->min_key;
+
+	while (!pf->done && pf->nr <= pf->window / 2)
+		if (prefetch_fill(pf) <= 0)
+			break;
+}
+
 static int verify_parent_transid(struct extent_io_tree *io_tree,
 				 struct extent_buffer *eb, u64 parent_transid,
 				 int ignore)
@@ -472,6 +748,7 @@ int __setup_root(u32 nodesize, u32 leafsize, u32 sectorsize,
 	root->last_trans = 0;
 	root->highest_inode = 0;
 	root->last_inode_alloc = 0;
+	root->free_objectid = 0;
 
 	INIT_LIST_HEAD(&root->dirty_list);
 	INIT_LIST_HEAD(&root->orphan_data_extents);
@@ -600,6 +877,7 @@ commit_tree:
 	root->commit_root = NULL;
 	fs_info->running_transaction = NULL;
 	fs_info->last_trans_committed = transid;
+	btrfs_backref_cache_free(fs_info);
 	return 0;
 }
 
@@ -1738,6 +2016,8 @@ int close_ctree_fs_info(struct btrfs_fs_info *fs_info)
 	btrfs_release_all_roots(fs_info);
 	btrfs_close_devices(fs_info->fs_devices);
 	btrfs_cleanup_all_caches(fs_info);
+	btrfs_backref_cache_free(fs_info);
+	btrfs_dir_cache_free(fs_info);
 	btrfs_free_fs_info(fs_info);
 	return 0;
 }
@@ -93,6 +93,47 @@ void readahead_tree_block(struct btrfs_root *root, u64 bytenr, u32 blocksize,
 struct extent_buffer* btrfs_find_create_tree_block(
 		struct btrfs_fs_info *fs_info, u64 bytenr, u32 blocksize);
 
+/* Dispatch each prefetch batch in device/physical order */
+#define BTRFS_PREFETCH_PHYSICAL		(1U << 0)
+
+/*
+ * Sliding readahead window over one level of the tree below @node.
+ *
+ * The consumer walks the tree in key order and reports where it is with
+ * btrfs_prefetch_update() before reading each block.  The next @window
+ * blocks at @level after that position, within @min_key..@max_key, are
+ * kept hinted with readahead(2), together with the next few nodes of the
+ * level above.  The fields can be adjusted between btrfs_prefetch_init()
+ * and the first update.
+ */
+struct btrfs_prefetch {
+	struct btrfs_root *root;
+	struct extent_buffer *node;
+	struct btrfs_key min_key;
+	struct btrfs_key max_key;
+	int level;
+	u32 window;
+	unsigned int flags;
+
+	/* first keys of the hinted blocks, a ring of @window entries */
+	struct btrfs_key *queue;
+	u32 head;
+	u32 nr;
+	/* where the next fill starts, @done once past @max_key */
+	struct btrfs_key next_key;
+	int done;
+	struct extent_buffer *scratch[BTRFS_MAX_LEVEL];
+
+	/* statistics */
+	u64 blocks_hinted;
+	u64 batches;
+};
+
+void btrfs_prefetch_init(struct btrfs_prefetch *pf, struct btrfs_root *root,
+			 struct extent_buffer *node);
+void btrfs_prefetch_update(struct btrfs_prefetch *pf, struct btrfs_key *key);
+void btrfs_prefetch_release(struct btrfs_prefetch *pf);
+
 int __setup_root(u32 nodesize, u32 leafsize, u32 sectorsize,
                         u32 stripesize, struct btrfs_root *root,
                         struct btrfs_fs_info *fs_info, u64 objectid);
@@ -20,8 +20,10 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <math.h>
+#include <time.h>
 #include "kerncompat.h"
 #include "radix-tree.h"
+#include "rbtree_augmented.h"
 #include "ctree.h"
 #include "disk-io.h"
 #include "print-tree.h"
@@ -29,6 +31,7 @@
 #include "crc32c.h"
 #include "volumes.h"
 #include "free-space-cache.h"
+#include "free-space-tree.h"
 #include "utils.h"
 
 #define PENDING_EXTENT_INSERT 0
@@ -62,6 +65,389 @@ static struct btrfs_block_group_cache *
 btrfs_find_block_group(struct btrfs_root *root, struct btrfs_block_group_cache
 		       *hint, u64 search_start, int data, int owner);
 
+/*
+ * fs_info->free_space_cache is the record of free space, the allocator
+ * looks it up through an index of the free ranges of each block group:
+ *
+ * - by offset, with the largest range of each subtree, to find the first
+ *   range after an offset that fits (next-fit) without walking all the
+ *   smaller ranges before it, and to skip a full block group at once
+ * - by size and offset, to find the smallest range that fits (best-fit)
+ *
+ * The index of a block group is built from the free space cache on the first
+ * allocation from it and kept up to date by btrfs_mark_free_space() and
+ * btrfs_clear_free_space(). A candidate is always checked against the free
+ * space cache, the index is rebuilt if it was changed directly.
+ */
+static u64 free_range_compute_max(struct btrfs_free_range *range)
+{
+	struct btrfs_free_range *child;
+	u64 max = range->bytes;
+
+	if (range->offset_node.rb_left) {
+		child = rb_entry(range->offset_node.rb_left,
+				 struct btrfs_free_range, offset_node);
+		max = max(max, child->subtree_max);
+	}
+	if (range->offset_node.rb_right) {
+		child = rb_entry(range->offset_node.rb_right,
+				 struct btrfs_free_range, offset_node);
+		max = max(max, child->subtree_max);
+	}
+	return max;
+}
+
+RB_DECLARE_CALLBACKS(static, free_range_augment, struct btrfs_free_range,
+		     offset_node, u64, subtree_max, free_range_compute_max)
+
+static int free_range_insert(struct btrfs_block_group_cache *cache,
+			     u64 offset, u64 bytes)
+{
+	struct rb_node **p = &cache->free_offset.rb_node;
+	struct rb_node *parent = NULL;
+	struct btrfs_free_range *range;
+	struct btrfs_free_range *entry;
+
+	range = malloc(sizeof(*range));
+	if (!range)
+		return -ENOMEM;
+	range->offset = offset;
+	range->bytes = bytes;
+	range->subtree_max = bytes;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct btrfs_free_range, offset_node);
+		if (entry->subtree_max < bytes)
+			entry->subtree_max = bytes;
+		if (offset < entry->offset)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&range->offset_node, parent, p);
+	rb_insert_augmented(&range->offset_node, &cache->free_offset,
+			    &free_range_augment);
+
+	p = &cache->free_size.rb_node;
+	parent = NULL;
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct btrfs_free_range, size_node);
+		if (bytes < entry->bytes ||
+		    (bytes == entry->bytes && offset < entry->offset))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&range->size_node, parent, p);
+	rb_insert_color(&range->size_node, &cache->free_size);
+	cache->free_ranges++;
+	return 0;
+}
+
+static void free_range_remove(struct btrfs_block_group_cache *cache,
+			      struct btrfs_free_range *range)
+{
+	rb_erase_augmented(&range->offset_node, &cache->free_offset,
+			   &free_range_augment);
+	rb_erase(&range->size_node, &cache->free_size);
+	cache->free_ranges--;
+	free(range);
+}
+
+/* The last range starting at or before @offset */
+static struct btrfs_free_range *
+free_range_lookup(struct btrfs_block_group_cache *cache, u64 offset)
+{
+	struct rb_node *node = cache->free_offset.rb_node;
+	struct btrfs_free_range *entry;
+	struct btrfs_free_range *ret = NULL;
+
+	while (node) {
+		entry = rb_entry(node, struct btrfs_free_range, offset_node);
+		if (entry->offset <= offset) {
+			ret = entry;
+			node = node->rb_right;
+		} else {
+			node = node->rb_left;
+		}
+	}
+	return ret;
+}
+
+static void free_index_drop(struct btrfs_block_group_cache *cache)
+{
+	struct btrfs_free_range *range;
+	struct rb_node *node;
+
+	while ((node = rb_first(&cache->free_size))) {
+		range = rb_entry(node, struct btrfs_free_range, size_node);
+		rb_erase(node, &cache->free_size);
+		free(range);
+	}
+	cache->free_offset = RB_ROOT;
+	cache->free_size = RB_ROOT;
+	cache->free_ranges = 0;
+	cache->free_indexed = 0;
+}
+
+/* Add [start, end) to the index, merged with the overlapping or adjacent */
+static int free_index_add(struct btrfs_block_group_cache *cache,
+			  u64 start, u64 end)
+{
+	struct btrfs_free_range *range;
+
+	start = max(start, cache->key.objectid);
+	end = min(end, cache->key.objectid + cache->key.offset);
+	if (start >= end)
+		return 0;
+
+	range = free_range_lookup(cache, start);
+	if (range && range->offset + range->bytes >= start) {
+		start = range->offset;
+		end = max(end, range->offset + range->bytes);
+		free_range_remove(cache, range);
+	}
+	while ((range = free_range_lookup(cache, end)) &&
+	       range->offset >= start) {
+		end = max(end, range->offset + range->bytes);
+		free_range_remove(cache, range);
+	}
+	return free_range_insert(cache, start, end - start);
+}
+
+/* Remove [start, end) from the index, splitting the ranges it cuts */
+static int free_index_remove(struct btrfs_block_group_cache *cache,
+			     u64 start, u64 end)
+{
+	struct btrfs_free_range *range;
+	u64 range_start;
+	u64 range_end;
+	int ret;
+
+	start = max(start, cache->key.objectid);
+	end = min(end, cache->key.objectid + cache->key.offset);
+	if (start >= end)
+		return 0;
+
+	while ((range = free_range_lookup(cache, end - 1)) &&
+	       range->offset + range->bytes > start) {
+		range_start = range->offset;
+		range_end = range->offset + range->bytes;
+		free_range_remove(cache, range);
+		if (range_end > end) {
+			ret = free_range_insert(cache, end, range_end - end);
+			if (ret)
+				return ret;
+		}
+		if (range_start < start) {
+			ret = free_range_insert(cache, range_start,
+						start - range_start);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+static int free_index_build(struct btrfs_fs_info *info,
+			    struct btrfs_block_group_cache *cache)
+{
+	u64 last = cache->key.objectid;
+	u64 group_end = cache->key.objectid + cache->key.offset;
+	u64 start;
+	u64 end;
+	int ret;
+
+	free_index_drop(cache);
+	while (last < group_end) {
+		ret = find_first_extent_bit(&info->free_space_cache, last,
+					    &start, &end, EXTENT_DIRTY);
+		if (ret || start >= group_end)
+			break;
+		ret = free_index_add(cache, start, end + 1);
+		if (ret) {
+			free_index_drop(cache);
+			return ret;
+		}
+		last = end + 1;
+	}
+	cache->free_indexed = 1;
+	info->alloc_stats.index_builds++;
+	return 0;
+}
+
+static void free_index_update(struct btrfs_fs_info *info, u64 start, u64 end,
+			      int add)
+{
+	struct btrfs_block_group_cache *cache;
+	u64 cur = start;
+	int ret;
+
+	while (cur <= end) {
+		cache = btrfs_lookup_first_block_group(info, cur);
+		if (!cache || cache->key.objectid > end)
+			break;
+		if (cache->free_indexed) {
+			if (add)
+				ret = free_index_add(cache, start, end + 1);
+			else
+				ret = free_index_remove(cache, start, end + 1);
+			/* rebuilt on next use */
+			if (ret)
+				free_index_drop(cache);
+		}
+		cur = cache->key.objectid + cache->key.offset;
+	}
+}
+
+/*
+ * Mark [start, end] as free space, like set_extent_dirty() on the free space
+ * cache, and update the allocator index of the block groups in the range
+ */
+int btrfs_mark_free_space(struct btrfs_fs_info *info, u64 start, u64 end)
+{
+	int ret;
+
+	ret = set_extent_dirty(&info->free_space_cache, start, end, GFP_NOFS);
+	if (ret < 0)
+		return ret;
+	free_index_update(info, start, end, 1);
+	return 0;
+}
+
+/* Counterpart of btrfs_mark_free_space(), [start, end] is not free anymore */
+int btrfs_clear_free_space(struct btrfs_fs_info *info, u64 start, u64 end)
+{
+	int ret;
+
+	/* returns the cleared bits */
+	ret = clear_extent_dirty(&info->free_space_cache, start, end, GFP_NOFS);
+	if (ret < 0)
+		return ret;
+	free_index_update(info, start, end, 0);
+	return 0;
+}
+
+/*
+ * First range after @from with @num bytes free from max(offset, @from), the
+ * subtree maximum prunes the subtrees without a large enough range
+ */
+static struct btrfs_free_range *free_index_next_fit(struct rb_node *node,
+						    u64 from, u64 num)
+{
+	struct btrfs_free_range *range;
+	struct btrfs_free_range *found;
+
+	while (node) {
+		range = rb_entry(node, struct btrfs_free_range, offset_node);
+		if (range->subtree_max < num)
+			return NULL;
+		if (range->offset > from) {
+			found = free_index_next_fit(node->rb_left, from, num);
+			if (found)
+				return found;
+			if (range->bytes >= num)
+				return range;
+		} else if (range->offset + range->bytes >= from + num) {
+			return range;
+		}
+		node = node->rb_right;
+	}
+	return NULL;
+}
+
+/* Smallest range with @num bytes free after @from */
+static struct btrfs_free_range *
+free_index_best_fit(struct btrfs_block_group_cache *cache, u64 from, u64 num)
+{
+	struct rb_node *node = cache->free_size.rb_node;
+	struct btrfs_free_range *range;
+	struct rb_node *first = NULL;
+
+	while (node) {
+		range = rb_entry(node, struct btrfs_free_range, size_node);
+		if (range->bytes >= num) {
+			first = node;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+	for (node = first; node; node = rb_next(node)) {
+		range = rb_entry(node, struct btrfs_free_range, size_node);
+		if (range->offset + range->bytes >= max(range->offset, from) + num)
+			return range;
+	}
+	return NULL;
+}
+
+/*
+ * Find @num free bytes at or after @from in the block group, returns the
+ * start or (u64)-1 if there is no such range
+ */
+static u64 free_index_find(struct btrfs_fs_info *info,
+			   struct btrfs_block_group_cache *cache,
+			   u64 from, u64 num, int best_fit)
+{
+	struct btrfs_free_range *range;
+	struct rb_node *root;
+	int resynced = 0;
+	u64 start;
+
+	if (!cache->free_indexed && free_index_build(info, cache))
+		return (u64)-1;
+again:
+	root = cache->free_offset.rb_node;
+	if (!root || rb_entry(root, struct btrfs_free_range,
+			      offset_node)->subtree_max < num) {
+		info->alloc_stats.skipped_groups++;
+		return (u64)-1;
+	}
+	if (best_fit)
+		range = free_index_best_fit(cache, from, num);
+	else
+		range = free_index_next_fit(root, from, num);
+	if (!range)
+		return (u64)-1;
+
+	start = max(range->offset, from);
+	if (!test_range_bit(&info->free_space_cache, start, start + num - 1,
+			    EXTENT_DIRTY, 1)) {
+		if (resynced || free_index_build(info, cache))
+			return (u64)-1;
+		info->alloc_stats.index_resyncs++;
+		resynced = 1;
+		goto again;
+	}
+	return start;
+}
+
+void btrfs_print_alloc_stats(struct btrfs_fs_info *info)
+{
+	struct btrfs_alloc_stats *stats = &info->alloc_stats;
+
+	if (!stats->allocs)
+		return;
+	printf("allocations: %llu, failed %llu, avg %llu ns, max %llu ns\n",
+	       (unsigned long long)stats->allocs,
+	       (unsigned long long)stats->failed,
+	       (unsigned long long)(stats->total_ns / stats->allocs),
+	       (unsigned long long)stats->max_ns);
+	printf("allocator retries: %llu, skipped block groups %llu, "
+	       "index builds %llu, resyncs %llu\n",
+	       (unsigned long long)stats->retries,
+	       (unsigned long long)stats->skipped_groups,
+	       (unsigned long long)stats->index_builds,
+	       (unsigned long long)stats->index_resyncs);
+	printf("block groups cached: %llu from free space tree, "
+	       "%llu from space cache, %llu by extent tree scan\n",
+	       (unsigned long long)stats->cached_from_tree,
+	       (unsigned long long)stats->cached_from_cache,
+	       (unsigned long long)stats->cached_from_scan);
+}
+
 static int remove_sb_from_cache(struct btrfs_root *root,
 				struct btrfs_block_group_cache *cache)
 {
@@ -69,9 +455,7 @@ static int remove_sb_from_cache(struct btrfs_root *root,
 	u64 *logical;
 	int stripe_len;
 	int i, nr, ret;
-	struct extent_io_tree *free_space_cache;
 
-	free_space_cache = &root->fs_info->free_space_cache;
 	for (i = 0; i < BTRFS_SUPER_MIRROR_MAX; i++) {
 		bytenr = btrfs_sb_offset(i);
 		ret = btrfs_rmap_block(&root->fs_info->mapping_tree,
@@ -79,14 +463,118 @@ static int remove_sb_from_cache(struct btrfs_root *root,
 				       &logical, &nr, &stripe_len);
 		BUG_ON(ret);
 		while (nr--) {
-			clear_extent_dirty(free_space_cache, logical[nr],
-				logical[nr] + stripe_len - 1, GFP_NOFS);
+			btrfs_clear_free_space(root->fs_info, logical[nr],
+					       logical[nr] + stripe_len - 1);
 		}
 		kfree(logical);
 	}
 	return 0;
 }
 
+/*
+ * The kernel updates the free space tree in every transaction that
+ * allocates or frees, which always COWs its root.  We don't maintain it at
+ * all, so a filesystem last committed by btrfs-progs is detected by the
+ * free space root being older than the super block.
+ */
+static int free_space_tree_trusted(struct btrfs_fs_info *info)
+{
+	struct btrfs_root *root = info->free_space_root;
+
+	if (!btrfs_fs_compat_ro(info, BTRFS_FEATURE_COMPAT_RO_FREE_SPACE_TREE))
+		return 0;
+	if (!root || !root->node)
+		return 0;
+	return btrfs_root_generation(&root->root_item) ==
+		btrfs_super_generation(info->super_copy);
+}
+
+/*
+ * The v1 space cache is valid as a whole only if it was written in the
+ * last transaction, we never update cache_generation on commit.
+ */
+static int space_cache_trusted(struct btrfs_fs_info *info)
+{
+	u64 cache_gen = btrfs_super_cache_generation(info->super_copy);
+
+	if (btrfs_fs_compat_ro(info, BTRFS_FEATURE_COMPAT_RO_FREE_SPACE_TREE))
+		return 0;
+	return cache_gen && cache_gen != (u64)-1 &&
+		cache_gen == btrfs_super_generation(info->super_copy);
+}
+
+/*
+ * Populate free_space_cache of a block group from the free space tree or
+ * the v1 space cache.  The loaders fill a btrfs_free_space_ctl, so use a
+ * temporary one and keep whatever fsck may have attached to the block
+ * group.  Returns 1 if the block group has been populated, 0 if the caller
+ * has to scan the extent tree.
+ */
+static int load_block_group_free_space(struct btrfs_fs_info *info,
+				       struct btrfs_block_group_cache *cache)
+{
+	struct btrfs_free_space_ctl *saved = cache->free_space_ctl;
+	struct btrfs_free_space_ctl *ctl;
+	struct btrfs_free_space *e;
+	struct rb_node *n;
+	u64 used;
+	int from_tree;
+	int loaded = 0;
+	int ret;
+
+	if (info->no_free_space_load || info->is_chunk_recover)
+		return 0;
+
+	from_tree = free_space_tree_trusted(info);
+	if (!from_tree && !space_cache_trusted(info))
+		return 0;
+
+	if (btrfs_init_free_space_ctl(cache, info->tree_root->sectorsize))
+		return 0;
+	ctl = cache->free_space_ctl;
+
+	if (from_tree) {
+		ret = load_free_space_tree(info, cache);
+		/*
+		 * Ranges pinned in this transaction are left out, so the
+		 * loaded space can only be smaller than what the block group
+		 * item says
+		 */
+		used = btrfs_block_group_used(&cache->item);
+		loaded = (ret == 0 && ctl->free_space + cache->bytes_super +
+			  used <= cache->key.offset);
+	} else {
+		loaded = (load_free_space_cache(info, cache) == 1);
+	}
+
+	if (loaded) {
+		for (n = rb_first(&ctl->free_space_offset); n; n = rb_next(n)) {
+			e = rb_entry(n, struct btrfs_free_space, offset_index);
+			ret = btrfs_mark_free_space(info, e->offset,
+						    e->offset + e->bytes - 1);
+			if (ret < 0) {
+				btrfs_clear_free_space(info,
+					cache->key.objectid,
+					cache->key.objectid +
+					cache->key.offset - 1);
+				loaded = 0;
+				break;
+			}
+		}
+	}
+	if (loaded) {
+		if (from_tree)
+			info->alloc_stats.cached_from_tree++;
+		else
+			info->alloc_stats.cached_from_cache++;
+	}
+
+	__btrfs_remove_free_space_cache(ctl);
+	kfree(ctl);
+	cache->free_space_ctl = saved;
+	return loaded;
+}
+
 static int cache_block_group(struct btrfs_root *root,
 			     struct btrfs_block_group_cache *block_group)
 {
@@ -94,7 +582,6 @@ static int cache_block_group(struct btrfs_root *root,
 	int ret;
 	struct btrfs_key key;
 	struct extent_buffer *leaf;
-	struct extent_io_tree *free_space_cache;
 	int slot;
 	u64 last;
 	u64 hole_size;
@@ -103,11 +590,16 @@ static int cache_block_group(struct btrfs_root *root,
 		return 0;
 
 	root = root->fs_info->extent_root;
-	free_space_cache = &root->fs_info->free_space_cache;
 
 	if (block_group->cached)
 		return 0;
 
+	if (load_block_group_free_space(root->fs_info, block_group)) {
+		remove_sb_from_cache(root, block_group);
+		block_group->cached = 1;
+		return 0;
+	}
+
 	path = btrfs_alloc_path();
 	if (!path)
 		return -ENOMEM;
@@ -148,9 +640,8 @@ static int cache_block_group(struct btrfs_root *root,
 		    key.type == BTRFS_METADATA_ITEM_KEY) {
 			if (key.objectid > last) {
 				hole_size = key.objectid - last;
-				set_extent_dirty(free_space_cache, last,
-						 last + hole_size - 1,
-						 GFP_NOFS);
+				btrfs_mark_free_space(root->fs_info, last,
+						      last + hole_size - 1);
 			}
 			if (key.type == BTRFS_METADATA_ITEM_KEY)
 				last = key.objectid + root->leafsize;
@@ -165,11 +656,12 @@ next:
 	    block_group->key.offset > last) {
 		hole_size = block_group->key.objectid +
 			block_group->key.offset - last;
-		set_extent_dirty(free_space_cache, last,
-				 last + hole_size - 1, GFP_NOFS);
+		btrfs_mark_free_space(root->fs_info, last,
+				      last + hole_size - 1);
 	}
 	remove_sb_from_cache(root, block_group);
 	block_group->cached = 1;
+	root->fs_info->alloc_stats.cached_from_scan++;
 err:
 	btrfs_free_path(path);
 	return 0;
@@ -247,7 +739,6 @@ static int noinline find_search_start(struct btrfs_root *root,
 	struct btrfs_block_group_cache *cache = *cache_ret;
 	u64 last = *start_ret;
 	u64 start = 0;
-	u64 end = 0;
 	u64 search_start = *start_ret;
 	int wrapped = 0;
 
@@ -262,24 +753,16 @@ again:
 	if (cache->ro || !block_group_bits(cache, data))
 		goto new_group;
 
-	while(1) {
-		ret = find_first_extent_bit(&root->fs_info->free_space_cache,
-					    last, &start, &end, EXTENT_DIRTY);
-		if (ret) {
-			goto new_group;
-		}
-
-		start = max(last, start);
-		last = end + 1;
-		if (last - start < num) {
-			continue;
-		}
-		if (start + num > cache->key.objectid + cache->key.offset) {
-			goto new_group;
-		}
-		*start_ret = start;
-		return 0;
-	}
+	/*
+	 * Data goes to the smallest range that fits to keep the large ones,
+	 * tree blocks stay close to the search start
+	 */
+	start = free_index_find(root->fs_info, cache, last, num,
+				data & BTRFS_BLOCK_GROUP_DATA);
+	if (start == (u64)-1)
+		goto new_group;
+	*start_ret = start;
+	return 0;
 out:
 	*start_ret = last;
 	cache = btrfs_lookup_block_group(root->fs_info, search_start);
@@ -1970,9 +2453,8 @@ static int update_block_group(struct btrfs_trans_handle *trans,
 			old_val -= num_bytes;
 			cache->space_info->bytes_used -= num_bytes;
 			if (mark_free) {
-				set_extent_dirty(&info->free_space_cache,
-						 bytenr, bytenr + num_bytes - 1,
-						 GFP_NOFS);
+				btrfs_mark_free_space(info, bytenr,
+						      bytenr + num_bytes - 1);
 			}
 		}
 		btrfs_set_block_group_used(&cache->item, old_val);
@@ -2028,8 +2510,6 @@ int btrfs_finish_extent_commit(struct btrfs_trans_handle *trans,
 	u64 start;
 	u64 end;
 	int ret;
-	struct extent_io_tree *free_space_cache;
-	free_space_cache = &root->fs_info->free_space_cache;
 
 	while(1) {
 		ret = find_first_extent_bit(unpin, 0, &start, &end,
@@ -2038,7 +2518,7 @@ int btrfs_finish_extent_commit(struct btrfs_trans_handle *trans,
 			break;
 		update_pinned_extents(root, start, end + 1 - start, 0);
 		clear_extent_dirty(unpin, start, end, GFP_NOFS);
-		set_extent_dirty(free_space_cache, start, end, GFP_NOFS);
+		btrfs_mark_free_space(root->fs_info, start, end);
 	}
 	return 0;
 }
@@ -2582,12 +3062,14 @@ check_failed:
 	if (test_range_bit(&info->extent_ins, ins->objectid,
 			   ins->objectid + num_bytes -1, EXTENT_LOCKED, 0)) {
 		search_start = ins->objectid + num_bytes;
+		info->alloc_stats.retries++;
 		goto new_group;
 	}
 
 	if (test_range_bit(&info->pinned_extents, ins->objectid,
 			   ins->objectid + num_bytes -1, EXTENT_DIRTY, 0)) {
 		search_start = ins->objectid + num_bytes;
+		info->alloc_stats.retries++;
 		goto new_group;
 	}
 
@@ -2595,12 +3077,14 @@ check_failed:
 	    test_range_bit(info->excluded_extents, ins->objectid,
 			   ins->objectid + num_bytes -1, EXTENT_DIRTY, 0)) {
 		search_start = ins->objectid + num_bytes;
+		info->alloc_stats.retries++;
 		goto new_group;
 	}
 
 	if (exclude_nr > 0 && (ins->objectid + num_bytes > exclude_start &&
 	    ins->objectid < exclude_start + exclude_nr)) {
 		search_start = exclude_start + exclude_nr;
+		info->alloc_stats.retries++;
 		goto new_group;
 	}
 
@@ -2608,6 +3092,7 @@ check_failed:
 		if (check_crossing_stripes(ins->objectid, num_bytes)) {
 			search_start = round_down(ins->objectid + num_bytes,
 						  BTRFS_STRIPE_LEN);
+			info->alloc_stats.retries++;
 			goto new_group;
 		}
 		block_group = btrfs_lookup_block_group(info, ins->objectid);
@@ -2651,6 +3136,9 @@ int btrfs_reserve_extent(struct btrfs_trans_handle *trans,
 	u64 search_start = 0;
 	u64 alloc_profile;
 	struct btrfs_fs_info *info = root->fs_info;
+	struct timespec start_time;
+	struct timespec end_time;
+	u64 elapsed;
 
 	if (info->extent_ops) {
 		struct btrfs_extent_ops *ops = info->extent_ops;
@@ -2687,15 +3175,24 @@ int btrfs_reserve_extent(struct btrfs_trans_handle *trans,
 	}
 
 	WARN_ON(num_bytes < root->sectorsize);
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
 	ret = find_free_extent(trans, root, num_bytes, empty_size,
 			       search_start, search_end, hint_byte, ins,
 			       trans->alloc_exclude_start,
 			       trans->alloc_exclude_nr, data);
+	clock_gettime(CLOCK_MONOTONIC, &end_time);
+	elapsed = (end_time.tv_sec - start_time.tv_sec) * 1000000000ULL +
+		  end_time.tv_nsec - start_time.tv_nsec;
+	info->alloc_stats.allocs++;
+	info->alloc_stats.total_ns += elapsed;
+	if (elapsed > info->alloc_stats.max_ns)
+		info->alloc_stats.max_ns = elapsed;
+	if (ret)
+		info->alloc_stats.failed++;
 	BUG_ON(ret);
 found:
-	clear_extent_dirty(&root->fs_info->free_space_cache,
-			   ins->objectid, ins->objectid + ins->offset - 1,
-			   GFP_NOFS);
+	btrfs_clear_free_space(root->fs_info, ins->objectid,
+			       ins->objectid + ins->offset - 1);
 	return ret;
 }
 
@@ -3114,6 +3611,7 @@ int btrfs_free_block_groups(struct btrfs_fs_info *info)
 				btrfs_remove_free_space_cache(cache);
 				kfree(cache->free_space_ctl);
 			}
+			free_index_drop(cache);
 			kfree(cache);
 		}
 		clear_extent_bits(&info->block_group_cache, start,
@@ -3720,6 +4218,7 @@ static int free_block_group_cache(struct btrfs_trans_handle *trans,
 		btrfs_remove_free_space_cache(cache);
 		kfree(cache->free_space_ctl);
 	}
+	free_index_drop(cache);
 	clear_extent_bits(&fs_info->block_group_cache, bytenr, bytenr + len,
 			  (unsigned int)-1, GFP_NOFS);
 	ret = free_space_info(fs_info, flags, len, 0, NULL);
@@ -26,6 +26,7 @@
 #include "print-tree.h"
 #include "crc32c.h"
 #include "internal.h"
+#include "bitops.h"
 
 #define MAX_CSUM_ITEMS(r,size) ((((BTRFS_LEAF_DATA_SIZE(r) - \
 			       sizeof(struct btrfs_item) * 2) / \
@@ -311,6 +312,364 @@ fail:
 	return ret;
 }
 
+/*
+ * Offset of the csum item following the one the path points to, or
+ * (u64)-1 if there is none.  The next leaf is not read, its first key is
+ * taken from the parents.
+ */
+static u64 next_csum_offset(struct btrfs_path *path)
+{
+	struct btrfs_key key;
+	int level;
+
+	if (path->slots[0] < btrfs_header_nritems(path->nodes[0])) {
+		btrfs_item_key_to_cpu(path->nodes[0], &key, path->slots[0]);
+		goto found;
+	}
+	for (level = 1; level < BTRFS_MAX_LEVEL; level++) {
+		if (!path->nodes[level])
+			break;
+		if (path->slots[level] + 1 <
+		    btrfs_header_nritems(path->nodes[level])) {
+			btrfs_node_key_to_cpu(path->nodes[level], &key,
+					      path->slots[level] + 1);
+			goto found;
+		}
+	}
+	return (u64)-1;
+found:
+	if (key.objectid != BTRFS_EXTENT_CSUM_OBJECTID ||
+	    key.type != BTRFS_EXTENT_CSUM_KEY)
+		return (u64)-1;
+	return key.offset;
+}
+
+/*
+ * Append checksums sorting after everything in the csum tree through
+ * @bulk, extending the last item if it ends right at @bytenr.  Returns 1
+ * without changing anything if the range does not sort last.
+ */
+static int append_csums(struct btrfs_bulk_insert *bulk, u64 bytenr,
+			const char *csums, u64 nr)
+{
+	struct btrfs_root *root = bulk->root;
+	struct btrfs_path *path = &bulk->path;
+	struct btrfs_key key;
+	struct extent_buffer *leaf;
+	u16 csum_size = btrfs_super_csum_size(root->fs_info->super_copy);
+	u32 max_items = MAX_CSUM_ITEMS(root, csum_size);
+	u32 item_size;
+	u32 used;
+	u64 grow;
+	u64 count;
+	unsigned long ptr;
+	int ret;
+
+	ret = btrfs_bulk_insert_last_key(bulk, &key);
+	if (ret < 0)
+		return ret;
+	if (ret == 0) {
+		if (key.objectid != BTRFS_EXTENT_CSUM_OBJECTID ||
+		    key.type != BTRFS_EXTENT_CSUM_KEY)
+			return 1;
+		leaf = path->nodes[0];
+		item_size = btrfs_item_size_nr(leaf, path->slots[0]);
+		if (key.offset + item_size / csum_size * root->sectorsize >
+		    bytenr)
+			return 1;
+
+		used = BTRFS_LEAF_DATA_SIZE(root) -
+		       btrfs_leaf_free_space(root, leaf);
+		if (key.offset + item_size / csum_size * root->sectorsize ==
+		    bytenr && item_size / csum_size < max_items &&
+		    used < bulk->leaf_limit) {
+			grow = min_t(u64, max_items - item_size / csum_size, nr);
+			grow = min_t(u64, grow,
+				     (bulk->leaf_limit - used) / csum_size);
+			if (grow) {
+				ret = btrfs_extend_item(bulk->trans, root, path,
+							grow * csum_size);
+				if (ret)
+					return ret;
+				ptr = btrfs_item_ptr_offset(leaf,
+							    path->slots[0]);
+				write_extent_buffer(leaf, csums,
+						    ptr + item_size,
+						    grow * csum_size);
+				btrfs_mark_buffer_dirty(leaf);
+				csums += grow * csum_size;
+				bytenr += grow * root->sectorsize;
+				nr -= grow;
+			}
+		}
+	}
+
+	key.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
+	key.type = BTRFS_EXTENT_CSUM_KEY;
+	while (nr) {
+		count = min_t(u64, nr, max_items);
+		key.offset = bytenr;
+		ret = btrfs_bulk_insert_item(bulk, &key, (void *)csums,
+					     count * csum_size);
+		if (ret)
+			return ret;
+		csums += count * csum_size;
+		bytenr += count * root->sectorsize;
+		nr -= count;
+	}
+	return 0;
+}
+
+/*
+ * Insert the @nr checksums in @csums for the sectors starting at @bytenr.
+ *
+ * None of the sectors may have a checksum yet, -EEXIST is returned
+ * without changing anything otherwise.  A csum item ending right at
+ * @bytenr is extended in place, the rest goes into new items of at most
+ * MAX_CSUM_ITEMS checksums each.
+ *
+ * Builders inserting in ascending order can pass a @bulk insertion on the
+ * csum root kept across calls, ranges sorting after the whole tree are
+ * then appended without searching.  @bulk may be NULL.
+ */
+int btrfs_insert_csums(struct btrfs_trans_handle *trans,
+		       struct btrfs_root *root, struct btrfs_bulk_insert *bulk,
+		       u64 bytenr, const char *csums, u64 nr)
+{
+	struct btrfs_bulk_insert local_bulk;
+	struct btrfs_path *path;
+	struct btrfs_key key;
+	struct extent_buffer *leaf;
+	u16 csum_size = btrfs_super_csum_size(root->fs_info->super_copy);
+	u32 max_items = MAX_CSUM_ITEMS(root, csum_size);
+	u64 end = bytenr + nr * root->sectorsize;
+	u64 cur;
+	u32 item_size;
+	unsigned long ptr;
+	int ret;
+
+	if (!nr)
+		return 0;
+
+	if (bulk) {
+		ret = append_csums(bulk, bytenr, csums, nr);
+		if (ret <= 0)
+			return ret;
+		btrfs_bulk_insert_release(bulk);
+	} else {
+		btrfs_bulk_insert_init(&local_bulk, trans, root, 0);
+		bulk = &local_bulk;
+	}
+
+	path = btrfs_alloc_path();
+	if (!path) {
+		ret = -ENOMEM;
+		goto out_bulk;
+	}
+
+	key.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
+	key.type = BTRFS_EXTENT_CSUM_KEY;
+	key.offset = bytenr;
+	ret = btrfs_search_slot(trans, root, &key, path, 0, 1);
+	if (ret < 0)
+		goto out;
+	if (ret == 0 || next_csum_offset(path) < end) {
+		ret = -EEXIST;
+		goto out;
+	}
+
+	/*
+	 * A search miss only ends up at slot 0 of the leftmost leaf, so the
+	 * previous item, if any, is in this leaf.
+	 */
+	leaf = path->nodes[0];
+	if (path->slots[0] > 0) {
+		btrfs_item_key_to_cpu(leaf, &key, path->slots[0] - 1);
+		item_size = btrfs_item_size_nr(leaf, path->slots[0] - 1);
+		cur = key.offset + item_size / csum_size * root->sectorsize;
+		if (key.objectid == BTRFS_EXTENT_CSUM_OBJECTID &&
+		    key.type == BTRFS_EXTENT_CSUM_KEY && cur > bytenr) {
+			ret = -EEXIST;
+			goto out;
+		}
+		if (key.objectid == BTRFS_EXTENT_CSUM_OBJECTID &&
+		    key.type == BTRFS_EXTENT_CSUM_KEY && cur == bytenr &&
+		    item_size / csum_size < max_items) {
+			u64 grow = max_items - item_size / csum_size;
+
+			grow = min(grow, nr);
+			grow = min_t(u64, grow,
+				     btrfs_leaf_free_space(root, leaf) /
+				     csum_size);
+			if (grow) {
+				path->slots[0]--;
+				ret = btrfs_extend_item(trans, root, path,
+							grow * csum_size);
+				if (ret)
+					goto out;
+				ptr = btrfs_item_ptr_offset(leaf,
+							    path->slots[0]);
+				write_extent_buffer(leaf, csums,
+						    ptr + item_size,
+						    grow * csum_size);
+				btrfs_mark_buffer_dirty(leaf);
+				csums += grow * csum_size;
+				bytenr += grow * root->sectorsize;
+				nr -= grow;
+			}
+		}
+	}
+	btrfs_release_path(path);
+
+	key.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
+	key.type = BTRFS_EXTENT_CSUM_KEY;
+	while (nr) {
+		u64 count = min_t(u64, nr, max_items);
+
+		key.offset = bytenr;
+		ret = btrfs_bulk_insert_item(bulk, &key, (void *)csums,
+					     count * csum_size);
+		if (ret)
+			goto out;
+		csums += count * csum_size;
+		bytenr += count * root->sectorsize;
+		nr -= count;
+	}
+	ret = 0;
+out:
+	btrfs_free_path(path);
+out_bulk:
+	if (bulk == &local_bulk)
+		btrfs_bulk_insert_release(bulk);
+	return ret;
+}
+
+/*
+ * Checksum the @len bytes of @data, which are to be written at @bytenr,
+ * and insert the checksums as btrfs_insert_csums() does.  @len must be a
+ * multiple of the sectorsize.
+ */
+int btrfs_csum_file_range(struct btrfs_trans_handle *trans,
+			  struct btrfs_root *root,
+			  struct btrfs_bulk_insert *bulk, u64 bytenr,
+			  char *data, u64 len)
+{
+	u16 csum_size = btrfs_super_csum_size(root->fs_info->super_copy);
+	u64 nr = len / root->sectorsize;
+	u32 crc;
+	u64 i;
+	char *csums;
+	int ret;
+
+	if (len % root->sectorsize)
+		return -EINVAL;
+
+	csums = malloc(nr * csum_size);
+	if (!csums)
+		return -ENOMEM;
+	for (i = 0; i < nr; i++) {
+		crc = btrfs_csum_data(root, data + i * root->sectorsize,
+				      ~(u32)0, root->sectorsize);
+		btrfs_csum_final(crc, csums + i * csum_size);
+	}
+	ret = btrfs_insert_csums(trans, root, bulk, bytenr, csums, nr);
+	free(csums);
+	return ret;
+}
+
+/*
+ * Copy the checksums of the @nr sectors starting at @bytenr to @csums,
+ * walking the csum items covering the range once.
+ *
+ * Sectors without a checksum are zeroed in @csums.  If @found is not NULL
+ * it is a bitmap of @nr bits, bits are set for the sectors that have one.
+ * @csums may be NULL to only count or locate the checksums.
+ *
+ * Returns the number of sectors a checksum was found for, or < 0 on error.
+ */
+int btrfs_lookup_csums_range(struct btrfs_root *root, u64 bytenr, u64 nr,
+			     char *csums, unsigned long *found)
+{
+	struct btrfs_path *path;
+	struct btrfs_key key;
+	struct extent_buffer *leaf;
+	u16 csum_size = btrfs_super_csum_size(root->fs_info->super_copy);
+	u64 end = bytenr + nr * root->sectorsize;
+	u64 item_end;
+	u64 start;
+	u64 stop;
+	u64 i;
+	int count = 0;
+	int ret;
+
+	if (csums)
+		memset(csums, 0, nr * csum_size);
+	if (found)
+		memset(found, 0, BITS_TO_LONGS(nr) * sizeof(unsigned long));
+
+	path = btrfs_alloc_path();
+	if (!path)
+		return -ENOMEM;
+
+	key.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
+	key.type = BTRFS_EXTENT_CSUM_KEY;
+	key.offset = bytenr;
+	ret = btrfs_search_slot(NULL, root, &key, path, 0, 0);
+	if (ret < 0)
+		goto out;
+	/* the item before may still cover the start of the range */
+	if (ret > 0 && path->slots[0] > 0)
+		path->slots[0]--;
+
+	while (1) {
+		leaf = path->nodes[0];
+		if (path->slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(root, path);
+			if (ret < 0)
+				goto out;
+			if (ret > 0)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(leaf, &key, path->slots[0]);
+		if (key.objectid > BTRFS_EXTENT_CSUM_OBJECTID ||
+		    (key.objectid == BTRFS_EXTENT_CSUM_OBJECTID &&
+		     key.type > BTRFS_EXTENT_CSUM_KEY) ||
+		    key.offset >= end)
+			break;
+		if (key.objectid != BTRFS_EXTENT_CSUM_OBJECTID ||
+		    key.type != BTRFS_EXTENT_CSUM_KEY)
+			goto next;
+
+		item_end = key.offset + btrfs_item_size_nr(leaf,
+				path->slots[0]) / csum_size * root->sectorsize;
+		start = max(key.offset, bytenr);
+		stop = min(item_end, end);
+		if (start >= stop)
+			goto next;
+
+		if (csums)
+			read_extent_buffer(leaf, csums +
+				(start - bytenr) / root->sectorsize * csum_size,
+				btrfs_item_ptr_offset(leaf, path->slots[0]) +
+				(start - key.offset) / root->sectorsize *
+				csum_size,
+				(stop - start) / root->sectorsize * csum_size);
+		for (i = (start - bytenr) / root->sectorsize;
+		     i < (stop - bytenr) / root->sectorsize; i++) {
+			if (found)
+				set_bit(i, found);
+			count++;
+		}
+next:
+		path->slots[0]++;
+	}
+	ret = count;
+out:
+	btrfs_free_path(path);
+	return ret;
+}
+
 /*
  * helper function for csum removal, this expects the
  * key to describe the csum pointed to by the path, and it expects
@@ -440,6 +440,7 @@ int load_free_space_cache(struct btrfs_fs_info *fs_info,
 	path = btrfs_alloc_path();
 	if (!path)
 		return 0;
+	path->reada = 1;
 
 	ret = __load_free_space_cache(fs_info->tree_root, ctl, path,
 				      block_group->key.objectid);
@@ -155,6 +155,8 @@ int btrfs_insert_inode(struct btrfs_trans_handle *trans, struct btrfs_root
 
 	ret = btrfs_insert_item(trans, root, &key, inode_item,
 				sizeof(*inode_item));
+	if (!ret)
+		btrfs_update_free_objectid(root, objectid);
 	return ret;
 }
 
@@ -24,9 +24,8 @@
 /*
  * walks the btree of allocated inodes and find a hole.
  */
-int btrfs_find_free_objectid(struct btrfs_trans_handle *trans,
-			     struct btrfs_root *root,
-			     u64 dirid, u64 *objectid)
+static int find_objectid_hole(struct btrfs_trans_handle *trans,
+			      struct btrfs_root *root, u64 *objectid)
 {
 	struct btrfs_path *path;
 	struct btrfs_key key;
@@ -36,7 +35,7 @@ int btrfs_find_free_objectid(struct btrfs_trans_handle *trans,
 	int start_found;
 	struct extent_buffer *l;
 	struct btrfs_key search_key;
-	u64 search_start = dirid;
+	u64 search_start;
 
 	path = btrfs_alloc_path();
 	BUG_ON(!path);
@@ -89,13 +88,102 @@ int btrfs_find_free_objectid(struct btrfs_trans_handle *trans,
 		last_ino = key.objectid + 1;
 		path->slots[0]++;
 	}
-	// FIXME -ENOSPC
 found:
-	root->last_inode_alloc = *objectid;
 	btrfs_free_path(path);
+	if (*objectid > BTRFS_LAST_FREE_OBJECTID)
+		return -ENOSPC;
+	root->last_inode_alloc = *objectid + 1;
 	BUG_ON(*objectid < search_start);
 	return 0;
 error:
 	btrfs_free_path(path);
 	return ret;
 }
+
+/*
+ * Find the highest objectid in use with a single reverse search, skipping
+ * the special objectids (orphans, free ino cache) above the free range.
+ */
+static int load_highest_objectid(struct btrfs_root *root, u64 *highest)
+{
+	struct btrfs_path *path;
+	struct btrfs_key key;
+	int ret;
+
+	path = btrfs_alloc_path();
+	if (!path)
+		return -ENOMEM;
+
+	key.objectid = BTRFS_LAST_FREE_OBJECTID;
+	key.type = (u8)-1;
+	key.offset = (u64)-1;
+
+	ret = btrfs_search_slot(NULL, root, &key, path, 0, 0);
+	if (ret < 0)
+		goto out;
+	BUG_ON(ret == 0);
+	ret = 0;
+
+	*highest = BTRFS_FIRST_FREE_OBJECTID - 1;
+	if (path->slots[0] == 0)
+		ret = btrfs_prev_leaf(root, path);
+	else
+		path->slots[0]--;
+	if (ret < 0)
+		goto out;
+	if (ret == 0) {
+		btrfs_item_key_to_cpu(path->nodes[0], &key, path->slots[0]);
+		if (key.objectid > *highest)
+			*highest = key.objectid;
+	}
+	ret = 0;
+out:
+	btrfs_free_path(path);
+	return ret;
+}
+
+/*
+ * Hand out objectids from a per-root counter above the highest objectid in
+ * use, which is looked up once instead of walking the leaves for a hole on
+ * each call.  Inodes inserted with an explicit number push the counter via
+ * btrfs_update_free_objectid().  Holes are only reused once the counter is
+ * exhausted.
+ *
+ * Unlike the hole search, consecutive calls return different objectids
+ * even if the caller has not inserted the previous one yet.
+ */
+int btrfs_find_free_objectid(struct btrfs_trans_handle *trans,
+			     struct btrfs_root *root,
+			     u64 dirid, u64 *objectid)
+{
+	u64 highest;
+	int ret;
+
+	if (!root->free_objectid) {
+		ret = load_highest_objectid(root, &highest);
+		if (ret < 0)
+			return ret;
+		root->free_objectid = highest + 1;
+	}
+
+	if (root->free_objectid > BTRFS_LAST_FREE_OBJECTID) {
+		ret = find_objectid_hole(trans, root, objectid);
+		if (ret == -ENOSPC && root->last_inode_alloc) {
+			/* wrap around once */
+			root->last_inode_alloc = 0;
+			ret = find_objectid_hole(trans, root, objectid);
+		}
+		return ret;
+	}
+
+	*objectid = root->free_objectid++;
+	root->last_inode_alloc = *objectid;
+	return 0;
+}
+
+void btrfs_update_free_objectid(struct btrfs_root *root, u64 objectid)
+{
+	if (root->free_objectid && objectid >= root->free_objectid &&
+	    objectid <= BTRFS_LAST_FREE_OBJECTID)
+		root->free_objectid = objectid + 1;
+}
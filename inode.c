@@ -45,6 +45,13 @@ static int btrfs_find_free_dir_index(struct btrfs_root *root, u64 dir_ino,
 	if (!ret_ino)
 		return 0;
 
+	ret = btrfs_dir_cache_last_index(root, dir_ino, &ret_val);
+	if (ret <= 0) {
+		*ret_ino = ret ? 2 : ret_val + 1;
+		return 0;
+	}
+	ret_val = 2;
+
 	path = btrfs_alloc_path();
 	if (!path)
 		return -ENOMEM;
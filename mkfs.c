@@ -628,6 +628,9 @@ static int add_file_items(struct btrfs_trans_handle *trans,
 	u64 cur_bytes;
 	u64 total_bytes;
 	struct extent_buffer *eb = NULL;
+	char *csums = NULL;
+	u16 csum_size = btrfs_super_csum_size(root->fs_info->super_copy);
+	u32 crc;
 	int fd;
 
 	if (st->st_size == 0)
@@ -672,7 +675,9 @@ static int add_file_items(struct btrfs_trans_handle *trans,
 	 * against any raid type
 	 */
 	eb = calloc(1, sizeof(*eb) + sectorsize);
-	if (!eb) {
+	csums = malloc(min(total_bytes, 1024ULL * 1024) / sectorsize *
+		       csum_size);
+	if (!eb || !csums) {
 		ret = -ENOMEM;
 		goto end;
 	}
@@ -705,16 +710,10 @@ again:
 		eb->start = first_block + bytes_read;
 		eb->len = sectorsize;
 
-		/*
-		 * we're doing the csum before we record the extent, but
-		 * that's ok
-		 */
-		ret = btrfs_csum_file_block(trans, root->fs_info->csum_root,
-					    first_block + bytes_read + sectorsize,
-					    first_block + bytes_read,
-					    eb->data, sectorsize);
-		if (ret)
-			goto end;
+		/* the checksums are inserted for the whole extent below */
+		crc = btrfs_csum_data(root, eb->data, ~(u32)0, sectorsize);
+		btrfs_csum_final(crc, csums + bytes_read / sectorsize *
+				 csum_size);
 
 		ret = write_and_map_eb(trans, root, eb);
 		if (ret) {
@@ -726,6 +725,11 @@ again:
 	}
 
 	if (bytes_read) {
+		ret = btrfs_insert_csums(trans, root->fs_info->csum_root,
+					 NULL, first_block, csums,
+					 bytes_read / sectorsize);
+		if (ret)
+			goto end;
 		ret = btrfs_record_file_extent(trans, root, objectid, btrfs_inode,
 					       file_pos, first_block, cur_bytes);
 		if (ret)
@@ -740,6 +744,7 @@ again:
 		goto again;
 
 end:
+	free(csums);
 	free(eb);
 	close(fd);
 	return ret;
@@ -963,8 +968,8 @@ static int create_chunks(struct btrfs_trans_handle *trans,
 					     chunk_start, chunk_size);
 		allocation->metadata += chunk_size;
 		BUG_ON(ret);
-		set_extent_dirty(&root->fs_info->free_space_cache,
-				 chunk_start, chunk_start + chunk_size - 1, 0);
+		btrfs_mark_free_space(root->fs_info, chunk_start,
+				      chunk_start + chunk_size - 1);
 	}
 
 	if (size_of_data < minimum_data_chunk_size)
@@ -978,8 +983,8 @@ static int create_chunks(struct btrfs_trans_handle *trans,
 				     chunk_start, size_of_data);
 	allocation->data += size_of_data;
 	BUG_ON(ret);
-	set_extent_dirty(&root->fs_info->free_space_cache,
-			 chunk_start, chunk_start + size_of_data - 1, 0);
+	btrfs_mark_free_space(root->fs_info, chunk_start,
+			      chunk_start + size_of_data - 1);
 	return ret;
 }
 
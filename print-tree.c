@@ -1095,7 +1095,8 @@ void btrfs_print_leaf(struct btrfs_root *root, struct extent_buffer *l)
 	}
 }
 
-void btrfs_print_tree(struct btrfs_root *root, struct extent_buffer *eb, int follow)
+static void print_tree(struct btrfs_root *root, struct extent_buffer *eb,
+		       struct btrfs_prefetch *pf)
 {
 	int i;
 	u32 nr;
@@ -1131,14 +1132,16 @@ void btrfs_print_tree(struct btrfs_root *root, struct extent_buffer *eb, int fol
 		       (unsigned long long)btrfs_node_ptr_generation(eb, i));
 		fflush(stdout);
 	}
-	if (!follow)
+	if (!pf)
 		return;
 
 	for (i = 0; i < nr; i++) {
-		struct extent_buffer *next = read_tree_block(root,
-					     btrfs_node_blockptr(eb, i),
-					     size,
-					     btrfs_node_ptr_generation(eb, i));
+		struct extent_buffer *next;
+
+		btrfs_node_key_to_cpu(eb, &key, i);
+		btrfs_prefetch_update(pf, &key);
+		next = read_tree_block(root, btrfs_node_blockptr(eb, i), size,
+				       btrfs_node_ptr_generation(eb, i));
 		if (!extent_buffer_uptodate(next)) {
 			fprintf(stderr, "failed to read %llu in tree %llu\n",
 				(unsigned long long)btrfs_node_blockptr(eb, i),
@@ -1151,7 +1154,20 @@ void btrfs_print_tree(struct btrfs_root *root, struct extent_buffer *eb, int fol
 		if (btrfs_header_level(next) !=
 			btrfs_header_level(eb) - 1)
 			BUG();
-		btrfs_print_tree(root, next, 1);
+		print_tree(root, next, pf);
 		free_extent_buffer(next);
 	}
 }
+
+void btrfs_print_tree(struct btrfs_root *root, struct extent_buffer *eb, int follow)
+{
+	struct btrfs_prefetch pf;
+
+	if (!eb || !follow) {
+		print_tree(root, eb, NULL);
+		return;
+	}
+	btrfs_prefetch_init(&pf, root, eb);
+	print_tree(root, eb, &pf);
+	btrfs_prefetch_release(&pf);
+}
@@ -26,18 +26,10 @@
 #define BTRFS_QGROUP_NFILTERS_INCREASE (2 * BTRFS_QGROUP_FILTER_MAX)
 #define BTRFS_QGROUP_NCOMPS_INCREASE (2 * BTRFS_QGROUP_COMP_MAX)
 
-struct qgroup_lookup {
-	struct rb_root root;
-};
+/* Buffer for TREE_SEARCH_V2, about 30k qgroups with limits per call */
+#define BTRFS_QGROUP_SEARCH_BUF_SIZE (4 * 1024 * 1024)
 
 struct btrfs_qgroup {
-	struct rb_node rb_node;
-	struct rb_node sort_node;
-	/*
-	 *all_parent_node is used to
-	 *filter a qgroup's all parent
-	 */
-	struct rb_node all_parent_node;
 	u64 qgroupid;
 
 	/*
@@ -58,23 +50,51 @@ struct btrfs_qgroup {
 	u64 rsv_rfer;
 	u64 rsv_excl;
 
-	/*qgroups this group is member of*/
-	struct list_head qgroups;
-	/*qgroups that are members of this group*/
-	struct list_head members;
+	/*qgroups this group is member of, slice of qgroup_lookup::parents*/
+	u32 parents_start;
+	u32 nr_parents;
+	/*qgroups that are members of this group, slice of ::members*/
+	u32 members_start;
+	u32 nr_members;
+};
+
+/*
+ * All qgroups in one array sorted by qgroupid. The relations are kept as
+ * index arrays: parents holds the parent indices grouped by member and
+ * members the member indices grouped by parent.
+ */
+struct qgroup_lookup {
+	struct btrfs_qgroup *qgroups;
+	int nr;
+	int alloc;
+	/*
+	 * While loading, only the first nr_sorted qgroups are sorted, the
+	 * rest were added out of order and are sorted once at the end. The
+	 * rest is usually in order too, tail_unordered is set if not.
+	 */
+	int nr_sorted;
+	int tail_unordered;
+
+	/* parent and member qgroupid pairs from the relation items */
+	u64 (*relations)[2];
+	int nr_relations;
+	int alloc_relations;
+
+	u32 *parents;
+	u32 *members;
 };
 
 /*
- * glue structure to represent the relations
- * between qgroups
+ * Sorted ids of a qgroup and all its ancestors, the data of the
+ * BTRFS_QGROUP_FILTER_ALL_PARENT filter after pre-processing
  */
-struct btrfs_qgroup_list {
-	struct list_head next_qgroup;
-	struct list_head next_member;
-	struct btrfs_qgroup *qgroup;
-	struct btrfs_qgroup *member;
+struct qgroup_id_set {
+	int nr;
+	u64 ids[0];
 };
 
+static enum btrfs_qgroup_format qgroup_format = BTRFS_QGROUP_FORMAT_TABLE;
+
 /*
  * qgroupid,rfer,excl default to set
  */
@@ -166,40 +186,45 @@ void btrfs_qgroup_setup_units(unsigned unit_mode)
 	btrfs_qgroup_columns[BTRFS_QGROUP_MAX_EXCL].unit_mode = unit_mode;
 }
 
-static int print_parent_column(struct btrfs_qgroup *qgroup)
+void btrfs_qgroup_setup_format(enum btrfs_qgroup_format format)
 {
-	struct btrfs_qgroup_list *list = NULL;
+	qgroup_format = format;
+}
+
+static int print_relation_column(struct qgroup_lookup *lookup, u32 *idx,
+				 u32 nr, const char *sep)
+{
+	struct btrfs_qgroup *bq;
 	int len = 0;
+	u32 i;
 
-	list_for_each_entry(list, &qgroup->qgroups, next_qgroup) {
-		len += printf("%llu/%llu",
-			      btrfs_qgroup_level(list->qgroup->qgroupid),
-			      btrfs_qgroup_subvid(list->qgroup->qgroupid));
-		if (!list_is_last(&list->next_qgroup, &qgroup->qgroups))
-			len += printf(",");
+	for (i = 0; i < nr; i++) {
+		bq = &lookup->qgroups[idx[i]];
+		len += printf("%s%llu/%llu", i ? sep : "",
+			      btrfs_qgroup_level(bq->qgroupid),
+			      btrfs_qgroup_subvid(bq->qgroupid));
 	}
-	if (list_empty(&qgroup->qgroups))
-		len += printf("---");
-
 	return len;
 }
 
-static int print_child_column(struct btrfs_qgroup *qgroup)
+static int print_parent_column(struct qgroup_lookup *lookup,
+			       struct btrfs_qgroup *qgroup)
 {
-	struct btrfs_qgroup_list *list = NULL;
-	int len = 0;
-
-	list_for_each_entry(list, &qgroup->members, next_member) {
-		len += printf("%llu/%llu",
-			      btrfs_qgroup_level(list->member->qgroupid),
-			      btrfs_qgroup_subvid(list->member->qgroupid));
-		if (!list_is_last(&list->next_member, &qgroup->members))
-			len += printf(",");
-	}
-	if (list_empty(&qgroup->members))
-		len += printf("---");
+	if (!qgroup->nr_parents)
+		return printf("---");
+	return print_relation_column(lookup,
+				     lookup->parents + qgroup->parents_start,
+				     qgroup->nr_parents, ",");
+}
 
-	return len;
+static int print_child_column(struct qgroup_lookup *lookup,
+			      struct btrfs_qgroup *qgroup)
+{
+	if (!qgroup->nr_members)
+		return printf("---");
+	return print_relation_column(lookup,
+				     lookup->members + qgroup->members_start,
+				     qgroup->nr_members, ",");
 }
 
 static void print_qgroup_column_add_blank(enum btrfs_qgroup_column_enum column,
@@ -210,7 +235,8 @@ static void print_qgroup_column_add_blank(enum btrfs_qgroup_column_enum column,
 		printf(" ");
 }
 
-static void print_qgroup_column(struct btrfs_qgroup *qgroup,
+static void print_qgroup_column(struct qgroup_lookup *lookup,
+				struct btrfs_qgroup *qgroup,
 				enum btrfs_qgroup_column_enum column)
 {
 	BUG_ON(column >= BTRFS_QGROUP_ALL || column < 0);
@@ -233,7 +259,7 @@ static void print_qgroup_column(struct btrfs_qgroup *qgroup,
 		len = printf("%*s", max_len, pretty_size_mode(qgroup->excl, unit_mode));
 		break;
 	case BTRFS_QGROUP_PARENT:
-		len = print_parent_column(qgroup);
+		len = print_parent_column(lookup, qgroup);
 		print_qgroup_column_add_blank(BTRFS_QGROUP_PARENT, len);
 		break;
 	case BTRFS_QGROUP_MAX_RFER:
@@ -249,7 +275,7 @@ static void print_qgroup_column(struct btrfs_qgroup *qgroup,
 			len = printf("%*s", max_len, "none");
 		break;
 	case BTRFS_QGROUP_CHILD:
-		len = print_child_column(qgroup);
+		len = print_child_column(lookup, qgroup);
 		print_qgroup_column_add_blank(BTRFS_QGROUP_CHILD, len);
 		break;
 	default:
@@ -257,14 +283,15 @@ static void print_qgroup_column(struct btrfs_qgroup *qgroup,
 	}
 }
 
-static void print_single_qgroup_table(struct btrfs_qgroup *qgroup)
+static void print_single_qgroup_table(struct qgroup_lookup *lookup,
+				      struct btrfs_qgroup *qgroup)
 {
 	int i;
 
 	for (i = 0; i < BTRFS_QGROUP_ALL; i++) {
 		if (!btrfs_qgroup_columns[i].need_print)
 			continue;
-		print_qgroup_column(qgroup, i);
+		print_qgroup_column(lookup, qgroup, i);
 
 		if (i != BTRFS_QGROUP_CHILD)
 			printf(" ");
@@ -315,9 +342,113 @@ static void print_table_head(void)
 	printf("\n");
 }
 
-static void qgroup_lookup_init(struct qgroup_lookup *tree)
+/*
+ * The machine readable formats print raw byte counts, an unset limit is an
+ * empty field or null
+ */
+static void print_csv_head(void)
 {
-	tree->root.rb_node = NULL;
+	int first = 1;
+	int i;
+
+	for (i = 0; i < BTRFS_QGROUP_ALL; i++) {
+		if (!btrfs_qgroup_columns[i].need_print)
+			continue;
+		printf("%s%s", first ? "" : ",", btrfs_qgroup_columns[i].name);
+		first = 0;
+	}
+	printf("\n");
+}
+
+static void print_single_qgroup_csv(struct qgroup_lookup *lookup,
+				    struct btrfs_qgroup *qgroup)
+{
+	int first = 1;
+	int i;
+
+	for (i = 0; i < BTRFS_QGROUP_ALL; i++) {
+		if (!btrfs_qgroup_columns[i].need_print)
+			continue;
+		if (!first)
+			printf(",");
+		first = 0;
+
+		switch (i) {
+		case BTRFS_QGROUP_QGROUPID:
+			printf("%llu/%llu", btrfs_qgroup_level(qgroup->qgroupid),
+			       btrfs_qgroup_subvid(qgroup->qgroupid));
+			break;
+		case BTRFS_QGROUP_RFER:
+			printf("%llu", qgroup->rfer);
+			break;
+		case BTRFS_QGROUP_EXCL:
+			printf("%llu", qgroup->excl);
+			break;
+		case BTRFS_QGROUP_MAX_RFER:
+			if (qgroup->flags & BTRFS_QGROUP_LIMIT_MAX_RFER)
+				printf("%llu", qgroup->max_rfer);
+			break;
+		case BTRFS_QGROUP_MAX_EXCL:
+			if (qgroup->flags & BTRFS_QGROUP_LIMIT_MAX_EXCL)
+				printf("%llu", qgroup->max_excl);
+			break;
+		case BTRFS_QGROUP_PARENT:
+			print_relation_column(lookup,
+				lookup->parents + qgroup->parents_start,
+				qgroup->nr_parents, " ");
+			break;
+		case BTRFS_QGROUP_CHILD:
+			print_relation_column(lookup,
+				lookup->members + qgroup->members_start,
+				qgroup->nr_members, " ");
+			break;
+		}
+	}
+	printf("\n");
+}
+
+static void print_json_relations(struct qgroup_lookup *lookup,
+				 const char *name, u32 *idx, u32 nr)
+{
+	struct btrfs_qgroup *bq;
+	u32 i;
+
+	printf(",\"%s\":[", name);
+	for (i = 0; i < nr; i++) {
+		bq = &lookup->qgroups[idx[i]];
+		printf("%s\"%llu/%llu\"", i ? "," : "",
+		       btrfs_qgroup_level(bq->qgroupid),
+		       btrfs_qgroup_subvid(bq->qgroupid));
+	}
+	printf("]");
+}
+
+/* One object per line with all the fields, independent of the columns */
+static void print_single_qgroup_json(struct qgroup_lookup *lookup,
+				     struct btrfs_qgroup *qgroup)
+{
+	printf("{\"qgroupid\":\"%llu/%llu\",\"generation\":%llu",
+	       btrfs_qgroup_level(qgroup->qgroupid),
+	       btrfs_qgroup_subvid(qgroup->qgroupid), qgroup->generation);
+	printf(",\"rfer\":%llu,\"rfer_cmpr\":%llu", qgroup->rfer,
+	       qgroup->rfer_cmpr);
+	printf(",\"excl\":%llu,\"excl_cmpr\":%llu", qgroup->excl,
+	       qgroup->excl_cmpr);
+	if (qgroup->flags & BTRFS_QGROUP_LIMIT_MAX_RFER)
+		printf(",\"max_rfer\":%llu", qgroup->max_rfer);
+	else
+		printf(",\"max_rfer\":null");
+	if (qgroup->flags & BTRFS_QGROUP_LIMIT_MAX_EXCL)
+		printf(",\"max_excl\":%llu", qgroup->max_excl);
+	else
+		printf(",\"max_excl\":null");
+	print_json_relations(lookup, "parents",
+			     lookup->parents + qgroup->parents_start,
+			     qgroup->nr_parents);
+	print_json_relations(lookup, "children",
+			     lookup->members + qgroup->members_start,
+			     qgroup->nr_members);
+	printf("}\n");
 }
 
 static int comp_entry_with_qgroupid(struct btrfs_qgroup *entry1,
@@ -522,235 +653,177 @@ comp_qgroupid:
 	return ret;
 }
 
-/*
- * insert a new root into the tree.  returns the existing root entry
- * if one is already there.  qgroupid is used
- * as the key
- */
-static int qgroup_tree_insert(struct qgroup_lookup *root_tree,
-			      struct btrfs_qgroup *ins)
+static int comp_qgroupid(const void *a, const void *b)
 {
+	const u64 *id1 = a;
+	const u64 *id2 = b;
 
-	struct rb_node **p = &root_tree->root.rb_node;
-	struct rb_node *parent = NULL;
-	struct btrfs_qgroup *curr;
-	int ret;
-
-	while (*p) {
-		parent = *p;
-		curr = rb_entry(parent, struct btrfs_qgroup, rb_node);
+	return *id1 < *id2 ? -1 : *id1 > *id2;
+}
 
-		ret = comp_entry_with_qgroupid(ins, curr, 0);
-		if (ret < 0)
-			p = &(*p)->rb_left;
-		else if (ret > 0)
-			p = &(*p)->rb_right;
-		else
-			return -EEXIST;
-	}
-	rb_link_node(&ins->rb_node, parent, p);
-	rb_insert_color(&ins->rb_node, &root_tree->root);
-	return 0;
+static struct btrfs_qgroup *qgroup_lookup_search(struct qgroup_lookup *lookup,
+						 u64 qgroupid)
+{
+	/* qgroupid is the first member of struct btrfs_qgroup */
+	return bsearch(&qgroupid, lookup->qgroups, lookup->nr,
+		       sizeof(struct btrfs_qgroup), comp_qgroupid);
 }
 
 /*
- *find a given qgroupid in the tree. We return the smallest one,
- *rb_next can be used to move forward looking for more if required
+ * Find the qgroup or add a new one. The info items come from the quota tree
+ * sorted by qgroupid, so their qgroups are appended to the sorted part of
+ * the array. Limit items without an info item add qgroups out of order
+ * into a tail, which is merged by qgroup_lookup_sort() once all items are
+ * loaded.
  */
-static struct btrfs_qgroup *qgroup_tree_search(struct qgroup_lookup *root_tree,
-					       u64 qgroupid)
+static struct btrfs_qgroup *qgroup_lookup_get(struct qgroup_lookup *lookup,
+					      u64 qgroupid)
 {
-	struct rb_node *n = root_tree->root.rb_node;
-	struct btrfs_qgroup *entry;
-	struct btrfs_qgroup tmp;
-	int ret;
-
-	tmp.qgroupid = qgroupid;
-
-	while (n) {
-		entry = rb_entry(n, struct btrfs_qgroup, rb_node);
-
-		ret = comp_entry_with_qgroupid(&tmp, entry, 0);
-		if (ret < 0)
-			n = n->rb_left;
-		else if (ret > 0)
-			n = n->rb_right;
-		else
-			return entry;
+	struct btrfs_qgroup *bq;
+	int sorted;
+	int i;
 
+	if (lookup->nr) {
+		bq = &lookup->qgroups[lookup->nr - 1];
+		if (bq->qgroupid == qgroupid)
+			return bq;
 	}
-	return NULL;
+	bq = bsearch(&qgroupid, lookup->qgroups, lookup->nr_sorted,
+		     sizeof(*bq), comp_qgroupid);
+	if (bq)
+		return bq;
+	if (!lookup->tail_unordered) {
+		bq = bsearch(&qgroupid, lookup->qgroups + lookup->nr_sorted,
+			     lookup->nr - lookup->nr_sorted, sizeof(*bq),
+			     comp_qgroupid);
+		if (bq)
+			return bq;
+	} else {
+		for (i = lookup->nr_sorted; i < lookup->nr; i++)
+			if (lookup->qgroups[i].qgroupid == qgroupid)
+				return &lookup->qgroups[i];
+	}
+	sorted = !lookup->nr ||
+		 lookup->qgroups[lookup->nr - 1].qgroupid < qgroupid;
+	if (!sorted && lookup->nr > lookup->nr_sorted)
+		lookup->tail_unordered = 1;
+	sorted = sorted && lookup->nr_sorted == lookup->nr;
+
+	if (lookup->nr == lookup->alloc) {
+		int alloc = max(lookup->alloc * 2, 1024);
+
+		bq = realloc(lookup->qgroups, alloc * sizeof(*bq));
+		if (!bq)
+			return NULL;
+		lookup->qgroups = bq;
+		lookup->alloc = alloc;
+	}
+	bq = &lookup->qgroups[lookup->nr++];
+	memset(bq, 0, sizeof(*bq));
+	bq->qgroupid = qgroupid;
+	if (sorted)
+		lookup->nr_sorted++;
+	return bq;
 }
 
-static int update_qgroup(struct qgroup_lookup *qgroup_lookup, u64 qgroupid,
-			 u64 generation, u64 rfer, u64 rfer_cmpr, u64 excl,
-			 u64 excl_cmpr, u64 flags, u64 max_rfer, u64 max_excl,
-			 u64 rsv_rfer, u64 rsv_excl, struct btrfs_qgroup *pa,
-			 struct btrfs_qgroup *child)
+/* Sort the qgroups added out of order, once all items are loaded */
+static void qgroup_lookup_sort(struct qgroup_lookup *lookup)
 {
-	struct btrfs_qgroup *bq;
-	struct btrfs_qgroup_list *list;
-
-	bq = qgroup_tree_search(qgroup_lookup, qgroupid);
-	if (!bq || bq->qgroupid != qgroupid)
-		return -ENOENT;
-
-	if (generation)
-		bq->generation = generation;
-	if (rfer)
-		bq->rfer = rfer;
-	if (rfer_cmpr)
-		bq->rfer_cmpr = rfer_cmpr;
-	if (excl)
-		bq->excl = excl;
-	if (excl_cmpr)
-		bq->excl_cmpr = excl_cmpr;
-	if (flags)
-		bq->flags = flags;
-	if (max_rfer)
-		bq->max_rfer = max_rfer;
-	if (max_excl)
-		bq->max_excl = max_excl;
-	if (rsv_rfer)
-		bq->rsv_rfer = rsv_rfer;
-	if (pa && child) {
-		list = malloc(sizeof(*list));
-		if (!list) {
-			fprintf(stderr, "memory allocation failed\n");
-			exit(1);
-		}
-		list->qgroup = pa;
-		list->member = child;
-		list_add_tail(&list->next_qgroup, &child->qgroups);
-		list_add_tail(&list->next_member, &pa->members);
+	if (lookup->nr_sorted == lookup->nr)
+		return;
+	qsort(lookup->qgroups, lookup->nr, sizeof(struct btrfs_qgroup),
+	      comp_qgroupid);
+	lookup->nr_sorted = lookup->nr;
+	lookup->tail_unordered = 0;
+}
+
+static int qgroup_lookup_add_relation(struct qgroup_lookup *lookup,
+				      u64 parent, u64 member)
+{
+	if (lookup->nr_relations == lookup->alloc_relations) {
+		int alloc = max(lookup->alloc_relations * 2, 1024);
+		u64 (*tmp)[2];
+
+		tmp = realloc(lookup->relations, alloc * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		lookup->relations = tmp;
+		lookup->alloc_relations = alloc;
 	}
+	lookup->relations[lookup->nr_relations][0] = parent;
+	lookup->relations[lookup->nr_relations][1] = member;
+	lookup->nr_relations++;
 	return 0;
 }
 
-static int add_qgroup(struct qgroup_lookup *qgroup_lookup, u64 qgroupid,
-		      u64 generation, u64 rfer, u64 rfer_cmpr, u64 excl,
-		      u64 excl_cmpr, u64 flags, u64 max_rfer, u64 max_excl,
-		      u64 rsv_rfer, u64 rsv_excl, struct btrfs_qgroup *parent,
-		      struct btrfs_qgroup *child)
+/*
+ * Turn the relation pairs into the parents and members index arrays. The
+ * relations are sorted by member and then by parent, so filling the slices
+ * in this order keeps both of them sorted by qgroupid.
+ */
+static int qgroup_lookup_build_relations(struct qgroup_lookup *lookup)
 {
-	struct btrfs_qgroup *bq;
-	struct btrfs_qgroup_list *list;
-	int ret;
+	struct btrfs_qgroup *qgroups = lookup->qgroups;
+	u32 (*edges)[2];
+	u32 parents_start = 0;
+	u32 members_start = 0;
+	int nr = 0;
+	int i;
 
-	ret = update_qgroup(qgroup_lookup, qgroupid, generation, rfer,
-			    rfer_cmpr, excl, excl_cmpr, flags, max_rfer,
-			    max_excl, rsv_rfer, rsv_excl, parent, child);
-	if (!ret)
+	if (!lookup->nr_relations)
 		return 0;
 
-	bq = calloc(1, sizeof(*bq));
-	if (!bq) {
-		printf("memory allocation failed\n");
-		exit(1);
-	}
-	if (qgroupid) {
-		bq->qgroupid = qgroupid;
-		INIT_LIST_HEAD(&bq->qgroups);
-		INIT_LIST_HEAD(&bq->members);
-	}
-	if (generation)
-		bq->generation = generation;
-	if (rfer)
-		bq->rfer = rfer;
-	if (rfer_cmpr)
-		bq->rfer_cmpr = rfer_cmpr;
-	if (excl)
-		bq->excl = excl;
-	if (excl_cmpr)
-		bq->excl_cmpr = excl_cmpr;
-	if (flags)
-		bq->flags = flags;
-	if (max_rfer)
-		bq->max_rfer = max_rfer;
-	if (max_excl)
-		bq->max_excl = max_excl;
-	if (rsv_rfer)
-		bq->rsv_rfer = rsv_rfer;
-	if (parent && child) {
-		list = malloc(sizeof(*list));
-		if (!list) {
-			fprintf(stderr, "memory allocation failed\n");
-			exit(1);
-		}
-		list->qgroup = parent;
-		list->member = child;
-		list_add_tail(&list->next_qgroup, &child->qgroups);
-		list_add_tail(&list->next_member, &parent->members);
-	}
-	ret = qgroup_tree_insert(qgroup_lookup, bq);
-	if (ret) {
-		printf("failed to insert tree %llu\n",
-		       bq->qgroupid);
-		exit(1);
+	edges = malloc(lookup->nr_relations * sizeof(*edges));
+	lookup->parents = malloc(lookup->nr_relations * sizeof(u32));
+	lookup->members = malloc(lookup->nr_relations * sizeof(u32));
+	if (!edges || !lookup->parents || !lookup->members) {
+		free(edges);
+		return -ENOMEM;
 	}
-	return ret;
-}
 
-static void __free_btrfs_qgroup(struct btrfs_qgroup *bq)
-{
-	struct btrfs_qgroup_list *list;
-	while (!list_empty(&bq->qgroups)) {
-		list = list_entry((&bq->qgroups)->next,
-				  struct btrfs_qgroup_list,
-				  next_qgroup);
-		list_del(&list->next_qgroup);
-		list_del(&list->next_member);
-		free(list);
-	}
-	while (!list_empty(&bq->members)) {
-		list = list_entry((&bq->members)->next,
-				  struct btrfs_qgroup_list,
-				  next_member);
-		list_del(&list->next_qgroup);
-		list_del(&list->next_member);
-		free(list);
+	for (i = 0; i < lookup->nr_relations; i++) {
+		struct btrfs_qgroup *parent;
+		struct btrfs_qgroup *member;
+
+		parent = qgroup_lookup_search(lookup, lookup->relations[i][0]);
+		member = qgroup_lookup_search(lookup, lookup->relations[i][1]);
+		if (!parent || !member)
+			continue;
+		edges[nr][0] = parent - qgroups;
+		edges[nr][1] = member - qgroups;
+		parent->nr_members++;
+		member->nr_parents++;
+		nr++;
 	}
-	free(bq);
-}
 
-static void __free_all_qgroups(struct qgroup_lookup *root_tree)
-{
-	struct btrfs_qgroup *entry;
-	struct rb_node *n;
+	for (i = 0; i < lookup->nr; i++) {
+		qgroups[i].parents_start = parents_start;
+		qgroups[i].members_start = members_start;
+		parents_start += qgroups[i].nr_parents;
+		members_start += qgroups[i].nr_members;
+		qgroups[i].nr_parents = 0;
+		qgroups[i].nr_members = 0;
+	}
 
-	n = rb_first(&root_tree->root);
-	while (n) {
-		entry = rb_entry(n, struct btrfs_qgroup, rb_node);
-		rb_erase(n, &root_tree->root);
-		__free_btrfs_qgroup(entry);
+	for (i = 0; i < nr; i++) {
+		struct btrfs_qgroup *parent = &qgroups[edges[i][0]];
+		struct btrfs_qgroup *member = &qgroups[edges[i][1]];
 
-		n = rb_first(&root_tree->root);
+		lookup->parents[member->parents_start + member->nr_parents++] =
+			edges[i][0];
+		lookup->members[parent->members_start + parent->nr_members++] =
+			edges[i][1];
 	}
+	free(edges);
+	return 0;
 }
 
-static int filter_all_parent_insert(struct qgroup_lookup *sort_tree,
-				    struct btrfs_qgroup *bq)
+static void __free_all_qgroups(struct qgroup_lookup *lookup)
 {
-	struct rb_node **p = &sort_tree->root.rb_node;
-	struct rb_node *parent = NULL;
-	struct btrfs_qgroup *curr;
-	int ret;
-
-	while (*p) {
-		parent = *p;
-		curr = rb_entry(parent, struct btrfs_qgroup, all_parent_node);
-
-		ret = comp_entry_with_qgroupid(bq, curr, 0);
-		if (ret < 0)
-			p = &(*p)->rb_left;
-		else if (ret > 0)
-			p = &(*p)->rb_right;
-		else
-			return -EEXIST;
-	}
-	rb_link_node(&bq->all_parent_node, parent, p);
-	rb_insert_color(&bq->all_parent_node, &sort_tree->root);
-	return 0;
+	free(lookup->qgroups);
+	free(lookup->relations);
+	free(lookup->parents);
+	free(lookup->members);
 }
 
 static int filter_by_parent(struct btrfs_qgroup *bq, u64 data)
@@ -767,35 +840,12 @@ static int filter_by_parent(struct btrfs_qgroup *bq, u64 data)
 
 static int filter_by_all_parent(struct btrfs_qgroup *bq, u64 data)
 {
-	struct qgroup_lookup lookup;
-	struct qgroup_lookup *ql = &lookup;
-	struct btrfs_qgroup_list *list;
-	struct rb_node *n;
-	struct btrfs_qgroup *qgroup =
-			 (struct btrfs_qgroup *)(unsigned long)data;
+	struct qgroup_id_set *set = (struct qgroup_id_set *)(unsigned long)data;
 
 	if (data == 0)
 		return 0;
-	if (bq->qgroupid == qgroup->qgroupid)
-		return 1;
-
-	qgroup_lookup_init(ql);
-	filter_all_parent_insert(ql, qgroup);
-	n = rb_first(&ql->root);
-	while (n) {
-		qgroup = rb_entry(n, struct btrfs_qgroup, all_parent_node);
-		if (!list_empty(&qgroup->qgroups)) {
-			list_for_each_entry(list, &qgroup->qgroups,
-					    next_qgroup) {
-				if ((list->qgroup)->qgroupid == bq->qgroupid)
-					return 1;
-				filter_all_parent_insert(ql, list->qgroup);
-			}
-		}
-		rb_erase(n, &ql->root);
-		n = rb_first(&ql->root);
-	}
-	return 0;
+	return bsearch(&bq->qgroupid, set->ids, set->nr, sizeof(u64),
+		       comp_qgroupid) != NULL;
 }
 
 static btrfs_qgroup_filter_func all_filter_funcs[] = {
@@ -879,55 +929,114 @@ static int filter_qgroup(struct btrfs_qgroup *bq,
 	return 1;
 }
 
-static void pre_process_filter_set(struct qgroup_lookup *lookup,
-				   struct btrfs_qgroup_filter_set *set)
+/* Collect the ids of @bq and all its ancestors with a breadth-first walk */
+static struct qgroup_id_set *qgroup_ancestors(struct qgroup_lookup *lookup,
+					      struct btrfs_qgroup *bq)
+{
+	struct qgroup_id_set *set = NULL;
+	u32 *queue;
+	char *seen;
+	int head = 0;
+	int tail = 0;
+	u32 i;
+
+	queue = malloc(lookup->nr * sizeof(*queue));
+	seen = calloc(lookup->nr, 1);
+	if (!queue || !seen)
+		goto out;
+
+	queue[tail++] = bq - lookup->qgroups;
+	seen[bq - lookup->qgroups] = 1;
+	while (head < tail) {
+		struct btrfs_qgroup *cur = &lookup->qgroups[queue[head++]];
+
+		for (i = 0; i < cur->nr_parents; i++) {
+			u32 idx = lookup->parents[cur->parents_start + i];
+
+			if (seen[idx])
+				continue;
+			seen[idx] = 1;
+			queue[tail++] = idx;
+		}
+	}
+
+	set = malloc(sizeof(*set) + tail * sizeof(u64));
+	if (!set)
+		goto out;
+	set->nr = tail;
+	for (head = 0; head < tail; head++)
+		set->ids[head] = lookup->qgroups[queue[head]].qgroupid;
+	qsort(set->ids, set->nr, sizeof(u64), comp_qgroupid);
+out:
+	free(queue);
+	free(seen);
+	return set;
+}
+
+static int pre_process_filter_set(struct qgroup_lookup *lookup,
+				  struct btrfs_qgroup_filter_set *set)
 {
 	int i;
 	struct btrfs_qgroup *qgroup_for_filter = NULL;
 
 	for (i = 0; i < set->nfilters; i++) {
+		if (set->filters[i].filter_func != filter_by_all_parent
+		    && set->filters[i].filter_func != filter_by_parent)
+			continue;
 
-		if (set->filters[i].filter_func == filter_by_all_parent
-		    || set->filters[i].filter_func == filter_by_parent) {
-			qgroup_for_filter = qgroup_tree_search(lookup,
-					    set->filters[i].data);
+		qgroup_for_filter = qgroup_lookup_search(lookup,
+					set->filters[i].data);
+		set->filters[i].data = 0;
+		if (!qgroup_for_filter)
+			continue;
+		if (set->filters[i].filter_func == filter_by_parent) {
 			set->filters[i].data =
-				 (u64)(unsigned long)qgroup_for_filter;
+				(u64)(unsigned long)qgroup_for_filter;
+			continue;
 		}
+		set->filters[i].data = (u64)(unsigned long)
+			qgroup_ancestors(lookup, qgroup_for_filter);
+		if (!set->filters[i].data)
+			return -ENOMEM;
 	}
+	return 0;
 }
 
-static int sort_tree_insert(struct qgroup_lookup *sort_tree,
-			    struct btrfs_qgroup *bq,
-			    struct btrfs_qgroup_comparer_set *comp_set)
+static void post_process_filter_set(struct btrfs_qgroup_filter_set *set)
 {
-	struct rb_node **p = &sort_tree->root.rb_node;
-	struct rb_node *parent = NULL;
-	struct btrfs_qgroup *curr;
-	int ret;
+	int i;
 
-	while (*p) {
-		parent = *p;
-		curr = rb_entry(parent, struct btrfs_qgroup, sort_node);
+	for (i = 0; i < set->nfilters; i++) {
+		if (set->filters[i].filter_func != filter_by_all_parent)
+			continue;
+		free((struct qgroup_id_set *)(unsigned long)set->filters[i].data);
+		set->filters[i].data = 0;
+	}
+}
 
-		ret = sort_comp(bq, curr, comp_set);
-		if (ret < 0)
-			p = &(*p)->rb_left;
-		else if (ret > 0)
-			p = &(*p)->rb_right;
-		else
-			return -EEXIST;
+static int relation_column_len(struct qgroup_lookup *lookup, u32 *idx, u32 nr)
+{
+	struct btrfs_qgroup *bq;
+	char tmp[100];
+	int len = 0;
+	u32 i;
+
+	for (i = 0; i < nr; i++) {
+		bq = &lookup->qgroups[idx[i]];
+		len += sprintf(tmp, "%llu/%llu",
+			       btrfs_qgroup_level(bq->qgroupid),
+			       btrfs_qgroup_subvid(bq->qgroupid));
+		if (i)
+			len += 1;
 	}
-	rb_link_node(&bq->sort_node, parent, p);
-	rb_insert_color(&bq->sort_node, &sort_tree->root);
-	return 0;
+	return len;
 }
 
-static void __update_columns_max_len(struct btrfs_qgroup *bq,
+static void __update_columns_max_len(struct qgroup_lookup *lookup,
+				     struct btrfs_qgroup *bq,
 				     enum btrfs_qgroup_column_enum column)
 {
 	BUG_ON(column >= BTRFS_QGROUP_ALL || column < 0);
-	struct btrfs_qgroup_list *list = NULL;
 	char tmp[100];
 	int len;
 	unsigned unit_mode = btrfs_qgroup_columns[column].unit_mode;
@@ -963,26 +1072,16 @@ static void __update_columns_max_len(struct btrfs_qgroup *bq,
 			btrfs_qgroup_columns[column].max_len = len;
 		break;
 	case BTRFS_QGROUP_PARENT:
-		len = 0;
-		list_for_each_entry(list, &bq->qgroups, next_qgroup) {
-			len += sprintf(tmp, "%llu/%llu",
-				btrfs_qgroup_level(list->qgroup->qgroupid),
-				btrfs_qgroup_subvid(list->qgroup->qgroupid));
-			if (!list_is_last(&list->next_qgroup, &bq->qgroups))
-				len += 1;
-		}
+		len = relation_column_len(lookup,
+				lookup->parents + bq->parents_start,
+				bq->nr_parents);
 		if (btrfs_qgroup_columns[column].max_len < len)
 			btrfs_qgroup_columns[column].max_len = len;
 		break;
 	case BTRFS_QGROUP_CHILD:
-		len = 0;
-		list_for_each_entry(list, &bq->members, next_member) {
-			len += sprintf(tmp, "%llu/%llu",
-				btrfs_qgroup_level(list->member->qgroupid),
-				btrfs_qgroup_subvid(list->member->qgroupid));
-			if (!list_is_last(&list->next_member, &bq->members))
-				len += 1;
-		}
+		len = relation_column_len(lookup,
+				lookup->members + bq->members_start,
+				bq->nr_members);
 		if (btrfs_qgroup_columns[column].max_len < len)
 			btrfs_qgroup_columns[column].max_len = len;
 		break;
@@ -992,41 +1091,68 @@ static void __update_columns_max_len(struct btrfs_qgroup *bq,
 
 }
 
-static void update_columns_max_len(struct btrfs_qgroup *bq)
+static void update_columns_max_len(struct qgroup_lookup *lookup,
+				   struct btrfs_qgroup *bq)
 {
 	int i;
 
 	for (i = 0; i < BTRFS_QGROUP_ALL; i++) {
 		if (!btrfs_qgroup_columns[i].need_print)
 			continue;
-		__update_columns_max_len(bq, i);
+		__update_columns_max_len(lookup, bq, i);
 	}
 }
 
-static void __filter_and_sort_qgroups(struct qgroup_lookup *all_qgroups,
-				 struct qgroup_lookup *sort_tree,
-				 struct btrfs_qgroup_filter_set *filter_set,
-				 struct btrfs_qgroup_comparer_set *comp_set)
+/* qsort has no context argument, the comparer set is passed here */
+static struct btrfs_qgroup_comparer_set *qgroup_sort_set;
+
+static int qgroup_sort_comp(const void *a, const void *b)
 {
-	struct rb_node *n;
+	struct btrfs_qgroup * const *entry1 = a;
+	struct btrfs_qgroup * const *entry2 = b;
+
+	return sort_comp(*entry1, *entry2, qgroup_sort_set);
+}
+
+/*
+ * Filter the qgroups into an array of pointers and sort it. The qgroups are
+ * already in qgroupid order, so the sort is done only for other orders.
+ */
+static int __filter_and_sort_qgroups(struct qgroup_lookup *lookup,
+				     struct btrfs_qgroup ***sorted, int *nr,
+				     struct btrfs_qgroup_filter_set *filter_set,
+				     struct btrfs_qgroup_comparer_set *comp_set)
+{
+	struct btrfs_qgroup **array;
 	struct btrfs_qgroup *entry;
 	int ret;
+	int i;
 
-	qgroup_lookup_init(sort_tree);
-	pre_process_filter_set(all_qgroups, filter_set);
-
-	n = rb_last(&all_qgroups->root);
-	while (n) {
-		entry = rb_entry(n, struct btrfs_qgroup, rb_node);
+	*nr = 0;
+	*sorted = NULL;
+	ret = pre_process_filter_set(lookup, filter_set);
+	if (ret)
+		return ret;
 
-		ret = filter_qgroup(entry, filter_set);
-		if (ret) {
-			sort_tree_insert(sort_tree, entry, comp_set);
+	array = malloc(max(lookup->nr, 1) * sizeof(*array));
+	if (!array)
+		return -ENOMEM;
+	for (i = 0; i < lookup->nr; i++) {
+		entry = &lookup->qgroups[i];
+		if (!filter_qgroup(entry, filter_set))
+			continue;
+		array[(*nr)++] = entry;
+		if (qgroup_format == BTRFS_QGROUP_FORMAT_TABLE)
+			update_columns_max_len(lookup, entry);
+	}
 
-			update_columns_max_len(entry);
-		}
-		n = rb_prev(n);
+	if (comp_set && comp_set->ncomps) {
+		qgroup_sort_set = comp_set;
+		qsort(array, *nr, sizeof(*array), qgroup_sort_comp);
+		qgroup_sort_set = NULL;
 	}
+	*sorted = array;
+	return 0;
 }
 
 static inline void print_status_flag_warning(u64 flags)
@@ -1042,151 +1168,176 @@ static inline void print_status_flag_warning(u64 flags)
 		"WARNING: Qgroup data inconsistent, rescan recommended\n");
 }
 
-static int __qgroups_search(int fd, struct qgroup_lookup *qgroup_lookup)
+static int qgroups_search_item(struct qgroup_lookup *lookup,
+			       struct btrfs_ioctl_search_header *sh, void *item)
 {
-	int ret;
-	struct btrfs_ioctl_search_args args;
-	struct btrfs_ioctl_search_key *sk = &args.key;
-	struct btrfs_ioctl_search_header *sh;
-	unsigned long off = 0;
-	unsigned int i;
 	struct btrfs_qgroup_info_item *info;
 	struct btrfs_qgroup_limit_item *limit;
 	struct btrfs_qgroup *bq;
-	struct btrfs_qgroup *bq1;
-	u64 a1;
-	u64 a2;
-	u64 a3;
-	u64 a4;
-	u64 a5;
 
-	memset(&args, 0, sizeof(args));
+	switch (sh->type) {
+	case BTRFS_QGROUP_STATUS_KEY:
+		print_status_flag_warning(btrfs_stack_qgroup_status_flags(item));
+		break;
+	case BTRFS_QGROUP_INFO_KEY:
+		bq = qgroup_lookup_get(lookup, sh->offset);
+		if (!bq)
+			return -ENOMEM;
+		info = item;
+		bq->generation = btrfs_stack_qgroup_info_generation(info);
+		bq->rfer = btrfs_stack_qgroup_info_referenced(info);
+		bq->rfer_cmpr =
+			btrfs_stack_qgroup_info_referenced_compressed(info);
+		bq->excl = btrfs_stack_qgroup_info_exclusive(info);
+		bq->excl_cmpr =
+			btrfs_stack_qgroup_info_exclusive_compressed(info);
+		break;
+	case BTRFS_QGROUP_LIMIT_KEY:
+		bq = qgroup_lookup_get(lookup, sh->offset);
+		if (!bq)
+			return -ENOMEM;
+		limit = item;
+		bq->flags = btrfs_stack_qgroup_limit_flags(limit);
+		bq->max_rfer = btrfs_stack_qgroup_limit_max_referenced(limit);
+		bq->max_excl = btrfs_stack_qgroup_limit_max_exclusive(limit);
+		bq->rsv_rfer = btrfs_stack_qgroup_limit_rsv_referenced(limit);
+		bq->rsv_excl = btrfs_stack_qgroup_limit_rsv_exclusive(limit);
+		break;
+	case BTRFS_QGROUP_RELATION_KEY:
+		/* each relation has two items, use the one from the member */
+		if (sh->offset < sh->objectid)
+			break;
+		return qgroup_lookup_add_relation(lookup, sh->offset,
+						  sh->objectid);
+	}
+	return 0;
+}
+
+/*
+ * Read the whole quota tree. With TREE_SEARCH_V2 and a large buffer this is
+ * one or a few ioctls even for tens of thousands of qgroups, old kernels
+ * fall back to the 4k buffer of the v1 ioctl.
+ */
+static int __qgroups_search(int fd, struct qgroup_lookup *lookup)
+{
+	struct btrfs_ioctl_search_args_v2 *args2;
+	struct btrfs_ioctl_search_args args;
+	struct btrfs_ioctl_search_key *sk;
+	struct btrfs_ioctl_search_header sh;
+	unsigned long off;
+	u64 buf_size;
+	char *buf;
+	int use_v1 = 0;
+	unsigned int i;
+	int ret;
+
+	args2 = malloc(sizeof(*args2) + BTRFS_QGROUP_SEARCH_BUF_SIZE);
+	if (!args2)
+		return -ENOMEM;
 
+	sk = &args2->key;
+	memset(sk, 0, sizeof(*sk));
 	sk->tree_id = BTRFS_QUOTA_TREE_OBJECTID;
 	sk->max_type = BTRFS_QGROUP_RELATION_KEY;
 	sk->min_type = BTRFS_QGROUP_STATUS_KEY;
 	sk->max_objectid = (u64)-1;
 	sk->max_offset = (u64)-1;
 	sk->max_transid = (u64)-1;
-	sk->nr_items = 4096;
-
-	qgroup_lookup_init(qgroup_lookup);
 
 	while (1) {
-		ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args);
+		if (!use_v1) {
+			sk->nr_items = (u32)-1;
+			args2->buf_size = BTRFS_QGROUP_SEARCH_BUF_SIZE;
+			ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH_V2, args2);
+			if (ret < 0 && (errno == ENOTTY || errno == EOPNOTSUPP)) {
+				use_v1 = 1;
+				continue;
+			}
+			buf = (char *)args2->buf;
+			buf_size = BTRFS_QGROUP_SEARCH_BUF_SIZE;
+		} else {
+			sk->nr_items = 4096;
+			memcpy(&args.key, sk, sizeof(*sk));
+			ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args);
+			memcpy(sk, &args.key, sizeof(*sk));
+			buf = args.buf;
+			buf_size = sizeof(args.buf);
+		}
 		if (ret < 0) {
 			fprintf(stderr,
 				"ERROR: can't perform the search - %s\n",
 				strerror(errno));
-			return ret;
+			goto out;
 		}
 		/* the ioctl returns the number of item it found in nr_items */
 		if (sk->nr_items == 0)
 			break;
 
 		off = 0;
-		/*
-		 * for each item, pull the key out of the header and then
-		 * read the root_ref item it contains
-		 */
 		for (i = 0; i < sk->nr_items; i++) {
-			sh = (struct btrfs_ioctl_search_header *)(args.buf +
-								  off);
-			off += sizeof(*sh);
-
-			if (sh->type == BTRFS_QGROUP_STATUS_KEY) {
-				struct btrfs_qgroup_status_item *si;
-				u64 flags;
-
-				si = (struct btrfs_qgroup_status_item *)
-				     (args.buf + off);
-				flags = btrfs_stack_qgroup_status_flags(si);
-				print_status_flag_warning(flags);
-			} else if (sh->type == BTRFS_QGROUP_INFO_KEY) {
-				info = (struct btrfs_qgroup_info_item *)
-				       (args.buf + off);
-				a1 = btrfs_stack_qgroup_info_generation(info);
-				a2 = btrfs_stack_qgroup_info_referenced(info);
-				a3 =
-				  btrfs_stack_qgroup_info_referenced_compressed
-				  (info);
-				a4 = btrfs_stack_qgroup_info_exclusive(info);
-				a5 =
-				  btrfs_stack_qgroup_info_exclusive_compressed
-				  (info);
-				add_qgroup(qgroup_lookup, sh->offset, a1, a2,
-					   a3, a4, a5, 0, 0, 0, 0, 0,
-					   NULL, NULL);
-			} else if (sh->type == BTRFS_QGROUP_LIMIT_KEY) {
-				limit = (struct btrfs_qgroup_limit_item *)
-				    (args.buf + off);
-
-				a1 = btrfs_stack_qgroup_limit_flags(limit);
-				a2 = btrfs_stack_qgroup_limit_max_referenced
-				     (limit);
-				a3 = btrfs_stack_qgroup_limit_max_exclusive
-				     (limit);
-				a4 = btrfs_stack_qgroup_limit_rsv_referenced
-				     (limit);
-				a5 = btrfs_stack_qgroup_limit_rsv_exclusive
-				     (limit);
-				add_qgroup(qgroup_lookup, sh->offset, 0, 0,
-					   0, 0, 0, a1, a2, a3, a4, a5,
-					   NULL, NULL);
-			} else if (sh->type == BTRFS_QGROUP_RELATION_KEY) {
-				if (sh->offset < sh->objectid)
-					goto skip;
-				bq = qgroup_tree_search(qgroup_lookup,
-							sh->offset);
-				if (!bq)
-					goto skip;
-				bq1 = qgroup_tree_search(qgroup_lookup,
-							 sh->objectid);
-				if (!bq1)
-					goto skip;
-				add_qgroup(qgroup_lookup, sh->offset, 0, 0,
-					   0, 0, 0, 0, 0, 0, 0, 0, bq, bq1);
-			} else
-				goto done;
-skip:
-			off += sh->len;
+			memcpy(&sh, buf + off, sizeof(sh));
+			off += sizeof(sh);
+			ret = qgroups_search_item(lookup, &sh, buf + off);
+			if (ret) {
+				error("not enough memory");
+				goto out;
+			}
+			off += sh.len;
 
 			/*
 			 * record the mins in sk so we can make sure the
-			 * next search doesn't repeat this root
+			 * next search doesn't repeat this item
 			 */
-			sk->min_type = sh->type;
-			sk->min_offset = sh->offset;
-			sk->min_objectid = sh->objectid;
+			sk->min_type = sh.type;
+			sk->min_offset = sh.offset;
+			sk->min_objectid = sh.objectid;
 		}
-		sk->nr_items = 4096;
+
 		/*
-		 * this iteration is done, step forward one qgroup for the next
-		 * ioctl
+		 * The search ends early only when the next item does not
+		 * fit, enough room left means the whole tree has been read
 		 */
-		if (sk->min_offset < (u64)-1)
+		if (buf_size - off >= sizeof(sh) + BTRFS_MAX_METADATA_BLOCKSIZE)
+			break;
+		if (sk->min_offset < (u64)-1) {
 			sk->min_offset++;
-		else
+		} else if (sk->min_type < BTRFS_QGROUP_RELATION_KEY) {
+			sk->min_type++;
+			sk->min_offset = 0;
+		} else if (sk->min_objectid < (u64)-1) {
+			sk->min_objectid++;
+			sk->min_type = BTRFS_QGROUP_STATUS_KEY;
+			sk->min_offset = 0;
+		} else {
 			break;
+		}
 	}
-
-done:
+	ret = 0;
+out:
+	free(args2);
 	return ret;
 }
 
-static void print_all_qgroups(struct qgroup_lookup *qgroup_lookup)
+static void print_all_qgroups(struct qgroup_lookup *lookup,
+			      struct btrfs_qgroup **sorted, int nr)
 {
+	int i;
 
-	struct rb_node *n;
-	struct btrfs_qgroup *entry;
-
-	print_table_head();
-
-	n = rb_first(&qgroup_lookup->root);
-	while (n) {
-		entry = rb_entry(n, struct btrfs_qgroup, sort_node);
-		print_single_qgroup_table(entry);
-		n = rb_next(n);
+	switch (qgroup_format) {
+	case BTRFS_QGROUP_FORMAT_TABLE:
+		print_table_head();
+		for (i = 0; i < nr; i++)
+			print_single_qgroup_table(lookup, sorted[i]);
+		break;
+	case BTRFS_QGROUP_FORMAT_CSV:
+		print_csv_head();
+		for (i = 0; i < nr; i++)
+			print_single_qgroup_csv(lookup, sorted[i]);
+		break;
+	case BTRFS_QGROUP_FORMAT_JSON:
+		for (i = 0; i < nr; i++)
+			print_single_qgroup_json(lookup, sorted[i]);
+		break;
 	}
 }
 
@@ -1196,16 +1347,28 @@ int btrfs_show_qgroups(int fd,
 {
 
 	struct qgroup_lookup qgroup_lookup;
-	struct qgroup_lookup sort_tree;
+	struct btrfs_qgroup **sorted = NULL;
+	int nr;
 	int ret;
 
+	memset(&qgroup_lookup, 0, sizeof(qgroup_lookup));
 	ret = __qgroups_search(fd, &qgroup_lookup);
 	if (ret)
-		return ret;
-	__filter_and_sort_qgroups(&qgroup_lookup, &sort_tree,
-				  filter_set, comp_set);
-	print_all_qgroups(&sort_tree);
+		goto out;
+	qgroup_lookup_sort(&qgroup_lookup);
+	ret = qgroup_lookup_build_relations(&qgroup_lookup);
+	if (!ret)
+		ret = __filter_and_sort_qgroups(&qgroup_lookup, &sorted, &nr,
+						filter_set, comp_set);
+	if (ret) {
+		error("not enough memory");
+		goto out;
+	}
+	print_all_qgroups(&qgroup_lookup, sorted, nr);
 
+out:
+	free(sorted);
+	post_process_filter_set(filter_set);
 	__free_all_qgroups(&qgroup_lookup);
 	btrfs_qgroup_free_filter_set(filter_set);
 	btrfs_qgroup_free_comparer_set(comp_set);
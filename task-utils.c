@@ -96,13 +96,13 @@ int task_period_start(struct task_info *info, unsigned int period_ms)
 	info->periodic.timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
 	if (info->periodic.timer_fd == -1) {
 		info->periodic.timer_fd = 0;
-		return info->periodic.timer_fd;
+		return -1;
 	}
 
 	info->periodic.wakeups_missed = 0;
 
 	sec = period_ms / 1000;
-	ns = (period_ms - (sec * 1000)) * 1000;
+	ns = (period_ms - (sec * 1000)) * 1000000;
 	itval.it_interval.tv_sec = sec;
 	itval.it_interval.tv_nsec = ns;
 	itval.it_value.tv_sec = sec;
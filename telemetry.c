@@ -0,0 +1,220 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "telemetry.h"
+#include "utils.h"
+
+void telemetry_init(struct telemetry *tm)
+{
+	memset(tm, 0, sizeof(*tm));
+	tm->interval_ms = 1000;
+}
+
+static int telemetry_open(struct telemetry *tm, const char *arg)
+{
+	int fd;
+
+	if (tm->out) {
+		error("telemetry output specified more than once");
+		return -EINVAL;
+	}
+	if (string_is_numerical(arg)) {
+		tm->out_is_fd = 1;
+		fd = dup(atoi(arg));
+		if (fd >= 0) {
+			tm->out = fdopen(fd, "a");
+			if (!tm->out)
+				close(fd);
+		}
+	} else {
+		tm->out = fopen(arg, "a");
+	}
+	if (!tm->out) {
+		error("cannot open telemetry output %s: %s", arg,
+			strerror(errno));
+		return -errno;
+	}
+	setvbuf(tm->out, NULL, _IOLBF, 0);
+	return 0;
+}
+
+/*
+ * Handle the telemetry options, return 1 if @opt was one of them, 0 if not
+ * and -1 on error.
+ */
+int telemetry_parse_opt(struct telemetry *tm, int opt, const char *arg)
+{
+	switch (opt) {
+	case GETOPT_VAL_TELEMETRY:
+		return telemetry_open(tm, arg) ? -1 : 1;
+	case GETOPT_VAL_TELEMETRY_INTERVAL:
+		tm->interval_ms = arg_strtou64(arg);
+		if (!tm->interval_ms) {
+			error("telemetry interval must be at least 1ms");
+			return -1;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+double telemetry_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void telemetry_sleep(unsigned int ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+static void *telemetry_thread(void *data)
+{
+	struct telemetry *tm = data;
+	int periodic;
+	int old;
+
+	/* without a timer fd the wait would return at once, sleep instead */
+	periodic = !task_period_start(tm->info, tm->interval_ms);
+	while (1) {
+		if (periodic)
+			task_period_wait(tm->info);
+		else
+			telemetry_sleep(tm->interval_ms);
+		/* do not leave a half written record behind */
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+		tm->sample(tm, "progress");
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &old);
+	}
+	return NULL;
+}
+
+int telemetry_start(struct telemetry *tm,
+		    void (*sample)(struct telemetry *tm, const char *event),
+		    void *data)
+{
+	int ret;
+
+	if (!tm->out)
+		return 0;
+	tm->sample = sample;
+	tm->data = data;
+	tm->last_time = telemetry_now();
+	tm->sample(tm, "start");
+
+	tm->info = task_init(telemetry_thread, NULL, tm);
+	if (!tm->info)
+		return -ENOMEM;
+	ret = task_start(tm->info);
+	if (ret) {
+		task_deinit(tm->info);
+		tm->info = NULL;
+		return -ret;
+	}
+	return 0;
+}
+
+/* Stop the poller and write the last record with @event */
+void telemetry_stop(struct telemetry *tm, const char *event)
+{
+	if (!tm->out || !tm->sample)
+		return;
+	if (tm->info) {
+		task_stop(tm->info);
+		task_deinit(tm->info);
+		tm->info = NULL;
+	}
+	tm->sample(tm, event);
+	tm->sample = NULL;
+}
+
+void telemetry_close(struct telemetry *tm)
+{
+	if (tm->out)
+		fclose(tm->out);
+	tm->out = NULL;
+}
+
+/*
+ * For commands writing the records from their own polling loop: whether
+ * the interval has passed since the last record or none was written yet.
+ */
+int telemetry_due(struct telemetry *tm)
+{
+	if (!tm->out)
+		return 0;
+	return !tm->last_time ||
+		(telemetry_now() - tm->last_time) * 1000 >= tm->interval_ms;
+}
+
+void telemetry_begin(struct telemetry *tm, const char *op, const char *event)
+{
+	fprintf(tm->out, "{\"time\":%.3f,\"op\":\"%s\",\"event\":\"%s\"",
+		telemetry_now(), op, event);
+}
+
+void telemetry_end(struct telemetry *tm)
+{
+	fputs("}\n", tm->out);
+	fflush(tm->out);
+	tm->last_time = telemetry_now();
+}
+
+void telemetry_u64(struct telemetry *tm, const char *key, u64 value)
+{
+	fprintf(tm->out, ",\"%s\":%llu", key, (unsigned long long)value);
+}
+
+void telemetry_str(struct telemetry *tm, const char *key, const char *value)
+{
+	fprintf(tm->out, ",\"%s\":", key);
+	print_json_string(tm->out, value);
+}
+
+/*
+ * Print the rate of the progress since the last record, or over @elapsed
+ * seconds if there was no last record, and the estimated time left.
+ */
+void telemetry_rate(struct telemetry *tm, u64 done, u64 last_done, u64 total,
+		    double elapsed)
+{
+	double rate = 0.0;
+
+	if (elapsed > 0 && done >= last_done)
+		rate = (done - last_done) / elapsed;
+	fprintf(tm->out, ",\"rate\":%.1f", rate);
+	if (rate > 0 && total > done)
+		fprintf(tm->out, ",\"eta\":%llu",
+			(unsigned long long)((total - done) / rate));
+	else if (total && total <= done)
+		fprintf(tm->out, ",\"eta\":0");
+}
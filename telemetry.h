@@ -0,0 +1,78 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_TELEMETRY_H__
+#define __BTRFS_TELEMETRY_H__
+
+#include <stdio.h>
+#include <getopt.h>
+#include "kerncompat.h"
+#include "task-utils.h"
+
+/*
+ * Periodic progress records of long running operations, written as JSON
+ * lines to a file descriptor or a file by one poller thread.
+ */
+struct telemetry {
+	FILE *out;
+	/* @out was given as a file descriptor inherited from the caller */
+	int out_is_fd;
+	unsigned int interval_ms;
+	struct task_info *info;
+	/* called from the poller thread and once more by telemetry_stop */
+	void (*sample)(struct telemetry *tm, const char *event);
+	void *data;
+	/* time of the previous record, for rates */
+	double last_time;
+};
+
+enum {
+	GETOPT_VAL_TELEMETRY = 512,
+	GETOPT_VAL_TELEMETRY_INTERVAL,
+};
+
+#define TELEMETRY_LONG_OPTIONS						\
+	{ "telemetry", required_argument, NULL, GETOPT_VAL_TELEMETRY },	\
+	{ "telemetry-interval", required_argument, NULL,		\
+		GETOPT_VAL_TELEMETRY_INTERVAL }
+
+#define TELEMETRY_USAGE							\
+	"--telemetry <fd>|<file>  write progress as JSON lines to <fd> or <file>", \
+	"--telemetry-interval <ms>  time between the records (default: 1000)"
+
+void telemetry_init(struct telemetry *tm);
+int telemetry_parse_opt(struct telemetry *tm, int opt, const char *arg);
+int telemetry_start(struct telemetry *tm,
+		    void (*sample)(struct telemetry *tm, const char *event),
+		    void *data);
+void telemetry_stop(struct telemetry *tm, const char *event);
+void telemetry_close(struct telemetry *tm);
+
+int telemetry_due(struct telemetry *tm);
+void telemetry_begin(struct telemetry *tm, const char *op, const char *event);
+void telemetry_end(struct telemetry *tm);
+void telemetry_u64(struct telemetry *tm, const char *key, u64 value);
+void telemetry_str(struct telemetry *tm, const char *key, const char *value);
+void telemetry_rate(struct telemetry *tm, u64 done, u64 last_done, u64 total,
+		    double elapsed);
+double telemetry_now(void);
+
+static inline int telemetry_enabled(struct telemetry *tm)
+{
+	return tm->out != NULL;
+}
+
+#endif
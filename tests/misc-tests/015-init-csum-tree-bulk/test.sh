@@ -0,0 +1,29 @@
+#!/bin/bash
+#
+# Rebuild the csum tree of a filesystem with many csum leaves, both from the
+# extent tree (ascending order, appended) and from the fs trees (partly out
+# of order, falling back to normal insertion), and verify the data against
+# the new checksums.
+
+source $TOP/tests/common
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+srcdir=$(mktemp -d --tmpdir btrfs-progs-csum-src.XXXXXX)
+run_check dd if=/dev/urandom of=$srcdir/big bs=1M count=64
+for i in $(seq 32); do
+	run_check dd if=/dev/urandom of=$srcdir/file$i bs=4k count=$i
+done
+
+run_check truncate -s 1G $IMAGE
+run_check $TOP/mkfs.btrfs -f -n 4k --rootdir $srcdir $IMAGE
+run_check $TOP/btrfs check --check-data-csum $IMAGE
+
+run_check $TOP/btrfs check --repair --init-csum-tree $IMAGE
+run_check $TOP/btrfs check --check-data-csum $IMAGE
+
+run_check $TOP/btrfs check --repair --init-csum-tree --init-extent-tree $IMAGE
+run_check $TOP/btrfs check --check-data-csum $IMAGE
+
+rm -rf $srcdir
@@ -0,0 +1,86 @@
+#!/bin/bash
+#
+# Verify that each step printed by 'balance plan' covers only selected block
+# groups of its type in its vrange, that the step limit matches their count,
+# and that executing the plan leaves a consistent filesystem
+
+source $TOP/tests/common
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+
+# check every vrange step of the plan against the -v block group list
+check_plan_steps()
+{
+	echo "$1" | awk '
+	BEGIN { n = 0 }
+	/^# block group / {
+		start[n] = $4 + 0
+		split($5, t, "/")
+		type[n] = t[1]
+		sel[n] = /, selected$/
+		n++
+	}
+	/^btrfs balance start/ {
+		steps++
+		for (i = 4; i < NF; i++) {
+			f = $i
+			want = substr(f, 2, 1) == "d" ? "Data" : "Metadata"
+			sub(/^-[dm]vrange=/, "", f)
+			split(f, r, /\.\.|,limit=/)
+			cnt = 0
+			for (j = 0; j < n; j++) {
+				if (!index(type[j], want) ||
+				    start[j] < r[1] + 0 || start[j] >= r[2] + 0)
+					continue
+				if (!sel[j]) {
+					print "unselected block group " \
+						start[j] " in " $i
+					bad = 1
+				}
+				cnt++
+			}
+			if (cnt != r[3] + 0) {
+				print "limit " r[3] " but " cnt \
+					" block groups in " $i
+				bad = 1
+			}
+		}
+	}
+	END {
+		if (!steps) {
+			print "no balance steps planned"
+			bad = 1
+		}
+		exit bad
+	}' >> $RESULTS 2>&1 || _fail "wrong balance plan, see $RESULTS"
+}
+
+run_check truncate -s 2G $IMAGE
+run_check $TOP/mkfs.btrfs -f $IMAGE
+run_check $SUDO_HELPER mount $IMAGE $TEST_MNT
+run_check $SUDO_HELPER chmod a+rw $TEST_MNT
+
+# fill several data block groups and leave them mostly empty
+for i in `seq 800`; do
+	run_check dd if=/dev/zero of=$TEST_MNT/file$i bs=1M count=1
+done
+run_check $TOP/btrfs filesystem sync $TEST_MNT
+for i in `seq 800`; do
+	if [ $(($i % 5)) -ne 0 ]; then
+		run_check rm -f $TEST_MNT/file$i
+	fi
+done
+run_check $TOP/btrfs filesystem sync $TEST_MNT
+
+plan=$(run_check_stdout $SUDO_HELPER $TOP/btrfs balance plan -v \
+	--max-usage 100 $TEST_MNT)
+check_plan_steps "$plan"
+
+run_check $SUDO_HELPER $TOP/btrfs balance plan --max-usage 100 --execute \
+	$TEST_MNT
+
+run_check $SUDO_HELPER umount $TEST_MNT
+run_check $TOP/btrfs check $IMAGE
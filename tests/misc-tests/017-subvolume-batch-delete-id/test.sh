@@ -0,0 +1,52 @@
+#!/bin/bash
+#
+# Verify that batch subvolume delete takes a numeric name as a path and only
+# id:<N> as a subvolume id
+
+source $TOP/tests/common
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+
+# fail unless the subvolume list of the mount point has the path $1
+subvol_exists()
+{
+	run_check_stdout $SUDO_HELPER $TOP/btrfs subvolume list $TEST_MNT |
+		grep -q " path $1\$"
+}
+
+run_check truncate -s 2G $IMAGE
+run_check $TOP/mkfs.btrfs -f $IMAGE
+run_check $SUDO_HELPER mount $IMAGE $TEST_MNT
+run_check $SUDO_HELPER chmod a+rw $TEST_MNT
+
+cd $TEST_MNT
+
+run_check $SUDO_HELPER $TOP/btrfs subvolume create first
+run_check $SUDO_HELPER $TOP/btrfs subvolume create second
+firstid=`run_check_stdout $SUDO_HELPER $TOP/btrfs inspect-internal rootid first`
+secondid=`run_check_stdout $SUDO_HELPER $TOP/btrfs inspect-internal rootid second`
+# a subvolume named like the id of another one
+run_check $SUDO_HELPER $TOP/btrfs subvolume create $firstid
+
+run_check $SUDO_HELPER $TOP/btrfs subvolume delete --batch $TEST_MNT $firstid
+subvol_exists $firstid && _fail "subvolume named $firstid not deleted"
+subvol_exists first || _fail "subvolume $firstid deleted instead of the path"
+
+run_check $SUDO_HELPER $TOP/btrfs subvolume delete --batch $TEST_MNT \
+	id:$secondid
+subvol_exists second && _fail "subvolume id $secondid not deleted"
+
+run_check $SUDO_HELPER $TOP/btrfs subvolume delete --stdin $TEST_MNT \
+	<<< "id:$firstid"
+subvol_exists first && _fail "subvolume id $firstid not deleted from stdin"
+
+run_mustfail "batch delete accepted a malformed id" \
+	$SUDO_HELPER $TOP/btrfs subvolume delete --batch $TEST_MNT id:12x
+
+cd ..
+
+run_check $SUDO_HELPER umount $TEST_MNT
+run_check $TOP/btrfs check $IMAGE
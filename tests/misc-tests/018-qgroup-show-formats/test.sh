@@ -0,0 +1,69 @@
+#!/bin/bash
+#
+# Verify the csv and json output of qgroup show against the qgroups, limits
+# and relations that were set up, and that all formats list the same qgroups
+
+source $TOP/tests/common
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+
+run_check truncate -s 2G $IMAGE
+run_check $TOP/mkfs.btrfs -f $IMAGE
+run_check $SUDO_HELPER mount $IMAGE $TEST_MNT
+run_check $SUDO_HELPER chmod a+rw $TEST_MNT
+
+cd $TEST_MNT
+
+run_check $SUDO_HELPER $TOP/btrfs quota enable .
+run_check $SUDO_HELPER $TOP/btrfs subvolume create sub1
+run_check $SUDO_HELPER $TOP/btrfs subvolume create sub2
+run_check $SUDO_HELPER chmod a+rw sub1 sub2
+id1=`run_check_stdout $SUDO_HELPER $TOP/btrfs inspect-internal rootid sub1`
+id2=`run_check_stdout $SUDO_HELPER $TOP/btrfs inspect-internal rootid sub2`
+run_check dd if=/dev/zero of=sub1/file bs=1M count=4
+run_check dd if=/dev/zero of=sub2/file bs=1M count=2
+
+run_check $SUDO_HELPER $TOP/btrfs qgroup create 1/100 .
+run_check $SUDO_HELPER $TOP/btrfs qgroup assign 0/$id1 1/100 .
+run_check $SUDO_HELPER $TOP/btrfs qgroup assign 0/$id2 1/100 .
+run_check $SUDO_HELPER $TOP/btrfs qgroup limit 10M 0/$id1 .
+run_check $SUDO_HELPER $TOP/btrfs quota rescan -w .
+run_check $TOP/btrfs filesystem sync .
+
+table=`run_check_stdout $SUDO_HELPER $TOP/btrfs qgroup show -pcre .`
+csv=`run_check_stdout $SUDO_HELPER $TOP/btrfs qgroup show -pcre \
+	--format=csv .`
+json=`run_check_stdout $SUDO_HELPER $TOP/btrfs qgroup show --format=json .`
+
+# the same qgroups in the same order in all formats
+ids_table=`echo "$table" | awk 'NR > 2 { print $1 }'`
+ids_csv=`echo "$csv" | awk -F, 'NR > 1 { print $1 }'`
+ids_json=`echo "$json" | sed -n 's/^{"qgroupid":"\([0-9/]*\)".*/\1/p'`
+[ "$ids_table" = "$ids_csv" ] || _fail "csv qgroups differ from the table"
+[ "$ids_table" = "$ids_json" ] || _fail "json qgroups differ from the table"
+
+echo "$csv" | head -n 1 |
+	grep -qx 'qgroupid,rfer,excl,max_rfer,max_excl,parent,child' ||
+	_fail "unexpected csv header"
+echo "$csv" | awk -F, 'NF != 7 { exit 1 }' ||
+	_fail "csv line with a wrong number of fields"
+echo "$csv" | grep -qx "0/$id1,[0-9]*,[0-9]*,10485760,,1/100," ||
+	_fail "wrong csv line for 0/$id1"
+echo "$csv" | grep -qx "0/$id2,[0-9]*,[0-9]*,,,1/100," ||
+	_fail "wrong csv line for 0/$id2"
+echo "$csv" | grep -qx "1/100,[0-9]*,[0-9]*,,,,0/$id1 0/$id2" ||
+	_fail "wrong csv line for 1/100"
+
+echo "$json" | grep "^{\"qgroupid\":\"0/$id1\"" |
+	grep -q '"max_rfer":10485760,"max_excl":null,"parents":\["1/100"\]' ||
+	_fail "wrong json object for 0/$id1"
+echo "$json" | grep "^{\"qgroupid\":\"1/100\"" |
+	grep -q "\"children\":\[\"0/$id1\",\"0/$id2\"\]}$" ||
+	_fail "wrong json object for 1/100"
+
+cd ..
+
+run_check $SUDO_HELPER umount $TEST_MNT
@@ -0,0 +1,73 @@
+#!/bin/bash
+#
+# Verify that the block group type filters of inspect-internal fragments
+# report the same block groups as the unfiltered run, and count only the
+# extents of the selected types
+
+source $TOP/tests/common
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+
+# block group rows of the csv output $1 with type $2
+bg_rows()
+{
+	echo "$1" | awk -F, -v type=$2 '$1 == "block_group" && $4 == type'
+}
+
+# value of the numeric field $2 of the json summary record in $1
+summary_field()
+{
+	echo "$1" | grep '^{"record":"summary"' |
+		sed -n "s/.*\"$2\":\([0-9]*\).*/\1/p"
+}
+
+run_check truncate -s 2G $IMAGE
+run_check $TOP/mkfs.btrfs -f $IMAGE
+run_check $SUDO_HELPER mount $IMAGE $TEST_MNT
+run_check $SUDO_HELPER chmod a+rw $TEST_MNT
+
+# interleave the writes of two files to fragment them
+for i in `seq 0 63`; do
+	for f in a b; do
+		run_check dd if=/dev/zero of=$TEST_MNT/$f bs=64k count=1 \
+			seek=$i conv=notrunc,fsync
+	done
+done
+for i in `seq 200`; do
+	run_check dd if=/dev/zero of=$TEST_MNT/small$i bs=4k count=3
+done
+run_check $TOP/btrfs filesystem sync $TEST_MNT
+
+all=`run_check_stdout $SUDO_HELPER $TOP/btrfs inspect-internal fragments \
+	--format=csv $TEST_MNT`
+
+for filter in "-d Data" "-m Metadata" "-s System"; do
+	set -- $filter
+	out=`run_check_stdout $SUDO_HELPER $TOP/btrfs inspect-internal \
+		fragments $1 --format=csv $TEST_MNT`
+	[ -n "`bg_rows "$out" $2`" ] || _fail "no $2 block groups for $1"
+	[ "`bg_rows "$out" $2`" = "`bg_rows "$all" $2`" ] ||
+		_fail "$2 block groups differ between $1 and no filter"
+	[ "`echo "$out" | grep -c '^block_group,'`" = \
+	  "`bg_rows "$out" $2 | wc -l`" ] ||
+		_fail "block groups of other types printed for $1"
+done
+
+out=`run_check_stdout $SUDO_HELPER $TOP/btrfs inspect-internal fragments -d \
+	--format=json $TEST_MNT`
+[ "`summary_field "$out" metadata_extents`" = 0 ] ||
+	_fail "metadata extents counted with -d"
+[ "`summary_field "$out" data_extents`" -gt 0 ] ||
+	_fail "no data extents counted with -d"
+
+out=`run_check_stdout $SUDO_HELPER $TOP/btrfs inspect-internal fragments -m \
+	--format=json $TEST_MNT`
+[ "`summary_field "$out" data_extents`" = 0 ] ||
+	_fail "data extents counted with -m"
+[ "`summary_field "$out" metadata_extents`" -gt 0 ] ||
+	_fail "no metadata extents counted with -m"
+
+run_check $SUDO_HELPER umount $TEST_MNT
@@ -0,0 +1,63 @@
+#!/bin/bash
+#
+# Unlink many files by deleting their dir items, dir indexes and inode refs,
+# and verify that check --repair moves all of them to lost+found with their
+# data intact
+
+source $TOP/tests/common
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+check_prereq btrfs-corrupt-block
+
+nfiles=1000
+
+srcdir=$(mktemp -d --tmpdir btrfs-progs-lost-found-src.XXXXXX)
+dstdir=$(mktemp -d --tmpdir btrfs-progs-lost-found-dst.XXXXXX)
+run_check mkdir $srcdir/dir
+for i in `seq $nfiles`; do
+	echo $i > $srcdir/dir/file$i
+done
+
+run_check truncate -s 1G $IMAGE
+run_check $TOP/mkfs.btrfs -f -n 4k --rootdir $srcdir $IMAGE
+
+dump=`run_check_stdout $TOP/btrfs inspect-internal dump-tree -t 5 $IMAGE`
+dirino=`echo "$dump" | awk '
+	/^\titem [0-9]+ key \([0-9]+ INODE_REF 256\)/ {
+		ino = substr($4, 2)
+		getline
+		if (/ name: dir$/) {
+			print ino
+			exit
+		}
+	}'`
+[ -n "$dirino" ] || _fail "inode of the directory not found"
+
+# all names in the directory and the back references of its files
+keys=`echo "$dump" | awk -v dir=$dirino '
+	/^\titem [0-9]+ key \(/ {
+		objectid = substr($4, 2)
+		offset = $6
+		sub(/\)$/, "", offset)
+		if (objectid == dir && $5 == "DIR_ITEM")
+			print objectid "," 84 "," offset
+		else if (objectid == dir && $5 == "DIR_INDEX")
+			print objectid "," 96 "," offset
+		else if ($5 == "INODE_REF" && offset == dir)
+			print objectid "," 12 "," offset
+	}'`
+for key in $keys; do
+	run_check $TOP/btrfs-corrupt-block -d -K $key -r 5 $IMAGE
+done
+
+run_mustfail "unlinked files not detected" $TOP/btrfs check $IMAGE
+run_check $TOP/btrfs check --repair $IMAGE
+run_check $TOP/btrfs check $IMAGE
+
+run_check $TOP/btrfs restore $IMAGE $dstdir
+[ `ls $dstdir/dir | wc -l` -eq 0 ] || _fail "files left in the directory"
+[ "`cat $dstdir/lost+found/* | sort -n`" = "`seq $nfiles`" ] ||
+	_fail "lost+found does not have all the files"
+
+rm -rf $srcdir $dstdir
@@ -0,0 +1,51 @@
+#!/bin/bash
+#
+# Repair the images of the fsck tests and rebuild their csum and extent trees.
+# This runs many allocations through the free space index, creates inodes
+# with the cached inode number counter (lost+found), and resolves the roots
+# of tree blocks through the backref cache and ulists for the images with
+# bad key order or item offsets.  Every step must leave a clean filesystem
+# and the free space index must never have to be resynced.
+
+source $TOP/tests/common
+
+check_prereq btrfs-image
+check_prereq btrfs
+
+# run check --repair with the given options, then check the result
+repair_and_check()
+{
+	local image
+	local out
+
+	image=$1
+	shift
+	out=`run_check_stdout $TOP/btrfs check --repair "$@" $image`
+	if echo "$out" | grep -q '^allocations: [0-9]*, failed [1-9]'; then
+		_fail "failed allocations in $(basename $image)"
+	fi
+	if echo "$out" | grep -q '^allocator retries: .*, resyncs [1-9]'; then
+		_fail "free space index out of sync in $(basename $image)"
+	fi
+	run_check $TOP/btrfs check $image
+}
+
+for dir in $(find $TOP/tests/fsck-tests -maxdepth 1 -mindepth 1 -type d |
+	     sort); do
+	# images with a custom test script need a custom repair
+	[ -x $dir/test.sh ] && continue
+	for image in $(find $dir \( -iname '*.img' -o -iname '*.img.xz' -o \
+				 -iname '*.raw' -o -iname '*.raw.xz' \) |
+		       sort); do
+		extracted=$(extract_image "$image")
+
+		repair_and_check $extracted
+		repair_and_check $extracted --init-csum-tree
+		# not supported for mixed block groups
+		if ! run_check_stdout $TOP/btrfs inspect-internal dump-super \
+				$extracted | grep -q MIXED_GROUPS; then
+			repair_and_check $extracted --init-extent-tree
+		fi
+		rm -f "$extracted"
+	done
+done
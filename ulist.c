@@ -9,6 +9,7 @@
 #include "kerncompat.h"
 #include "ulist.h"
 #include "ctree.h"
+#include "internal.h"
 
 /*
  * ulist is a generic data structure to hold a collection of unique u64
@@ -48,9 +49,12 @@
  */
 void ulist_init(struct ulist *ulist)
 {
-	INIT_LIST_HEAD(&ulist->nodes);
-	ulist->root = RB_ROOT;
 	ulist->nnodes = 0;
+	ulist->chunks = NULL;
+	ulist->nr_chunks = 0;
+	ulist->max_chunks = 0;
+	ulist->table = NULL;
+	ulist->table_size = 0;
 }
 
 /**
@@ -62,27 +66,25 @@ void ulist_init(struct ulist *ulist)
  */
 static void ulist_fini(struct ulist *ulist)
 {
-	struct ulist_node *node;
-	struct ulist_node *next;
+	unsigned long i;
 
-	list_for_each_entry_safe(node, next, &ulist->nodes, list) {
-		kfree(node);
-	}
-	ulist->root = RB_ROOT;
-	INIT_LIST_HEAD(&ulist->nodes);
+	for (i = 0; i < ulist->nr_chunks; i++)
+		kfree(ulist->chunks[i]);
+	kfree(ulist->chunks);
+	kfree(ulist->table);
+	ulist_init(ulist);
 }
 
 /**
  * ulist_reinit - prepare a ulist for reuse
  * @ulist:	ulist to be reused
  *
- * Free up all additional memory allocated for the list elements and reinit
- * the ulist.
+ * Drop all elements.  The memory allocated for them and for the hash table
+ * is kept for the next round, it's released by ulist_free.
  */
 void ulist_reinit(struct ulist *ulist)
 {
-	ulist_fini(ulist);
-	ulist_init(ulist);
+	ulist->nnodes = 0;
 }
 
 /**
@@ -117,42 +119,100 @@ void ulist_free(struct ulist *ulist)
 	kfree(ulist);
 }
 
-static struct ulist_node *ulist_rbtree_search(struct ulist *ulist, u64 val)
+static inline struct ulist_node *ulist_node_at(struct ulist *ulist,
+					       unsigned long pos)
+{
+	if (pos < ULIST_INLINE_NODES)
+		return &ulist->inline_nodes[pos];
+	pos -= ULIST_INLINE_NODES;
+	return &ulist->chunks[pos / ULIST_CHUNK_NODES][pos % ULIST_CHUNK_NODES];
+}
+
+static inline unsigned long ulist_hash(u64 val, unsigned long table_size)
 {
-	struct rb_node *n = ulist->root.rb_node;
-	struct ulist_node *u = NULL;
-
-	while (n) {
-		u = rb_entry(n, struct ulist_node, rb_node);
-		if (u->val < val)
-			n = n->rb_right;
-		else if (u->val > val)
-			n = n->rb_left;
-		else
-			return u;
+	return (unsigned long)((val * 0x9e3779b97f4a7c15ULL) >> 32) &
+		(table_size - 1);
+}
+
+static struct ulist_node *ulist_search(struct ulist *ulist, u64 val)
+{
+	struct ulist_node *node;
+	unsigned long i;
+
+	if (ulist->nnodes <= ULIST_INLINE_NODES) {
+		for (i = 0; i < ulist->nnodes; i++)
+			if (ulist->inline_nodes[i].val == val)
+				return &ulist->inline_nodes[i];
+		return NULL;
+	}
+
+	i = ulist_hash(val, ulist->table_size);
+	while ((node = ulist->table[i]) != NULL) {
+		if (node->val == val)
+			return node;
+		i = (i + 1) & (ulist->table_size - 1);
 	}
 	return NULL;
 }
 
-static int ulist_rbtree_insert(struct ulist *ulist, struct ulist_node *ins)
+static void ulist_hash_insert(struct ulist *ulist, struct ulist_node *node)
+{
+	unsigned long i;
+
+	i = ulist_hash(node->val, ulist->table_size);
+	while (ulist->table[i])
+		i = (i + 1) & (ulist->table_size - 1);
+	ulist->table[i] = node;
+}
+
+/*
+ * Make room for one more node: a chunk for it if it's past the inline
+ * nodes, and a hash table at most half full.  Nothing is changed if an
+ * allocation fails.
+ */
+static int ulist_reserve(struct ulist *ulist, gfp_t gfp_mask)
 {
-	struct rb_node **p = &ulist->root.rb_node;
-	struct rb_node *parent = NULL;
-	struct ulist_node *cur = NULL;
-
-	while (*p) {
-		parent = *p;
-		cur = rb_entry(parent, struct ulist_node, rb_node);
-
-		if (cur->val < ins->val)
-			p = &(*p)->rb_right;
-		else if (cur->val > ins->val)
-			p = &(*p)->rb_left;
-		else
-			return -EEXIST;
+	unsigned long pos = ulist->nnodes;
+	unsigned long size;
+	unsigned long i;
+	void *tmp;
+
+	if (pos < ULIST_INLINE_NODES)
+		return 0;
+
+	if ((pos - ULIST_INLINE_NODES) / ULIST_CHUNK_NODES >=
+	    ulist->nr_chunks) {
+		if (ulist->nr_chunks == ulist->max_chunks) {
+			size = max_t(unsigned long, 4, ulist->max_chunks * 2);
+			tmp = realloc(ulist->chunks, size * sizeof(*ulist->chunks));
+			if (!tmp)
+				return -ENOMEM;
+			ulist->chunks = tmp;
+			ulist->max_chunks = size;
+		}
+		tmp = kmalloc(ULIST_CHUNK_NODES * sizeof(struct ulist_node),
+			      gfp_mask);
+		if (!tmp)
+			return -ENOMEM;
+		ulist->chunks[ulist->nr_chunks++] = tmp;
+	}
+
+	if ((pos + 1) * 2 > ulist->table_size) {
+		size = max_t(unsigned long, 32, ulist->table_size * 2);
+		tmp = kmalloc(size * sizeof(*ulist->table), gfp_mask);
+		if (!tmp)
+			return -ENOMEM;
+		kfree(ulist->table);
+		ulist->table = tmp;
+		ulist->table_size = size;
+	} else if (pos > ULIST_INLINE_NODES) {
+		return 0;
 	}
-	rb_link_node(&ins->rb_node, parent, p);
-	rb_insert_color(&ins->rb_node, &ulist->root);
+
+	/* new table, or switching from the inline search to the hash */
+	memset(ulist->table, 0, ulist->table_size * sizeof(*ulist->table));
+	for (i = 0; i < pos; i++)
+		ulist_hash_insert(ulist, ulist_node_at(ulist, i));
 	return 0;
 }
 
@@ -184,29 +244,29 @@ int ulist_add(struct ulist *ulist, u64 val, u64 aux, gfp_t gfp_mask)
 int ulist_add_merge(struct ulist *ulist, u64 val, u64 aux,
 		    u64 *old_aux, gfp_t gfp_mask)
 {
-	int ret;
 	struct ulist_node *node;
+	int ret;
 
-	node = ulist_rbtree_search(ulist, val);
+	node = ulist_search(ulist, val);
 	if (node) {
 		if (old_aux)
 			*old_aux = node->aux;
 		return 0;
 	}
-	node = kmalloc(sizeof(*node), gfp_mask);
-	if (!node)
-		return -ENOMEM;
 
+	ret = ulist_reserve(ulist, gfp_mask);
+	if (ret)
+		return ret;
+
+	node = ulist_node_at(ulist, ulist->nnodes);
 	node->val = val;
 	node->aux = aux;
 #ifdef CONFIG_BTRFS_DEBUG
 	node->seqnum = ulist->nnodes;
 #endif
-
-	ret = ulist_rbtree_insert(ulist, node);
-	ASSERT(!ret);
-	list_add_tail(&node->list, &ulist->nodes);
 	ulist->nnodes++;
+	if (ulist->nnodes > ULIST_INLINE_NODES)
+		ulist_hash_insert(ulist, node);
 
 	return 1;
 }
@@ -221,9 +281,7 @@ int ulist_add_merge(struct ulist *ulist, u64 val, u64 aux,
  *
  * This function is used to iterate an ulist.
  * It returns the next element from the ulist or %NULL when the
- * end is reached. No guarantee is made with respect to the order in which
- * the elements are returned. They might neither be returned in order of
- * addition nor in ascending order.
+ * end is reached. The elements are returned in the order they were added.
  * It is allowed to call ulist_add during an enumeration. Newly added items
  * are guaranteed to show up in the running enumeration.
  */
@@ -231,19 +289,13 @@ struct ulist_node *ulist_next(struct ulist *ulist, struct ulist_iterator *uiter)
 {
 	struct ulist_node *node;
 
-	if (list_empty(&ulist->nodes))
+	if (uiter->pos >= ulist->nnodes)
 		return NULL;
-	if (uiter->cur_list && uiter->cur_list->next == &ulist->nodes)
-		return NULL;
-	if (uiter->cur_list) {
-		uiter->cur_list = uiter->cur_list->next;
-	} else {
-		uiter->cur_list = ulist->nodes.next;
 #ifdef CONFIG_BTRFS_DEBUG
+	if (uiter->pos == 0)
 		uiter->i = 0;
 #endif
-	}
-	node = list_entry(uiter->cur_list, struct ulist_node, list);
+	node = ulist_node_at(ulist, uiter->pos++);
 #ifdef CONFIG_BTRFS_DEBUG
 	ASSERT(node->seqnum == uiter->i);
 	ASSERT(uiter->i >= 0 && uiter->i < ulist->nnodes);
@@ -9,8 +9,6 @@
 #define __ULIST_H__
 
 #include "kerncompat.h"
-#include "list.h"
-#include "rbtree.h"
 
 /*
  * ulist is a generic data structure to hold a collection of unique u64
@@ -23,7 +21,7 @@ struct ulist_iterator {
 #ifdef CONFIG_BTRFS_DEBUG
 	int i;
 #endif
-	struct list_head *cur_list;  /* hint to start search */
+	unsigned long pos;	/* index of the next node to return */
 };
 
 /*
@@ -36,19 +34,33 @@ struct ulist_node {
 #ifdef CONFIG_BTRFS_DEBUG
 	int seqnum;		/* sequence number this node is added */
 #endif
-
-	struct list_head list;  /* used to link node */
-	struct rb_node rb_node;	/* used to speed up search */
 };
 
+/*
+ * Most ulists hold a handful of values, these live in the ulist itself and
+ * are searched linearly.  Further nodes are allocated in chunks that never
+ * move, so pointers returned by ulist_next stay valid while adding, and are
+ * looked up through an open addressing hash table.
+ */
+#define ULIST_INLINE_NODES	8
+#define ULIST_CHUNK_NODES	64
+
 struct ulist {
 	/*
 	 * number of elements stored in list
 	 */
 	unsigned long nnodes;
 
-	struct list_head nodes;
-	struct rb_root root;
+	struct ulist_node inline_nodes[ULIST_INLINE_NODES];
+
+	/* chunks of ULIST_CHUNK_NODES nodes, kept over ulist_reinit */
+	struct ulist_node **chunks;
+	unsigned long nr_chunks;
+	unsigned long max_chunks;
+
+	/* hash of all nodes, only valid with more than the inline nodes */
+	struct ulist_node **table;
+	unsigned long table_size;
 };
 
 void ulist_init(struct ulist *ulist);
@@ -76,6 +88,6 @@ static inline int ulist_add_merge_ptr(struct ulist *ulist, u64 val, void *aux,
 struct ulist_node *ulist_next(struct ulist *ulist,
 			      struct ulist_iterator *uiter);
 
-#define ULIST_ITER_INIT(uiter) ((uiter)->cur_list = NULL)
+#define ULIST_ITER_INIT(uiter) ((uiter)->pos = 0)
 
 #endif
@@ -38,6 +38,9 @@
 #include <sys/statfs.h>
 #include <linux/magic.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sys/sysmacros.h>
+#include <utime.h>
 
 #include "kerncompat.h"
 #include "radix-tree.h"
@@ -2563,7 +2566,238 @@ int test_dev_for_mkfs(const char *file, int force_overwrite)
 	return 0;
 }
 
-int btrfs_scan_lblkid(void)
+/*
+ * Cache of the device scan: the device number, size and generation of the
+ * btrfs superblock of each block device, 0 if there was none. Devices
+ * without btrfs are not opened again as long as their size is the same and
+ * udev has not processed any change of the device since the cache was
+ * written. Devices with btrfs always get their primary superblock read.
+ *
+ * The cache can miss a filesystem created from another host on shared
+ * storage, so it is only used when enabled by btrfs_scan_enable_cache(),
+ * for listing filesystems.  A scan that skipped devices is not remembered
+ * as done, later scans, eg. for open_ctree, read all devices again.
+ */
+#define BTRFS_SCAN_CACHE	"/var/lib/btrfs/scan.cache"
+#define BTRFS_SCAN_THREADS	16
+
+struct scan_device {
+	char name[PATH_MAX];
+	dev_t devt;
+	u64 size;
+	u64 generation;
+	struct btrfs_super_block *super;
+	/* skipped thanks to the cache */
+	int cached;
+	/* superblock read attempted, the generation is valid */
+	int probed;
+};
+
+struct scan_cache_entry {
+	dev_t devt;
+	u64 size;
+	u64 generation;
+};
+
+struct scan_pool {
+	pthread_mutex_t lock;
+	struct scan_device *devs;
+	int nr;
+	int next;
+};
+
+static int btrfs_scan_cache;
+
+void btrfs_scan_enable_cache(void)
+{
+	btrfs_scan_cache = 1;
+}
+
+static int cmp_scan_cache_entry(const void *a, const void *b)
+{
+	const struct scan_cache_entry *ea = a;
+	const struct scan_cache_entry *eb = b;
+
+	return ea->devt < eb->devt ? -1 : ea->devt > eb->devt;
+}
+
+static int scan_cache_load(struct scan_cache_entry **entries, time_t *mtime)
+{
+	struct scan_cache_entry *e = NULL;
+	unsigned int maj, mnr;
+	unsigned long long size, gen;
+	struct stat st;
+	FILE *f;
+	int alloc = 0;
+	int nr = 0;
+
+	*entries = NULL;
+	f = fopen(BTRFS_SCAN_CACHE, "r");
+	if (!f)
+		return 0;
+	if (fstat(fileno(f), &st) < 0)
+		goto out;
+	*mtime = st.st_mtime;
+
+	while (fscanf(f, "%u:%u %llu %llu\n", &maj, &mnr, &size, &gen) == 4) {
+		if (nr == alloc) {
+			struct scan_cache_entry *tmp;
+
+			alloc = max(alloc * 2, 64);
+			tmp = realloc(e, alloc * sizeof(*e));
+			if (!tmp)
+				break;
+			e = tmp;
+		}
+		e[nr].devt = makedev(maj, mnr);
+		e[nr].size = size;
+		e[nr].generation = gen;
+		nr++;
+	}
+	qsort(e, nr, sizeof(*e), cmp_scan_cache_entry);
+	*entries = e;
+out:
+	fclose(f);
+	return nr;
+}
+
+/* The cache file time is set to @start, the time the scan began */
+static void scan_cache_save(struct scan_device *devs, int nr, time_t start)
+{
+	struct utimbuf times = { .actime = start, .modtime = start };
+	char tmp[PATH_MAX];
+	FILE *f;
+	int i;
+
+	mkdir("/var/lib/btrfs", 0755);
+	snprintf(tmp, sizeof(tmp), "%s.tmp.%d", BTRFS_SCAN_CACHE, getpid());
+	f = fopen(tmp, "w");
+	if (!f)
+		return;
+	for (i = 0; i < nr; i++) {
+		if (!devs[i].cached && !devs[i].probed)
+			continue;
+		fprintf(f, "%u:%u %llu %llu\n", major(devs[i].devt),
+			minor(devs[i].devt), (unsigned long long)devs[i].size,
+			(unsigned long long)devs[i].generation);
+	}
+	if (fclose(f) || utime(tmp, &times) || rename(tmp, BTRFS_SCAN_CACHE))
+		unlink(tmp);
+}
+
+/*
+ * A device without btrfs can be skipped if udev has seen no change on it
+ * since the cache was written, udev reprobes a device when it is closed
+ * after writing, eg. by mkfs.
+ */
+static int scan_cache_valid(struct scan_cache_entry *entries, int nr,
+			    time_t mtime, struct scan_device *dev)
+{
+	struct scan_cache_entry key = { .devt = dev->devt };
+	struct scan_cache_entry *e;
+	char path[64];
+	struct stat st;
+
+	e = bsearch(&key, entries, nr, sizeof(key), cmp_scan_cache_entry);
+	if (!e || e->size != dev->size || e->generation)
+		return 0;
+	snprintf(path, sizeof(path), "/run/udev/data/b%u:%u",
+		 major(dev->devt), minor(dev->devt));
+	if (stat(path, &st) < 0)
+		return 0;
+	return st.st_mtime < mtime;
+}
+
+/* List the block devices from /proc/partitions, sizes come in 1k blocks */
+static int scan_list_devices(struct scan_device **devs_ret)
+{
+	struct scan_device *devs = NULL;
+	unsigned int maj, mnr;
+	unsigned long long blocks;
+	char line[512];
+	char name[256];
+	char *p;
+	FILE *f;
+	int alloc = 0;
+	int nr = 0;
+
+	f = fopen("/proc/partitions", "r");
+	if (!f)
+		return -errno;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, " %u %u %llu %255s", &maj, &mnr, &blocks,
+			   name) != 4)
+			continue;
+		if (nr == alloc) {
+			struct scan_device *tmp;
+
+			alloc = max(alloc * 2, 64);
+			tmp = realloc(devs, alloc * sizeof(*devs));
+			if (!tmp) {
+				free(devs);
+				fclose(f);
+				return -ENOMEM;
+			}
+			devs = tmp;
+		}
+		/* eg. cciss!c0d0 is /dev/cciss/c0d0 */
+		for (p = name; *p; p++)
+			if (*p == '!')
+				*p = '/';
+		memset(&devs[nr], 0, sizeof(devs[nr]));
+		snprintf(devs[nr].name, sizeof(devs[nr].name), "/dev/%s", name);
+		devs[nr].devt = makedev(maj, mnr);
+		devs[nr].size = blocks * 1024;
+		nr++;
+	}
+	fclose(f);
+	*devs_ret = devs;
+	return nr;
+}
+
+static void *scan_device_worker(void *data)
+{
+	struct scan_pool *pool = data;
+	struct scan_device *dev;
+	struct stat st;
+	int fd;
+
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->next >= pool->nr) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		dev = &pool->devs[pool->next++];
+		pthread_mutex_unlock(&pool->lock);
+
+		if (dev->cached)
+			continue;
+		fd = open(dev->name, O_RDONLY);
+		if (fd < 0)
+			continue;
+		/* the node may not match the device from /proc/partitions */
+		if (fstat(fd, &st) < 0 || !S_ISBLK(st.st_mode) ||
+		    st.st_rdev != dev->devt) {
+			close(fd);
+			continue;
+		}
+		dev->super = malloc(BTRFS_SUPER_INFO_SIZE);
+		if (dev->super)
+			dev->probed = 1;
+		if (dev->super && btrfs_read_dev_super(fd, dev->super,
+				BTRFS_SUPER_INFO_OFFSET, 0) == 0) {
+			dev->generation = btrfs_super_generation(dev->super);
+		} else {
+			free(dev->super);
+			dev->super = NULL;
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+static int btrfs_scan_blkid(void)
 {
 	int fd = -1;
 	int ret;
@@ -2574,9 +2808,6 @@ int btrfs_scan_lblkid(void)
 	blkid_cache cache = NULL;
 	char path[PATH_MAX];
 
-	if (btrfs_scan_done)
-		return 0;
-
 	if (blkid_get_cache(&cache, NULL) < 0) {
 		printf("ERROR: lblkid cache get failed\n");
 		return 1;
@@ -2609,7 +2840,93 @@ int btrfs_scan_lblkid(void)
 	blkid_dev_iterate_end(iter);
 	blkid_put_cache(cache);
 
-	btrfs_scan_done = 1;
+	return 0;
+}
+
+/*
+ * Scan all block devices for btrfs. The primary superblocks are read by a
+ * pool of threads, devices known to have no btrfs from the scan cache are
+ * skipped. Falls back to libblkid without /proc/partitions.
+ */
+int btrfs_scan_lblkid(void)
+{
+	struct scan_cache_entry *entries = NULL;
+	struct scan_device *devs = NULL;
+	struct btrfs_fs_devices *tmp_devices;
+	struct scan_pool pool;
+	pthread_t threads[BTRFS_SCAN_THREADS];
+	time_t start = time(NULL);
+	time_t mtime = 0;
+	u64 num_devices;
+	int nr_entries = 0;
+	int nr_cached = 0;
+	int nr_threads = 0;
+	int nr_probed = 0;
+	int nr;
+	int ret;
+	int i;
+
+	if (btrfs_scan_done)
+		return 0;
+
+	nr = scan_list_devices(&devs);
+	if (nr < 0) {
+		ret = btrfs_scan_blkid();
+		if (!ret)
+			btrfs_scan_done = 1;
+		return ret;
+	}
+
+	if (btrfs_scan_cache) {
+		nr_entries = scan_cache_load(&entries, &mtime);
+		for (i = 0; i < nr; i++) {
+			devs[i].cached = scan_cache_valid(entries, nr_entries,
+							  mtime, &devs[i]);
+			nr_cached += devs[i].cached;
+		}
+	}
+
+	memset(&pool, 0, sizeof(pool));
+	pthread_mutex_init(&pool.lock, NULL);
+	pool.devs = devs;
+	pool.nr = nr;
+	for (i = 0; i < min(nr, BTRFS_SCAN_THREADS); i++) {
+		if (pthread_create(&threads[i], NULL, scan_device_worker, &pool))
+			break;
+		nr_threads++;
+	}
+	if (!nr_threads)
+		scan_device_worker(&pool);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&pool.lock);
+
+	/* the list of filesystems is not thread safe, add the devices here */
+	for (i = 0; i < nr; i++) {
+		char *path;
+
+		if (devs[i].probed)
+			nr_probed++;
+		if (!devs[i].super)
+			continue;
+
+		path = canonicalize_path(devs[i].name);
+		ret = btrfs_scan_one_super(path ? path : devs[i].name,
+					   devs[i].super, &tmp_devices,
+					   &num_devices);
+		if (ret)
+			printf("ERROR: could not scan %s\n", devs[i].name);
+		free(path);
+		free(devs[i].super);
+	}
+	/* refresh the cache time whenever a device had to be read */
+	if (btrfs_scan_cache && (nr_probed || nr != nr_entries))
+		scan_cache_save(devs, nr, start);
+
+	free(entries);
+	free(devs);
+	if (!nr_cached)
+		btrfs_scan_done = 1;
 
 	return 0;
 }
@@ -3240,3 +3557,66 @@ out:
 
 	return ret;
 }
+
+/*
+ * Print a string as a quoted JSON string, escaping quotes, backslashes and
+ * control characters. Other bytes are passed through unchanged.
+ */
+void print_json_string(FILE *out, const char *str)
+{
+	const unsigned char *p;
+
+	fputc('"', out);
+	for (p = (const unsigned char *)str; *p; p++) {
+		switch (*p) {
+		case '"':
+			fputs("\\\"", out);
+			break;
+		case '\\':
+			fputs("\\\\", out);
+			break;
+		case '\n':
+			fputs("\\n", out);
+			break;
+		case '\t':
+			fputs("\\t", out);
+			break;
+		default:
+			if (*p < 0x20)
+				fprintf(out, "\\u%04x", *p);
+			else
+				fputc(*p, out);
+		}
+	}
+	fputc('"', out);
+}
+
+/*
+ * Parse a line of whitespace separated unsigned numbers, as read by the
+ * batch modes from stdin, into @vals.  Negative numbers, anything that is
+ * not a number and more than @max numbers are rejected.
+ *
+ * Returns the count of numbers parsed or -EINVAL.
+ */
+int parse_u64_line(const char *line, u64 *vals, int max)
+{
+	const char *p = line;
+	char *end;
+	int nr = 0;
+
+	while (1) {
+		while (isspace(*p))
+			p++;
+		if (!*p)
+			break;
+		if (nr == max || !isdigit(*p))
+			return -EINVAL;
+		errno = 0;
+		vals[nr] = strtoull(p, &end, 0);
+		if (errno || (*end && !isspace(*end)))
+			return -EINVAL;
+		nr++;
+		p = end;
+	}
+	return nr;
+}
@@ -181,6 +181,7 @@ int csum_tree_block(struct btrfs_root *root, struct extent_buffer *buf,
 int ask_user(const char *question);
 int lookup_ino_rootid(int fd, u64 *rootid);
 int btrfs_scan_lblkid(void);
+void btrfs_scan_enable_cache(void);
 int get_btrfs_mount(const char *dev, char *mp, size_t mp_size);
 int find_mount_root(const char *path, char **mount_root);
 int get_device_info(int fd, u64 devid,
@@ -280,6 +281,8 @@ const char *get_argv0_buf(void);
 unsigned int get_unit_mode_from_arg(int *argc, char *argv[], int df_mode);
 void clean_args_no_options(int argc, char *argv[], const char * const *usage);
 int string_is_numerical(const char *str);
+void print_json_string(FILE *out, const char *str);
+int parse_u64_line(const char *line, u64 *vals, int max);
 
 __attribute__ ((format (printf, 1, 2)))
 static inline void warning(const char *fmt, ...)
@@ -53,6 +53,43 @@ static inline int nr_data_stripes(struct map_lookup *map)
 
 static LIST_HEAD(fs_uuids);
 
+/* Hash of the scanned filesystems by fsid, chained through fsid_hash_next */
+#define FSID_HASH_SIZE	256
+static struct btrfs_fs_devices *fsid_hash[FSID_HASH_SIZE];
+
+static unsigned int fsid_hash_slot(const u8 *fsid)
+{
+	u32 hash = 0;
+	int i;
+
+	for (i = 0; i < BTRFS_FSID_SIZE; i++)
+		hash = hash * 31 + fsid[i];
+	return hash % FSID_HASH_SIZE;
+}
+
+static void add_fs_devices(struct btrfs_fs_devices *fs_devices)
+{
+	unsigned int slot = fsid_hash_slot(fs_devices->fsid);
+
+	list_add(&fs_devices->list, &fs_uuids);
+	fs_devices->fsid_hash_next = fsid_hash[slot];
+	fsid_hash[slot] = fs_devices;
+}
+
+static void del_fs_devices(struct btrfs_fs_devices *fs_devices)
+{
+	struct btrfs_fs_devices **p = &fsid_hash[fsid_hash_slot(fs_devices->fsid)];
+
+	list_del(&fs_devices->list);
+	while (*p) {
+		if (*p == fs_devices) {
+			*p = fs_devices->fsid_hash_next;
+			break;
+		}
+		p = &(*p)->fsid_hash_next;
+	}
+}
+
 static struct btrfs_device *__find_device(struct list_head *head, u64 devid,
 					  u8 *uuid)
 {
@@ -71,11 +108,10 @@ static struct btrfs_device *__find_device(struct list_head *head, u64 devid,
 
 static struct btrfs_fs_devices *find_fsid(u8 *fsid)
 {
-	struct list_head *cur;
 	struct btrfs_fs_devices *fs_devices;
 
-	list_for_each(cur, &fs_uuids) {
-		fs_devices = list_entry(cur, struct btrfs_fs_devices, list);
+	fs_devices = fsid_hash[fsid_hash_slot(fsid)];
+	for (; fs_devices; fs_devices = fs_devices->fsid_hash_next) {
 		if (memcmp(fsid, fs_devices->fsid, BTRFS_FSID_SIZE) == 0)
 			return fs_devices;
 	}
@@ -96,8 +132,8 @@ static int device_list_add(const char *path,
 		if (!fs_devices)
 			return -ENOMEM;
 		INIT_LIST_HEAD(&fs_devices->devices);
-		list_add(&fs_devices->list, &fs_uuids);
 		memcpy(fs_devices->fsid, disk_super->fsid, BTRFS_FSID_SIZE);
+		add_fs_devices(fs_devices);
 		fs_devices->latest_devid = devid;
 		fs_devices->latest_trans = found_transid;
 		fs_devices->lowest_devid = (u64)-1;
@@ -187,11 +223,11 @@ again:
 
 		orig = fs_devices;
 		fs_devices = seed_devices;
-		list_del(&orig->list);
+		del_fs_devices(orig);
 		free(orig);
 		goto again;
 	} else {
-		list_del(&fs_devices->list);
+		del_fs_devices(fs_devices);
 		free(fs_devices);
 	}
 
@@ -247,6 +283,25 @@ fail:
 	return ret;
 }
 
+/*
+ * Add the device with an already read and verified superblock to the list
+ * of scanned filesystems
+ */
+int btrfs_scan_one_super(const char *path, struct btrfs_super_block *disk_super,
+			 struct btrfs_fs_devices **fs_devices_ret,
+			 u64 *total_devs)
+{
+	u64 devid;
+
+	devid = btrfs_stack_device_id(&disk_super->dev_item);
+	if (btrfs_super_flags(disk_super) & BTRFS_SUPER_FLAG_METADUMP)
+		*total_devs = 1;
+	else
+		*total_devs = btrfs_super_num_devices(disk_super);
+
+	return device_list_add(path, disk_super, devid, fs_devices_ret);
+}
+
 int btrfs_scan_one_device(int fd, const char *path,
 			  struct btrfs_fs_devices **fs_devices_ret,
 			  u64 *total_devs, u64 super_offset, int super_recover)
@@ -254,21 +309,14 @@ int btrfs_scan_one_device(int fd, const char *path,
 	struct btrfs_super_block *disk_super;
 	char buf[BTRFS_SUPER_INFO_SIZE];
 	int ret;
-	u64 devid;
 
 	disk_super = (struct btrfs_super_block *)buf;
 	ret = btrfs_read_dev_super(fd, disk_super, super_offset, super_recover);
 	if (ret < 0)
 		return -EIO;
-	devid = btrfs_stack_device_id(&disk_super->dev_item);
-	if (btrfs_super_flags(disk_super) & BTRFS_SUPER_FLAG_METADUMP)
-		*total_devs = 1;
-	else
-		*total_devs = btrfs_super_num_devices(disk_super);
 
-	ret = device_list_add(path, disk_super, devid, fs_devices_ret);
-
-	return ret;
+	return btrfs_scan_one_super(path, disk_super, fs_devices_ret,
+				    total_devs);
 }
 
 /*
@@ -1770,8 +1818,8 @@ static int open_seed_devices(struct btrfs_root *root, u8 *fsid)
 			goto out;
 		}
 		INIT_LIST_HEAD(&fs_devices->devices);
-		list_add(&fs_devices->list, &fs_uuids);
 		memcpy(fs_devices->fsid, fsid, BTRFS_FSID_SIZE);
+		add_fs_devices(fs_devices);
 	}
 
 	ret = btrfs_open_devices(fs_devices, O_RDONLY);
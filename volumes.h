@@ -83,6 +83,9 @@ struct btrfs_fs_devices {
 
 	int seeding;
 	struct btrfs_fs_devices *seed;
+
+	/* next filesystem in the same slot of the fsid hash */
+	struct btrfs_fs_devices *fsid_hash_next;
 };
 
 struct btrfs_bio_stripe {
@@ -211,6 +214,9 @@ int btrfs_update_device(struct btrfs_trans_handle *trans,
 int btrfs_scan_one_device(int fd, const char *path,
 			  struct btrfs_fs_devices **fs_devices_ret,
 			  u64 *total_devs, u64 super_offset, int super_recover);
+int btrfs_scan_one_super(const char *path, struct btrfs_super_block *disk_super,
+			 struct btrfs_fs_devices **fs_devices_ret,
+			 u64 *total_devs);
 int btrfs_num_copies(struct btrfs_mapping_tree *map_tree, u64 logical, u64 len);
 struct list_head *btrfs_scanned_uuids(void);
 int btrfs_add_system_chunk(struct btrfs_trans_handle *trans,